@@ -145,11 +145,20 @@ rcd_fid_t ifc_fiber_map_dequeue(fid(fmap) fm, fstr_mem_t** out_key);
 rcd_fid_t ifc_fiber_map_dequeue_data(fid(fmap) fm, fstr_mem_t** out_key, fstr_mem_t** out_data);
 
 /// Creates a sub fiber that waits the specified time and then cancels the target fiber.
+/// Prefer ifc_cancel_timeout_arm_fid() which does not spawn a fiber.
 rcd_sub_fiber_t* ifc_cancel_alarm_arm_fid(uint128_t alarm_timeout_ns, rcd_fid_t target_fid);
 
 /// Creates a sub fiber that waits the specified time and then cancels the current fiber.
+/// Prefer ifc_cancel_timeout_arm() which does not spawn a fiber.
 rcd_sub_fiber_t* ifc_cancel_alarm_arm(uint128_t alarm_timeout_ns);
 
+/// Arms an alarm on the timer wheel that cancels the target fiber after the specified time.
+/// The alarm is disarmed when free'd. See lwt_alarm_arm().
+lwt_alarm_t* ifc_cancel_timeout_arm_fid(uint128_t timeout_ns, rcd_fid_t target_fid);
+
+/// Arms an alarm on the timer wheel that cancels the current fiber after the specified time.
+lwt_alarm_t* ifc_cancel_timeout_arm(uint128_t timeout_ns);
+
 /// Creates a sub fiber that waits for the specified fiber to exit and then cancels the target fiber.
 rcd_sub_fiber_t* ifc_cancel_on_exit_arm_fid(rcd_fid_t wait_fid, rcd_fid_t target_fid);
 
@@ -1748,6 +1748,88 @@ enum {
 #define CLONE_NEWNET	0x40000000
 #define CLONE_IO	0x80000000
 
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#define SYS_io_uring_enter 426
+#define SYS_io_uring_register 427
+#endif
+
+#define IORING_OP_NOP 0
+#define IORING_OP_FSYNC 3
+#define IORING_OP_ASYNC_CANCEL 14
+#define IORING_OP_READ 22
+#define IORING_OP_WRITE 23
+
+#define IORING_ENTER_GETEVENTS (1U << 0)
+
+#define IORING_FEAT_SINGLE_MMAP (1U << 0)
+#define IORING_FEAT_NODROP (1U << 1)
+#define IORING_FEAT_SUBMIT_STABLE (1U << 2)
+#define IORING_FEAT_RW_CUR_POS (1U << 3)
+
+#define IORING_OFF_SQ_RING 0ULL
+#define IORING_OFF_CQ_RING 0x8000000ULL
+#define IORING_OFF_SQES 0x10000000ULL
+
+struct io_uring_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t ioprio;
+    int32_t fd;
+    uint64_t off;
+    uint64_t addr;
+    uint32_t len;
+    uint32_t op_flags;
+    uint64_t user_data;
+    uint16_t buf_index;
+    uint16_t personality;
+    int32_t splice_fd_in;
+    uint64_t __pad2[2];
+};
+
+struct io_uring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+};
+
+struct io_sqring_offsets {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring_mask;
+    uint32_t ring_entries;
+    uint32_t flags;
+    uint32_t dropped;
+    uint32_t array;
+    uint32_t resv1;
+    uint64_t resv2;
+};
+
+struct io_cqring_offsets {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring_mask;
+    uint32_t ring_entries;
+    uint32_t overflow;
+    uint32_t cqes;
+    uint32_t flags;
+    uint32_t resv1;
+    uint64_t resv2;
+};
+
+struct io_uring_params {
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t flags;
+    uint32_t sq_thread_cpu;
+    uint32_t sq_thread_idle;
+    uint32_t features;
+    uint32_t wq_fd;
+    uint32_t resv[3];
+    struct io_sqring_offsets sq_off;
+    struct io_cqring_offsets cq_off;
+};
+
 // Declare all syscalls in Linux as direct C wrappers.
 ssize_t read(int fd, void* buf, size_t count);
 ssize_t write(int fd, const void* buf, size_t count);
@@ -2057,6 +2139,9 @@ int syncfs(int fd);
 /* SYS_getcpu 309 */
 /* SYS_process_vm_readv 310 */
 /* SYS_process_vm_writev 311 */
+int io_uring_setup(uint32_t entries, struct io_uring_params* params);
+int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, const sigset_t* sig);
+int io_uring_register(int fd, uint32_t opcode, void* arg, uint32_t nr_args);
 
 /// Librcd wrapper for the mount syscall that uses fixed strings instead of
 /// c strings. Throws an io exception if the mount fails.
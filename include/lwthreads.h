@@ -35,10 +35,25 @@ rcd_fid_t name() { \
     return global_fid; \
 }
 
+/// Scheduling class of a fiber. Executors always run fibers of a higher class
+/// before fibers of a lower class, but a lower class that has waited for a
+/// while gets to run now and then so it's never starved completely.
+typedef enum lwt_fiber_class {
+    /// Inherits the class of the fiber that spawns it.
+    lwt_fiber_class_inherit = 0,
+    /// Latency sensitive fibers, e.g. request handlers.
+    lwt_fiber_class_latency,
+    /// Default class.
+    lwt_fiber_class_normal,
+    /// Batch work that should only run when the other classes are idle.
+    lwt_fiber_class_background,
+} lwt_fiber_class_t;
+
 /// Internal librcd struct, do not use.
 typedef struct lwt_fiber_options {
     fstr_t name;
     size_t est_stack_size;
+    lwt_fiber_class_t fiber_class;
 } lwt_fiber_options_t;
 
 typedef struct lwt_heap lwt_heap_t;
@@ -52,6 +67,82 @@ typedef enum lwt_fd_event {
     lwt_fd_event_write,
 } lwt_fd_event_t;
 
+/// Runtime configuration of lwthreads. Initialized with defaults and passed
+/// to lwt_configure() once during startup before any fiber is started.
+typedef struct lwt_config {
+    /// Number of I/O shards that monitor file descriptor readiness. Each
+    /// shard has its own epoll instance, blocking fd table and monitor thread.
+    /// Zero selects a default based on the number of cpus.
+    uint32_t io_shard_count;
+    /// When true idle executors poll the epoll instance of their I/O shard
+    /// and one idle executor per shard sleeps in epoll_wait() instead of on
+    /// the scheduler futex. Fibers that become ready are run directly on the
+    /// polling executor, saving the hop through the I/O monitor thread which
+    /// then only polls when the executors of its shard are all busy.
+    bool executor_io_polling;
+    /// When true an io_uring instance is set up and used for I/O that epoll
+    /// cannot make asynchronous (regular file reads, writes and fsync).
+    /// Silently falls back to the default engine when the kernel does not
+    /// support io_uring or it's disabled by policy.
+    bool io_uring;
+    /// Upper bound of the pool of blocker threads that run blocking calls
+    /// offloaded with lwt_offload(). Threads are started on demand and are
+    /// then reused. Zero selects a default.
+    uint32_t blocker_thread_count;
+    /// When true each executor is pinned to one cpu in the cpuset of the
+    /// process. Executors are grouped per NUMA node, idle executors prefer to
+    /// steal fibers from executors on the same node and memory first touched
+    /// by an executor is allocated from its local node. Small chunks freed
+    /// by executors are kept in a pool per node and reused on that node.
+    bool executor_affinity;
+    /// When true a system monitor thread looks for executors that are stuck
+    /// in blocking syscalls while runnable fibers are waiting and starts spare
+    /// executors that take over the waiting fibers. Spare executors retire
+    /// (park) after being idle for a while and are reused when needed again.
+    bool elastic_executors;
+    /// Upper bound of the number of spare executors started by the system
+    /// monitor. Zero selects the number of cpus.
+    uint32_t max_spare_executors;
+    /// Time slice in microseconds for preemption of cpu bound fibers. When
+    /// non-zero a fiber that has been running for a full slice is forced to
+    /// yield at the next safe point (memory allocation or cancellation
+    /// point). Fibers that hold system locks are never preempted. Zero
+    /// disables preemption and scheduling is then fully cooperative.
+    uint32_t preemption_slice_us;
+    /// Time in microseconds an executor that runs out of fibers keeps
+    /// looking for new ones (spinning and now and then yielding the cpu)
+    /// before it goes to sleep. Avoids sleeping and waking up executors on
+    /// bursty load at the cost of cpu time. Zero makes executors go to sleep
+    /// directly.
+    uint32_t executor_spin_us;
+    /// When true every stacklet split (a call that overflows into a new
+    /// stacklet) is counted per call site so hot splits can be found with
+    /// lwt_write_hot_split_dump_fd(). Adds an atomic update to every split.
+    bool hot_split_tracking;
+    /// Sampling interval in microseconds of cpu time for the built in
+    /// profiler. When non-zero every executor takes a sample of the running
+    /// fiber (main name, instance name and backtrace) each interval. The
+    /// samples can be written as folded stacks for flame graphs with
+    /// lwt_write_profile_folded_fd() or by sending SIGUSR2 to the process.
+    /// Zero disables the profiler.
+    uint32_t profiler_interval_us;
+    /// Number of scheduler events (spawn, wake, defer with the reason,
+    /// run, ifc call and accept and exit) each physical thread keeps in its
+    /// trace ring, rounded up to a power of two. The oldest events are
+    /// overwritten when the ring is full. Recording an event costs a few
+    /// stores and reading the time stamp counter. The rings can be exported
+    /// with lwt_write_trace_json_fd(). Zero disables tracing.
+    uint32_t trace_ring_events;
+    /// When true every executor keeps monitoring counters (context switches,
+    /// run queue wait times, ifc joins, I/O waits and more) that are only
+    /// written by the executor itself, so counting is a plain increment. The
+    /// counters can be exported with lwt_write_metrics_json_fd() and
+    /// lwt_write_metrics_prometheus_fd() at any time.
+    bool metrics;
+    /// Huge pages to back large vm pool regions with. See vm_set_huge_pages().
+    vm_huge_pages_t vm_huge_pages;
+} lwt_config_t;
+
 /// Reads a random 64 bit integer from the x86_64 CPU random generator.
 static inline uint64_t lwt_rdrand64() {
     uint64_t r;
@@ -98,6 +189,24 @@ int32_t lwt_waitpid(int32_t pid);
 /// Yields the fiber while calling flock().
 int32_t lwt_flock(int32_t fd, int32_t operation);
 
+/// Runs a blocking function on a thread from the blocker thread pool and
+/// defers the current fiber until it returns. Use it for syscalls that have
+/// no asynchronous alternative (fsync, stat on slow network file systems,
+/// getdents on huge directories etc.) so they never stall an executor.
+/// The function runs on a real thread without a fiber. It must not throw,
+/// allocate memory, take locks or call anything that requires a fiber. If the
+/// fiber is canceled while the function runs the thread is killed wherever it
+/// is, so anything it holds at that point is never released.
+void lwt_offload(void (*block_fn)(void*), void* arg_ptr);
+
+/// Sets the scheduling class of the current fiber and returns the previous
+/// class. Fibers spawned by the fiber inherit the class so a fiber can spawn
+/// background workers by temporarily lowering its own class around fmitosis.
+lwt_fiber_class_t lwt_set_fiber_class(lwt_fiber_class_t fiber_class);
+
+/// Returns the scheduling class of the current fiber.
+lwt_fiber_class_t lwt_get_fiber_class();
+
 /// Allows global state to be initialized once with minimal overhead. Works
 /// exactly like pthread_once but allows an extra argument to be specified.
 /// The once struct must already be initialized before this call.
@@ -105,12 +214,33 @@ int32_t lwt_flock(int32_t fd, int32_t operation);
 /// behavior and incorrect concurrency design.
 void lwt_once(lwt_once_t* once_ctrl, void (*init_fn)(void*), void* arg_ptr);
 
-/// Parses /proc/processors and counts cores in the system
+/// Counts the cores the process may run on according to sched_getaffinity().
+/// Falls back to parsing /proc/cpuinfo if the affinity cannot be read.
 uint32_t lwt_system_cpu_count();
 
 /// Yields the currently running fiber.
 void lwt_yield();
 
+/// Handle for an armed alarm. See lwt_alarm_arm().
+typedef struct lwt_alarm lwt_alarm_t;
+
+/// Sleeps the current fiber for the specified number of nanoseconds. The
+/// timer has a resolution of about a millisecond and never expires early.
+/// Unlike a timer rio handle this does not allocate any file descriptor.
+/// Returns immediately without a cancellation point if wait_ns is zero.
+void lwt_sleep(uint128_t wait_ns);
+
+/// Arms an alarm that cancels the target fiber when the timeout expires.
+/// The alarm is allocated on the current heap and is disarmed when free'd.
+lwt_alarm_t* lwt_alarm_arm(uint128_t timeout_ns, rcd_fid_t target_fid);
+
+/// Sets the maximum time that interruptible joins made by the current fiber
+/// waits for the server to accept them. A join that is not accepted in time
+/// is withdrawn and throws a lwt_join_timeout io exception. Joins that are
+/// already accepted are not affected. Zero (the default) disables the timeout.
+/// Returns the previous timeout.
+uint128_t lwt_set_join_timeout(uint128_t timeout_ns);
+
 void lwt_block_until_edge_level_io_event(int fd, lwt_fd_event_t event);
 void lwt_block_until_epoll_ready(int fd, lwt_fd_event_t event);
 void lwt_io_free_fd_tracking(int fd);
@@ -123,6 +253,12 @@ void lwt_io_free_fd_tracking(int fd);
 /// reading/writing disabled.
 int32_t lwt_init_process(int argc, char** argv, char** env);
 
+/// This function is overridden in librcd programs that need to tune the
+/// runtime. It's called once during startup in a system thread before any
+/// fiber is started with a config that contains the defaults. The function
+/// may modify it but must not call anything that requires a fiber.
+void lwt_configure(lwt_config_t* config);
+
 /// Creates a cancellation point.
 void lwt_cancellation_point();
 
@@ -147,6 +283,7 @@ noret void lwt_exit(int status);
 void __rcd_escape_sh_txn(lwt_heap_t** __rcd_txn_aheap);
 void __rcd_escape_gh_txn(lwt_heap_t** __rcd_global_heap_tail);
 void __lwt_fiber_stack_push_sub_heap();
+void __lwt_fiber_stack_push_arena_heap();
 void __lwt_fiber_stack_pop_sub_heap(void* arg_ptr);
 void __lwt_fiber_stack_push_switch_heap(lwt_heap_t* extra_fiber_heap);
 void __lwt_fiber_stack_pop_switch_heap(void* arg_ptr);
@@ -181,6 +318,9 @@ rcd_exception_t* lwt_copy_exception(rcd_exception_t* exception);
 /// use the "throw" macros instead.
 noret void lwt_throw_new_exception(fstr_t message, fstr_t file, uint64_t line, rcd_exception_type_t exception_type, void* eio_class, void* eio_data, lwt_heap_t* custom_heap, rcd_exception_t* fwd_exception);
 
+/// Thrown when a join times out before it was accepted. See lwt_set_join_timeout().
+define_eio(lwt_join_timeout);
+
 /// Throws an existing exception. Takes ownership over the exception passed to
 /// it and transfers the ownership to the exception handler that catches it.
 noret void lwt_throw_exception(rcd_exception_t* exception);
@@ -201,14 +341,27 @@ void* lwt_alloc_buffer(size_t min_size, size_t* size_out);
 /// Escapes an allocation in a sub heap to the parent heap, making it survive
 /// when the sub heap is unwound. Note that this call has immediate effect
 /// and the memory will leak up even if the sub heap is unwound by throwing
-/// an exception at a later time.
+/// an exception at a later time. Allocations in arena heaps can't be escaped
+/// in place, use lwt_alloc_escape_reloc() for them.
 void lwt_alloc_escape(void* ptr);
 
+/// Like lwt_alloc_escape() but also supports allocations in arena heaps by
+/// copying them to the parent heap. Returns the pointer the allocation can
+/// be used through from now on.
+void* lwt_alloc_escape_reloc(void* ptr);
+
 /// Imports an allocation from a remote heap into the current. Make sure that
 /// the remote heap is synchronized (it should be joined with the current
 /// fiber), otherwise your program will have undefined behavior.
+/// Allocations in arena heaps can't be imported in place, use
+/// lwt_alloc_import_reloc() for them.
 void lwt_alloc_import(void* ptr);
 
+/// Like lwt_alloc_import() but also supports allocations in arena heaps by
+/// copying them to the current heap. Returns the pointer the allocation can
+/// be used through from now on.
+void* lwt_alloc_import_reloc(void* ptr);
+
 /// Returns the total allocation size of an allocated segment.
 /// Make sure that the remote heap is synchronized (it should be joined with
 /// the current fiber), otherwise your program will have undefined behavior.
@@ -278,6 +431,65 @@ void lwt_write_fiber_dump_fd(int32_t write_fd);
 /// Calls lwt_write_fiber_dump_fd() on STDERR.
 void lwt_write_fiber_dump_debug();
 
+/// Writes the stack sizes learned from the peak stack depth of exited fibers
+/// to the specified file descriptor. Each fiber main gets one line with its
+/// name and stack size in bytes separated by a space. New fibers start with
+/// the learned size when it's larger than the estimation made at link time.
+/// The output can be loaded with lwt_load_learned_stack_sizes() or baked
+/// into the next build with the --stack-profile option of rcd-pl.
+void lwt_write_learned_stack_sizes_fd(int32_t write_fd);
+
+/// Loads stack sizes written by lwt_write_learned_stack_sizes_fd(). Sizes
+/// that are already learned are only increased. Throws exception_arg if
+/// the profile is malformed.
+void lwt_load_learned_stack_sizes(fstr_t profile);
+
+/// Writes the call sites where fibers most often has overflowed into new
+/// stacklets ("hot splits") with the number of splits and the backtrace of
+/// the first split at each site to the specified file descriptor. Sites
+/// are only tracked when hot split tracking is enabled with lwt_configure().
+/// Errors are ignored and if the file descriptor blocks, so will the thread.
+void lwt_write_hot_split_dump_fd(int32_t write_fd);
+
+/// Writes the samples taken by the profiler so far as folded stacks to the
+/// specified file descriptor. Each distinct stack gets one line with the
+/// fiber main, the fiber instance (if named) and the functions from the
+/// outermost call to the sampled instruction separated by ";", followed by
+/// a space and the number of samples. Samples taken while the executor was
+/// not running a fiber are attributed to "[librcd executor]". The output
+/// is also written to "librcd-profile.<pid>.folded" in the working
+/// directory when the process receives SIGUSR2. Nothing is written unless
+/// the profiler is enabled with lwt_configure(). Errors are ignored and if
+/// the file descriptor blocks, so will the thread.
+void lwt_write_profile_folded_fd(int32_t write_fd);
+
+/// Writes the scheduler events in the trace rings of all physical threads
+/// in the Chrome trace event format (JSON) to the specified file
+/// descriptor. The output can be opened with chrome://tracing or Perfetto.
+/// The time fibers spend running is drawn as complete events named by the
+/// fiber main and all other events are drawn as instant events with the
+/// fiber id and the related fiber, file descriptor or ifc function in the
+/// arguments. The trace is empty unless tracing is enabled with
+/// lwt_configure(). Errors are ignored and if the file descriptor blocks,
+/// so will the thread.
+void lwt_write_trace_json_fd(int32_t write_fd);
+
+/// Takes a snapshot of the metrics and writes it as a JSON object to the
+/// specified file descriptor. The snapshot has the run queue depth and
+/// context switches per executor, the number of fibers alive, the counters
+/// of all executors summed up, a histogram of the time fibers waited in a
+/// run queue, ifc joins per ifc function, I/O waits per kind of file
+/// descriptor, the vm allocation statistics and the vm fragmentation report
+/// (see vm_get_frag_report()). The executors are not stopped while the
+/// snapshot is taken so the counters are not consistent with each other.
+/// Counters are zero unless metrics are enabled with lwt_configure(). Errors
+/// are ignored and if the file descriptor blocks, so will the thread.
+void lwt_write_metrics_json_fd(int32_t write_fd);
+
+/// Like lwt_write_metrics_json_fd() but writes the snapshot in the
+/// Prometheus text exposition format.
+void lwt_write_metrics_prometheus_fd(int32_t write_fd);
+
 /// Overloaded exception string conversion for convenience.
 static inline fstr_t __attribute__((overloadable)) STR(rcd_exception_t* x) { return fss(lwt_get_exception_dump(x)); }
 
@@ -439,54 +439,66 @@ extern int rcd_pp_marker__fiber_main_declare;
 #define sub_heap \
     LET(uint8_t __rcd_sh_cl __attribute__((cleanup(__lwt_fiber_stack_pop_sub_heap))) = (__lwt_fiber_stack_push_sub_heap(), 0))
 
+/// rcd-macro: Creates a sub heap that bump allocates small allocations from
+/// larger chunks and uses it in the following block. Allocations in the arena
+/// are only freed as a whole when the block is exited, which makes it cheap
+/// to create many short lived allocations. Allocations that leave the arena
+/// are copied so only escape() and import() that return the new location
+/// of the allocation can be used with them.
+#define arena_heap \
+    LET(uint8_t __rcd_sh_cl __attribute__((cleanup(__lwt_fiber_stack_pop_sub_heap))) = (__lwt_fiber_stack_push_arena_heap(), 0))
+
 /// rcd-macro: Let an allocation escape the sub heap, importing it into the
-/// parent heap so it survives.
+/// parent heap so it survives. Evaluates to the allocation which is a copy
+/// when it escapes from an arena heap.
 #define escape(alloc0) ({ \
     typeof(alloc0) __alloc0_ptr = alloc0; \
-    lwt_alloc_escape(__alloc0_ptr); \
-    __alloc0_ptr; \
+    (typeof(alloc0)) lwt_alloc_escape_reloc(__alloc0_ptr); \
 })
 
 /// rcd-macro: Let a complex struct with a direct "heap" member escape the sub
 /// heap, importing it into the parent heap so it survives.
 #define escape_complex(alloc0) ({ \
     typeof(alloc0) __alloc0_ptr = alloc0; \
-    lwt_alloc_escape(__alloc0_ptr->heap); \
+    __alloc0_ptr->heap = lwt_alloc_escape_reloc(__alloc0_ptr->heap); \
     __alloc0_ptr; \
 })
 
+#define _ESCAPE_LIST_ARG(alloc) alloc = (typeof(alloc)) lwt_alloc_escape_reloc(alloc);
+
 /// rcd-macro: Let one or more allocations escape the sub heap, importing them
-/// into the parent heap so they survive.
+/// into the parent heap so they survive. The arguments must be lvalues, they
+/// are updated with the copies of allocations that escape from an arena heap.
 #define escape_list(...) ({ \
-    void* __allocs[] = {__VA_ARGS__}; \
-    size_t __allocs_n = LENGTHOF(__allocs); \
-    for (size_t __rcd_e_i = 0; __rcd_e_i < __allocs_n; __rcd_e_i++) \
-        lwt_alloc_escape(__allocs[__rcd_e_i]); \
+    FOR_EACH_ARG(_ESCAPE_LIST_ARG, __VA_ARGS__) \
+    (void) 0; \
 })
 
 /// rcd-macro: Imports an allocation to the current sub heap from the remote
-/// heap we are joined with.
+/// heap we are joined with. Evaluates to the allocation which is a copy when
+/// it's imported from an arena heap.
 #define import(alloc0) ({ \
     typeof(alloc0) __alloc0_ptr = alloc0; \
-    lwt_alloc_import(__alloc0_ptr); \
-    __alloc0_ptr; \
+    (typeof(alloc0)) lwt_alloc_import_reloc(__alloc0_ptr); \
 })
 
 /// rcd-macro: Imports a complex struct allocation with a direct "heap" member
 /// to the current sub heap from the remote heap we are joined with.
 #define import_complex(alloc0) ({ \
     typeof(alloc0) __alloc0_ptr = alloc0; \
-    lwt_alloc_escape(__alloc0_ptr->heap); \
+    __alloc0_ptr->heap = lwt_alloc_import_reloc(__alloc0_ptr->heap); \
     __alloc0_ptr; \
 })
 
+#define _IMPORT_LIST_ARG(alloc) alloc = (typeof(alloc)) lwt_alloc_import_reloc(alloc);
+
 /// rcd-macro: Let one or more allocations be imported to the current sub
-/// heap from the remote heap we are joined with.
+/// heap from the remote heap we are joined with. The arguments must be
+/// lvalues, they are updated with the copies of allocations that are
+/// imported from an arena heap.
 #define import_list(...) ({ \
-    void* __allocs[] = {__VA_ARGS__}; \
-    size_t __allocs_n = LENGTHOF(__allocs); \
-    for (size_t __rcd_e_i = 0; __rcd_e_i < __allocs_n; __rcd_e_i++) \
-        lwt_alloc_import(__allocs[__rcd_e_i]); \
+    FOR_EACH_ARG(_IMPORT_LIST_ARG, __VA_ARGS__) \
+    (void) 0; \
 })
 
 /// rcd-macro: Creates a sub heap that wraps a single statement.
@@ -936,7 +936,7 @@ void rio_alarm_set(rio_t* rio, uint128_t value_ns, bool value_absolute, uint128_
 /// the last wait.
 uint64_t rio_alarm_wait(rio_t* rio) NO_NULL_ARGS;
 
-/// Uses rio timers to wait a specified time before continuing execution.
+/// Waits a specified time before continuing execution. See lwt_sleep().
 /// If wait_ns is zero the function will return immediately.
 void rio_wait(uint128_t wait_ns);
 
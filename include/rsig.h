@@ -14,6 +14,8 @@ typedef struct rsig_signal_cfg {
     bool ignore;
     /// handler_fn should be null, writing safe signal handlers is not supported by librcd. When it's null the default action will be used.
     void* handler_fn;
+    /// If system calls interrupted by the handler should be restarted.
+    bool restart;
 } rsig_signal_cfg_t;
 
 typedef struct rsig_full_signal_cfg {
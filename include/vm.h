@@ -34,10 +34,88 @@ static void free_fn_name(type* element) { \
     __##allocate_fn_name##_free_list(element); \
 }
 
-/// The total number of allocated bytes.
-/// Can be read for the purposes of statistics and detecting memory leaks.
+/// The approximate total number of allocated bytes. Physical threads count
+/// their allocations separately and only add them here in batches, so it
+/// can be off by up to 64 KiB per thread. Can be read lock free for the
+/// purposes of statistics. Use vm_get_total_allocated_bytes() when the
+/// exact number is required.
 extern size_t vm_total_allocated_bytes;
 
+/// Returns the exact total number of allocated bytes by summing the
+/// counters of all threads. Takes a global lock, so it's meant for
+/// detecting memory leaks and not to be called in hot paths.
+size_t vm_get_total_allocated_bytes();
+
+/// Allocation statistics of the vm. The counters are updated lock free and
+/// are not read atomically as a whole, so they are only consistent with
+/// each other when the vm is idle.
+typedef struct vm_stats {
+    /// Bytes currently allocated in each size class, indexed by log2 of the
+    /// size of the allocations in the class.
+    size_t class_allocated_bytes[64];
+    /// Total bytes and number of segments the janitor has returned to the
+    /// system.
+    uint64_t janitor_reclaimed_bytes;
+    uint64_t janitor_reclaimed_mmaps;
+    /// Bytes of pool memory mapped with huge pages.
+    uint64_t huge_page_bytes;
+} vm_stats_t;
+
+/// Reads the current allocation statistics of the vm.
+void vm_get_stats(vm_stats_t* stats_out);
+
+/// Free memory of the vm per size class, showing how fragmented it is.
+typedef struct vm_frag_report {
+    /// Bytes in free chunks per size class, indexed by log2 of the size of
+    /// the chunks. Free chunks of page size or larger are not backed by
+    /// memory unless they are in hugetlb regions or smaller than a huge page
+    /// in huge page regions. Chunks the janitor merges from halves that
+    /// still held memory are counted as dirty until it has reclaimed them.
+    uint64_t free_bytes[64];
+    /// Bytes in freed chunks that still hold memory, per size class. The
+    /// janitor returns them to the system after a while unless they are
+    /// reused first.
+    uint64_t dirty_bytes[64];
+    /// Dirty bytes that the janitor will return to the system.
+    uint64_t reclaimable_bytes;
+    /// Free and dirty bytes that hold memory which can't be returned to the
+    /// system until the chunks are merged with their buddies: chunks smaller
+    /// than a page and chunks smaller than a huge page in huge page regions.
+    /// Chunks in hugetlb regions are never returned and always stranded.
+    uint64_t stranded_bytes;
+    /// Bytes mapped from the system for the vm pool.
+    uint64_t pool_bytes;
+    /// Number of free buddy pairs merged by the janitor.
+    uint64_t coalesced_chunks;
+} vm_frag_report_t;
+
+/// Walks the free lists of the vm and reports how fragmented free memory is.
+/// Free chunks cached by physical threads are not included. Takes time
+/// proportional to the number of free chunks and holds the vm locks while
+/// walking them, so it should only be called now and then.
+void vm_get_frag_report(vm_frag_report_t* report_out);
+
+/// Kinds of huge pages the vm can back its pool memory with.
+typedef enum vm_huge_pages {
+    /// Only use normal pages.
+    vm_huge_pages_none = 0,
+    /// Advise the kernel to use transparent huge pages with MADV_HUGEPAGE.
+    /// Has no effect when transparent huge pages are disabled in the system.
+    vm_huge_pages_transparent,
+    /// Map pool memory from the reserved hugetlb pages with MAP_HUGETLB,
+    /// falling back to transparent huge pages when no hugetlb pages are
+    /// available.
+    vm_huge_pages_hugetlb,
+} vm_huge_pages_t;
+
+/// Makes the vm back pool regions of at least 2 MB that it maps from now on
+/// with huge pages, reducing TLB misses for processes with large heaps. The
+/// janitor only returns whole huge pages to the system so chunks smaller than
+/// a huge page in those regions stay resident. Hugetlb pages are never
+/// returned, they stay reserved by the process once mapped. Ignored in the
+/// debug modes that protect individual pages.
+void vm_set_huge_pages(vm_huge_pages_t huge_pages);
+
 /// Maps a memory range. Similar to the linux mmap except that this function
 /// guarantees O(1) run-time complexity and is able to chunks of arbitrary
 /// size although special constraints apply:
@@ -144,9 +144,20 @@ static inline void atomic_spinlock_uwlock(rwspinlock_t* rwspinlock) {
     }
 }
 
+/// Adjusts the number of spinlocks held by the current physical thread. The counter lives in the physical thread
+/// struct at %fs:0xe8 and fibers are never preempted while it's non zero. This is what makes it safe to allocate
+/// memory (which is a preemption point) while holding a spinlock.
+__attribute__((always_inline))
+static inline void atomic_spinlock_held_add(int32_t delta) {
+    __asm__ __volatile__("addl %0, %%fs:0xe8" :: "ri"(delta) : "memory", "cc");
+}
+
 __attribute__((always_inline))
 static inline bool atomic_spinlock_trylock(int8_t* spinlock) {
-    return atomic_cas_int8(spinlock, 0, -1);
+    if (!atomic_cas_int8(spinlock, 0, -1))
+        return false;
+    atomic_spinlock_held_add(1);
+    return true;
 }
 
 __attribute__((always_inline))
@@ -163,6 +174,7 @@ static inline void atomic_spinlock_unlock(int8_t* spinlock) {
         if (atomic_cas_int8(spinlock, -1, 0))
             break;
     }
+    atomic_spinlock_held_add(-1);
 }
 
 #endif	/* CAS_H */
@@ -350,9 +350,7 @@ rcd_fid_t ifc_fiber_map_dequeue_data(fid(fmap) fm, fstr_mem_t** out_key, fstr_me
 
 fiber_main ifc_cancel_alarm_fiber(fiber_main_attr, uint128_t alarm_timeout_ns, rcd_fid_t cancel_target_fid) { try {
     lwt_cancellation_point();
-    rio_t* timer = rio_timer_create();
-    rio_alarm_set(timer, alarm_timeout_ns, false, 0);
-    rio_alarm_wait(timer);
+    lwt_sleep(alarm_timeout_ns);
     // Need to use exclusive cancellation instead of normal,
     // otherwise we have a race where both fibers can cancel each other.
     lwt_exclusive_cancel_fiber_id(cancel_target_fid);
@@ -370,6 +368,14 @@ rcd_sub_fiber_t* ifc_cancel_alarm_arm(uint128_t alarm_timeout_ns) {
     return ifc_cancel_alarm_arm_fid(alarm_timeout_ns, rcd_self);
 }
 
+lwt_alarm_t* ifc_cancel_timeout_arm_fid(uint128_t timeout_ns, rcd_fid_t cancel_target_fid) {
+    return lwt_alarm_arm(timeout_ns, cancel_target_fid);
+}
+
+lwt_alarm_t* ifc_cancel_timeout_arm(uint128_t timeout_ns) {
+    return ifc_cancel_timeout_arm_fid(timeout_ns, rcd_self);
+}
+
 fiber_main ifc_cancel_on_exit_fiber(fiber_main_attr, rcd_fid_t wait_fid, rcd_fid_t cancel_target_fid) { try {
     lwt_cancellation_point();
     ifc_wait(wait_fid);
@@ -541,7 +547,7 @@ typedef struct ifc_ibpipe_state {
 /// A non copying form of write that imports entire memory buckets.
 join_locked(void) ifc_ibpipe_fiber_write(fstr_mem_t* bucket, bool more_hint, join_server_params, ifc_ibpipe_state_t* pipe_state) {
     switch_heap(pipe_state->frame_queue_heap) {
-        lwt_alloc_import(bucket);
+        bucket = lwt_alloc_import_reloc(bucket);
         list_push_end(pipe_state->frame_queue, fstr_mem_t*, bucket);
         pipe_state->more_hint = more_hint;
     }
@@ -961,6 +961,19 @@ int syncfs(int fd) {
     return (int) syscall(SYS_syncfs, fd);
 }
 
+int io_uring_setup(uint32_t entries, struct io_uring_params* params) {
+    // The ring is a file descriptor that is always created with CLOEXEC by the kernel.
+    return (int) syscall(SYS_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, const sigset_t* sig) {
+    return (int) syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, sig, _NSIG/8);
+}
+
+int io_uring_register(int fd, uint32_t opcode, void* arg, uint32_t nr_args) {
+    return (int) syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
 // Make sigprocmask alias for rt_sigprocmask.
 int sigprocmask(int how, const sigset_t* set, sigset_t* oldset)
 __attribute__ ((weak, alias ("rt_sigprocmask")));
@@ -15,6 +15,15 @@
 /// The first reserved real time signal in Linux.
 #define LWT_ASYNC_CANCEL_SIGNAL 33
 
+/// Real time signal sent by the per-executor cpu time timer when preemption is enabled.
+#define LWT_PREEMPT_SIGNAL 34
+
+/// Signal sent by the per-executor cpu time timer when the profiler is enabled.
+#define LWT_PROFILER_SIGNAL SIGPROF
+
+/// Signal that makes the profiler write the samples taken so far to a file.
+#define LWT_PROFILER_DUMP_SIGNAL SIGUSR2
+
 /// Expression that yields the current stack limit.
 /// Useful for testing if we're running in the rcd system or in a fiber.
 #define LWT_READ_STACK_LIMIT ({ \
@@ -63,6 +72,85 @@ int32_t lwt_start_new_thread(void (*func)(void* arg_ptr), void* stack, int flags
 
 fstr_t lwt_get_backtrace_archaic(fstr_t buf);
 
+/// Allocates the profiler sample table of the current executor unless it already has one. Called when executors start
+/// if the profiler is enabled. Samples are counted by lwt_profiler_sample() as soon as the table exists.
+void lwt_profiler_init_local();
+
+/// Records a profiler sample of the context interrupted by the profiler signal. Called by rsig_sigprof_low_handler
+/// on the signal stack with the end of stack limit of the interrupted context, which is zero on the mega stack.
+void lwt_profiler_sample(struct ucontext* uc, void* end_of_stack);
+
 extern const size_t lwt_physical_thread_size;
 
+struct vm_thread_cache;
+
+/// Returns the location where the vm keeps its chunk cache for the current physical thread.
+struct vm_thread_cache** lwt_get_vm_thread_cache_ptr();
+
+/// Starts the system monitor that adds spare executors when executors are blocked in syscalls, unless it's already
+/// running. Zero max_spares selects a default. Called at startup when elastic executors are enabled.
+void lwt_sysmon_start(uint32_t max_spares);
+
+/// Returns the number of executors, not counting spare executors.
+size_t lwt_get_executor_count();
+
+/// Test-only hook. Changes how long idle executors spin before going to sleep as if executor_spin_us was configured
+/// with lwt_configure() and returns the previous value. Executors that are already sleeping are not affected.
+uint32_t lwt_executor_spin_set(uint32_t spin_us);
+
+/// Returns the number of times a sleeping executor has been woken up through the futex to run an enqueued fiber.
+uint64_t lwt_get_executor_futex_wake_count();
+
+/// Returns the number of fiber structs that executors have reused from their fiber cache instead of allocating.
+uint64_t lwt_get_reused_fiber_count();
+
+/// Test-only hook. Starts or stops counting stacklet splits per call site as if hot_split_tracking was configured with
+/// lwt_configure() and returns true if they were counted before. Stopping keeps the sites counted so far.
+bool lwt_hot_split_tracking_set_enabled(bool enabled);
+
+/// Test-only hook. Starts or stops recording scheduler events as if trace_ring_events was configured with
+/// lwt_configure() and returns true if they were recorded before. Starting gives the current physical thread a ring
+/// of n_events events unless it already has one. Other threads without a ring keep dropping their events. Stopping
+/// keeps the rings and the events recorded so far.
+bool lwt_trace_set_enabled_local(bool enabled, size_t n_events);
+
+/// Test-only hook. Starts or stops collecting metrics on every executor as if metrics was configured with
+/// lwt_configure() and returns true if they were collected before. Counters only count what happens while they are
+/// started and keep their values while stopped.
+bool lwt_metrics_set_enabled(bool enabled);
+
+/// Returns the NUMA node the current physical thread is pinned to or -1 if it's not pinned to a node or the
+/// process only runs on a single node.
+int32_t lwt_get_numa_node();
+
+/// Returns the number of times the current executor has picked a fiber to execute. It only changes under a running
+/// fiber if the fiber is switched out, e.g. when it's preempted.
+uint64_t lwt_get_sched_tick();
+
+/// Test-only hook. Changes the preemption time slice at runtime as if preemption_slice_us was configured with
+/// lwt_configure() and returns the previous slice. Executors re-arm their preemption timer the next time they pick a
+/// fiber. Zero disables preemption again.
+uint32_t lwt_preemption_set_slice(uint32_t slice_us);
+
+/// True if the io_uring engine was enabled with lwt_configure() or
+/// lwt_uring_set_enabled() and is supported by the kernel.
+bool lwt_uring_is_enabled();
+
+/// Operations on the io_uring engine. They work like the syscalls with the
+/// same name (returns -1 and sets errno on failure) but defers the fiber
+/// instead of blocking the physical thread. An offset of -1 uses and
+/// advances the current file position. Must only be called when the
+/// engine is started.
+ssize_t lwt_uring_read(int32_t fd, void* buf, size_t count);
+ssize_t lwt_uring_write(int32_t fd, const void* buf, size_t count);
+ssize_t lwt_uring_pread(int32_t fd, void* buf, size_t count, int64_t offset);
+ssize_t lwt_uring_pwrite(int32_t fd, const void* buf, size_t count, int64_t offset);
+int32_t lwt_uring_fsync(int32_t fd);
+
+/// Test-only hook. Enables or disables the io_uring engine at runtime as if io_uring was configured with
+/// lwt_configure() and returns true if it was enabled before. The ring is set up the first time it's enabled and is
+/// then kept, disabling it only makes new operations use the default engine. Nothing changes if the kernel does not
+/// support io_uring so check lwt_uring_is_enabled() afterwards. Not thread safe.
+bool lwt_uring_set_enabled(bool enabled);
+
 #endif	/* LWTHREADS_INTERNAL_H */
@@ -12,6 +12,7 @@
 #include "linux.h"
 #include "atomic.h"
 #include "hmap.h"
+#include "json.h"
 
 #pragma librcd
 
@@ -28,6 +29,7 @@
 #define LWT_LONGJMP_MMAP_UNRESERVE 10
 #define LWT_LONGJMP_VA_START 11
 #define LWT_LONGJMP_PANIC 12
+#define LWT_LONGJMP_PREEMPT 13
 
 #define LWT_INIT_PHYSICAL_MUTEX 1
 #define LWT_INIT_PHYSICAL_COND 0
@@ -39,10 +41,93 @@
     struct lwt_fiber* fiber = LWT_PHYS_THREAD->current_fiber; \
     assert(fiber != 0);
 
-#define LWT_INIT_FIBER_ID 1
-
 #define LWT_SYNC_ERROR_MSG "synchronization error"
 
+/// Maximum number of times in a row an executor picks its runnext fiber before it must take one from its fifo.
+/// Prevents two fibers that wake each other up in a loop from starving the rest of the run queue.
+#define LWT_RUNNEXT_STREAK_MAX 16
+
+/// Every n:th dequeue an executor polls the global queue before its local run queue so fibers woken up by
+/// non-executor threads cannot be starved by executors that always have local work.
+#define LWT_GLOBAL_QUEUE_POLL_INTERVAL 61
+
+/// Number of fiber classes that have their own fifo in the run queues (all except lwt_fiber_class_inherit).
+#define LWT_N_FIBER_CLASSES 3
+
+/// Index of the fifo of a fiber class in the run queues. Classes are ordered by priority.
+#define LWT_FIBER_CLASS_I(fiber_class) ((size_t) ((fiber_class) - lwt_fiber_class_latency))
+
+CASSERT(LWT_FIBER_CLASS_I(lwt_fiber_class_background) == LWT_N_FIBER_CLASSES - 1);
+
+/// Number of dequeues in a row a non-empty fiber class fifo can be passed over for higher classes before it gets
+/// to run one fiber anyway. Bounds how long a busy latency class can starve the normal and background classes.
+#define LWT_FIBER_CLASS_AGING_LIMIT 32
+
+/// Interval between the scans of the system monitor when elastic executors are enabled.
+#define LWT_SYSMON_INTERVAL_NS (2 * 1000000ULL)
+
+/// An executor that has been running the same fiber for this long while the thread is sleeping in the kernel is
+/// considered blocked in a syscall by the system monitor.
+#define LWT_SYSMON_BLOCK_THRESHOLD_NS (10 * 1000000ULL)
+
+/// A spare executor that has not found any work for this long is retired.
+#define LWT_SPARE_EXECUTOR_RETIRE_NS (1000 * 1000000ULL)
+
+/// When executors poll their I/O shard the monitor thread of the shard only polls it when no executor has done so
+/// for this long, e.g. because all executors of the shard are busy running fibers.
+#define LWT_IO_MONITOR_FALLBACK_NS (2 * 1000000ULL)
+
+/// Freed stacklets of 2^n bytes where n is in this range are kept in a per-executor cache and reused without going
+/// through the vm. Stacklets outside the range are rare and returned to the vm directly.
+#define LWT_STACKLET_CACHE_MIN_2E 10
+#define LWT_STACKLET_CACHE_MAX_2E 20
+
+/// Maximum number of stacklets an executor caches per size class.
+#define LWT_STACKLET_CACHE_DEPTH 8
+
+/// Stacklets larger than 2^n bytes are not kept in the stacklet cache of an executor that goes to sleep. Smaller ones
+/// decay by half each time so an executor that stays idle ends up with an empty cache.
+#define LWT_STACKLET_CACHE_IDLE_MAX_2E 16
+
+/// Maximum number of finalized fiber structs an executor keeps for reuse.
+#define LWT_FIBER_CACHE_DEPTH 0x40
+
+/// Cached fiber structs only keep root stacklets of up to 2^n bytes, larger ones go to the stacklet cache. This
+/// bounds the fiber cache to 4 MiB per executor. It's halved each time the executor goes to sleep.
+#define LWT_FIBER_CACHE_MAX_STACKLET_2E 16
+
+/// Number of distinct call sites the hot split counter can track. Splits at further sites are only counted in total.
+#define LWT_HOT_SPLIT_SITES 0x100
+
+/// Number of return addresses recorded for each hot split site.
+#define LWT_HOT_SPLIT_BACKTRACE_DEPTH 8
+
+/// Number of distinct fiber mains that can have a learned stack size.
+#define LWT_STACK_LEARN_SLOTS 0x400
+
+/// A learned stack size decays by 1/2^n of itself every time a fiber with the same main exits without needing as much stack.
+#define LWT_STACK_LEARN_DECAY_SHIFT 8
+
+/// Upper bound of learned stack sizes. Fibers that go deeper still get more stacklets, but their root stacklet stays
+/// small enough for the stacklet cache so it can be recycled with the fiber struct.
+#define LWT_STACK_LEARN_MAX_SIZE (1UL << (LWT_STACKLET_CACHE_MAX_2E - 1))
+
+/// Number of distinct stacks each executor can count profiler samples for. Samples of further stacks are dropped.
+#define LWT_PROFILER_STACKS 0x800
+
+/// Maximum number of frames recorded for a profiler sample, including the interrupted instruction.
+#define LWT_PROFILER_DEPTH 32
+
+/// Maximum length of the fiber instance name recorded for a profiler sample.
+#define LWT_PROFILER_INSTANCE_NAME_MAX 32
+
+/// Number of buckets in the run queue wait time histogram of the metrics. Bucket n counts waits shorter than 2^n
+/// time stamp counter ticks that did not fit in the bucket before, the last bucket counts all longer waits.
+#define LWT_METRICS_WAIT_BUCKETS 40
+
+/// Number of distinct ifc functions each executor counts joins for. Joins of further functions are counted together.
+#define LWT_METRICS_IFC_FNS 0x40
+
 #define LWT_SYS_SPINLOCK_RLOCK(rwspinlock) { \
     bool _rlock = true; \
     rwspinlock_t* _prev_system_rwspinlock; \
@@ -78,6 +163,19 @@ struct lwt_heap {
     vm_heap_t* vm_heap;
 };
 
+/// Kinds of file descriptors that fibers wait for, as counted by the metrics.
+typedef enum lwt_fd_type {
+    /// Not classified yet.
+    lwt_fd_type_unknown,
+    lwt_fd_type_socket,
+    lwt_fd_type_pipe,
+    lwt_fd_type_char,
+    lwt_fd_type_epoll,
+    lwt_fd_type_other,
+} lwt_fd_type_t;
+
+#define LWT_N_FD_TYPES (lwt_fd_type_other + 1)
+
 /// Maps file descriptors to the corresponding fibers that wait
 /// for them. Only one fiber can wait for either read or write for a fd at the
 /// same time - more does not make sense and will trigger an IO exception.
@@ -92,6 +190,8 @@ typedef struct lwt_blocking_fd {
     struct lwt_fiber* write_fiber;
     /// If the fd is epoll it must be polled on because epoll in epoll works edgetriggered.
     bool is_epoll;
+    /// What kind of file the fd is. Only classified when metrics are enabled.
+    lwt_fd_type_t fd_type;
 } lwt_blocking_fd_t;
 
 typedef enum lwt_fiber_event_type {
@@ -179,8 +279,43 @@ typedef struct lwt_fiber_event {
 
 typedef struct exec_blocked_fiber {
     struct exec_blocked_fiber* next;
+    /// Index of the class fifo the fiber is queued in. Copied from the fiber class when it's enqueued.
+    uint8_t class_i;
 } exec_blocked_fiber_t;
 
+typedef struct exec_block_queue {
+    exec_blocked_fiber_t* first;
+    exec_blocked_fiber_t* last;
+} exec_block_queue_t;
+
+/// One fifo per fiber class, indexed from the highest to the lowest class. Higher classes are always dequeued first
+/// but a class that has been passed over LWT_FIBER_CLASS_AGING_LIMIT times in a row gets to run one fiber.
+typedef struct exec_block_class_queue {
+    exec_block_queue_t fifo[LWT_N_FIBER_CLASSES];
+    /// Number of dequeues in a row each class was passed over while it was non-empty.
+    uint32_t n_passed[LWT_N_FIBER_CLASSES];
+} exec_block_class_queue_t;
+
+/// Run queue owned by a single executor. The owning executor pushes fibers it wakes up here and pops them back
+/// in the next scheduling round while idle sibling executors steal from the head of the fifo.
+typedef struct lwt_run_queue {
+    /// Protects runnext, fifo and length. Only held for a couple of instructions at a time.
+    int8_t lock;
+    /// The fiber most recently woken up by the owning executor. It's executed before the fifo as it's likely that
+    /// it is about to consume whatever the previous fiber just produced and the data is still hot in the cache.
+    exec_blocked_fiber_t* runnext;
+    /// Fifos of execution blocked fibers that await execution by the owning executor or a thief.
+    exec_block_class_queue_t fifo;
+    /// Number of fibers in the run queue including runnext. Read without locking as a hint by thieves.
+    volatile size_t length;
+    /// Number of times in a row that runnext was picked over the fifo. Only accessed by the owner.
+    uint32_t runnext_streak;
+    /// Number of dequeues made by the owning executor. Used to poll the global queue now and then. Only accessed by the owner.
+    uint32_t tick;
+    /// Pseudo random state for selecting the first victim when stealing. Only accessed by the owner.
+    uint64_t steal_seed;
+} lwt_run_queue_t;
+
 typedef struct lwt_ifc_client {
     struct lwt_fiber* fiber;
     /// Global call id so ifc calls can be ordered across different functions queues.
@@ -212,6 +347,18 @@ typedef struct lwt_ifc_server {
     void* server_state;
     /// If the above server state is not 0 and this is true the above server state is read locked and accepting shared requests only.
     bool read_locked_state;
+    /// Ifc lock of the accepting fiber which protects the server and its references.
+    rwspinlock_t* ifc_lock;
+    /// The server state passed to accept which is offered to clients every time the server is re-accepting.
+    void* accept_state;
+    /// The function queues the server is accepting on and its references to them. Both live on the server stack.
+    struct lwt_ifc_fn_queue** fn_queues;
+    struct lwt_ifc_server_ref* server_refs;
+    size_t n_fn_queues;
+    /// True if the server re-accepts after every request. The last client to unjoin such a server re-accepts on
+    /// its behalf instead of waking it up, unless it's draining (waiting for clients to leave before exiting).
+    bool auto_reaccepting;
+    bool draining;
 } lwt_ifc_server_t;
 
 /// Reference to an ifc server from an ifc function queue.
@@ -243,6 +390,8 @@ typedef struct lwt_ifc_fn_queue {
     } waiting_clients;
     /// Indexed in server_fiber->ifc_fn_queues if server_fiber is still alive.
     rbtree_node_t rb_node;
+    /// Ifc lock of the server fiber that protects the queue. Stays valid after the server fiber is gone.
+    rwspinlock_t* ifc_lock;
 } lwt_ifc_fn_queue_t;
 
 typedef struct lwt_start_args {
@@ -267,10 +416,126 @@ typedef struct lwt_stacklet {
     size_t len;
     // The rsp in the older stacklet context.
     uint64_t* older_rsp;
+    /// Stack used by the fiber in all older stacklets.
+    size_t depth;
     // Raw stacklet memory.
     uint64_t mem[];
 } lwt_stacklet_t;
 
+#define LWT_STACKLET_CACHE_N_BINS (LWT_STACKLET_CACHE_MAX_2E - LWT_STACKLET_CACHE_MIN_2E + 1)
+
+/// Cache of freed stacklets binned by size class. Owned by a single executor so it needs no locking.
+/// Cached stacklets are linked by their next field.
+typedef struct lwt_stacklet_cache {
+    lwt_stacklet_t* bins[LWT_STACKLET_CACHE_N_BINS];
+    uint8_t n_cached[LWT_STACKLET_CACHE_N_BINS];
+} lwt_stacklet_cache_t;
+
+/// A call site where fibers has overflowed into a new stacklet and how many times it has happened.
+typedef struct lwt_hot_split_site {
+    /// Return address of the call that overflowed or 0 if the slot is free.
+    void* site;
+    uint64_t count;
+    /// Backtrace of the first split at the site, starting with the site itself. Unused entries are 0.
+    void* backtrace[LWT_HOT_SPLIT_BACKTRACE_DEPTH];
+} lwt_hot_split_site_t;
+
+/// A distinct stack sampled by the profiler and how many samples it has been seen in.
+typedef struct lwt_profiler_stack {
+    /// Number of samples of the stack or 0 if the slot is free. Set last when the slot is taken.
+    uint64_t count;
+    uint64_t hash;
+    /// Name of the main of the sampled fiber. Fiber main names are static.
+    fstr_t main_name;
+    /// Copy of the (truncated) instance name of the sampled fiber as the fiber can exit at any time.
+    uint8_t instance_name[LWT_PROFILER_INSTANCE_NAME_MAX];
+    uint8_t instance_name_len;
+    uint8_t n_frames;
+    /// Sampled instruction pointer followed by the call sites of the frames below it.
+    void* frames[LWT_PROFILER_DEPTH];
+} lwt_profiler_stack_t;
+
+/// Samples taken by the profiler on an executor, counted per distinct stack with open addressing.
+/// Only written by the profiler signal handler of the executor and read by lwt_write_profile_folded_fd().
+typedef struct lwt_profiler {
+    lwt_profiler_stack_t stacks[LWT_PROFILER_STACKS];
+} lwt_profiler_t;
+
+typedef enum lwt_trace_event_type {
+    /// A fiber was spawned by the fiber in arg. The event has the main name of the new fiber.
+    lwt_trace_event_spawn,
+    /// A fiber was made runnable by the fiber in arg.
+    lwt_trace_event_wake,
+    /// A fiber started running. The event has the main name of the fiber.
+    lwt_trace_event_run,
+    /// A fiber was switched out to wait for something else than another fiber or a file descriptor.
+    lwt_trace_event_defer,
+    /// A fiber was switched out to wait for the fiber in arg.
+    lwt_trace_event_defer_fid,
+    /// A fiber was switched out to wait for the file descriptor in arg.
+    lwt_trace_event_defer_fd,
+    /// A fiber was switched out to wait for ifc clients.
+    lwt_trace_event_defer_accept,
+    lwt_trace_event_yield,
+    lwt_trace_event_preempt,
+    /// A fiber made an ifc call to the fiber in arg. The event has the ifc function pointer.
+    lwt_trace_event_ifc_call,
+    /// The ifc call to the fiber in arg was accepted. The event has the ifc function pointer.
+    lwt_trace_event_ifc_accept,
+    lwt_trace_event_exit,
+} lwt_trace_event_type_t;
+
+typedef struct lwt_trace_event {
+    /// Sequence number of the event plus one or 0 while the event is written.
+    volatile uint64_t seq;
+    uint64_t tsc;
+    rcd_fid_t fid;
+    /// Fiber id or file descriptor related to the event, depending on the type.
+    int64_t arg;
+    /// Main name string or ifc function pointer, depending on the type.
+    const void* ptr;
+    uint32_t len;
+    lwt_trace_event_type_t type;
+} lwt_trace_event_t;
+
+/// Scheduler events recorded by a physical thread, overwriting the oldest events when full.
+/// Only written by the owning physical thread and read lock free by lwt_write_trace_json_fd().
+typedef struct lwt_trace_ring {
+    struct lwt_trace_ring* next;
+    int32_t tid;
+    fstr_t thread_name;
+    uint64_t mask;
+    /// Number of events written so far.
+    volatile uint64_t n_events;
+    lwt_trace_event_t events[];
+} lwt_trace_ring_t;
+
+/// Monitoring counters of an executor. Only written by the owning executor (or fibers running on it) without any
+/// synchronization and read lock free by lwt_metrics_snapshot(), which is why every counter is a single word.
+typedef struct lwt_metrics_shard {
+    /// Number of times a fiber was switched in.
+    volatile uint64_t context_switches;
+    volatile uint64_t preemptions;
+    volatile uint64_t yields;
+    /// Number of times a running fiber overflowed into a new stacklet.
+    volatile uint64_t stacklet_overflows;
+    volatile uint64_t fibers_spawned;
+    volatile uint64_t fibers_exited;
+    /// Histogram of the time fibers waited in a run queue before being switched in, see LWT_METRICS_WAIT_BUCKETS.
+    volatile uint64_t queue_wait_buckets[LWT_METRICS_WAIT_BUCKETS];
+    volatile uint64_t queue_wait_ticks_sum;
+    /// Number of times a fiber was deferred waiting for a file descriptor, per kind of file descriptor.
+    volatile uint64_t io_waits[LWT_N_FD_TYPES];
+    /// Number of ifc joins made per ifc function with open addressing. A slot is taken by setting the function
+    /// pointer, which is never changed after that.
+    struct lwt_metrics_ifc_fn {
+        void* volatile fn_ptr;
+        volatile uint64_t count;
+    } ifc_joins[LWT_METRICS_IFC_FNS];
+    /// Number of ifc joins of functions that did not fit in the table.
+    volatile uint64_t ifc_joins_other;
+} lwt_metrics_shard_t;
+
 typedef struct lwt_fiber {
     struct {
         /// Fibers are indexed by id in lwt_all_fibers.
@@ -300,15 +565,26 @@ typedef struct lwt_fiber {
     int32_t local_errno;
     /// Name of fiber main. (e.g. generic function name of main function)
     fstr_t main_name;
+    /// Scheduling class of the fiber. Never lwt_fiber_class_inherit for started fibers.
+    lwt_fiber_class_t fiber_class;
     /// Estimated maximum stack size that is worth pre-allocating for performance.
-    /// This is determined in post-link time by analyzing the complete call graph of the program.
+    /// This is determined in post-link time by analyzing the complete call graph of the program
+    /// or learned from the stack depth reached by earlier fibers with the same main, whichever is larger.
     size_t est_stack_size;
+    /// Deepest stack seen so far, sampled when overflowing into new stacklets and when switched out.
+    size_t peak_stack_depth;
+    /// Time stamp counter when the fiber was last enqueued for execution or 0. Only set when metrics are enabled.
+    uint64_t enqueue_tsc;
     /// Name of fiber instance. (e.g. ID of related object)
     fstr_t instance_name;
     /// Stack of dynamic stack allocations.
     lwt_stack_alloc_t* stack_alloc_stack;
     /// The current stacklet.
     lwt_stacklet_t* current_stacklet;
+    /// The last stacklet released by the fiber. It's kept as long as the fiber is running so a fiber that repeatedly
+    /// crosses the same stacklet boundary doesn't pay for a new stacklet every time. Moved to the stacklet cache of
+    /// the executor when the fiber is switched out.
+    lwt_stacklet_t* spare_stacklet;
     /// The current fiber heap.
     vm_heap_t* current_heap;
     /// started == true: Currently stacked events. started == false: Pointer to a callback function.
@@ -326,6 +602,8 @@ typedef struct lwt_fiber {
     rcd_fid_t defer_wait_fid;
     /// If the fiber is deferred, this is one of the waiting file descriptors or -1.
     int32_t defer_wait_fd;
+    /// Maximum time that interruptible joins made by the fiber waits for the server to accept them or 0 for no limit.
+    uint128_t join_timeout_ns;
     /// Previous fiber in the linked list. (shared_fiber_mem.fiber_list)
     struct lwt_fiber* prev;
     /// Next fiber in the linked list. (shared_fiber_mem.fiber_list)
@@ -357,6 +635,8 @@ typedef struct lwt_physical_thread {
     int64_t linux_tid;
     /// %fs:0xe0 - Pointer to fxsave memory for context switching from fibers and back without loosing the floating point and other special register state.
     lwt_fxsave_mem_t* fxsave_mem;
+    /// %fs:0xe8 - Number of atomic spinlocks currently held by the physical thread. Maintained by the spinlock functions in atomic.h.
+    uint32_t n_spinlocks_held;
     /// The pid returned from clone.
     int32_t pid;
     /// When unwinding try/catch: The jump buffer of the block.
@@ -375,11 +655,65 @@ typedef struct lwt_physical_thread {
     void* thread_static_memory;
     /// Main function for the fiber we are currently starting.
     void (*main_fn_ptr)(void*);
+    /// True if this physical thread is an executor and owns the run queue below.
+    bool is_executor;
+    /// Sequence number of the executor, assigned when it starts.
+    uint32_t executor_index;
+    /// NUMA node the executor is pinned to. Always zero when executor affinity is disabled.
+    uint32_t numa_node;
+    /// True when the executor is pinned to the cpu at cpu_i in lwt_cpu_topology.
+    bool is_pinned;
+    uint32_t cpu_i;
+    /// True for executors started by the system monitor to stand in for executors that are blocked in syscalls.
+    bool is_spare_executor;
+    /// True while the executor is waiting for fibers to execute.
+    volatile bool is_idle;
+    /// True while the executor is a retired spare executor.
+    volatile bool is_parked;
+    /// Incremented by the executor every time it picks a fiber to execute.
+    /// sched_tick, preempt_tick and preempt_pending must be kept in this order as rsig_sigpreempt_handler uses them.
+    volatile uint64_t sched_tick;
+    /// The sched_tick seen by the last preemption signal.
+    volatile uint64_t preempt_tick;
+    /// Set by the preemption signal when the current fiber has used up its time slice.
+    volatile bool preempt_pending;
+    /// Timer that sends the preemption signal and the slice it's armed with. Created when first armed.
+    bool has_preempt_timer;
+    timer_t preempt_timer;
+    uint32_t preempt_timer_slice_us;
+    /// The sched_tick that the system monitor last saw and when it saw it change. Only accessed by the system monitor.
+    uint64_t sysmon_tick;
+    uint64_t sysmon_tick_ns;
+    /// Stacklets released by fibers running on the executor that can be reused.
+    lwt_stacklet_cache_t stacklet_cache;
+    /// Finalized fiber structs kept for reuse by fibers spawned on the executor, linked by their next field.
+    /// Each one keeps the root stacklet of its last fiber as its spare stacklet.
+    lwt_fiber_t* fiber_cache;
+    uint32_t n_cached_fibers;
+    /// Number of fiber structs that the executor has reused from its fiber cache.
+    uint64_t n_reused_fibers;
+    /// Samples taken by the profiler on the executor. Only allocated when the profiler is enabled.
+    lwt_profiler_t* profiler;
+    /// Scheduler events recorded by the physical thread. Allocated on the first event when tracing is enabled.
+    lwt_trace_ring_t* trace_ring;
+    /// Monitoring counters of the executor. Only allocated when metrics are enabled.
+    lwt_metrics_shard_t* metrics;
+    /// Free memory chunks cached by the vm for the physical thread. Allocated by the vm on first use.
+    struct vm_thread_cache* vm_thread_cache;
+    /// Local run queue of the executor. Zero initialized when the physical thread struct is allocated.
+    lwt_run_queue_t run_queue;
 } lwt_physical_thread_t;
 
 // This constant is used by _start to allocate an initial physical thread struct.
 const size_t lwt_physical_thread_size = sizeof(lwt_physical_thread_t);
 
+// This constant is used by rsig_sigpreempt_handler to find the preemption state.
+const size_t lwt_sched_tick_offset = offsetof(lwt_physical_thread_t, sched_tick);
+CASSERT(offsetof(lwt_physical_thread_t, fxsave_mem) == 0xe0);
+CASSERT(offsetof(lwt_physical_thread_t, n_spinlocks_held) == 0xe8);
+CASSERT(offsetof(lwt_physical_thread_t, preempt_tick) == offsetof(lwt_physical_thread_t, sched_tick) + 0x8);
+CASSERT(offsetof(lwt_physical_thread_t, preempt_pending) == offsetof(lwt_physical_thread_t, sched_tick) + 0x10);
+
 typedef struct lwt_executor_thread {
     lwt_physical_thread_t* phys_thread;
     struct lwt_executor_thread* next;
@@ -393,61 +727,363 @@ static const uint128_t lwt_once_status_init = 0;
 static const uint128_t lwt_once_status_spin = (UINT128_MAX);
 static const uint128_t lwt_once_status_done = (UINT128_MAX - 1);
 
-// Hash map types declarations that map a fiber id to a lwt_fiber_t*.
-HMAP_DEFINE_TYPE(fid, rcd_fid_t, lwt_fiber_t*, false, 1000, 0.5, false);
-
 // Hash map types declarations that map a fd to a lwt_blocking_fd_t*.
 HMAP_DEFINE_TYPE(bfd, int32_t, lwt_blocking_fd_t*, false, 1000, 0.5, false);
 
+/// Cpus the process may run on according to sched_getaffinity(), ordered by NUMA node so executors with adjacent
+/// indexes are pinned to cpus on the same node. Only initialized when executor affinity is enabled.
+static struct lwt_cpu_topology {
+    uint32_t n_cpus;
+    uint32_t n_nodes;
+    uint16_t* cpus;
+    uint16_t* cpu_nodes;
+} lwt_cpu_topology = {0};
+
 // Physical LWT threads.
 lwt_executor_thread_t* lwt_executor_threads = 0;
 size_t lwt_executor_thread_count = 0;
 int8_t lwt_executor_match_lock = 0;
 
+/// Spare executors started by the system monitor. They are never stopped, instead they are parked when retired
+/// and unparked the next time the system monitor needs an executor.
+static struct lwt_sysmon {
+    /// Protects n_spares and n_parked.
+    int8_t lock;
+    /// Number of spare executors started.
+    uint32_t n_spares;
+    /// Upper bound of n_spares.
+    uint32_t max_spares;
+    /// Number of spare executors that are parked.
+    volatile uint32_t n_parked;
+    /// Futex with the number of unpark tokens available to parked spare executors.
+    uint32_t unpark_futex;
+    /// True from when a spare executor is started or unparked until it has taken over the cpu of the blocked
+    /// executor it stands in for. No more spares are added meanwhile. Protected by lock.
+    bool spare_pending;
+    /// Index in lwt_cpu_topology of the cpu the pending spare takes over, -1 if the blocked executor is not pinned.
+    int32_t spare_cpu_i;
+} lwt_sysmon = {0};
+
+/// Call sites where fibers overflow into new stacklets. Only updated when hot split tracking is enabled.
+/// Sites are inserted lock free with open addressing and never removed.
+static struct lwt_hot_splits {
+    /// True while splits are counted. Starts out as hot_split_tracking and is only changed at runtime by
+    /// lwt_hot_split_tracking_set_enabled().
+    volatile bool enabled;
+    lwt_hot_split_site_t sites[LWT_HOT_SPLIT_SITES];
+    /// Total number of splits, including those at sites that did not fit in the table.
+    uint64_t n_splits;
+} lwt_hot_splits = {0};
+
+/// Stack sizes learned from the peak stack depth of exited fibers, indexed by fiber main name with open addressing.
+/// Mains are inserted with the lock held and never removed so lookups are lock free. A slot is published by
+/// setting the main name string pointer last.
+static struct lwt_stack_learn {
+    int8_t lock;
+    struct lwt_stack_learn_slot {
+        fstr_t main_name;
+        size_t stack_size;
+    } slots[LWT_STACK_LEARN_SLOTS];
+} lwt_stack_learn = {0};
+
+/// Trace rings of all physical threads that has recorded scheduler events. Rings are inserted lock free and never removed.
+static struct {
+    /// True while events are recorded. Starts out true if trace_ring_events is configured and is only changed at
+    /// runtime by lwt_trace_set_enabled_local().
+    volatile bool enabled;
+    lwt_trace_ring_t* rings;
+} lwt_trace = {0};
+
+/// The time stamp counter and monotonic clock at startup, used to convert time stamp counter ticks to time.
+/// Only read when tracing or metrics are enabled.
+static struct {
+    uint64_t tsc0;
+    uint64_t ns0;
+} lwt_tsc_epoch = {0};
+
 /// The global heap and synchronization to access it.
 static struct {
     vm_heap_t* heap;
     int32_t rwlock;
 } lwt_global_heap = {0};
 
-/// Memory for shared fiber control and ifc.
+/// Memory for shared fiber control. Ifc queues are protected by the ifc lock in the fiber table instead.
 static struct {
     int32_t rwlock;
-    /// Hash map of all fiber control structs indexed by fiber->id.
-    hmap_fid_t fiber_map;
     /// Linked list of all fibers.
     lwt_fiber_t* fiber_list;
-    /// Queue of execution blocked fibers that await execution by a physical thread.
-    struct {
-        exec_blocked_fiber_t* first;
-        exec_blocked_fiber_t* last;
-    } exec_block_queue;
+    /// Global queue of execution blocked fibers that await execution by a physical thread.
+    /// Fibers woken up by executors are queued in their local run queue instead, this queue is used by all other physical threads.
+    exec_block_class_queue_t exec_block_queue;
+    /// Protects exec_block_queue so executors can poll it without taking the shared fiber lock.
+    int8_t exec_block_queue_lock;
     /// Futex that is incremented every time the blocked fibers list changes and used to yield the cpu to the kernel when no fiber requires execution by futex(2).
     uint32_t exec_block_futex;
+    /// Number of executors that are sleeping on exec_block_futex or about to. Enqueue only wakes the futex when non-zero.
+    uint32_t n_sleeping_executors;
+    /// Number of executors that are blocked polling their I/O shard instead of sleeping on exec_block_futex or
+    /// about to. Enqueue wakes one of them through the wake fd of its shard when no executor is sleeping.
+    uint32_t n_polling_executors;
+    /// Number of times enqueue woke a sleeping executor through exec_block_futex.
+    uint64_t n_futex_wakes;
     // If this is true only one executor is allowed and the rest should block until it's disabled. Used for debugging purposes where multiple threads mess with the debugger.
     bool debug_choke_enabled;
     // Number of threads that is stuck waiting for debug_choke_enabled to change to false. Should never be higher than lwt_executor_thread_count - 1.
     uint64_t debug_choke_count;
     // Futex that is incremented every time debug_choke_enabled changes.
     uint32_t debug_choke_futex;
-    /// This ifc call id is incremented every time a new ifc call is made so ifc calls can be ordered across different functions queues.
-    uint128_t ifc_call_id;
 } shared_fiber_mem = {0};
 
-/// Free list allocator for lwt_ifc_fn_queue_t structs. Is externally synchronized with shared_fiber_mem.rwlock.
-VM_DEFINE_FREE_LIST_ALLOCATOR_FN(lwt_ifc_fn_queue_t, lwt_ifc_fn_queue_allocate, lwt_ifc_fn_queue_free, false);
-
+/// Number of low bits in a fiber id that index its slot in the fiber table.
+/// The high bits contain the generation of the slot which is incremented
+/// every time the slot is reused so fiber ids are never recycled.
+#define LWT_FID_SLOT_BITS 28
+#define LWT_FID_SLOT_MASK ((1UL << LWT_FID_SLOT_BITS) - 1)
+
+/// The fiber table is a two level array of slot chunks so it can grow
+/// without moving slots that lock-free readers may be looking at.
+#define LWT_FID_CHUNK_BITS 12
+#define LWT_FID_CHUNK_SLOTS (1UL << LWT_FID_CHUNK_BITS)
+#define LWT_FID_CHUNK_MASK (LWT_FID_CHUNK_SLOTS - 1)
+#define LWT_FID_CHUNKS (1UL << (LWT_FID_SLOT_BITS - LWT_FID_CHUNK_BITS))
+
+typedef struct lwt_fid_slot {
+    /// Generation of the fiber that occupies or last occupied the slot.
+    volatile uint64_t gen;
+    /// The fiber that occupies the slot or 0 if it's free.
+    lwt_fiber_t* volatile fiber;
+    /// Next free slot index when free.
+    uint32_t next_free;
+    /// Protects the ifc function queues of the fiber in the slot and the ifc servers that accepts on them.
+    /// Slots are never freed so the lock outlives the fiber and can be taken with a stale fiber id.
+    /// Lock order is ifc lock before shared_fiber_mem.rwlock.
+    rwspinlock_t ifc_lock;
+    /// Incremented for every ifc call to the fiber so calls can be ordered across its function queues. Protected by ifc_lock.
+    uint64_t ifc_call_id;
+} lwt_fid_slot_t;
+
+/// Table of all fibers that resolves fiber ids without any lock.
+/// Writers are serialized by the table lock. Readers validate the slot
+/// generation before and after reading the fiber pointer instead.
 static struct {
+    int8_t lock;
+    /// Number of fibers in the table.
+    size_t count;
+    /// Number of allocated chunks and slots in them that was never used.
+    size_t n_chunks;
+    size_t n_fresh_slots;
+    /// Free list of recycled slots (slot index + 1, 0 if empty).
+    uint32_t free_head;
+    lwt_fid_slot_t* volatile chunks[LWT_FID_CHUNKS];
+} lwt_fid_table = {0};
+
+static lwt_fid_slot_t* lwt_fid_table_slot(uint32_t slot_i) {
+    lwt_fid_slot_t* chunk = lwt_fid_table.chunks[slot_i >> LWT_FID_CHUNK_BITS];
+    return (chunk != 0? &chunk[slot_i & LWT_FID_CHUNK_MASK]: 0);
+}
+
+/// Returns the slot of a fiber id that is or was in the table.
+static lwt_fid_slot_t* lwt_fid_table_id_slot(rcd_fid_t fiber_id) {
+    lwt_fid_slot_t* slot = lwt_fid_table_slot((uint32_t) (fiber_id & LWT_FID_SLOT_MASK));
+    assert(slot != 0);
+    return slot;
+}
+
+/// Resolves a fiber id without taking any lock. Fiber structs are allocated
+/// from a free list and never unmapped so the returned fiber is always safe
+/// to read, but unless the shared fiber lock is held it can exit and be
+/// reused at any time after returning. Callers that don't hold the lock may
+/// therefore only use the result as a hint and must look it up again after
+/// locking.
+static lwt_fiber_t* lwt_fid_table_lookup(rcd_fid_t fiber_id) {
+    uint128_t gen = fiber_id >> LWT_FID_SLOT_BITS;
+    if (gen == 0 || gen > UINT64_MAX)
+        return 0;
+    lwt_fid_slot_t* slot = lwt_fid_table_slot((uint32_t) (fiber_id & LWT_FID_SLOT_MASK));
+    if (slot == 0 || slot->gen != gen)
+        return 0;
+    // The slot fields are volatile and x86_64 does not reorder loads so no fence is required.
+    lwt_fiber_t* fiber = slot->fiber;
+    // The generation is only written once per fiber id, if it's unchanged the fiber pointer belongs to it.
+    return (slot->gen == gen? fiber: 0);
+}
+
+/// Allocates a slot for a new fiber and returns its fiber id.
+static rcd_fid_t lwt_fid_table_insert(lwt_fiber_t* fiber) {
+    uint32_t slot_i;
+    lwt_fid_slot_t* slot;
+    atomic_spinlock_lock(&lwt_fid_table.lock); {
+        if (lwt_fid_table.free_head != 0) {
+            slot_i = lwt_fid_table.free_head - 1;
+            slot = lwt_fid_table_slot(slot_i);
+            lwt_fid_table.free_head = slot->next_free;
+        } else {
+            if (lwt_fid_table.n_fresh_slots == 0) {
+                if (lwt_fid_table.n_chunks == LWT_FID_CHUNKS)
+                    throw("fiber table is full", exception_fatal);
+                lwt_fid_slot_t* chunk = vm_mmap_reserve(sizeof(lwt_fid_slot_t) * LWT_FID_CHUNK_SLOTS, 0);
+                memset(chunk, 0, sizeof(lwt_fid_slot_t) * LWT_FID_CHUNK_SLOTS);
+                sync_synchronize();
+                lwt_fid_table.chunks[lwt_fid_table.n_chunks] = chunk;
+                lwt_fid_table.n_chunks++;
+                lwt_fid_table.n_fresh_slots = LWT_FID_CHUNK_SLOTS;
+            }
+            slot_i = lwt_fid_table.n_chunks * LWT_FID_CHUNK_SLOTS - lwt_fid_table.n_fresh_slots;
+            lwt_fid_table.n_fresh_slots--;
+            slot = lwt_fid_table_slot(slot_i);
+        }
+        // Publish the new generation before the fiber so readers of the old fiber id never see the new fiber.
+        slot->gen++;
+        sync_synchronize();
+        slot->fiber = fiber;
+        lwt_fid_table.count++;
+    } atomic_spinlock_unlock(&lwt_fid_table.lock);
+    return ((uint128_t) slot->gen << LWT_FID_SLOT_BITS) | slot_i;
+}
+
+static void lwt_fid_table_remove(rcd_fid_t fiber_id) {
+    uint32_t slot_i = (uint32_t) (fiber_id & LWT_FID_SLOT_MASK);
+    atomic_spinlock_lock(&lwt_fid_table.lock); {
+        lwt_fid_slot_t* slot = lwt_fid_table_slot(slot_i);
+        if (slot == 0 || slot->fiber == 0 || slot->gen != (fiber_id >> LWT_FID_SLOT_BITS))
+            throw("removing fiber from global index failed: index did not exist. possible memory corruption", exception_fatal);
+        slot->fiber = 0;
+        slot->next_free = lwt_fid_table.free_head;
+        lwt_fid_table.free_head = slot_i + 1;
+        lwt_fid_table.count--;
+    } atomic_spinlock_unlock(&lwt_fid_table.lock);
+}
+
+/// Free list allocator for lwt_ifc_fn_queue_t structs. Queues of different fibers are protected by different locks so it's synchronized.
+VM_DEFINE_FREE_LIST_ALLOCATOR_FN(lwt_ifc_fn_queue_t, lwt_ifc_fn_queue_allocate, lwt_ifc_fn_queue_free, true);
+
+/// Timer wheel tick length as a power of two in nanoseconds (~1 ms).
+#define LWT_TIMER_TICK_SHIFT 20
+/// Number of slots in each level of the timer wheel as a power of two.
+#define LWT_TIMER_LEVEL_BITS 6
+#define LWT_TIMER_LEVEL_SLOTS (1 << LWT_TIMER_LEVEL_BITS)
+#define LWT_TIMER_LEVEL_MASK (LWT_TIMER_LEVEL_SLOTS - 1)
+/// Number of levels in the timer wheel. Covers 2^24 ticks (~4.9 hours), timers beyond that are parked in the last level.
+#define LWT_TIMER_LEVELS 4
+
+typedef enum lwt_timer_action {
+    /// Wakes up a fiber waiting for the timer.
+    lwt_timer_action_wake,
+    /// Cancels a fiber.
+    lwt_timer_action_cancel,
+} lwt_timer_action_t;
+
+typedef struct lwt_timer {
+    struct lwt_timer* prev;
+    struct lwt_timer* next;
+    /// The wheel that the timer was armed in.
+    struct lwt_timer_wheel* wheel;
+    /// Absolute monotonic time in ticks when the timer expires.
+    uint64_t expire_tick;
+    /// True while the timer is in the wheel. Protected by the wheel lock.
+    bool armed;
+    /// Level and slot in the wheel while armed.
+    uint8_t level;
+    uint8_t slot;
+    lwt_timer_action_t action;
+    /// The fiber to wake up. (lwt_timer_action_wake)
+    lwt_fiber_t* fiber;
+    /// The fiber to cancel. (lwt_timer_action_cancel)
+    rcd_fid_t target_fid;
+} lwt_timer_t;
+
+struct lwt_alarm {
+    lwt_timer_t timer;
+};
+
+/// Hierarchical timer wheel. Arming and disarming is O(1). The wheel is advanced by its I/O shard when its timer fd expires.
+typedef struct lwt_timer_wheel {
+    /// Protects all fields in the wheel and all timers armed in it.
+    int8_t lock;
+    /// Timer fd that expires at armed_tick, registered in the epoll instance of the I/O shard.
+    int32_t timer_fd;
+    /// The next tick that has not been processed yet.
+    uint64_t current_tick;
+    /// The tick that timer_fd is armed to expire at or UINT64_MAX if disarmed.
+    uint64_t armed_tick;
+    /// Number of armed timers.
+    size_t n_timers;
+    /// Bitmap of the slots that are not empty in each level.
+    uint64_t slot_bitmap[LWT_TIMER_LEVELS];
+    lwt_timer_t* slots[LWT_TIMER_LEVELS][LWT_TIMER_LEVEL_SLOTS];
+} lwt_timer_wheel_t;
+
+/// I/O readiness is monitored by a number of shards that each has its own epoll instance, monitor thread and
+/// blocking fd table so readiness dispatch is not serialized by a single thread and lock.
+/// File descriptors are assigned to shards by their number.
+/// Physical threads that can be polling the epoll instance of an I/O shard.
+typedef enum lwt_io_poller {
+    lwt_io_poller_none = 0,
+    lwt_io_poller_executor,
+    lwt_io_poller_monitor,
+} lwt_io_poller_t;
+
+typedef struct lwt_io_shard {
+    /// Protects blocking_fd_map and all lwt_blocking_fd_t structs indexed in it.
     int32_t rwlock;
     /// Hash map of all fiber control structs indexed by blocking_fd->fd.
     hmap_bfd_t blocking_fd_map;
-} shared_bfd_mem = {0};
+    /// File descriptor for the epoll instance of the shard.
+    int epoll_fd;
+    /// Eventfd in the epoll instance that is written to wake up an executor blocked polling the shard.
+    int32_t wake_fd;
+    /// The lwt_io_poller_t that is blocked polling the shard, taken with a cas when executor polling is enabled.
+    uint32_t poller;
+    /// Incremented every time an executor has polled the shard. The monitor thread only polls the shard when it
+    /// stops changing.
+    uint32_t n_executor_polls;
+    /// Timers armed by fibers running on the executors that poll this shard.
+    lwt_timer_wheel_t timer_wheel;
+} __attribute__((aligned(64))) lwt_io_shard_t;
+
+/// Array of all I/O shards.
+static lwt_io_shard_t* lwt_io_shards;
+
+/// Number of I/O shards. Fixed at startup.
+static uint32_t lwt_io_shard_count;
+
+/// Completion based I/O engine built on io_uring. Used for operations that epoll readiness cannot
+/// make asynchronous. Fibers fill in submission entries directly and are woken by a completion thread.
+static struct lwt_uring {
+    /// True if new operations should use the ring. Only changes at startup or from lwt_uring_set_enabled().
+    bool enabled;
+    /// True if the ring and its completion thread is set up. They are kept until the process exits.
+    bool started;
+    /// File descriptor of the ring.
+    int32_t ring_fd;
+    /// Serializes fibers that fill in submission entries.
+    int8_t sq_lock;
+    /// Submission queue ring, shared with the kernel.
+    volatile uint32_t* sq_head;
+    volatile uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t* sq_array;
+    struct io_uring_sqe* sqes;
+    /// Completion queue ring, shared with the kernel. Only consumed by the completion thread.
+    volatile uint32_t* cq_head;
+    volatile uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;
+} lwt_uring = {0};
+
+/// A pending io_uring operation. Lives on the stack of the submitting fiber until it's complete.
+typedef struct lwt_uring_req {
+    lwt_fiber_t* fiber;
+    int32_t res;
+    bool complete;
+} lwt_uring_req_t;
 
 /// Free list allocator for main fiber structs.
 VM_DEFINE_FREE_LIST_ALLOCATOR_FN(lwt_fiber_t, lwt_fiber_allocate, lwt_fiber_free, true);
 
-/// Free list allocator for lwt_blocking_fd_t structs. Is externally synchronized with shared_bfd_mem.rwlock.
-VM_DEFINE_FREE_LIST_ALLOCATOR_FN(lwt_blocking_fd_t, lwt_blocking_fd_allocate, lwt_blocking_fd_free, false);
+/// Free list allocator for lwt_blocking_fd_t structs. Is shared by all I/O shards and therefore synchronized.
+VM_DEFINE_FREE_LIST_ALLOCATOR_FN(lwt_blocking_fd_t, lwt_blocking_fd_allocate, lwt_blocking_fd_free, true);
 
 /// First argument passed to program containing the program path.
 fstr_mem_t* lwt_program_path;
@@ -455,8 +1091,20 @@ fstr_mem_t* lwt_program_path;
 /// Memory used for storing program arguments and environment.
 fstr_t lwt_program_cmdline_mem;
 
-/// Shared file descriptor for epoll operations.
-int lwt_shared_epoll_fd;
+/// Runtime configuration. Passed to lwt_configure() at startup and read only after that.
+static lwt_config_t lwt_config = {0};
+
+/// Preemption time slice that executors arm their preemption timer with. Starts out as preemption_slice_us and is
+/// only changed at runtime by lwt_preemption_set_slice().
+static volatile uint32_t lwt_preemption_slice_us;
+
+/// Time idle executors spin before going to sleep. Starts out as executor_spin_us and is only changed at runtime by
+/// lwt_executor_spin_set().
+static volatile uint32_t lwt_executor_spin_us;
+
+/// True while executors count metrics. Starts out as metrics and is only changed at runtime by
+/// lwt_metrics_set_enabled().
+static volatile bool lwt_metrics_enabled;
 
 /// Limit for worker count that is set when debugging.
 volatile uint64_t lwt_debug_max_worker_count = UINT64_MAX;
@@ -486,6 +1134,12 @@ static list(void*)* lwt_get_backtrace_for_frame_ptr(void* current_frame_ptr, uin
 
 static list(void*)* lwt_get_backtrace();
 
+static void lwt_stacklet_cache_flush(lwt_physical_thread_t* phys_thread);
+static void lwt_stacklet_cache_trim(lwt_physical_thread_t* phys_thread);
+
+static void lwt_fiber_cache_flush(lwt_physical_thread_t* phys_thread);
+static void lwt_fiber_cache_trim(lwt_physical_thread_t* phys_thread);
+
 static void lwt_fatal_exception_handler(rcd_exception_t* exception);
 
 static int32_t lwt_sigtkill_thread(int32_t tid, int32_t signal, union sigval value) {
@@ -589,24 +1243,457 @@ static inline void lwt_sys_spinlock_unlock(rwspinlock_t* rwspinlock, rwspinlock_
     phys_thread->system_rwspinlock = *prev_system_rwspinlock;
 }
 
+/// Returns the index of the highest class with a non-empty fifo or LWT_N_FIBER_CLASSES if all fifos are empty.
+static inline size_t exec_block_class_queue_top(exec_block_class_queue_t* class_queue) {
+    for (size_t i = 0; i < LWT_N_FIBER_CLASSES; i++) {
+        if (class_queue->fifo[i].first != 0)
+            return i;
+    }
+    return LWT_N_FIBER_CLASSES;
+}
+
+static inline void exec_block_class_queue_enqueue(exec_block_class_queue_t* class_queue, exec_blocked_fiber_t* execb_fiber) {
+    QUEUE_ENQUEUE_SL(&class_queue->fifo[execb_fiber->class_i], execb_fiber);
+}
+
+/// Dequeues a fiber from the highest non-empty class unless a lower class has aged enough to get its turn.
+/// Returns 0 if all fifos are empty.
+static exec_blocked_fiber_t* exec_block_class_queue_dequeue(exec_block_class_queue_t* class_queue) {
+    size_t class_i = LWT_N_FIBER_CLASSES;
+    for (size_t i = 0; i < LWT_N_FIBER_CLASSES; i++) {
+        if (class_queue->fifo[i].first == 0) {
+            class_queue->n_passed[i] = 0;
+        } else if (class_i == LWT_N_FIBER_CLASSES) {
+            class_i = i;
+        } else if (++class_queue->n_passed[i] >= LWT_FIBER_CLASS_AGING_LIMIT) {
+            class_i = i;
+            break;
+        }
+    }
+    if (class_i == LWT_N_FIBER_CLASSES)
+        return 0;
+    class_queue->n_passed[class_i] = 0;
+    return QUEUE_DEQUEUE_SL(&class_queue->fifo[class_i]);
+}
+
+/// Pushes a fiber to the local run queue of an executor. When run_next is true the fiber takes the runnext slot
+/// and any fiber that was already there is kicked out to the end of its fifo. Background fibers never take the
+/// runnext slot as they should not run before anything else that is already waiting.
+static void lwt_run_queue_push(lwt_run_queue_t* run_queue, exec_blocked_fiber_t* execb_fiber, bool run_next) {
+    atomic_spinlock_lock(&run_queue->lock);
+    if (run_next && execb_fiber->class_i != LWT_FIBER_CLASS_I(lwt_fiber_class_background)) {
+        exec_blocked_fiber_t* kicked_execb_fiber = run_queue->runnext;
+        run_queue->runnext = execb_fiber;
+        if (kicked_execb_fiber != 0)
+            exec_block_class_queue_enqueue(&run_queue->fifo, kicked_execb_fiber);
+    } else {
+        exec_block_class_queue_enqueue(&run_queue->fifo, execb_fiber);
+    }
+    run_queue->length++;
+    atomic_spinlock_unlock(&run_queue->lock);
+}
+
+/// Pops the next fiber from the local run queue of the executor or returns 0 if it's empty.
+/// The runnext fiber is skipped while a fiber of a higher class waits in the fifos.
+static exec_blocked_fiber_t* lwt_run_queue_pop(lwt_run_queue_t* run_queue) {
+    if (run_queue->length == 0)
+        return 0;
+    exec_blocked_fiber_t* execb_fiber;
+    atomic_spinlock_lock(&run_queue->lock);
+    size_t top_class_i = exec_block_class_queue_top(&run_queue->fifo);
+    if (run_queue->runnext != 0 && (top_class_i == LWT_N_FIBER_CLASSES
+    || (run_queue->runnext_streak < LWT_RUNNEXT_STREAK_MAX && run_queue->runnext->class_i <= top_class_i))) {
+        execb_fiber = run_queue->runnext;
+        run_queue->runnext = 0;
+        run_queue->runnext_streak++;
+    } else {
+        execb_fiber = exec_block_class_queue_dequeue(&run_queue->fifo);
+        run_queue->runnext_streak = 0;
+    }
+    if (execb_fiber != 0)
+        run_queue->length--;
+    atomic_spinlock_unlock(&run_queue->lock);
+    return execb_fiber;
+}
+
+/// Steals about half of the fibers in the victim run queue from its highest non-empty class. One of them is returned
+/// for immediate execution and the rest is moved to the fifo of the thief. The runnext fiber is only stolen when the
+/// victim fifos are empty.
+static exec_blocked_fiber_t* lwt_run_queue_steal(lwt_run_queue_t* thief_run_queue, lwt_run_queue_t* victim_run_queue) {
+    // Peek without locking to avoid bouncing the cache line of run queues that are empty anyway.
+    if (victim_run_queue->length == 0)
+        return 0;
+    exec_block_queue_t loot = {0};
+    size_t loot_length = 0;
+    atomic_spinlock_lock(&victim_run_queue->lock);
+    size_t class_i = exec_block_class_queue_top(&victim_run_queue->fifo);
+    if (class_i < LWT_N_FIBER_CLASSES) {
+        size_t steal_length = (victim_run_queue->length + 1) / 2;
+        for (; loot_length < steal_length; loot_length++) {
+            exec_blocked_fiber_t* execb_fiber = QUEUE_DEQUEUE_SL(&victim_run_queue->fifo.fifo[class_i]);
+            if (execb_fiber == 0)
+                break;
+            QUEUE_ENQUEUE_SL(&loot, execb_fiber);
+        }
+    } else if (victim_run_queue->runnext != 0) {
+        class_i = victim_run_queue->runnext->class_i;
+        QUEUE_ENQUEUE_SL(&loot, victim_run_queue->runnext);
+        victim_run_queue->runnext = 0;
+        loot_length = 1;
+    }
+    victim_run_queue->length -= loot_length;
+    atomic_spinlock_unlock(&victim_run_queue->lock);
+    exec_blocked_fiber_t* execb_fiber = QUEUE_DEQUEUE_SL(&loot);
+    if (loot.first != 0) {
+        atomic_spinlock_lock(&thief_run_queue->lock);
+        exec_block_queue_t* thief_fifo = &thief_run_queue->fifo.fifo[class_i];
+        if (thief_fifo->first == 0) {
+            *thief_fifo = loot;
+        } else {
+            thief_fifo->last->next = loot.first;
+            thief_fifo->last = loot.last;
+        }
+        thief_run_queue->length += loot_length - 1;
+        atomic_spinlock_unlock(&thief_run_queue->lock);
+    }
+    return execb_fiber;
+}
+
+/// Tries to steal work from the run queue of any sibling executor. Starts with a pseudo random victim so idle
+/// executors don't all converge on the same sibling. Siblings on the same NUMA node are tried first so fibers
+/// (and the memory they are working with) don't bounce between nodes unless a whole node is idle.
+static exec_blocked_fiber_t* lwt_scheduler_exec_block_steal(lwt_physical_thread_t* phys_thread) {
+    size_t n_executors = lwt_executor_thread_count;
+    lwt_executor_thread_t* first_exec_thread = lwt_executor_threads;
+    if (n_executors <= 1 || first_exec_thread == 0)
+        return 0;
+    lwt_run_queue_t* run_queue = &phys_thread->run_queue;
+    run_queue->steal_seed = run_queue->steal_seed * 6364136223846793005UL + 1442695040888963407UL;
+    size_t offset = (run_queue->steal_seed >> 33) % n_executors;
+    lwt_executor_thread_t* start_exec_thread = first_exec_thread;
+    for (size_t i = 0; i < offset && start_exec_thread->next != 0; i++)
+        start_exec_thread = start_exec_thread->next;
+    size_t n_passes = (lwt_cpu_topology.n_nodes > 1? 2: 1);
+    for (size_t pass = 0; pass < n_passes; pass++) {
+        lwt_executor_thread_t* exec_thread = start_exec_thread;
+        do {
+            lwt_physical_thread_t* victim_phys_thread = exec_thread->phys_thread;
+            bool is_local_victim = (victim_phys_thread->numa_node == phys_thread->numa_node);
+            if (victim_phys_thread != phys_thread && is_local_victim == (pass == 0)) {
+                exec_blocked_fiber_t* execb_fiber = lwt_run_queue_steal(run_queue, &victim_phys_thread->run_queue);
+                if (execb_fiber != 0)
+                    return execb_fiber;
+            }
+            exec_thread = (exec_thread->next != 0? exec_thread->next: first_exec_thread);
+        } while (exec_thread != start_exec_thread);
+    }
+    return 0;
+}
+
+/// Dequeues a fiber from the global queue or returns 0 if it's empty.
+static exec_blocked_fiber_t* lwt_scheduler_global_queue_dequeue() {
+    // Peek without locking as the global queue is usually empty when the process is busy.
+    if (exec_block_class_queue_top(&shared_fiber_mem.exec_block_queue) == LWT_N_FIBER_CLASSES)
+        return 0;
+    exec_blocked_fiber_t* execb_fiber;
+    atomic_spinlock_lock(&shared_fiber_mem.exec_block_queue_lock); {
+        execb_fiber = exec_block_class_queue_dequeue(&shared_fiber_mem.exec_block_queue);
+    } atomic_spinlock_unlock(&shared_fiber_mem.exec_block_queue_lock);
+    return execb_fiber;
+}
+
+static exec_blocked_fiber_t* lwt_scheduler_exec_block_poll_io(lwt_physical_thread_t* phys_thread);
+static exec_blocked_fiber_t* lwt_scheduler_exec_block_wait_io(lwt_physical_thread_t* phys_thread, lwt_io_shard_t* io_shard, uint32_t exec_blocked_futex_v, struct timespec* timeout);
+
+static uint64_t lwt_timer_now_ns();
+
+/// Reads the time stamp counter of the cpu.
+static inline uint64_t lwt_rdtsc() {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+/// Allocates a trace ring of at least min_events events for the physical thread and makes it visible to the exporter.
+static void lwt_trace_ring_alloc(lwt_physical_thread_t* phys_thread, size_t min_events) {
+    size_t n_events = 1;
+    while (n_events < min_events)
+        n_events <<= 1;
+    lwt_trace_ring_t* ring = vm_mmap_reserve(sizeof(lwt_trace_ring_t) + n_events * sizeof(lwt_trace_event_t), 0);
+    ring->n_events = 0;
+    ring->tid = gettid();
+    ring->thread_name = phys_thread->system_fiber.main_name;
+    ring->mask = n_events - 1;
+    for (;;) {
+        lwt_trace_ring_t* rings = lwt_trace.rings;
+        ring->next = rings;
+        if (atomic_cas_ptr((void**) &lwt_trace.rings, rings, ring))
+            break;
+        sync_synchronize();
+    }
+    phys_thread->trace_ring = ring;
+}
+
+/// Allocates the trace ring of the physical thread and makes it visible to the trace exporter if tracing is enabled.
+/// Called by the threads that record scheduler events when they start as events are recorded with scheduler spinlocks
+/// held and allocating the ring there would stall every other thread that needs the lock. Events of threads without
+/// a ring are dropped.
+static void lwt_trace_ring_init(lwt_physical_thread_t* phys_thread) {
+    if (lwt_config.trace_ring_events == 0)
+        return;
+    lwt_trace_ring_alloc(phys_thread, lwt_config.trace_ring_events);
+}
+
+/// Records a scheduler event in the trace ring of the current physical thread if it has one.
+static inline void lwt_trace_event(lwt_trace_event_type_t type, rcd_fid_t fid, int64_t arg, const void* ptr, uint32_t len) {
+    if (!lwt_trace.enabled)
+        return;
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    lwt_trace_ring_t* ring = phys_thread->trace_ring;
+    if (ring == 0)
+        return;
+    uint64_t seq = ring->n_events;
+    lwt_trace_event_t* event = &ring->events[seq & ring->mask];
+    // Readers check the sequence number before and after reading the event. Stores are not reordered with other
+    // stores on x86-64 so compiler barriers are enough to make the sequence number guard the event.
+    event->seq = 0;
+    __asm__ __volatile__("" ::: "memory");
+    event->tsc = lwt_rdtsc();
+    event->fid = fid;
+    event->arg = arg;
+    event->ptr = ptr;
+    event->len = len;
+    event->type = type;
+    __asm__ __volatile__("" ::: "memory");
+    event->seq = seq + 1;
+    ring->n_events = seq + 1;
+}
+
+/// Returns the length of a time stamp counter tick in nanoseconds, measured over the time since startup.
+static double lwt_tsc_ns_per_tick(uint64_t tsc_now, uint64_t ns_now) {
+    return (tsc_now > lwt_tsc_epoch.tsc0? (double) (ns_now - lwt_tsc_epoch.ns0) / (tsc_now - lwt_tsc_epoch.tsc0): 0);
+}
+
+/// Returns the metrics shard of the physical thread or 0 if metrics are disabled or it's not an executor.
+static inline lwt_metrics_shard_t* lwt_metrics_of(lwt_physical_thread_t* phys_thread) {
+    return (lwt_metrics_enabled? phys_thread->metrics: 0);
+}
+
+/// Returns the metrics shard of the current physical thread, see lwt_metrics_of().
+static inline lwt_metrics_shard_t* lwt_metrics_local() {
+    return lwt_metrics_of(LWT_PHYS_THREAD);
+}
+
+/// Allocates the metrics shard of an executor unless it already has one. The shard is only written by the executor
+/// so it can be allocated by another thread as long as it's published before it's used.
+static void lwt_metrics_init(lwt_physical_thread_t* phys_thread) {
+    if (phys_thread->metrics != 0)
+        return;
+    lwt_metrics_shard_t* metrics = vm_mmap_reserve(sizeof(lwt_metrics_shard_t), 0);
+    memset(metrics, 0, sizeof(lwt_metrics_shard_t));
+    if (!atomic_cas_ptr((void**) &phys_thread->metrics, 0, metrics))
+        vm_mmap_unreserve(metrics, sizeof(lwt_metrics_shard_t));
+}
+
+/// Counts a fiber being switched in by the executor and how long it waited in a run queue.
+static inline void lwt_metrics_switch_in(lwt_metrics_shard_t* metrics, lwt_fiber_t* fiber) {
+    metrics->context_switches++;
+    if (fiber->enqueue_tsc == 0)
+        return;
+    // The time stamp counters of different cpus can be slightly off, a negative wait is no wait.
+    int64_t wait_ticks = MAX((int64_t) (lwt_rdtsc() - fiber->enqueue_tsc), 0);
+    fiber->enqueue_tsc = 0;
+    size_t bucket_i = (wait_ticks == 0? 0: 64 - __builtin_clzl(wait_ticks));
+    metrics->queue_wait_buckets[MIN(bucket_i, LWT_METRICS_WAIT_BUCKETS - 1)]++;
+    metrics->queue_wait_ticks_sum += wait_ticks;
+}
+
+/// Counts an ifc join to the function in the slot of the function, taking a free slot if it has none.
+static inline void lwt_metrics_ifc_join(lwt_metrics_shard_t* metrics, void* ifc_fn_ptr) {
+    uint64_t hash = ((uintptr_t) ifc_fn_ptr * 0x9e3779b97f4a7c15UL) >> 32;
+    for (size_t i = 0; i < LWT_METRICS_IFC_FNS; i++) {
+        struct lwt_metrics_ifc_fn* slot = &metrics->ifc_joins[(hash + i) % LWT_METRICS_IFC_FNS];
+        if (slot->fn_ptr == 0)
+            slot->fn_ptr = ifc_fn_ptr;
+        if (slot->fn_ptr == ifc_fn_ptr) {
+            slot->count++;
+            return;
+        }
+    }
+    metrics->ifc_joins_other++;
+}
+
+/// Classifies a file descriptor for the io wait metrics.
+static lwt_fd_type_t lwt_metrics_fd_type(int32_t fd, bool is_epoll) {
+    if (is_epoll)
+        return lwt_fd_type_epoll;
+    struct stat fs;
+    if (fstat(fd, &fs) == -1)
+        return lwt_fd_type_other;
+    if (S_ISSOCK(fs.st_mode))
+        return lwt_fd_type_socket;
+    if (S_ISFIFO(fs.st_mode))
+        return lwt_fd_type_pipe;
+    if (S_ISCHR(fs.st_mode))
+        return lwt_fd_type_char;
+    return lwt_fd_type_other;
+}
+
+/// Wakes up an executor that is blocked polling its I/O shard so it looks for fibers to run.
+static void lwt_io_wake_poller() {
+    for (uint32_t i = 0; i < lwt_io_shard_count; i++) {
+        lwt_io_shard_t* io_shard = &lwt_io_shards[i];
+        if (io_shard->poller != lwt_io_poller_executor)
+            continue;
+        uint64_t wake_v = 1;
+        ssize_t write_r = write(io_shard->wake_fd, &wake_v, sizeof(wake_v));
+        if (write_r == -1 && errno != EAGAIN)
+            RCD_SYSCALL_EXCEPTION(write, exception_fatal);
+        return;
+    }
+}
+
 /// Enqueues a fiber scheduled for execution and wakes any waiting physical thread in the process.
-static void lwt_scheduler_exec_block_enqueue(lwt_fiber_t* fiber) {
+/// Executors enqueue in their own run queue, when run_next is true the fiber is scheduled to run directly after the
+/// current fiber, otherwise it's put last in the fifo. All other physical threads enqueue in the global queue.
+static void lwt_scheduler_exec_block_enqueue(lwt_fiber_t* fiber, bool run_next) {
     assert(ATOMIC_RWLOCK_IS_WLOCKED(shared_fiber_mem.rwlock));
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    assert(fiber->fiber_class != lwt_fiber_class_inherit);
+    lwt_trace_event(lwt_trace_event_wake, fiber->ctrl.id, phys_thread->current_fiber->ctrl.id, 0, 0);
+    if (lwt_metrics_enabled)
+        fiber->enqueue_tsc = lwt_rdtsc();
+    fiber->exec_blocked.class_i = LWT_FIBER_CLASS_I(fiber->fiber_class);
+    if (phys_thread->is_executor) {
+        lwt_run_queue_push(&phys_thread->run_queue, &fiber->exec_blocked, run_next);
+    } else {
+        atomic_spinlock_lock(&shared_fiber_mem.exec_block_queue_lock); {
+            exec_block_class_queue_enqueue(&shared_fiber_mem.exec_block_queue, &fiber->exec_blocked);
+        } atomic_spinlock_unlock(&shared_fiber_mem.exec_block_queue_lock);
+    }
+    // The futex must be incremented after the fiber is visible in a queue, otherwise an executor could scan the
+    // queues, miss the fiber and then go to sleep without noticing that the futex changed.
     for (;;) {
         uint32_t exec_blocked_futex_v = shared_fiber_mem.exec_block_futex;
         if (atomic_cas_uint32(&shared_fiber_mem.exec_block_futex, exec_blocked_futex_v, exec_blocked_futex_v + 1))
             break;
         sync_synchronize();
     }
-    QUEUE_ENQUEUE_SL(&shared_fiber_mem.exec_block_queue, &fiber->exec_blocked);
+    // Only wake when an executor is sleeping. An executor that counts itself as sleeping after the check above
+    // read the futex before it was incremented so its wait returns immediately and it scans the queues again.
+    // The same goes for executors that count themselves as polling.
+    if (shared_fiber_mem.n_sleeping_executors == 0) {
+        if (shared_fiber_mem.n_polling_executors != 0)
+            lwt_io_wake_poller();
+        return;
+    }
+    for (;;) {
+        uint64_t n_futex_wakes_v = shared_fiber_mem.n_futex_wakes;
+        if (atomic_cas_uint64(&shared_fiber_mem.n_futex_wakes, n_futex_wakes_v, n_futex_wakes_v + 1))
+            break;
+    }
     int32_t futex_r = futex((int*) &shared_fiber_mem.exec_block_futex, FUTEX_WAKE, 1, 0, 0, 0);
     if (futex_r == -1)
         RCD_SYSCALL_EXCEPTION(futex, exception_fatal);
 }
 
+/// Kernel layout of struct sigevent including the target thread id used by SIGEV_THREAD_ID which musl does not expose.
+struct lwt_ksigevent {
+    union sigval sigev_value;
+    int32_t sigev_signo;
+    int32_t sigev_notify;
+    int32_t sigev_notify_thread_id;
+    uint8_t pad[64 - sizeof(union sigval) - 3 * sizeof(int32_t)];
+};
+
+/// Linux specific sigev_notify value that delivers the timer signal to a specific thread.
+#define LWT_SIGEV_THREAD_ID 4
+
+/// Creates a timer that sends the specified signal to the current executor. It measures the cpu time of the thread so
+/// idle executors and executors blocked in syscalls don't receive any signals. Note that a signal can still be pending
+/// when the executor enters a syscall and then makes it fail with EINTR, even with SA_RESTART for syscalls that are
+/// never restarted (nanosleep, epoll_wait, futex waits with a timeout etc.).
+static timer_t lwt_executor_timer_create(int32_t signo) {
+    struct lwt_ksigevent ksigevent = {
+        .sigev_signo = signo,
+        .sigev_notify = LWT_SIGEV_THREAD_ID,
+        .sigev_notify_thread_id = gettid(),
+    };
+    // The kernel writes an int timer id, the rest of the zero initialized timer_t stays zero.
+    timer_t timer_id = 0;
+    int32_t timer_create_r = timer_create(CLOCK_THREAD_CPUTIME_ID, (struct sigevent*) &ksigevent, &timer_id);
+    if (timer_create_r == -1)
+        RCD_SYSCALL_EXCEPTION(timer_create, exception_fatal);
+    return timer_id;
+}
+
+/// Arms the timer to fire every interval. Zero disarms it.
+static void lwt_executor_timer_set(timer_t timer_id, uint64_t interval_ns) {
+    struct itimerspec interval_timer = {
+        .it_interval = {.tv_sec = interval_ns / 1000000000ULL, .tv_nsec = interval_ns % 1000000000ULL},
+        .it_value = {.tv_sec = interval_ns / 1000000000ULL, .tv_nsec = interval_ns % 1000000000ULL},
+    };
+    int32_t timer_settime_r = timer_settime(timer_id, 0, &interval_timer, 0);
+    if (timer_settime_r == -1)
+        RCD_SYSCALL_EXCEPTION(timer_settime, exception_fatal);
+}
+
+/// Starts a timer that sends the specified signal to the current executor every interval.
+static void lwt_executor_timer_init(int32_t signo, uint64_t interval_ns) {
+    lwt_executor_timer_set(lwt_executor_timer_create(signo), interval_ns);
+}
+
+/// Re-arms the preemption timer of the executor when the preemption slice has changed since it was last armed.
+/// Called every time the executor picks a fiber so it's cheap when nothing has changed.
+static inline void lwt_executor_preempt_timer_sync(lwt_physical_thread_t* phys_thread) {
+    uint32_t slice_us = lwt_preemption_slice_us;
+    if (slice_us == phys_thread->preempt_timer_slice_us)
+        return;
+    if (!phys_thread->has_preempt_timer) {
+        phys_thread->preempt_timer = lwt_executor_timer_create(LWT_PREEMPT_SIGNAL);
+        phys_thread->has_preempt_timer = true;
+    }
+    lwt_executor_timer_set(phys_thread->preempt_timer, slice_us * 1000ULL);
+    phys_thread->preempt_timer_slice_us = slice_us;
+}
+
+static void lwt_sysmon_spare_take_over(lwt_physical_thread_t* phys_thread);
+
+/// Retires the current spare executor by parking it until the system monitor unparks it again.
+/// The run queue of the executor is empty so nothing is stranded while it's parked.
+static void lwt_sysmon_park_spare_executor(lwt_physical_thread_t* phys_thread) {
+    assert(phys_thread->is_spare_executor && phys_thread->run_queue.length == 0);
+    // Parked executors may stay parked for a long time, don't keep any fibers or stacklets while parked.
+    lwt_fiber_cache_flush(phys_thread);
+    lwt_stacklet_cache_flush(phys_thread);
+    atomic_spinlock_lock(&lwt_sysmon.lock); {
+        lwt_sysmon.n_parked++;
+        phys_thread->is_parked = true;
+    } atomic_spinlock_unlock(&lwt_sysmon.lock);
+    for (;;) {
+        uint32_t unpark_futex_v = lwt_sysmon.unpark_futex;
+        if (unpark_futex_v > 0) {
+            if (atomic_cas_uint32(&lwt_sysmon.unpark_futex, unpark_futex_v, unpark_futex_v - 1))
+                break;
+            continue;
+        }
+        int32_t futex_r = futex((int*) &lwt_sysmon.unpark_futex, FUTEX_WAIT, 0, 0, 0, 0);
+        if (futex_r != 0 && errno != EWOULDBLOCK && errno != EINTR)
+            RCD_SYSCALL_EXCEPTION(futex, exception_fatal);
+    }
+    phys_thread->is_parked = false;
+    lwt_sysmon_spare_take_over(phys_thread);
+}
+
 /// Dequeues a fiber scheduled for execution and yields to Linux until one becomes available.
+/// Looks in the local run queue first, then in the global queue and finally tries to steal from sibling executors.
 static lwt_fiber_t* lwt_scheduler_exec_block_dequeue() {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    lwt_run_queue_t* run_queue = &phys_thread->run_queue;
     exec_blocked_fiber_t* execb_fiber = 0;
+    uint64_t idle_since_ns = 0;
+    uint64_t spin_since_ns = 0;
+    uint32_t unyielded_spins = 0;
     for (;;) {
         // Implementation of debug choke here.
         for (;;) {
@@ -615,7 +1702,7 @@ static lwt_fiber_t* lwt_scheduler_exec_block_dequeue() {
             if (!shared_fiber_mem.debug_choke_enabled)
                 break;
             uint64_t debug_choke_count_v = shared_fiber_mem.debug_choke_count;
-            if (debug_choke_count_v >= (lwt_executor_thread_count - 1))
+            if (debug_choke_count_v >= (lwt_executor_thread_count - lwt_sysmon.n_parked - 1))
                 break;
             if (atomic_cas_uint64(&shared_fiber_mem.debug_choke_count, debug_choke_count_v, debug_choke_count_v + 1)) {
                 // Wait until the debug_choke_futex is triggered.
@@ -631,19 +1718,89 @@ static lwt_fiber_t* lwt_scheduler_exec_block_dequeue() {
             }
         }
         // Try to dequeue the next execution blocked fiber.
-        uint32_t exec_blocked_futex_v;
-        LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
-            exec_blocked_futex_v = shared_fiber_mem.exec_block_futex;
-            sync_synchronize(); // Barrier to guarantee memory ordering as the previous futex load must be executed before the following load.
-            execb_fiber = QUEUE_DEQUEUE_SL(&shared_fiber_mem.exec_block_queue);
-        } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+        uint32_t exec_blocked_futex_v = shared_fiber_mem.exec_block_futex;
+        sync_synchronize(); // Barrier to guarantee memory ordering as the previous futex load must be executed before the following loads.
+        run_queue->tick++;
+        if ((run_queue->tick % LWT_GLOBAL_QUEUE_POLL_INTERVAL) == 0)
+            execb_fiber = lwt_scheduler_global_queue_dequeue();
+        if (execb_fiber == 0)
+            execb_fiber = lwt_run_queue_pop(run_queue);
+        if (execb_fiber == 0)
+            execb_fiber = lwt_scheduler_global_queue_dequeue();
+        if (execb_fiber == 0)
+            execb_fiber = lwt_scheduler_exec_block_steal(phys_thread);
+        if (execb_fiber == 0 && lwt_config.executor_io_polling)
+            execb_fiber = lwt_scheduler_exec_block_poll_io(phys_thread);
         if (execb_fiber != 0)
             break;
-        int32_t futex_r = futex((int*) &shared_fiber_mem.exec_block_futex, FUTEX_WAIT, (int) exec_blocked_futex_v, 0, 0, 0);
+        // Keep looking for a while before going to sleep so bursts of work don't pay for sleeping and waking up.
+        uint32_t spin_us = lwt_executor_spin_us;
+        if (spin_us > 0) {
+            uint64_t now_ns = lwt_timer_now_ns();
+            if (spin_since_ns == 0)
+                spin_since_ns = now_ns;
+            if (now_ns - spin_since_ns < spin_us * 1000ULL) {
+                phys_thread->is_idle = true;
+                unyielded_spins = atomic_spin_yield(unyielded_spins);
+                continue;
+            }
+        }
+        // Spare executors retire when they have not found anything to do for a while.
+        struct timespec* idle_timeout = 0;
+        struct timespec spare_idle_timeout = {.tv_sec = 0, .tv_nsec = 0};
+        if (phys_thread->is_spare_executor) {
+            uint64_t now_ns = lwt_timer_now_ns();
+            if (idle_since_ns == 0) {
+                idle_since_ns = now_ns;
+            } else if (now_ns - idle_since_ns >= LWT_SPARE_EXECUTOR_RETIRE_NS) {
+                lwt_sysmon_park_spare_executor(phys_thread);
+                idle_since_ns = 0;
+                continue;
+            }
+            spare_idle_timeout.tv_sec = LWT_SPARE_EXECUTOR_RETIRE_NS / 1000000000ULL;
+            spare_idle_timeout.tv_nsec = LWT_SPARE_EXECUTOR_RETIRE_NS % 1000000000ULL;
+            idle_timeout = &spare_idle_timeout;
+        }
+        // An executor that goes to sleep does not need to hold on to as many stacklets and fibers.
+        lwt_fiber_cache_trim(phys_thread);
+        lwt_stacklet_cache_trim(phys_thread);
+        phys_thread->is_idle = true;
+        // One idle executor per I/O shard sleeps in epoll_wait() instead of on the futex so it runs the fibers that
+        // I/O events wake up itself, without going through the monitor thread of the shard.
+        if (lwt_config.executor_io_polling) {
+            lwt_io_shard_t* io_shard = &lwt_io_shards[phys_thread->executor_index % lwt_io_shard_count];
+            if (atomic_cas_uint32(&io_shard->poller, lwt_io_poller_none, lwt_io_poller_executor)) {
+                execb_fiber = lwt_scheduler_exec_block_wait_io(phys_thread, io_shard, exec_blocked_futex_v, idle_timeout);
+                atomic_cas_uint32(&io_shard->poller, lwt_io_poller_executor, lwt_io_poller_none);
+                phys_thread->is_idle = false;
+                if (execb_fiber != 0)
+                    break;
+                spin_since_ns = 0;
+                continue;
+            }
+        }
+        for (;;) {
+            uint32_t n_sleeping_v = shared_fiber_mem.n_sleeping_executors;
+            if (atomic_cas_uint32(&shared_fiber_mem.n_sleeping_executors, n_sleeping_v, n_sleeping_v + 1))
+                break;
+        }
+        int32_t futex_r = futex((int*) &shared_fiber_mem.exec_block_futex, FUTEX_WAIT, (int) exec_blocked_futex_v, idle_timeout, 0, 0);
+        for (;;) {
+            uint32_t n_sleeping_v = shared_fiber_mem.n_sleeping_executors;
+            if (atomic_cas_uint32(&shared_fiber_mem.n_sleeping_executors, n_sleeping_v, n_sleeping_v - 1))
+                break;
+        }
+        phys_thread->is_idle = false;
         if (futex_r != 0 && errno != ETIMEDOUT && errno != EWOULDBLOCK && errno != EINTR)
             RCD_SYSCALL_EXCEPTION(futex, exception_fatal);
+        // Spin again after waking up.
+        spin_since_ns = 0;
         sync_synchronize();
     }
+    phys_thread->is_idle = false;
+    phys_thread->sched_tick++;
+    phys_thread->preempt_pending = false;
+    lwt_executor_preempt_timer_sync(phys_thread);
     return ((void*) execb_fiber) - offsetof(lwt_fiber_t, exec_blocked);
 }
 
@@ -660,6 +1817,57 @@ void lwt_debug_choke_fibers(bool trigger) {
         RCD_SYSCALL_EXCEPTION(futex, exception_fatal);
 }
 
+/// Updates the peak stack depth of the fiber with the depth at the specified position in the current stacklet.
+static inline void lwt_stack_depth_sample(lwt_fiber_t* fiber, void* stack_ptr) {
+    lwt_stacklet_t* stacklet = fiber->current_stacklet;
+    if (stacklet == 0 || stack_ptr < (void*) stacklet || stack_ptr > ((void*) stacklet) + stacklet->len)
+        return;
+    size_t depth = stacklet->depth + ((((void*) stacklet) + stacklet->len) - stack_ptr);
+    fiber->peak_stack_depth = MAX(fiber->peak_stack_depth, depth);
+}
+
+/// Returns the slot of the fiber main in the stack size learning table or 0 if it's not found.
+/// When inserting the main is added if it's not found and the table isn't full, this requires the table lock.
+static struct lwt_stack_learn_slot* lwt_stack_learn_slot(fstr_t main_name, bool insert) {
+    uint64_t hash = hmap_murmurhash_64a(main_name.str, main_name.len, 0);
+    for (size_t i = 0; i < LWT_STACK_LEARN_SLOTS; i++) {
+        struct lwt_stack_learn_slot* slot = &lwt_stack_learn.slots[(hash + i) % LWT_STACK_LEARN_SLOTS];
+        if (slot->main_name.str == 0) {
+            if (!insert)
+                return 0;
+            slot->main_name.len = main_name.len;
+            atomic_cas_ptr((void**) &slot->main_name.str, 0, main_name.str);
+            return slot;
+        }
+        if (fstr_equal(slot->main_name, main_name))
+            return slot;
+    }
+    return 0;
+}
+
+/// Returns the learned stack size for fibers with the specified main or 0 if nothing has been learned yet.
+static size_t lwt_stack_learn_get(fstr_t main_name) {
+    if (main_name.len == 0)
+        return 0;
+    struct lwt_stack_learn_slot* slot = lwt_stack_learn_slot(main_name, false);
+    return (slot != 0)? slot->stack_size: 0;
+}
+
+/// Folds the peak stack depth of a fiber into the learned stack size of its main. The learned size is a high-water
+/// mark that decays slowly so a single unusually deep fiber does not inflate the stack of all future fibers for good.
+/// The main name must stay valid for the life time of the program.
+static void lwt_stack_learn_record(fstr_t main_name, size_t peak_stack_depth) {
+    if (main_name.len == 0)
+        return;
+    atomic_spinlock_lock(&lwt_stack_learn.lock); {
+        struct lwt_stack_learn_slot* slot = lwt_stack_learn_slot(main_name, true);
+        if (slot != 0) {
+            size_t decayed_stack_size = slot->stack_size - (slot->stack_size >> LWT_STACK_LEARN_DECAY_SHIFT);
+            slot->stack_size = MIN(MAX(decayed_stack_size, peak_stack_depth), LWT_STACK_LEARN_MAX_SIZE);
+        }
+    } atomic_spinlock_unlock(&lwt_stack_learn.lock);
+}
+
 /// Defers fiber until canceled or done with whatever pending operation we have.
 static void lwt_scheduler_fiber_defer(bool is_yielding, lwt_ifc_server_t* accept_ifc_server, rcd_fid_t wait_fid, int32_t wait_fd) {
     LWT_GET_LOCAL_FIBER(fiber);
@@ -670,11 +1878,26 @@ static void lwt_scheduler_fiber_defer(bool is_yielding, lwt_ifc_server_t* accept
     fiber->defer_ifc_server = accept_ifc_server;
     fiber->defer_wait_fid = wait_fid;
     fiber->defer_wait_fd = wait_fd;
+    if (is_yielding) {
+        lwt_trace_event(lwt_trace_event_yield, fiber->ctrl.id, 0, 0, 0);
+        lwt_metrics_shard_t* metrics = lwt_metrics_local();
+        if (metrics != 0)
+            metrics->yields++;
+    } else if (accept_ifc_server != 0) {
+        lwt_trace_event(lwt_trace_event_defer_accept, fiber->ctrl.id, 0, 0, 0);
+    } else if (wait_fd != -1) {
+        lwt_trace_event(lwt_trace_event_defer_fd, fiber->ctrl.id, wait_fd, 0, 0);
+    } else if (wait_fid != 0) {
+        lwt_trace_event(lwt_trace_event_defer_fid, fiber->ctrl.id, wait_fid, 0, 0);
+    } else {
+        lwt_trace_event(lwt_trace_event_defer, fiber->ctrl.id, 0, 0, 0);
+    }
     // Push deferred event.
     jmp_buf jbuf;
     lwt_fiber_event_data_t event;
     event.deferred.jbuf = &jbuf;
     lwt_fiber_event_push(fiber, lwt_fiber_event_deferred, event);
+    lwt_stack_depth_sample(fiber, &jbuf);
     // Commence context switch.
     int setjmp_r = setjmp(jbuf);
     if (setjmp_r == LWT_LONGJMP_DIRECT) {
@@ -690,11 +1913,45 @@ static void lwt_scheduler_fiber_defer(bool is_yielding, lwt_ifc_server_t* accept
     }
 }
 
+/// Switches out the fiber and puts it last in the local run queue. Unlike yielding it ignores and never touches the
+/// done, canceled and join race flags so it's safe to call anywhere, even between publishing a wait and deferring.
+static void lwt_scheduler_fiber_preempt(lwt_fiber_t* fiber) {
+    lwt_trace_event(lwt_trace_event_preempt, fiber->ctrl.id, 0, 0, 0);
+    lwt_metrics_shard_t* metrics = lwt_metrics_local();
+    if (metrics != 0)
+        metrics->preemptions++;
+    jmp_buf jbuf;
+    lwt_fiber_event_data_t event;
+    event.deferred.jbuf = &jbuf;
+    lwt_fiber_event_push(fiber, lwt_fiber_event_deferred, event);
+    lwt_stack_depth_sample(fiber, &jbuf);
+    int setjmp_r = setjmp(jbuf);
+    if (setjmp_r == LWT_LONGJMP_DIRECT) {
+        lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+        longjmp(phys_thread->physical_jmp_buf, LWT_LONGJMP_PREEMPT);
+        unreachable();
+    }
+}
+
+/// Preempts the fiber if the preemption signal found that it has used up its time slice. Called at safe points.
+/// Fibers holding system locks or spinlocks or running on the thread static mega stack are never preempted.
+static inline void lwt_preemption_point_raw(lwt_fiber_t* fiber) {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    if (!phys_thread->preempt_pending || phys_thread->system_rwspinlock != 0 || phys_thread->n_spinlocks_held != 0
+    || fiber == &phys_thread->system_fiber)
+        return;
+    void* end_of_stack = phys_thread->end_of_stack;
+    if (end_of_stack == 0 || end_of_stack >= (void*) (UINT64_MAX - 1))
+        return;
+    phys_thread->preempt_pending = false;
+    lwt_scheduler_fiber_preempt(fiber);
+}
+
 static void lwt_scheduler_fiber_wake_done_raw(lwt_fiber_t* fiber) {
     assert(ATOMIC_RWLOCK_IS_WLOCKED(shared_fiber_mem.rwlock));
     if (fiber->ctrl.deferred) {
         fiber->ctrl.deferred = false;
-        lwt_scheduler_exec_block_enqueue(fiber);
+        lwt_scheduler_exec_block_enqueue(fiber, true);
     } else {
         fiber->ctrl.done = true;
     }
@@ -712,7 +1969,7 @@ static void lwt_scheduler_fiber_wake_join_race_raw(lwt_fiber_t* fiber) {
         fiber->ctrl.join_race = true;
         if (!fiber->ctrl.unintr && fiber->ctrl.deferred) {
             fiber->ctrl.deferred = false;
-            lwt_scheduler_exec_block_enqueue(fiber);
+            lwt_scheduler_exec_block_enqueue(fiber, true);
         }
     }
 }
@@ -751,10 +2008,9 @@ static __inline void lwt_cancellation_point_raw(lwt_fiber_t* fiber) {
 }
 
 static void lwt_cancel_fiber_id_raw(rcd_fid_t fiber_id) {
-    hmap_fid_lookup_t lu = hmap_fid_lookup(&shared_fiber_mem.fiber_map, fiber_id, true);
-    if (!hmap_fid_found(lu))
+    lwt_fiber_t* remote_fiber = lwt_fid_table_lookup(fiber_id);
+    if (remote_fiber == 0)
         return;
-    lwt_fiber_t* remote_fiber = hmap_fid_value(lu);
     if (remote_fiber->ctrl.canceled != 0 || remote_fiber->ctrl.hidden_cancel)
         return;
     LWT_GET_LOCAL_FIBER(local_fiber);
@@ -780,11 +2036,14 @@ static void lwt_cancel_fiber_id_raw(rcd_fid_t fiber_id) {
     }
     if (!remote_fiber->ctrl.unintr && remote_fiber->ctrl.deferred) {
         remote_fiber->ctrl.deferred = false;
-        lwt_scheduler_exec_block_enqueue(remote_fiber);
+        lwt_scheduler_exec_block_enqueue(remote_fiber, true);
     }
 }
 
 void lwt_cancel_fiber_id(rcd_fid_t fiber_id) {
+    // Canceling fibers that are already gone is common, don't serialize on the lock for it.
+    if (lwt_fid_table_lookup(fiber_id) == 0)
+        return;
     LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
         lwt_cancel_fiber_id_raw(fiber_id);
     } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
@@ -852,6 +2111,29 @@ int32_t lwt_get_thread_pid() {
     return phys_thread->pid;
 }
 
+struct vm_thread_cache** lwt_get_vm_thread_cache_ptr() {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    return &phys_thread->vm_thread_cache;
+}
+
+int32_t lwt_get_numa_node() {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    if (!phys_thread->is_executor || lwt_cpu_topology.n_nodes <= 1)
+        return -1;
+    return phys_thread->numa_node;
+}
+
+uint64_t lwt_get_sched_tick() {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    return phys_thread->sched_tick;
+}
+
+uint32_t lwt_preemption_set_slice(uint32_t slice_us) {
+    uint32_t prev_slice_us = lwt_preemption_slice_us;
+    lwt_preemption_slice_us = slice_us;
+    return prev_slice_us;
+}
+
 /// Fiber finalization that is run by fiber when it shuts down.
 /// To avoid a permanent return pointer in all root stacklets the control flow of the fiber is manipulated directly to run it.
 noret static void lwt_fiber_finalize() {
@@ -868,22 +2150,267 @@ noret static void lwt_fiber_finalize() {
     unreachable();
 }
 
-/// Returns the end of stack limit for the specified stacklet.
-static inline void* lwt_get_end_of_stack_limit(lwt_stacklet_t* stacklet) {
-    // ===== Example prologue: =====
-    // lea -0x40(%rsp),%r11
-    // cmp %fs:0x8,%r11
-    // ja 1f
-    // movabs $0x40,%r10
-    // movabs $0x0,%r11
-    // callq  __morestack
-    // retq
-    // 1: push rbp
-    //
-    // ===== Worst case memory layout @ prologue oosm check: =====
-    //   |__stack_ptr_|______description_______|_stacklet->mem_|
-    //   |  0x18(rsp) [ stack eightbyte n - 2  ]  0x38(slm)    |
-    //   |  0x10(rsp) [ stack eightbyte n - 1  ]  0x30(slm)    |
+/// Reserves a stacklet of at least min_size bytes, from the stacklet cache of the executor if possible.
+static lwt_stacklet_t* lwt_stacklet_reserve(lwt_physical_thread_t* phys_thread, size_t min_size, size_t* size_out) {
+    size_t size_2e = MAX(64 - __builtin_clzll(min_size - 1), LWT_STACKLET_CACHE_MIN_2E);
+    if (size_2e <= LWT_STACKLET_CACHE_MAX_2E) {
+        lwt_stacklet_cache_t* cache = &phys_thread->stacklet_cache;
+        size_t bin_i = size_2e - LWT_STACKLET_CACHE_MIN_2E;
+        lwt_stacklet_t* stacklet = cache->bins[bin_i];
+        if (stacklet != 0) {
+            cache->bins[bin_i] = stacklet->next;
+            cache->n_cached[bin_i]--;
+            *size_out = stacklet->len;
+            return stacklet;
+        }
+    }
+    return vm_mmap_reserve_sys(min_size, size_out);
+}
+
+/// Releases a stacklet to the stacklet cache of the executor or back to the vm if it's not cachable or the cache is full.
+static void lwt_stacklet_release(lwt_physical_thread_t* phys_thread, lwt_stacklet_t* stacklet) {
+    size_t len = stacklet->len;
+#if !defined(DEBUG) && !defined(VM_DEBUG_PAGE_AND_NOREUSE_ALLOCS)
+    // Stacklets from the vm are always 2^n bytes. When debugging they are never cached so use after free is detected.
+    if ((len & (len - 1)) == 0) {
+        size_t size_2e = __builtin_ctzll(len);
+        lwt_stacklet_cache_t* cache = &phys_thread->stacklet_cache;
+        size_t bin_i = size_2e - LWT_STACKLET_CACHE_MIN_2E;
+        if (size_2e >= LWT_STACKLET_CACHE_MIN_2E && size_2e <= LWT_STACKLET_CACHE_MAX_2E && cache->n_cached[bin_i] < LWT_STACKLET_CACHE_DEPTH) {
+            stacklet->next = cache->bins[bin_i];
+            cache->bins[bin_i] = stacklet;
+            cache->n_cached[bin_i]++;
+            return;
+        }
+    }
+#endif
+    vm_mmap_unreserve_sys(stacklet, len);
+}
+
+/// Returns all stacklets in the stacklet cache of the executor to the vm.
+static void lwt_stacklet_cache_flush(lwt_physical_thread_t* phys_thread) {
+    lwt_stacklet_cache_t* cache = &phys_thread->stacklet_cache;
+    for (size_t bin_i = 0; bin_i < LWT_STACKLET_CACHE_N_BINS; bin_i++) {
+        lwt_stacklet_t *stacklet, *next_stacklet;
+        LL_FOREACH_SAFE(cache->bins[bin_i], stacklet, next_stacklet) {
+            vm_mmap_unreserve_sys(stacklet, stacklet->len);
+        }
+        cache->bins[bin_i] = 0;
+        cache->n_cached[bin_i] = 0;
+    }
+}
+
+/// Shrinks the stacklet cache of an executor that is about to go to sleep, see LWT_STACKLET_CACHE_IDLE_MAX_2E.
+static void lwt_stacklet_cache_trim(lwt_physical_thread_t* phys_thread) {
+    lwt_stacklet_cache_t* cache = &phys_thread->stacklet_cache;
+    for (size_t bin_i = 0; bin_i < LWT_STACKLET_CACHE_N_BINS; bin_i++) {
+        size_t n_keep = (bin_i + LWT_STACKLET_CACHE_MIN_2E <= LWT_STACKLET_CACHE_IDLE_MAX_2E? cache->n_cached[bin_i] / 2: 0);
+        while (cache->n_cached[bin_i] > n_keep) {
+            lwt_stacklet_t* stacklet = cache->bins[bin_i];
+            cache->bins[bin_i] = stacklet->next;
+            cache->n_cached[bin_i]--;
+            vm_mmap_unreserve_sys(stacklet, stacklet->len);
+        }
+    }
+}
+
+/// Called when a fiber is switched out. Its spare stacklet is moved to the stacklet cache of the executor so
+/// stacklets are not held by fibers that are not running.
+static inline void lwt_stacklet_spare_release(lwt_physical_thread_t* phys_thread, lwt_fiber_t* fiber) {
+    if (fiber->spare_stacklet != 0) {
+        lwt_stacklet_release(phys_thread, fiber->spare_stacklet);
+        fiber->spare_stacklet = 0;
+    }
+}
+
+/// Allocates the struct of a new fiber, reusing one from the fiber cache of the executor if possible.
+/// A reused struct comes with a spare stacklet that the new fiber can use as its root stacklet.
+static lwt_fiber_t* lwt_fiber_reuse() {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    lwt_fiber_t* fiber = phys_thread->fiber_cache;
+    if (!phys_thread->is_executor || fiber == 0) {
+        fiber = lwt_fiber_allocate();
+        fiber->spare_stacklet = 0;
+        return fiber;
+    }
+    phys_thread->fiber_cache = fiber->next;
+    phys_thread->n_cached_fibers--;
+    phys_thread->n_reused_fibers++;
+    return fiber;
+}
+
+/// Frees the struct of a torn down fiber. The executor keeps a bounded number of them together with their root
+/// stacklet so spawning a fiber and allocating its first stacklet doesn't have to allocate anything.
+static void lwt_fiber_recycle(lwt_physical_thread_t* phys_thread, lwt_fiber_t* fiber, lwt_stacklet_t* root_stacklet) {
+#ifndef DEBUG
+    if (phys_thread->n_cached_fibers < LWT_FIBER_CACHE_DEPTH) {
+        if (root_stacklet != 0 && root_stacklet->len > (1UL << LWT_FIBER_CACHE_MAX_STACKLET_2E)) {
+            lwt_stacklet_release(phys_thread, root_stacklet);
+            root_stacklet = 0;
+        }
+        fiber->spare_stacklet = root_stacklet;
+        fiber->next = phys_thread->fiber_cache;
+        phys_thread->fiber_cache = fiber;
+        phys_thread->n_cached_fibers++;
+        return;
+    }
+#endif
+    if (root_stacklet != 0)
+        lwt_stacklet_release(phys_thread, root_stacklet);
+    lwt_fiber_free(fiber);
+}
+
+/// Frees all fiber structs in the fiber cache of the executor and their spare stacklets.
+static void lwt_fiber_cache_flush(lwt_physical_thread_t* phys_thread) {
+    lwt_fiber_t *fiber, *next_fiber;
+    LL_FOREACH_SAFE(phys_thread->fiber_cache, fiber, next_fiber) {
+        if (fiber->spare_stacklet != 0)
+            vm_mmap_unreserve_sys(fiber->spare_stacklet, fiber->spare_stacklet->len);
+        lwt_fiber_free(fiber);
+    }
+    phys_thread->fiber_cache = 0;
+    phys_thread->n_cached_fibers = 0;
+}
+
+/// Halves the fiber cache of an executor that is about to go to sleep.
+static void lwt_fiber_cache_trim(lwt_physical_thread_t* phys_thread) {
+    uint32_t n_keep = phys_thread->n_cached_fibers / 2;
+    while (phys_thread->n_cached_fibers > n_keep) {
+        lwt_fiber_t* fiber = phys_thread->fiber_cache;
+        phys_thread->fiber_cache = fiber->next;
+        phys_thread->n_cached_fibers--;
+        if (fiber->spare_stacklet != 0)
+            vm_mmap_unreserve_sys(fiber->spare_stacklet, fiber->spare_stacklet->len);
+        lwt_fiber_free(fiber);
+    }
+}
+
+/// Counts a stacklet split at the call that returns to older_rsp[2]. The first time a call site is seen its backtrace
+/// is recorded by walking the frame pointers of the fiber, starting with the frame of the caller.
+static void lwt_hot_split_count(uint64_t* older_rsp) {
+    void* site = (void*) older_rsp[2];
+    for (;;) {
+        uint64_t old_n_splits = lwt_hot_splits.n_splits;
+        if (atomic_cas_uint64(&lwt_hot_splits.n_splits, old_n_splits, old_n_splits + 1))
+            break;
+    }
+    size_t slot_i = (((uintptr_t) site) * 0x9e3779b97f4a7c15UL) >> 32;
+    for (size_t i = 0; i < LWT_HOT_SPLIT_SITES; i++) {
+        lwt_hot_split_site_t* hs = &lwt_hot_splits.sites[(slot_i + i) % LWT_HOT_SPLIT_SITES];
+        if (hs->site == 0 && atomic_cas_uint64((uint64_t*) &hs->site, 0, (uint64_t) site)) {
+            hs->backtrace[0] = site;
+            void** frame_ptr = (void**) older_rsp[0];
+            for (size_t bt_i = 1; bt_i < LWT_HOT_SPLIT_BACKTRACE_DEPTH && frame_ptr != 0 && ((uintptr_t) frame_ptr & 0x7) == 0;) {
+                void* ret_address = frame_ptr[1];
+                if (ret_address == 0)
+                    break;
+                // Virtual morestack frames hold the real return address, skip the injected releasestack return pointers.
+                if (ret_address != __releasestack && ret_address != __releasestack_fx)
+                    hs->backtrace[bt_i++] = ret_address;
+                frame_ptr = frame_ptr[0];
+            }
+        }
+        if (hs->site != site)
+            continue;
+        for (;;) {
+            uint64_t old_count = hs->count;
+            if (atomic_cas_uint64(&hs->count, old_count, old_count + 1))
+                break;
+        }
+        return;
+    }
+}
+
+/// Returns true if a frame (saved rbp and return address) at the pointer is within one of the stacklets of the fiber.
+static bool lwt_profiler_is_frame_ptr(lwt_fiber_t* fiber, void** frame_ptr) {
+    if (((uintptr_t) frame_ptr & 0x7) != 0)
+        return false;
+    for (lwt_stacklet_t* stacklet = fiber->current_stacklet; stacklet != 0; stacklet = stacklet->next) {
+        if ((void*) frame_ptr >= (void*) stacklet->mem && (void*) (frame_ptr + 2) <= (void*) stacklet + stacklet->len)
+            return true;
+    }
+    return false;
+}
+
+void lwt_profiler_init_local() {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    if (phys_thread->profiler != 0)
+        return;
+    lwt_profiler_t* profiler = vm_mmap_reserve(sizeof(lwt_profiler_t), 0);
+    memset(profiler, 0, sizeof(lwt_profiler_t));
+    phys_thread->profiler = profiler;
+}
+
+void lwt_profiler_sample(struct ucontext* uc, void* end_of_stack) {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    lwt_profiler_t* profiler = phys_thread->profiler;
+    if (profiler == 0)
+        return;
+    // The signal can interrupt anything so we can't allocate or take locks here, all state is kept on the signal stack
+    // until the sample is counted in the table that only this handler writes to.
+    // Fibers always run with an end of stack limit, the executor runs on the mega stack without one.
+    lwt_fiber_t* fiber = phys_thread->current_fiber;
+    bool in_fiber = (end_of_stack != 0 && fiber != &phys_thread->system_fiber);
+    fstr_t main_name = (in_fiber? fiber->main_name: "[librcd executor]");
+    fstr_t instance_name = (in_fiber? fiber->instance_name: "");
+    instance_name.len = MIN(instance_name.len, LWT_PROFILER_INSTANCE_NAME_MAX);
+    void* frames[LWT_PROFILER_DEPTH];
+    size_t n_frames = 0;
+    frames[n_frames++] = (void*) uc->uc_mcontext.gregs[REG_RIP];
+    if (in_fiber) {
+        // The interrupted code may not have set up its frame yet so only frame pointers into the stacklets of the fiber
+        // are followed. Return addresses are stored as the call instruction so they symbolize to the call site.
+        void** frame_ptr = (void**) uc->uc_mcontext.gregs[REG_RBP];
+        while (n_frames < LWT_PROFILER_DEPTH && lwt_profiler_is_frame_ptr(fiber, frame_ptr)) {
+            void* ret_address = frame_ptr[1];
+            if (ret_address == 0)
+                break;
+            // Virtual morestack frames hold the real return address, skip the injected releasestack return pointers.
+            if (ret_address != __releasestack && ret_address != __releasestack_fx)
+                frames[n_frames++] = ret_address - 1;
+            frame_ptr = frame_ptr[0];
+        }
+    }
+    uint64_t hash = hmap_murmurhash_64a(frames, n_frames * sizeof(void*), (uint64_t) main_name.str);
+    hash = hmap_murmurhash_64a(instance_name.str, instance_name.len, hash);
+    for (size_t i = 0; i < LWT_PROFILER_STACKS; i++) {
+        lwt_profiler_stack_t* ps = &profiler->stacks[(hash + i) % LWT_PROFILER_STACKS];
+        if (ps->count == 0) {
+            ps->hash = hash;
+            ps->main_name = main_name;
+            memcpy(ps->instance_name, instance_name.str, instance_name.len);
+            ps->instance_name_len = instance_name.len;
+            memcpy(ps->frames, frames, n_frames * sizeof(void*));
+            ps->n_frames = n_frames;
+            sync_synchronize();
+            ps->count = 1;
+            return;
+        }
+        if (ps->hash == hash && ps->n_frames == n_frames && ps->main_name.str == main_name.str
+        && fstr_equal((fstr_t) {.str = ps->instance_name, .len = ps->instance_name_len}, instance_name)
+        && memcmp(ps->frames, frames, n_frames * sizeof(void*)) == 0) {
+            ps->count++;
+            return;
+        }
+    }
+}
+
+/// Returns the end of stack limit for the specified stacklet.
+static inline void* lwt_get_end_of_stack_limit(lwt_stacklet_t* stacklet) {
+    // ===== Example prologue: =====
+    // lea -0x40(%rsp),%r11
+    // cmp %fs:0x8,%r11
+    // ja 1f
+    // movabs $0x40,%r10
+    // movabs $0x0,%r11
+    // callq  __morestack
+    // retq
+    // 1: push rbp
+    //
+    // ===== Worst case memory layout @ prologue oosm check: =====
+    //   |__stack_ptr_|______description_______|_stacklet->mem_|
+    //   |  0x18(rsp) [ stack eightbyte n - 2  ]  0x38(slm)    |
+    //   |  0x10(rsp) [ stack eightbyte n - 1  ]  0x30(slm)    |
     //   |  0x08(rsp) [ stack eightbyte n      ]  0x28(slm)    |
     //   |  0x00(rsp) [  call return address   ]  0x20(slm)    |
     //                    (irrelevant frame)
@@ -933,6 +2460,68 @@ static void lwt_init_signal_stack() {
         throw(concs("sanity check failed: when setting up signal stack, the previous signal stack value was unexpectedly not disabled [", fss(fstr_from_uint(prev_sstack.ss_flags, 16)), "]"), exception_fatal);
 }
 
+/// Number of cpus in a cpu set.
+#define LWT_CPU_SET_SIZE (8 * sizeof(cpu_set_t))
+
+static inline bool lwt_cpu_set_test(cpu_set_t* cpu_set, size_t cpu) {
+    return (cpu_set->__bits[cpu / (8 * sizeof(__cpu_mask))] & (1UL << (cpu % (8 * sizeof(__cpu_mask))))) != 0;
+}
+
+static inline void lwt_cpu_set_add(cpu_set_t* cpu_set, size_t cpu) {
+    cpu_set->__bits[cpu / (8 * sizeof(__cpu_mask))] |= (1UL << (cpu % (8 * sizeof(__cpu_mask))));
+}
+
+/// Pins an executor to the cpu at cpu_i in the topology.
+static void lwt_pin_executor_cpu(lwt_physical_thread_t* phys_thread, uint32_t cpu_i) {
+    uint16_t cpu = lwt_cpu_topology.cpus[cpu_i];
+    cpu_set_t cpu_set = {{0}};
+    lwt_cpu_set_add(&cpu_set, cpu);
+    int32_t setaffinity_r = sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+    if (setaffinity_r == -1)
+        RCD_SYSCALL_EXCEPTION(sched_setaffinity, exception_fatal);
+    phys_thread->numa_node = lwt_cpu_topology.cpu_nodes[cpu_i];
+    phys_thread->is_pinned = true;
+    phys_thread->cpu_i = cpu_i;
+}
+
+/// Pins an executor to a cpu from the process cpuset when executor affinity is enabled.
+static void lwt_pin_executor(lwt_physical_thread_t* phys_thread) {
+    if (lwt_cpu_topology.n_cpus == 0)
+        return;
+    lwt_pin_executor_cpu(phys_thread, phys_thread->executor_index % lwt_cpu_topology.n_cpus);
+}
+
+/// Lets an executor run on any cpu in the topology again.
+static void lwt_unpin_executor(lwt_physical_thread_t* phys_thread) {
+    cpu_set_t cpu_set = {{0}};
+    for (size_t cpu_i = 0; cpu_i < lwt_cpu_topology.n_cpus; cpu_i++)
+        lwt_cpu_set_add(&cpu_set, lwt_cpu_topology.cpus[cpu_i]);
+    int32_t setaffinity_r = sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+    if (setaffinity_r == -1)
+        RCD_SYSCALL_EXCEPTION(sched_setaffinity, exception_fatal);
+    phys_thread->is_pinned = false;
+}
+
+/// Called by spare executors when they start or are unparked. Pins the spare to the cpu of the blocked executor it
+/// stands in for as that cpu is idle while the executor is blocked. Any other cpu is already busy with an executor.
+static void lwt_sysmon_spare_take_over(lwt_physical_thread_t* phys_thread) {
+    bool is_pending;
+    int32_t cpu_i;
+    atomic_spinlock_lock(&lwt_sysmon.lock); {
+        is_pending = lwt_sysmon.spare_pending;
+        cpu_i = lwt_sysmon.spare_cpu_i;
+        lwt_sysmon.spare_pending = false;
+    } atomic_spinlock_unlock(&lwt_sysmon.lock);
+    if (!is_pending)
+        return;
+    if (cpu_i >= 0) {
+        if (!phys_thread->is_pinned || phys_thread->cpu_i != cpu_i)
+            lwt_pin_executor_cpu(phys_thread, cpu_i);
+    } else if (phys_thread->is_pinned) {
+        lwt_unpin_executor(phys_thread);
+    }
+}
+
 static void lwt_physical_executor_thread(void* arg_ptr) {
     const size_t lwt_stacklet_t_size = ((sizeof(lwt_stacklet_t) + 0xfUL) & ~0xfUL);
     const size_t lwt_stack_alloc_t_size = ((sizeof(lwt_stack_alloc_t) + 0xfUL) & ~0xfUL);
@@ -948,17 +2537,50 @@ static void lwt_physical_executor_thread(void* arg_ptr) {
     lwt_fiber_t* fiber;
     void* fiber_end_of_stack;
     int32_t setjmp_r;
+    {
+        static uint32_t executor_index_counter = 0;
+        for (;;) {
+            uint32_t executor_index = executor_index_counter;
+            if (atomic_cas_uint32(&executor_index_counter, executor_index, executor_index + 1)) {
+                phys_thread->executor_index = executor_index;
+                break;
+            }
+            sync_synchronize();
+        }
+    }
+    phys_thread->is_spare_executor = (arg_ptr != 0);
+    // Pin the executor before it touches any memory so its pages (and the pages of the fibers it runs) are
+    // allocated from the local NUMA node by the default first touch policy.
+    if (phys_thread->is_spare_executor) {
+        lwt_sysmon_spare_take_over(phys_thread);
+    } else {
+        lwt_pin_executor(phys_thread);
+    }
     // Initialize the fxsave memory.
     phys_thread->fxsave_mem = vm_mmap_reserve(sizeof(lwt_fxsave_mem_t), 0);
     // Since fibers have limited stack memory we must set up an alternative stack that the kernel can use for signal handlers for these physical executor threads.
     lwt_init_signal_stack();
     // Notify any debuggers that we started a new thread.
     raise(SIGUSR1);
+    // The preemption timer is armed when the executor picks its first fiber.
+    if (lwt_config.profiler_interval_us > 0) {
+        lwt_profiler_init_local();
+        lwt_executor_timer_init(LWT_PROFILER_SIGNAL, lwt_config.profiler_interval_us * 1000ULL);
+    }
+    lwt_trace_ring_init(phys_thread);
+    if (lwt_metrics_enabled)
+        lwt_metrics_init(phys_thread);
+    // From now on fibers woken up by this thread are scheduled in its local run queue.
+    phys_thread->is_executor = true;
     // Get the next execution blocked fiber.
     get_next_execution_blocked_fiber: {
         // Read next execution blocked fiber.
         fiber = lwt_scheduler_exec_block_dequeue();
         phys_thread->current_fiber = fiber;
+        lwt_trace_event(lwt_trace_event_run, fiber->ctrl.id, 0, fiber->main_name.str, fiber->main_name.len);
+        lwt_metrics_shard_t* metrics = lwt_metrics_of(phys_thread);
+        if (metrics != 0)
+            lwt_metrics_switch_in(metrics, fiber);
         if (!fiber->ctrl.started)
             goto start_new_fiber;
         //phys-scheduler/ DBG("thread ", DBG_INT(phys_thread->ptid),  ": undeferring fiber [", DBG_INT(fiber->ctrl->id), "]");
@@ -1133,10 +2755,13 @@ static void lwt_physical_executor_thread(void* arg_ptr) {
             }
 #endif
             // The required stack size is stored in r10 (except the msb), round up and 8 byte align it.
-            size_t required_stack_size = (((phys_thread->stack_pinj_jmp_buf.r10 & ~0x8000000000000000) + 0x7UL) & ~0x7UL);
+            size_t frame_stack_size = (((phys_thread->stack_pinj_jmp_buf.r10 & ~0x8000000000000000) + 0x7UL) & ~0x7UL);
+            size_t required_stack_size = frame_stack_size;
             // When allocating the first stacklet we use the estimated stack size for the entire fiber.
             if (older_stacklet == 0)
                 required_stack_size = MAX(required_stack_size, fiber->est_stack_size);
+            else if (lwt_metrics_of(phys_thread) != 0)
+                phys_thread->metrics->stacklet_overflows++;
             // The system needs to pad the stack with 5 extra qwords: initial call (injected return pointer), last call, morestack call, morestack pushed rbp and setjmp/longjmp call.
             size_t system_stack_pad_size = 5 * 0x8;
             // Let the top area be the argument area plus 2 extra qwords where the old rip and rbp is stored.
@@ -1153,7 +2778,16 @@ static void lwt_physical_executor_thread(void* arg_ptr) {
             min_alloc_size += 8;
 #endif
             size_t final_alloc_size;
-            lwt_stacklet_t* younger_stacklet = vm_mmap_reserve_sys(min_alloc_size, &final_alloc_size);
+            lwt_stacklet_t* younger_stacklet;
+            if (fiber->spare_stacklet != 0 && fiber->spare_stacklet->len >= min_alloc_size && (fiber->spare_stacklet->len >> 2) <= min_alloc_size) {
+                // Reuse the stacklet the fiber released last, this is the common case for a hot split.
+                // It's also the root stacklet of the previous fiber if the fiber struct was recycled.
+                younger_stacklet = fiber->spare_stacklet;
+                fiber->spare_stacklet = 0;
+                final_alloc_size = younger_stacklet->len;
+            } else {
+                younger_stacklet = lwt_stacklet_reserve(phys_thread, min_alloc_size, &final_alloc_size);
+            }
 #ifdef DEBUG
             // When debugging, always allocate new stacklets for every call.
             final_alloc_size = ((min_alloc_size + 0xfUL) & ~0xfUL);
@@ -1180,6 +2814,9 @@ static void lwt_physical_executor_thread(void* arg_ptr) {
                 // Save the rsp and memcopy over arg area to new stacklet.
                 uint64_t* older_rsp = (uint64_t*) (phys_thread->stack_pinj_jmp_buf.rsp);
                 younger_stacklet->older_rsp = older_rsp;
+                younger_stacklet->depth = older_stacklet->depth + ((((void*) older_stacklet) + older_stacklet->len) - ((void*) older_rsp));
+                if (lwt_hot_splits.enabled)
+                    lwt_hot_split_count(older_rsp);
                 if (arg_data_size > 0) {
                     // The old stack layout looks like the following:
                     // 8n + 0x18(rsp) [  argument eightbyte n  ]
@@ -1201,6 +2838,7 @@ static void lwt_physical_executor_thread(void* arg_ptr) {
             } else {
                 // The fiber had no stacklet yet so rsp is undefined and the call here overwrote whatever stack we used.
                 younger_stacklet->older_rsp = 0;
+                younger_stacklet->depth = 0;
                 assert(arg_data_size == 0);
                 // We store a null return and frame pointer in the virtual morestack frame so frame walking really stops.
                 stack_top[0] = 0; // rbp
@@ -1210,6 +2848,8 @@ static void lwt_physical_executor_thread(void* arg_ptr) {
                 // Initialize rbp point to the virtual morestack frame in the top area.
                 phys_thread->stack_pinj_jmp_buf.rbp = (uint64_t) &stack_top[0];
             }
+            // The fiber needs at least the frame and its arguments on top of the older stacklets.
+            fiber->peak_stack_depth = MAX(fiber->peak_stack_depth, younger_stacklet->depth + frame_stack_size + top_area_size);
             // The r10 msb signifies that we are doing a fx save context switch.
             uint64_t releasestack_fn;
             if ((phys_thread->stack_pinj_jmp_buf.r10 & 0x8000000000000000) != 0) {
@@ -1247,8 +2887,15 @@ static void lwt_physical_executor_thread(void* arg_ptr) {
                 phys_thread->stack_pinj_jmp_buf.rbp = older_rsp[0];
                 phys_thread->stack_pinj_jmp_buf.rip = older_rsp[1];
                 phys_thread->stack_pinj_jmp_buf.rsp = (uint64_t) &older_rsp[2];
-                // Free the younger stacklet.
-                vm_mmap_unreserve_sys(younger_stacklet, younger_stacklet->len);
+#ifdef DEBUG
+                // When debugging, always free the younger stacklet so every call gets a new stacklet.
+                lwt_stacklet_release(phys_thread, younger_stacklet);
+#else
+                // Keep the younger stacklet as the spare stacklet of the fiber in case it crosses the same boundary again.
+                if (fiber->spare_stacklet != 0)
+                    lwt_stacklet_release(phys_thread, fiber->spare_stacklet);
+                fiber->spare_stacklet = younger_stacklet;
+#endif
             } else {
                 // The fiber main function returned, the fiber is shutting down.
                 // The instance name will be free'd and become invalid memory if it's allocated in the root of the heap,
@@ -1305,7 +2952,7 @@ static void lwt_physical_executor_thread(void* arg_ptr) {
                     break;
                 }
                 // Free this stacklet.
-                vm_mmap_unreserve_sys(stacklet, stacklet->len);
+                lwt_stacklet_release(phys_thread, stacklet);
                 stacklet = prev_stacklet;
             }
             // Restore end of stack to whatever it was in the catch context and long jump back to it via the try_jmp_buf.
@@ -1313,46 +2960,54 @@ static void lwt_physical_executor_thread(void* arg_ptr) {
             longjmp(*try_jmp_buf, 1);
             unreachable();
         } case LWT_LONGJMP_TEARDOWN: {
+            lwt_trace_event(lwt_trace_event_exit, fiber->ctrl.id, 0, 0, 0);
+            if (lwt_metrics_of(phys_thread) != 0)
+                phys_thread->metrics->fibers_exited++;
             // Switch to system fiber context beyond this point.
             phys_thread->current_fiber = &phys_thread->system_fiber;
-            // Tearing down the whole fiber, free the last stacklets.
-            lwt_stacklet_t *stacklet, *next_stacklet;
+            // Tearing down the whole fiber, free the last stacklets except the root stacklet which is recycled with the fiber struct.
+            lwt_stacklet_t *stacklet, *next_stacklet, *root_stacklet = 0;
             LL_FOREACH_SAFE(fiber->current_stacklet, stacklet, next_stacklet) {
-                vm_mmap_unreserve_sys(stacklet, stacklet->len);
+                if (next_stacklet == 0) {
+                    root_stacklet = stacklet;
+                } else {
+                    lwt_stacklet_release(phys_thread, stacklet);
+                }
             }
+            lwt_stacklet_spare_release(phys_thread, fiber);
+            lwt_stack_learn_record(fiber->main_name, fiber->peak_stack_depth);
             // Free the last dynamic stack allocations.
             lwt_stack_alloc_t *stack_alloc, *next_stack_alloc;
             LL_FOREACH_SAFE(fiber->stack_alloc_stack, stack_alloc, next_stack_alloc) {
                 vm_mmap_unreserve_sys(stack_alloc, stack_alloc->len);
             }
             //phys-scheduler/ DBG_RAW("thread ", DBG_INT(phys_thread->pid),  ": fiber [", DBG_INT(fiber->ctrl.id), "] signaled teardown, tearing down");
-            // Remove the fiber from the global index.
-            LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
-                hmap_fid_lookup_t lu = hmap_fid_lookup(&shared_fiber_mem.fiber_map, fiber->ctrl.id, true);
-                if (!hmap_fid_found(lu))
-                    throw("removing fiber from global index failed: index did not exist. possible memory corruption", exception_fatal);
-                hmap_fid_delete(&shared_fiber_mem.fiber_map, lu);
-                DL_DELETE(shared_fiber_mem.fiber_list, fiber);
-            } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
-            // The fiber is no longer reachable by any calls as it doesn't exist in the global index.
-            LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
-                for (lwt_ifc_fn_queue_t* ifc_fn_queue = RBTREE_NODE2ELEM(lwt_ifc_fn_queue_t, rb_node, rbtree_first(&fiber->ifc_fn_queues))
-                ; ifc_fn_queue != 0; ifc_fn_queue = RBTREE_NODE2ELEM(lwt_ifc_fn_queue_t, rb_node, rbtree_next(&ifc_fn_queue->rb_node))) {
-                    // There can be no ifc server as the accept loop should have free'd it, however there may still be waiting clients. Trigger join race in all of them.
-                    assert(ifc_fn_queue->ifc_server_ref_count == 0);
-                    for (lwt_ifc_client_t* client = ifc_fn_queue->waiting_clients.first; client != 0; client = client->next) {
-                        if (client->fiber->ctrl.unintr) {
-                            /// Uninterruptable pending clients cannot be join raced as this is a form of interrupt, instead they are just woken up as they expect to be so if the client no longer existed.
-                            lwt_scheduler_fiber_wake_done_raw(client->fiber);
-                        } else {
-                            /// For normal interruptible clients we use a standard join race.
-                            lwt_scheduler_fiber_wake_join_race_raw(client->fiber);
+            // Remove the fiber from the global index. Clients validate that the fiber is still indexed after taking
+            // the ifc lock so no new clients can be queued after this.
+            rwspinlock_t* ifc_lock = &lwt_fid_table_id_slot(fiber->ctrl.id)->ifc_lock;
+            LWT_SYS_SPINLOCK_WLOCK(ifc_lock); {
+                LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+                    lwt_fid_table_remove(fiber->ctrl.id);
+                    DL_DELETE(shared_fiber_mem.fiber_list, fiber);
+                    // The fiber is no longer reachable by any calls as it doesn't exist in the global index.
+                    for (lwt_ifc_fn_queue_t* ifc_fn_queue = RBTREE_NODE2ELEM(lwt_ifc_fn_queue_t, rb_node, rbtree_first(&fiber->ifc_fn_queues))
+                    ; ifc_fn_queue != 0; ifc_fn_queue = RBTREE_NODE2ELEM(lwt_ifc_fn_queue_t, rb_node, rbtree_next(&ifc_fn_queue->rb_node))) {
+                        // There can be no ifc server as the accept loop should have free'd it, however there may still be waiting clients. Trigger join race in all of them.
+                        assert(ifc_fn_queue->ifc_server_ref_count == 0);
+                        for (lwt_ifc_client_t* client = ifc_fn_queue->waiting_clients.first; client != 0; client = client->next) {
+                            if (client->fiber->ctrl.unintr) {
+                                /// Uninterruptable pending clients cannot be join raced as this is a form of interrupt, instead they are just woken up as they expect to be so if the client no longer existed.
+                                lwt_scheduler_fiber_wake_done_raw(client->fiber);
+                            } else {
+                                /// For normal interruptible clients we use a standard join race.
+                                lwt_scheduler_fiber_wake_join_race_raw(client->fiber);
+                            }
                         }
+                        // We set server fiber to null as the fiber will become invalid memory.
+                        ifc_fn_queue->server_fiber = 0;
                     }
-                    // We set server fiber to null as the fiber will become invalid memory.
-                    ifc_fn_queue->server_fiber = 0;
-                }
-            } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+                } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+            } LWT_SYS_SPINLOCK_UNLOCK(ifc_lock);
             // Free any pending cancellation.
             rcd_exception_t* src_cancel_e = fiber->ctrl.canceled;
             if (src_cancel_e != 0) {
@@ -1364,23 +3019,34 @@ static void lwt_physical_executor_thread(void* arg_ptr) {
             // Free the root heap and all remaining associated memory/resources.
             //DBG("thread ", DBG_INT(phys_thread->ptid),  ": releasing heap [", DBG_PTR(fiber->current_heap), "] of fiber [", DBG_PTR(fiber), "]");
             // Free the actual fiber struct.
-            lwt_fiber_free(fiber);
+            lwt_fiber_recycle(phys_thread, fiber, root_stacklet);
             break;
         } case LWT_LONGJMP_PANIC: {
             lwt_panic();
             break;
+        } case LWT_LONGJMP_PREEMPT: {
+            // The fiber used up its time slice. It's queued without being marked as deferred so anything that
+            // wakes it up while it's queued just sets done as if it was still running.
+            lwt_stacklet_spare_release(phys_thread, fiber);
+            LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+                lwt_scheduler_exec_block_enqueue(fiber, false);
+            } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+            // Unsafe to reference the fiber after the unlock as another executor may have picked it up.
+            phys_thread->current_fiber = &phys_thread->system_fiber;
+            break;
         } case LWT_LONGJMP_SWITCH: {
         } case LWT_LONGJMP_YIELD: {
         } default: {
             //phys-scheduler/ DBG_RAW("thread ", DBG_INT(phys_thread->pid),  ": fiber [", DBG_INT(fiber->ctrl.id), "] signaled defer, deferring");
             // Mark the thread as deferred unless it's canceled or done in which case it should be immediately resumed as deferred and (canceled or done) cannot be true at the same time.
+            lwt_stacklet_spare_release(phys_thread, fiber);
             bool defer_bounce;
             LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
                 defer_bounce = ((!fiber->ctrl.unintr && (fiber->ctrl.canceled != 0 || fiber->ctrl.join_race)) || fiber->ctrl.done);
                 if (!defer_bounce) {
                     if (setjmp_r == LWT_LONGJMP_YIELD) {
-                        // Add to end of defer blocking queue so execution can begin again asap.
-                        lwt_scheduler_exec_block_enqueue(fiber);
+                        // Add to end of the local run queue fifo so the other fibers get to execute first.
+                        lwt_scheduler_exec_block_enqueue(fiber, false);
                     } else {
                         // Set deferred to true allowing physical threads to take control over the fiber.
                         fiber->ctrl.deferred = true;
@@ -1409,6 +3075,7 @@ static void lwt_physical_thread_main(void* arg_ptr) {
     lwt_start_cb_t start_cb = *start_cb_arg_ptr;
     vm_mmap_unreserve(start_cb_arg_ptr, sizeof(lwt_start_cb_t));
     start_cb.start_fn(start_cb.arg_ptr);
+    vm_thread_cache_flush();
     _exit(0);
 }
 
@@ -1442,64 +3109,231 @@ static lwt_physical_thread_t* lwt_start_physical_thread(lwt_start_cb_t start_cb)
     return phys_thread;
 }
 
-typedef struct lwt_real_block_args {
-    void (*main_fn)(void*);
+/// Releases the memory that a physical thread which is gone still owns. Threads that exit voluntarily do this
+/// themselves before they exit while threads that are killed from the outside are reaped by their killer.
+/// The physical thread struct itself lives on the thread stack and is released with it.
+static void lwt_physical_thread_reap(lwt_physical_thread_t* phys_thread) {
+    vm_thread_cache_release(&phys_thread->vm_thread_cache);
+}
+
+/// Default upper bound of the blocker thread pool. Threads are only started
+/// on demand so this is rarely reached.
+#define LWT_BLOCKER_THREAD_COUNT_DEFAULT 0x100
+
+/// Size of the stack of a blocker thread.
+#define LWT_BLOCKER_STACK_SIZE (PAGE_SIZE * 0x10)
+
+typedef enum lwt_blocker_state {
+    lwt_blocker_state_queued,
+    lwt_blocker_state_running,
+    lwt_blocker_state_done,
+    lwt_blocker_state_killing,
+} lwt_blocker_state_t;
+
+/// A blocking call that is offloaded to the blocker thread pool. It lives on
+/// a heap owned by the submitting fiber which is deferred until the task is
+/// done or, if canceled, until the task is either dequeued or the blocker
+/// thread that runs it is killed.
+typedef struct lwt_blocker_task {
+    struct lwt_blocker_task* prev;
+    struct lwt_blocker_task* next;
+    void (*block_fn)(void*);
     void* arg_ptr;
     lwt_heap_t* heap;
-    int32_t event_h;
-} lwt_real_block_args_t;
+    lwt_fiber_t* fiber;
+    /// Transitions away from queued are protected by the pool lock while
+    /// transitions away from running are protected by the shared fiber lock.
+    lwt_blocker_state_t state;
+    /// Thread that runs the task, its physical thread and the base of its stack (when running).
+    int32_t thread_tid;
+    lwt_physical_thread_t* thread_phys;
+    void* thread_stack_base;
+} lwt_blocker_task_t;
+
+/// Bounded pool of real threads that runs blocking syscalls on behalf of
+/// fibers so they never stall executors. Threads are started lazily when
+/// there are more queued tasks than idle threads and are then reused.
+static struct lwt_blocker_pool {
+    int8_t lock;
+    volatile uint32_t futex;
+    uint32_t max_threads;
+    uint32_t n_threads;
+    uint32_t n_idle;
+    uint32_t n_queued;
+    lwt_blocker_task_t* queue;
+} lwt_blocker_pool;
+
+/// Dequeues the next task and yields to Linux until one becomes available.
+static lwt_blocker_task_t* lwt_blocker_pool_dequeue(void* stack_base) {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    for (bool was_idle = false;;) {
+        uint32_t futex_v;
+        atomic_spinlock_lock(&lwt_blocker_pool.lock); {
+            if (was_idle)
+                lwt_blocker_pool.n_idle--;
+            lwt_blocker_task_t* task = lwt_blocker_pool.queue;
+            if (task != 0) {
+                DL_DELETE(lwt_blocker_pool.queue, task);
+                lwt_blocker_pool.n_queued--;
+                task->state = lwt_blocker_state_running;
+                task->thread_tid = phys_thread->pid;
+                task->thread_phys = phys_thread;
+                task->thread_stack_base = stack_base;
+                atomic_spinlock_unlock(&lwt_blocker_pool.lock);
+                return task;
+            }
+            lwt_blocker_pool.n_idle++;
+            was_idle = true;
+            futex_v = lwt_blocker_pool.futex;
+        } atomic_spinlock_unlock(&lwt_blocker_pool.lock);
+        int32_t futex_r = futex((int*) &lwt_blocker_pool.futex, FUTEX_WAIT, (int) futex_v, 0, 0, 0);
+        if (futex_r != 0 && errno != EWOULDBLOCK && errno != EINTR)
+            RCD_SYSCALL_EXCEPTION(futex, exception_fatal);
+    }
+}
 
-static void lwt_real_block_main(void* arg_ptr) {
-    lwt_real_block_args_t* real_block_args = arg_ptr;
-    lwt_setup_real_block_thread(real_block_args->heap->vm_heap);
+/// Blocks or unblocks LWT_ASYNC_CANCEL_SIGNAL for the current thread. The libc refuses to add the signals it
+/// reserves to a signal set so we build the set ourselves.
+static void lwt_async_cancel_signal_mask(int32_t how) {
+    sigset_t cancel_mask = {0};
+    cancel_mask.__bits[0] = 1UL << (LWT_ASYNC_CANCEL_SIGNAL - 1);
+    int32_t rt_sigprocmask_r = rt_sigprocmask(how, &cancel_mask, 0);
+    if (rt_sigprocmask_r == -1)
+        RCD_SYSCALL_EXCEPTION(rt_sigprocmask, exception_fatal);
+}
+
+static void lwt_blocker_thread_main(void* arg_ptr) {
+    void* stack_base = arg_ptr;
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    phys_thread->pid = gettid();
+    lwt_setup_real_block_thread(0);
+    phys_thread->system_fiber.main_name = "[librcd blocker fiber]";
+    lwt_trace_ring_init(phys_thread);
     rsig_thread_signal_mask_reset();
-    // Call the real block main function.
-    real_block_args->main_fn(real_block_args->arg_ptr);
-    uint64_t trigger = 1;
-    write(real_block_args->event_h, (void*) &trigger, sizeof(trigger));
-    _exit(0);
+    // The thread may only be killed while it runs a blocking function. Anywhere else it may hold a lock that
+    // would never be released. A kill that arrives outside it stays pending until we either exit or finish.
+    lwt_async_cancel_signal_mask(SIG_BLOCK);
+    for (;;) {
+        lwt_blocker_task_t* task = lwt_blocker_pool_dequeue(stack_base);
+        phys_thread->system_fiber.current_heap = task->heap->vm_heap;
+        lwt_async_cancel_signal_mask(SIG_UNBLOCK);
+        task->block_fn(task->arg_ptr);
+        lwt_async_cancel_signal_mask(SIG_BLOCK);
+        phys_thread->system_fiber.current_heap = 0;
+        bool killed;
+        LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+            killed = (task->state == lwt_blocker_state_killing);
+            if (!killed) {
+                task->state = lwt_blocker_state_done;
+                lwt_scheduler_fiber_wake_done_raw(task->fiber);
+            }
+        } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+        // The fiber gave up on us and is about to kill this thread. We no
+        // longer own anything so just exit before it gets the chance. The
+        // killer reaps our vm thread cache once we are gone.
+        if (killed)
+            _exit(0);
+    }
 }
 
-static void lwt_block_on_real_thread(void (*main_fn)(void*), void* arg_ptr) {
-    // Prepare arguments.
-    rio_t* event_h = rio_eventfd_create(0, false);
-    lwt_heap_t* post_clone_heap;
-    lwt_real_block_args_t* real_block_args = lwt_alloc_heaped_object(sizeof(lwt_real_block_args_t), &post_clone_heap);
-    real_block_args->main_fn = main_fn;
-    real_block_args->arg_ptr = arg_ptr;
-    real_block_args->heap = post_clone_heap;
-    real_block_args->event_h = rio_get_fd_write(event_h);
-    // Allocate a small stack for the auxiliary thread.
-    const size_t aux_thread_stack_size = 0x4000;
-    void* stack_base = lwt_alloc_new(aux_thread_stack_size);
-    void* stack_entry_point = stack_base + aux_thread_stack_size;
+static void lwt_blocker_thread_start() {
+    void* stack_base = vm_mmap_reserve(LWT_BLOCKER_STACK_SIZE, 0);
+    void* stack_entry_point = (void*) vm_align_floor((uintptr_t) stack_base + LWT_BLOCKER_STACK_SIZE, VM_ALLOC_ALIGN);
     lwt_physical_thread_t* phys_thread = 0;
-    int32_t clone_r = lwt_start_new_thread(lwt_real_block_main, stack_entry_point, lwt_get_thread_clone_flags(), real_block_args, &phys_thread);
+    int32_t clone_r = lwt_start_new_thread(lwt_blocker_thread_main, stack_entry_point, lwt_get_thread_clone_flags(), stack_base, &phys_thread);
     if (clone_r == -1)
         RCD_SYSCALL_EXCEPTION(clone, exception_fatal);
-    int32_t waitpid_main_tid = clone_r;
-    // Wait for the process nicely.
-    try {
-        rio_eventfd_wait(event_h);
-    } finally {
-        // The thread is about to exit, spin until it does to avoid race. It should just be a few instructions.
-        // We can't kill it with SIGKILL if we where canceled as it would kill our entire thread group,
-        // instead we use LWT_ASYNC_CANCEL_SIGNAL which kills individual threads by invoking lwt_sigcancel_handler().
-        for (int32_t signal = LWT_ASYNC_CANCEL_SIGNAL;; signal = 0) {
-            int32_t rt_tgsigqueueinfo_r = lwt_sigtkill_thread(waitpid_main_tid, signal, (union sigval) {0});
-            if (rt_tgsigqueueinfo_r == -1) {
-                int32_t errno_v = errno;
-                if (errno_v == ESRCH)
-                    break;
-                else if (errno_v == EAGAIN)
-                    continue;
-                RCD_SYSCALL_EXCEPTION(rt_tgsigqueueinfo, exception_fatal);
-            }
-            sched_yield();
+}
+
+static void lwt_blocker_pool_submit(lwt_blocker_task_t* task) {
+    bool start_thread = false, wake_thread;
+    atomic_spinlock_lock(&lwt_blocker_pool.lock); {
+        task->state = lwt_blocker_state_queued;
+        DL_APPEND(lwt_blocker_pool.queue, task);
+        lwt_blocker_pool.n_queued++;
+        // Idle threads that have been woken but not yet dequeued still count
+        // as idle, so only start a new thread if the queue outgrows them.
+        if (lwt_blocker_pool.n_queued > lwt_blocker_pool.n_idle && lwt_blocker_pool.n_threads < lwt_blocker_pool.max_threads) {
+            lwt_blocker_pool.n_threads++;
+            start_thread = true;
         }
+        wake_thread = (lwt_blocker_pool.n_idle > 0);
+        lwt_blocker_pool.futex++;
+    } atomic_spinlock_unlock(&lwt_blocker_pool.lock);
+    if (start_thread)
+        lwt_blocker_thread_start();
+    if (wake_thread) {
+        int32_t futex_r = futex((int*) &lwt_blocker_pool.futex, FUTEX_WAKE, 1, 0, 0, 0);
+        if (futex_r == -1)
+            RCD_SYSCALL_EXCEPTION(futex, exception_fatal);
     }
 }
 
+/// Called when a fiber is canceled while waiting for a task. Dequeues the task
+/// if it hasn't started yet, otherwise kills the thread that runs it.
+static void lwt_blocker_task_abort(lwt_blocker_task_t* task) {
+    bool dequeued = false;
+    atomic_spinlock_lock(&lwt_blocker_pool.lock); {
+        if (task->state == lwt_blocker_state_queued) {
+            DL_DELETE(lwt_blocker_pool.queue, task);
+            lwt_blocker_pool.n_queued--;
+            dequeued = true;
+        }
+    } atomic_spinlock_unlock(&lwt_blocker_pool.lock);
+    if (dequeued)
+        return;
+    bool kill;
+    LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+        kill = (task->state == lwt_blocker_state_running);
+        if (kill)
+            task->state = lwt_blocker_state_killing;
+    } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+    if (!kill)
+        return;
+    // We can't kill it with SIGKILL as it would kill our entire thread group,
+    // instead we use LWT_ASYNC_CANCEL_SIGNAL which kills individual threads by invoking lwt_sigcancel_handler().
+    // The thread might also exit by itself if it finishes the task, either way we spin until it's gone.
+    for (int32_t signal = LWT_ASYNC_CANCEL_SIGNAL;; signal = 0) {
+        int32_t rt_tgsigqueueinfo_r = lwt_sigtkill_thread(task->thread_tid, signal, (union sigval) {0});
+        if (rt_tgsigqueueinfo_r == -1) {
+            int32_t errno_v = errno;
+            if (errno_v == ESRCH)
+                break;
+            else if (errno_v == EAGAIN)
+                continue;
+            RCD_SYSCALL_EXCEPTION(rt_tgsigqueueinfo, exception_fatal);
+        }
+        sched_yield();
+    }
+    // The thread is gone, release its physical thread and stack and let the pool replace it.
+    lwt_physical_thread_reap(task->thread_phys);
+    vm_mmap_unreserve(task->thread_stack_base, LWT_BLOCKER_STACK_SIZE);
+    atomic_spinlock_lock(&lwt_blocker_pool.lock); {
+        lwt_blocker_pool.n_threads--;
+    } atomic_spinlock_unlock(&lwt_blocker_pool.lock);
+}
+
+void lwt_offload(void (*block_fn)(void*), void* arg_ptr) { sub_heap {
+    LWT_GET_LOCAL_FIBER(fiber);
+    lwt_cancellation_point_raw(fiber);
+    lwt_heap_t* task_heap;
+    lwt_blocker_task_t* task = lwt_alloc_heaped_object(sizeof(lwt_blocker_task_t), &task_heap);
+    *task = (lwt_blocker_task_t) {.block_fn = block_fn, .arg_ptr = arg_ptr, .heap = task_heap, .fiber = fiber};
+    // Prevents race (defer bounces if the task completes before it).
+    fiber->ctrl.done = false;
+    lwt_blocker_pool_submit(task);
+    lwt_scheduler_fiber_defer(false, 0, 0, -1);
+    bool done;
+    LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+        done = (task->state == lwt_blocker_state_done);
+    } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+    if (!done) {
+        // We woke up due to cancellation.
+        lwt_blocker_task_abort(task);
+        lwt_cancellation_point_raw(fiber);
+    }
+}}
+
 typedef struct lwt_waitpid_main_args {
     int32_t pid;
     bool* out_success;
@@ -1527,7 +3361,7 @@ static void lwt_waitpid_main(void* arg_ptr) {
 }
 
 int32_t lwt_waitpid(int32_t pid) { sub_heap {
-    // Start a thread that can block on waitid() since linux does not provide an asynchronous facility for this.
+    // Offload to a thread that can block on waitid() since linux does not provide an asynchronous facility for this.
     bool success;
     int32_t exit_code;
     int32_t ret_errno;
@@ -1536,7 +3370,7 @@ int32_t lwt_waitpid(int32_t pid) { sub_heap {
     waitpid_main_args.out_success = &success;
     waitpid_main_args.out_exit_code = &exit_code;
     waitpid_main_args.out_errno = &ret_errno;
-    lwt_block_on_real_thread(lwt_waitpid_main, &waitpid_main_args);
+    lwt_offload(lwt_waitpid_main, &waitpid_main_args);
     if (!success) {
         errno = ret_errno;
         RCD_SYSCALL_EXCEPTION(waitid, exception_io);
@@ -1567,7 +3401,7 @@ static void lwt_flock_main(void* arg_ptr) {
 }
 
 int32_t lwt_flock(int32_t fd, int32_t operation) { sub_heap {
-    // Start a thread that can block on flock() since linux does not provide an asynchronous facility that allows us to do wait for this event.
+    // Offload to a thread that can block on flock() since linux does not provide an asynchronous facility that allows us to do wait for this event.
     bool success;
     int32_t ret_errno;
     lwt_flock_main_args_t flock_main_args;
@@ -1575,7 +3409,7 @@ int32_t lwt_flock(int32_t fd, int32_t operation) { sub_heap {
     flock_main_args.operation = operation;
     flock_main_args.out_success = &success;
     flock_main_args.out_errno = &ret_errno;
-    lwt_block_on_real_thread(lwt_flock_main, &flock_main_args);
+    lwt_offload(lwt_flock_main, &flock_main_args);
     if (!success)
         errno = ret_errno;
     return success? 0: -1;
@@ -1637,23 +3471,109 @@ void lwt_once(lwt_once_t* once_ctrl, void (*init_fn)(void*), void* arg_ptr) {
     }
 }
 
+/// Starts a new executor and adds it to the executor list. Must be called with lwt_executor_match_lock held.
+static void lwt_start_executor_thread(bool is_spare) {
+    lwt_start_cb_t executor_start_cb = {.start_fn = lwt_physical_executor_thread, .arg_ptr = (void*) (uintptr_t) is_spare};
+    lwt_physical_thread_t* phys_thread = lwt_start_physical_thread(executor_start_cb);
+    global_heap {
+        lwt_executor_thread_t* exec_thread = new(lwt_executor_thread_t);
+        exec_thread->phys_thread = phys_thread;
+        LL_PREPEND(lwt_executor_threads, exec_thread);
+    }
+    lwt_executor_thread_count++;
+}
+
 static void lwt_match_executor_count(uint32_t optimal_count) {
-    lwt_start_cb_t executor_start_cb = {.start_fn = lwt_physical_executor_thread, .arg_ptr = 0};
     atomic_spinlock_lock(&lwt_executor_match_lock);
     uint32_t target_executor_thread_count = MIN(optimal_count, lwt_debug_max_worker_count);
-    while (lwt_executor_thread_count < target_executor_thread_count) {
-        lwt_physical_thread_t* phys_thread = lwt_start_physical_thread(executor_start_cb);
-        global_heap {
-            lwt_executor_thread_t* exec_thread = new(lwt_executor_thread_t);
-            exec_thread->phys_thread = phys_thread;
-            LL_PREPEND(lwt_executor_threads, exec_thread);
+    while (lwt_executor_thread_count - lwt_sysmon.n_spares < target_executor_thread_count)
+        lwt_start_executor_thread(false);
+    atomic_spinlock_unlock(&lwt_executor_match_lock);
+}
+
+/// Reads a kernel cpu list file (e.g. "0-3,8,10-11") into a cpu set. Returns false if the file cannot be read.
+static bool lwt_read_cpu_list(fstr_t file_path, cpu_set_t* out_cpu_set) {
+    *out_cpu_set = (cpu_set_t) {{0}};
+    bool read_ok = true;
+    sub_heap {
+        try {
+            fstr_t cpu_list = rio_read_virtual_file_contents(file_path, fss(fstr_alloc(PAGE_SIZE)));
+            for (fstr_t range; fstr_iterate_trim(&cpu_list, ",", &range);) {
+                fstr_t first, last;
+                if (!fstr_divide(range, "-", &first, &last))
+                    first = last = range;
+                uint128_t last_cpu = MIN(fstr_to_uint(last, 10), LWT_CPU_SET_SIZE - 1);
+                for (uint128_t cpu = fstr_to_uint(first, 10); cpu <= last_cpu; cpu++)
+                    lwt_cpu_set_add(out_cpu_set, cpu);
+            }
+        } catch (exception_io, e) {
+            read_ok = false;
         }
-        lwt_executor_thread_count++;
     }
-    atomic_spinlock_unlock(&lwt_executor_match_lock);
+    return read_ok;
+}
+
+/// Reads the cpus the process may run on. Returns false if they cannot be determined.
+static bool lwt_get_process_cpu_set(cpu_set_t* out_cpu_set) {
+    *out_cpu_set = (cpu_set_t) {{0}};
+    return sched_getaffinity(0, sizeof(*out_cpu_set), out_cpu_set) != -1;
+}
+
+/// Discovers the process cpuset and the NUMA node of each cpu in it. Called once at startup when executor
+/// affinity is enabled. Cpus are ordered by node so executors started in sequence fill one node at a time.
+static void lwt_cpu_topology_init() {
+    cpu_set_t process_cpu_set;
+    if (!lwt_get_process_cpu_set(&process_cpu_set))
+        return;
+    // Map cpus to nodes. Kernels without NUMA support have no node directory and everything is on node zero.
+    uint16_t cpu_node_map[LWT_CPU_SET_SIZE] = {0};
+    cpu_set_t online_nodes;
+    if (!lwt_read_cpu_list("/sys/devices/system/node/online", &online_nodes)) {
+        online_nodes = (cpu_set_t) {{0}};
+        lwt_cpu_set_add(&online_nodes, 0);
+    }
+    for (size_t node = 0; node < LWT_CPU_SET_SIZE; node++) {
+        if (!lwt_cpu_set_test(&online_nodes, node))
+            continue;
+        cpu_set_t node_cpu_set;
+        if (!lwt_read_cpu_list(concs("/sys/devices/system/node/node", ui2fs(node), "/cpulist"), &node_cpu_set))
+            continue;
+        for (size_t cpu = 0; cpu < LWT_CPU_SET_SIZE; cpu++) {
+            if (lwt_cpu_set_test(&node_cpu_set, cpu))
+                cpu_node_map[cpu] = node;
+        }
+    }
+    global_heap {
+        lwt_cpu_topology.cpus = lwt_alloc_new(sizeof(uint16_t) * LWT_CPU_SET_SIZE);
+        lwt_cpu_topology.cpu_nodes = lwt_alloc_new(sizeof(uint16_t) * LWT_CPU_SET_SIZE);
+    }
+    for (size_t node = 0; node < LWT_CPU_SET_SIZE; node++) {
+        if (!lwt_cpu_set_test(&online_nodes, node))
+            continue;
+        uint32_t n_node_cpus = 0;
+        for (size_t cpu = 0; cpu < LWT_CPU_SET_SIZE; cpu++) {
+            if (!lwt_cpu_set_test(&process_cpu_set, cpu) || cpu_node_map[cpu] != node)
+                continue;
+            lwt_cpu_topology.cpus[lwt_cpu_topology.n_cpus] = cpu;
+            lwt_cpu_topology.cpu_nodes[lwt_cpu_topology.n_cpus] = node;
+            lwt_cpu_topology.n_cpus++;
+            n_node_cpus++;
+        }
+        if (n_node_cpus > 0)
+            lwt_cpu_topology.n_nodes++;
+    }
 }
 
 uint32_t lwt_system_cpu_count() {
+    // Honor the cpuset of the process (taskset, cgroups etc) when it's available.
+    cpu_set_t process_cpu_set;
+    if (lwt_get_process_cpu_set(&process_cpu_set)) {
+        uint32_t core_count = 0;
+        for (size_t i = 0; i < LENGTHOF(process_cpu_set.__bits); i++)
+            core_count += __builtin_popcountl(process_cpu_set.__bits[i]);
+        if (core_count > 0)
+            return core_count;
+    }
     fstr_t cpuinfo_path = "/proc/cpuinfo";
     uint32_t core_count = 0;
     sub_heap {
@@ -1673,82 +3593,562 @@ void lwt_start_optimal_executor_count() {
     lwt_match_executor_count(optimal_count > 4? optimal_count: 4);
 }
 
+lwt_fiber_class_t lwt_set_fiber_class(lwt_fiber_class_t fiber_class) {
+    if (fiber_class < lwt_fiber_class_inherit || fiber_class > lwt_fiber_class_background)
+        throw("invalid fiber class", exception_arg);
+    LWT_GET_LOCAL_FIBER(fiber);
+    lwt_fiber_class_t prev_fiber_class = fiber->fiber_class;
+    if (fiber_class != lwt_fiber_class_inherit) {
+        // Wakers read the class when enqueueing the fiber.
+        LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+            fiber->fiber_class = fiber_class;
+        } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+    }
+    return prev_fiber_class;
+}
+
+lwt_fiber_class_t lwt_get_fiber_class() {
+    LWT_GET_LOCAL_FIBER(fiber);
+    return fiber->fiber_class;
+}
+
 void lwt_yield() {
     LWT_GET_LOCAL_FIBER(fiber);
     lwt_cancellation_point_raw(fiber);
-    if (shared_fiber_mem.exec_block_queue.first != 0) {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    if (phys_thread->run_queue.length != 0 || exec_block_class_queue_top(&shared_fiber_mem.exec_block_queue) != LWT_N_FIBER_CLASSES) {
         fiber->ctrl.done = false;
         lwt_scheduler_fiber_defer(true, 0, 0, -1);
         lwt_cancellation_point_raw(fiber);
     }
 }
 
+static inline lwt_io_shard_t* lwt_io_get_shard(int fd) {
+    return &lwt_io_shards[((uint32_t) fd) % lwt_io_shard_count];
+}
+
+static uint64_t lwt_timer_now_ns() {
+    struct timespec tp;
+    int32_t clock_gettime_r = clock_gettime(CLOCK_MONOTONIC, &tp);
+    if (clock_gettime_r == -1)
+        RCD_SYSCALL_EXCEPTION(clock_gettime, exception_fatal);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static void lwt_timer_wheel_init(lwt_timer_wheel_t* wheel, int epoll_fd) {
+    *wheel = (lwt_timer_wheel_t) {0};
+    wheel->current_tick = lwt_timer_now_ns() >> LWT_TIMER_TICK_SHIFT;
+    wheel->armed_tick = UINT64_MAX;
+    wheel->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->timer_fd == -1)
+        RCD_SYSCALL_EXCEPTION(timerfd_create, exception_fatal);
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.fd = wheel->timer_fd};
+    int epoll_ctl_r = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wheel->timer_fd, &event);
+    if (epoll_ctl_r == -1)
+        RCD_SYSCALL_EXCEPTION(epoll_ctl, exception_fatal);
+}
+
+/// Returns the timer wheel that fibers running on the current physical thread arm their timers in.
+static inline lwt_timer_wheel_t* lwt_timer_get_wheel() {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    return &lwt_io_shards[phys_thread->executor_index % lwt_io_shard_count].timer_wheel;
+}
+
+static void lwt_timer_wheel_insert(lwt_timer_wheel_t* wheel, lwt_timer_t* timer) {
+    uint64_t expire_tick = MAX(timer->expire_tick, wheel->current_tick);
+    uint64_t delta = expire_tick - wheel->current_tick;
+    const uint64_t wheel_range = (1ULL << (LWT_TIMER_LEVEL_BITS * LWT_TIMER_LEVELS));
+    if (delta >= wheel_range) {
+        // Park the timer in the last level. It's reinserted when the level cascades.
+        delta = wheel_range - 1;
+        expire_tick = wheel->current_tick + delta;
+    }
+    uint8_t level = 0;
+    while (delta >= (1ULL << (LWT_TIMER_LEVEL_BITS * (level + 1))))
+        level++;
+    uint8_t slot = (expire_tick >> (LWT_TIMER_LEVEL_BITS * level)) & LWT_TIMER_LEVEL_MASK;
+    timer->level = level;
+    timer->slot = slot;
+    DL_APPEND(wheel->slots[level][slot], timer);
+    wheel->slot_bitmap[level] |= (1ULL << slot);
+}
+
+static void lwt_timer_wheel_remove(lwt_timer_wheel_t* wheel, lwt_timer_t* timer) {
+    DL_DELETE(wheel->slots[timer->level][timer->slot], timer);
+    if (wheel->slots[timer->level][timer->slot] == 0)
+        wheel->slot_bitmap[timer->level] &= ~(1ULL << timer->slot);
+}
+
+/// Moves the timers in the current slot of the specified level to lower levels. Returns the index of the slot.
+static uint8_t lwt_timer_wheel_cascade(lwt_timer_wheel_t* wheel, uint8_t level) {
+    uint8_t slot = (wheel->current_tick >> (LWT_TIMER_LEVEL_BITS * level)) & LWT_TIMER_LEVEL_MASK;
+    lwt_timer_t* timers = wheel->slots[level][slot];
+    wheel->slots[level][slot] = 0;
+    wheel->slot_bitmap[level] &= ~(1ULL << slot);
+    lwt_timer_t *timer, *tmp;
+    DL_FOREACH_SAFE(timers, timer, tmp) {
+        lwt_timer_wheel_insert(wheel, timer);
+    }
+    return slot;
+}
+
+/// Arms the timer fd of the wheel so it expires when the next slot needs to be processed. When force is false
+/// the timer fd is only rearmed if it needs to expire earlier than it currently does.
+static void lwt_timer_wheel_rearm(lwt_timer_wheel_t* wheel, bool force) {
+    uint64_t next_tick;
+    if (wheel->n_timers == 0) {
+        next_tick = UINT64_MAX;
+    } else {
+        // Either the next non-empty slot in the first level or the next cascade.
+        uint64_t pending = wheel->slot_bitmap[0] >> (wheel->current_tick & LWT_TIMER_LEVEL_MASK);
+        next_tick = (pending != 0)? wheel->current_tick + __builtin_ctzll(pending): (wheel->current_tick | LWT_TIMER_LEVEL_MASK) + 1;
+    }
+    if (force? (next_tick == wheel->armed_tick): (next_tick >= wheel->armed_tick))
+        return;
+    struct itimerspec time_spec = {0};
+    if (next_tick != UINT64_MAX) {
+        uint64_t next_ns = next_tick << LWT_TIMER_TICK_SHIFT;
+        time_spec.it_value.tv_sec = next_ns / 1000000000;
+        time_spec.it_value.tv_nsec = next_ns % 1000000000;
+    }
+    // This also resets the expiration count and thereby the readiness of the timer fd.
+    int32_t settime_r = timerfd_settime(wheel->timer_fd, TFD_TIMER_ABSTIME, &time_spec, 0);
+    if (settime_r == -1)
+        RCD_SYSCALL_EXCEPTION(timerfd_settime, exception_fatal);
+    wheel->armed_tick = next_tick;
+}
+
+/// Advances the wheel to the current time and fires all timers that expired.
+static void lwt_timer_wheel_run(lwt_timer_wheel_t* wheel) {
+    uint64_t now_tick = lwt_timer_now_ns() >> LWT_TIMER_TICK_SHIFT;
+    atomic_spinlock_lock(&wheel->lock);
+    lwt_timer_t* expired = 0;
+    while (wheel->current_tick <= now_tick) {
+        if (wheel->n_timers == 0) {
+            wheel->current_tick = now_tick + 1;
+            break;
+        }
+        uint8_t slot = wheel->current_tick & LWT_TIMER_LEVEL_MASK;
+        if (slot == 0) {
+            for (uint8_t level = 1; level < LWT_TIMER_LEVELS; level++) {
+                if (lwt_timer_wheel_cascade(wheel, level) != 0)
+                    break;
+            }
+        } else if (wheel->slot_bitmap[0] == 0) {
+            // Nothing can expire before the next cascade.
+            wheel->current_tick = MIN((wheel->current_tick | LWT_TIMER_LEVEL_MASK) + 1, now_tick + 1);
+            continue;
+        }
+        lwt_timer_t* timers = wheel->slots[0][slot];
+        if (timers != 0) {
+            wheel->slots[0][slot] = 0;
+            wheel->slot_bitmap[0] &= ~(1ULL << slot);
+            DL_CONCAT(expired, timers);
+        }
+        wheel->current_tick++;
+    }
+    if (expired != 0) {
+        // Fire timers while still holding the wheel lock so their owners cannot disarm and free them concurrently.
+        LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+            lwt_timer_t *timer, *tmp;
+            DL_FOREACH_SAFE(expired, timer, tmp) {
+                timer->armed = false;
+                wheel->n_timers--;
+                if (timer->action == lwt_timer_action_wake) {
+                    lwt_scheduler_fiber_wake_done_raw(timer->fiber);
+                } else {
+                    lwt_cancel_fiber_id_raw(timer->target_fid);
+                }
+            }
+        } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+    }
+    lwt_timer_wheel_rearm(wheel, true);
+    atomic_spinlock_unlock(&wheel->lock);
+}
+
+/// Arms a timer in the wheel of the current physical thread.
+static void lwt_timer_arm(lwt_timer_t* timer, uint128_t timeout_ns) {
+    uint64_t now_ns = lwt_timer_now_ns();
+    uint128_t expire_ns = now_ns + MIN(timeout_ns, (uint128_t) UINT64_MAX);
+    // Round up so timers never expire early.
+    timer->expire_tick = (expire_ns + (1ULL << LWT_TIMER_TICK_SHIFT) - 1) >> LWT_TIMER_TICK_SHIFT;
+    lwt_timer_wheel_t* wheel = lwt_timer_get_wheel();
+    timer->wheel = wheel;
+    atomic_spinlock_lock(&wheel->lock);
+    if (wheel->n_timers == 0) {
+        // The wheel is not advanced while it's empty. Skip the idle gap here, otherwise the next run
+        // walks all of it under the wheel lock.
+        wheel->current_tick = MAX(wheel->current_tick, now_ns >> LWT_TIMER_TICK_SHIFT);
+    }
+    timer->armed = true;
+    wheel->n_timers++;
+    lwt_timer_wheel_insert(wheel, timer);
+    lwt_timer_wheel_rearm(wheel, false);
+    atomic_spinlock_unlock(&wheel->lock);
+}
+
+/// Disarms a timer. Returns false if the timer already fired.
+static bool lwt_timer_disarm(lwt_timer_t* timer) {
+    lwt_timer_wheel_t* wheel = timer->wheel;
+    bool was_armed;
+    atomic_spinlock_lock(&wheel->lock);
+    was_armed = timer->armed;
+    if (was_armed) {
+        // The timer fd is left as is, expiring without any timers to fire is harmless.
+        lwt_timer_wheel_remove(wheel, timer);
+        timer->armed = false;
+        wheel->n_timers--;
+    }
+    atomic_spinlock_unlock(&wheel->lock);
+    return was_armed;
+}
+
+void lwt_sleep(uint128_t wait_ns) {
+    if (wait_ns == 0)
+        return;
+    LWT_GET_LOCAL_FIBER(fiber);
+    lwt_cancellation_point_raw(fiber);
+    lwt_timer_t timer = {.action = lwt_timer_action_wake, .fiber = fiber};
+    // Prevents race (defer bounces if the timer fires before it).
+    fiber->ctrl.done = false;
+    lwt_timer_arm(&timer, wait_ns);
+    lwt_scheduler_fiber_defer(false, 0, 0, -1);
+    if (lwt_timer_disarm(&timer)) {
+        // We woke up before the timer fired.
+        lwt_cancellation_point_raw(fiber);
+        throw("scheduler error: sleeping fiber woke up without any satisfied preconditions", exception_fatal);
+    }
+}
+
+static void lwt_alarm_destruct(void* arg_ptr) {
+    lwt_alarm_t* alarm = arg_ptr;
+    lwt_timer_disarm(&alarm->timer);
+}
+
+lwt_alarm_t* lwt_alarm_arm(uint128_t timeout_ns, rcd_fid_t target_fid) {
+    lwt_alarm_t* alarm = lwt_alloc_destructable(sizeof(lwt_alarm_t), lwt_alarm_destruct);
+    alarm->timer = (lwt_timer_t) {.action = lwt_timer_action_cancel, .target_fid = target_fid};
+    lwt_timer_arm(&alarm->timer, timeout_ns);
+    return alarm;
+}
+
+uint128_t lwt_set_join_timeout(uint128_t timeout_ns) {
+    LWT_GET_LOCAL_FIBER(fiber);
+    uint128_t prev_timeout_ns = fiber->join_timeout_ns;
+    fiber->join_timeout_ns = timeout_ns;
+    return prev_timeout_ns;
+}
+
+/// Dispatches ready events from the epoll instance of an I/O shard by waking up the fibers waiting for them.
+static void lwt_io_dispatch_events(lwt_io_shard_t* io_shard, struct epoll_event* epoll_events, int n_epoll_events) {
+    for (int i = 0; i < n_epoll_events; i++) {
+        int32_t fd = epoll_events[i].data.fd;
+        if (fd == io_shard->timer_wheel.timer_fd) {
+            lwt_timer_wheel_run(&io_shard->timer_wheel);
+            continue;
+        }
+        if (fd == io_shard->wake_fd) {
+            // Only wakes up the poller, the fibers to run are already queued.
+            uint64_t wake_v;
+            (void) read(io_shard->wake_fd, &wake_v, sizeof(wake_v));
+            continue;
+        }
+        LWT_SYS_SPINLOCK_WLOCK(&io_shard->rwlock); {
+            // DBG("[io/", i2fs(fd), "]: epoll notified");
+            hmap_bfd_lookup_t blu = hmap_bfd_lookup(&io_shard->blocking_fd_map, fd, true);
+            if (hmap_bfd_found(blu)) {
+                lwt_blocking_fd_t* blocking_fd = hmap_bfd_value(blu);
+                if (blocking_fd->is_epoll) {
+                    // Due to how recursive epoll is implemented in the kernel the inner epoll must be waited on to consume the ready status.
+                    // We must do it here to avoid race between the io-monitor thread and the corresponding fiber waking up.
+                    struct epoll_event events[1];
+                    int32_t epoll_wait_r = epoll_wait(fd, events, LENGTHOF(events), 0);
+                    if (epoll_wait_r == -1 && errno != EINTR)
+                        RCD_SYSCALL_EXCEPTION(epoll_wait, exception_fatal);
+                }
+                if ((epoll_events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0) {
+                    lwt_fiber_t* read_fiber = blocking_fd->read_fiber;
+                    if (read_fiber != 0) {
+                        // DBG("[io/", i2fs(fd), "]: waking read fiber");
+                        lwt_scheduler_fiber_wake_done(read_fiber);
+                        blocking_fd->read_fiber = 0;
+                    } else {
+                        // DBG("[io/", i2fs(fd), "]: pending read");
+                        blocking_fd->read_ready = true;
+                    }
+                }
+                if ((epoll_events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0) {
+                    lwt_fiber_t* write_fiber = blocking_fd->write_fiber;
+                    if (write_fiber != 0) {
+                        // DBG("[io/", i2fs(fd), "]: waking write fiber");
+                        lwt_scheduler_fiber_wake_done(write_fiber);
+                        blocking_fd->write_fiber = 0;
+                    } else {
+                        // DBG("[io/", i2fs(fd), "]: pending write");
+                        blocking_fd->write_ready = true;
+                    }
+                }
+            }
+        } LWT_SYS_SPINLOCK_UNLOCK(&io_shard->rwlock);
+    }
+}
+
 static void lwt_io_monitor_thread(void* arg_ptr) {
+    lwt_io_shard_t* io_shard = arg_ptr;
     // Rename the system fiber.
     lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
     phys_thread->system_fiber.main_name = "[librcd I/O fiber]";
+    lwt_trace_ring_init(phys_thread);
     const int epoll_events_count = PAGE_SIZE / sizeof(struct epoll_event);
     struct epoll_event epoll_events[epoll_events_count];
+    size_t shard_i = io_shard - lwt_io_shards;
     for (;;) {
+        if (lwt_config.executor_io_polling && shard_i < lwt_executor_thread_count) {
+            // Executors of the shard poll it themselves. Stand by and only poll when none of them has done so for
+            // a while, so events are not delayed for long when they are all busy running fibers.
+            uint32_t n_executor_polls = io_shard->n_executor_polls;
+            struct timespec interval = {.tv_sec = 0, .tv_nsec = LWT_IO_MONITOR_FALLBACK_NS};
+            nanosleep(&interval, 0);
+            if (io_shard->n_executor_polls != n_executor_polls || !atomic_cas_uint32(&io_shard->poller, lwt_io_poller_none, lwt_io_poller_monitor))
+                continue;
+            int epoll_r = epoll_wait(io_shard->epoll_fd, epoll_events, epoll_events_count, 0);
+            atomic_cas_uint32(&io_shard->poller, lwt_io_poller_monitor, lwt_io_poller_none);
+            if (epoll_r == -1) {
+                if (errno == EINTR)
+                    continue;
+                RCD_SYSCALL_EXCEPTION(epoll_wait, exception_fatal);
+            }
+            lwt_io_dispatch_events(io_shard, epoll_events, epoll_r);
+            continue;
+        }
         // DBG("[io/*]: epoll_wait()");
-        int epoll_r = epoll_wait(lwt_shared_epoll_fd, epoll_events, epoll_events_count, -1);
+        int epoll_r = epoll_wait(io_shard->epoll_fd, epoll_events, epoll_events_count, -1);
         if (epoll_r == -1) {
             if (errno == EINTR)
                 continue;
             RCD_SYSCALL_EXCEPTION(epoll_wait, exception_fatal);
         }
-        for (int i = 0; i < epoll_r; i++) {
-            int32_t fd = epoll_events[i].data.fd;
-            LWT_SYS_SPINLOCK_WLOCK(&shared_bfd_mem.rwlock); {
-                // DBG("[io/", i2fs(fd), "]: epoll notified");
-                hmap_bfd_lookup_t blu = hmap_bfd_lookup(&shared_bfd_mem.blocking_fd_map, fd, true);
-                if (hmap_bfd_found(blu)) {
-                    lwt_blocking_fd_t* blocking_fd = hmap_bfd_value(blu);
-                    if (blocking_fd->is_epoll) {
-                        // Due to how recursive epoll is implemented in the kernel the inner epoll must be waited on to consume the ready status.
-                        // We must do it here to avoid race between the io-monitor thread and the corresponding fiber waking up.
-                        struct epoll_event events[1];
-                        int32_t epoll_wait_r = epoll_wait(fd, events, LENGTHOF(events), 0);
-                        if (epoll_wait_r == -1 && errno != EINTR)
-                            RCD_SYSCALL_EXCEPTION(epoll_wait, exception_fatal);
-                    }
-                    if ((epoll_events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0) {
-                        lwt_fiber_t* read_fiber = blocking_fd->read_fiber;
-                        if (read_fiber != 0) {
-                            // DBG("[io/", i2fs(fd), "]: waking read fiber");
-                            lwt_scheduler_fiber_wake_done(read_fiber);
-                            blocking_fd->read_fiber = 0;
-                        } else {
-                            // DBG("[io/", i2fs(fd), "]: pending read");
-                            blocking_fd->read_ready = true;
-                        }
-                    }
-                    if ((epoll_events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0) {
-                        lwt_fiber_t* write_fiber = blocking_fd->write_fiber;
-                        if (write_fiber != 0) {
-                            // DBG("[io/", i2fs(fd), "]: waking write fiber");
-                            lwt_scheduler_fiber_wake_done(write_fiber);
-                            blocking_fd->write_fiber = 0;
-                        } else {
-                            // DBG("[io/", i2fs(fd), "]: pending write");
-                            blocking_fd->write_ready = true;
-                        }
-                    }
-                }
-            } LWT_SYS_SPINLOCK_UNLOCK(&shared_bfd_mem.rwlock);
+        lwt_io_dispatch_events(io_shard, epoll_events, epoll_r);
+    }
+}
+
+/// Returns true if the thread is sleeping in the kernel according to /proc, i.e. not running or runnable.
+static bool lwt_sysmon_is_thread_blocked(int32_t pid) {
+    bool is_blocked = false;
+    sub_heap {
+        try {
+            fstr_t stat = rio_read_virtual_file_contents(concs("/proc/self/task/", i2fs(pid), "/stat"), fss(fstr_alloc(PAGE_SIZE)));
+            // The state follows the command name which is in parenthesis and may contain anything.
+            fstr_t state;
+            if (fstr_rdivide(stat, ")", 0, &state)) {
+                state = fstr_trim(state);
+                is_blocked = (state.len > 0 && (state.str[0] == 'S' || state.str[0] == 'D'));
+            }
+        } catch (exception_io, e) {}
+    }
+    return is_blocked;
+}
+
+/// Writes the profile to a file in the working directory every time the process receives the profiler dump signal.
+/// The signal is blocked in all threads so it stays pending until it's accepted here.
+static void lwt_profiler_dump_thread(void* arg_ptr) {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    phys_thread->system_fiber.main_name = "[librcd profiler fiber]";
+    sigset_t dump_mask;
+    sigemptyset(&dump_mask);
+    sigaddset(&dump_mask, LWT_PROFILER_DUMP_SIGNAL);
+    for (;;) {
+        siginfo_t si;
+        int32_t sigtimedwait_r = rt_sigtimedwait(&dump_mask, &si, 0);
+        if (sigtimedwait_r == -1) {
+            if (errno == EINTR)
+                continue;
+            RCD_SYSCALL_EXCEPTION(rt_sigtimedwait, exception_fatal);
+        }
+        sub_heap {
+            fstr_t profile_path = concs("librcd-profile.", i2fs(getpid()), ".folded");
+            int32_t profile_fd = open(fstr_to_cstr(profile_path), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (profile_fd != -1) {
+                lwt_write_profile_folded_fd(profile_fd);
+                close(profile_fd);
+            }
         }
     }
 }
 
+/// Makes one more executor available, either by unparking a retired spare executor or starting a new one.
+/// The spare takes over the cpu at cpu_i in the topology, or any cpu if cpu_i is -1.
+static void lwt_sysmon_add_spare_executor(int32_t cpu_i) {
+    atomic_spinlock_lock(&lwt_executor_match_lock);
+    atomic_spinlock_lock(&lwt_sysmon.lock);
+    if (lwt_sysmon.n_parked > 0) {
+        lwt_sysmon.n_parked--;
+        lwt_sysmon.spare_pending = true;
+        lwt_sysmon.spare_cpu_i = cpu_i;
+        for (;;) {
+            uint32_t unpark_futex_v = lwt_sysmon.unpark_futex;
+            if (atomic_cas_uint32(&lwt_sysmon.unpark_futex, unpark_futex_v, unpark_futex_v + 1))
+                break;
+            sync_synchronize();
+        }
+        int32_t futex_r = futex((int*) &lwt_sysmon.unpark_futex, FUTEX_WAKE, 1, 0, 0, 0);
+        if (futex_r == -1)
+            RCD_SYSCALL_EXCEPTION(futex, exception_fatal);
+    } else if (lwt_sysmon.n_spares < lwt_sysmon.max_spares) {
+        lwt_sysmon.n_spares++;
+        lwt_sysmon.spare_pending = true;
+        lwt_sysmon.spare_cpu_i = cpu_i;
+        lwt_start_executor_thread(true);
+    }
+    atomic_spinlock_unlock(&lwt_sysmon.lock);
+    atomic_spinlock_unlock(&lwt_executor_match_lock);
+}
+
+/// True if a spare executor that is not parked is pinned to the cpu at cpu_i in the topology.
+static bool lwt_sysmon_is_cpu_taken(uint32_t cpu_i) {
+    for (lwt_executor_thread_t* exec_thread = lwt_executor_threads; exec_thread != 0; exec_thread = exec_thread->next) {
+        lwt_physical_thread_t* exec_phys_thread = exec_thread->phys_thread;
+        if (exec_phys_thread->is_spare_executor && !exec_phys_thread->is_parked && exec_phys_thread->is_pinned && exec_phys_thread->cpu_i == cpu_i)
+            return true;
+    }
+    return false;
+}
+
+/// System monitor. Looks for executors that are stuck in a blocking syscall (regular file I/O, fsync, getdents etc)
+/// while there are runnable fibers and no idle executor can take them. It then adds a spare executor that steals
+/// the runnable fibers, so all cores are kept busy without permanently overcommitting threads.
+static void lwt_sysmon_thread(void* arg_ptr) {
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    phys_thread->system_fiber.main_name = "[librcd sysmon fiber]";
+    for (;;) {
+        struct timespec interval = {.tv_sec = 0, .tv_nsec = LWT_SYSMON_INTERVAL_NS};
+        nanosleep(&interval, 0);
+        uint64_t now_ns = lwt_timer_now_ns();
+        size_t n_blocked = 0;
+        size_t n_idle = 0;
+        int32_t blocked_cpu_i = -1;
+        bool has_runnable = (exec_block_class_queue_top(&shared_fiber_mem.exec_block_queue) != LWT_N_FIBER_CLASSES);
+        for (lwt_executor_thread_t* exec_thread = lwt_executor_threads; exec_thread != 0; exec_thread = exec_thread->next) {
+            lwt_physical_thread_t* exec_phys_thread = exec_thread->phys_thread;
+            if (exec_phys_thread->is_parked)
+                continue;
+            if (exec_phys_thread->is_idle) {
+                n_idle++;
+                continue;
+            }
+            has_runnable = has_runnable || (exec_phys_thread->run_queue.length != 0);
+            uint64_t sched_tick = exec_phys_thread->sched_tick;
+            if (sched_tick != exec_phys_thread->sysmon_tick) {
+                exec_phys_thread->sysmon_tick = sched_tick;
+                exec_phys_thread->sysmon_tick_ns = now_ns;
+                continue;
+            }
+            if (now_ns - exec_phys_thread->sysmon_tick_ns >= LWT_SYSMON_BLOCK_THRESHOLD_NS && lwt_sysmon_is_thread_blocked(exec_phys_thread->pid)) {
+                n_blocked++;
+                // Prefer the cpu of a blocked executor that no spare is pinned to yet.
+                if (exec_phys_thread->is_pinned && !lwt_sysmon_is_cpu_taken(exec_phys_thread->cpu_i))
+                    blocked_cpu_i = exec_phys_thread->cpu_i;
+            }
+        }
+        if (n_blocked > 0 && n_idle == 0 && has_runnable && !lwt_sysmon.spare_pending)
+            lwt_sysmon_add_spare_executor(blocked_cpu_i);
+    }
+}
+
+void lwt_sysmon_start(uint32_t max_spares) {
+    static int8_t started = 0;
+    if (!atomic_cas_int8(&started, 0, 1))
+        return;
+    lwt_sysmon.max_spares = (max_spares > 0? max_spares: lwt_system_cpu_count());
+    lwt_start_cb_t sysmon_start_cb = {.start_fn = lwt_sysmon_thread, .arg_ptr = 0};
+    lwt_start_physical_thread(sysmon_start_cb);
+}
+
+size_t lwt_get_executor_count() {
+    return lwt_executor_thread_count - lwt_sysmon.n_spares;
+}
+
+uint32_t lwt_executor_spin_set(uint32_t spin_us) {
+    uint32_t prev_spin_us = lwt_executor_spin_us;
+    lwt_executor_spin_us = spin_us;
+    return prev_spin_us;
+}
+
+uint64_t lwt_get_executor_futex_wake_count() {
+    return shared_fiber_mem.n_futex_wakes;
+}
+
+uint64_t lwt_get_reused_fiber_count() {
+    uint64_t n_reused_fibers = 0;
+    for (lwt_executor_thread_t* exec_thread = lwt_executor_threads; exec_thread != 0; exec_thread = exec_thread->next)
+        n_reused_fibers += exec_thread->phys_thread->n_reused_fibers;
+    return n_reused_fibers;
+}
+
+/// Called by idle executors before going to sleep. Polls the I/O shard of the executor without blocking and
+/// wakes up the fibers that are ready which puts them in the local run queue of the executor.
+/// Returns the next fiber to run or 0 if no fiber became ready.
+static exec_blocked_fiber_t* lwt_scheduler_exec_block_poll_io(lwt_physical_thread_t* phys_thread) {
+    lwt_io_shard_t* io_shard = &lwt_io_shards[phys_thread->executor_index % lwt_io_shard_count];
+    struct epoll_event epoll_events[64];
+    int epoll_r = epoll_wait(io_shard->epoll_fd, epoll_events, LENGTHOF(epoll_events), 0);
+    if (epoll_r == -1) {
+        if (errno == EINTR)
+            return 0;
+        RCD_SYSCALL_EXCEPTION(epoll_wait, exception_fatal);
+    }
+    io_shard->n_executor_polls++;
+    if (epoll_r == 0)
+        return 0;
+    lwt_io_dispatch_events(io_shard, epoll_events, epoll_r);
+    return lwt_run_queue_pop(&phys_thread->run_queue);
+}
+
+/// Called by idle executors that took the poller role of their I/O shard instead of sleeping on the futex. Blocks
+/// in epoll_wait() until a file descriptor or timer of the shard is ready, a fiber is enqueued or the timeout passes.
+/// Returns the next fiber to run or 0 if no fiber became ready.
+static exec_blocked_fiber_t* lwt_scheduler_exec_block_wait_io(lwt_physical_thread_t* phys_thread, lwt_io_shard_t* io_shard, uint32_t exec_blocked_futex_v, struct timespec* timeout) {
+    for (;;) {
+        uint32_t n_polling_v = shared_fiber_mem.n_polling_executors;
+        if (atomic_cas_uint32(&shared_fiber_mem.n_polling_executors, n_polling_v, n_polling_v + 1))
+            break;
+    }
+    // Like the futex wait this must not miss a fiber that was enqueued after the futex was read. Enqueue increments
+    // the futex before it checks for polling executors, so either it sees this executor or the futex has changed.
+    struct epoll_event epoll_events[64];
+    int epoll_r = 0;
+    if (shared_fiber_mem.exec_block_futex == exec_blocked_futex_v) {
+        int timeout_ms = (timeout != 0? timeout->tv_sec * 1000 + timeout->tv_nsec / 1000000: -1);
+        epoll_r = epoll_wait(io_shard->epoll_fd, epoll_events, LENGTHOF(epoll_events), timeout_ms);
+    }
+    for (;;) {
+        uint32_t n_polling_v = shared_fiber_mem.n_polling_executors;
+        if (atomic_cas_uint32(&shared_fiber_mem.n_polling_executors, n_polling_v, n_polling_v - 1))
+            break;
+    }
+    io_shard->n_executor_polls++;
+    if (epoll_r == -1) {
+        if (errno == EINTR)
+            return 0;
+        RCD_SYSCALL_EXCEPTION(epoll_wait, exception_fatal);
+    }
+    if (epoll_r == 0)
+        return 0;
+    lwt_io_dispatch_events(io_shard, epoll_events, epoll_r);
+    return lwt_run_queue_pop(&phys_thread->run_queue);
+}
+
 static void lwt_io_block(int fd, lwt_fd_event_t event, bool is_epoll) {
     LWT_GET_LOCAL_FIBER(fiber);
     lwt_cancellation_point_raw(fiber);
     lwt_blocking_fd_t* blocking_fd;
     bool event_already_ready = false;
     bool epoll_ctrl_add_needed = false;
+    lwt_fd_type_t fd_type = lwt_fd_type_unknown;
     const fstr_t* err_msg = 0;
-    LWT_SYS_SPINLOCK_WLOCK(&shared_bfd_mem.rwlock); {
-        hmap_bfd_lookup_t blu = hmap_bfd_lookup(&shared_bfd_mem.blocking_fd_map, fd, true);
+    lwt_io_shard_t* io_shard = lwt_io_get_shard(fd);
+    LWT_SYS_SPINLOCK_WLOCK(&io_shard->rwlock); {
+        hmap_bfd_lookup_t blu = hmap_bfd_lookup(&io_shard->blocking_fd_map, fd, true);
         if (!hmap_bfd_found(blu)) {
             blocking_fd = lwt_blocking_fd_allocate();
             blocking_fd->read_ready = false;
@@ -1756,7 +4156,8 @@ static void lwt_io_block(int fd, lwt_fd_event_t event, bool is_epoll) {
             blocking_fd->write_ready = false;
             blocking_fd->write_fiber = (event == lwt_fd_event_write? fiber: 0);
             blocking_fd->is_epoll = is_epoll;
-            hmap_bfd_insert(&shared_bfd_mem.blocking_fd_map, blu, fd, blocking_fd);
+            blocking_fd->fd_type = lwt_fd_type_unknown;
+            hmap_bfd_insert(&io_shard->blocking_fd_map, blu, fd, blocking_fd);
             epoll_ctrl_add_needed = true;
         } else {
             blocking_fd = hmap_bfd_value(blu);
@@ -1788,24 +4189,34 @@ static void lwt_io_block(int fd, lwt_fd_event_t event, bool is_epoll) {
         }
         // Prevents race (defer bounces if edge level event is triggered before it).
         fiber->ctrl.done = false;
-    } LWT_SYS_SPINLOCK_UNLOCK(&shared_bfd_mem.rwlock);
+        fd_type = blocking_fd->fd_type;
+    } LWT_SYS_SPINLOCK_UNLOCK(&io_shard->rwlock);
     if (err_msg != 0)
         throw(*err_msg, exception_io);
     if (epoll_ctrl_add_needed) {
         struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.fd = fd};
-        int epoll_ctl_r = epoll_ctl(lwt_shared_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        int epoll_ctl_r = epoll_ctl(io_shard->epoll_fd, EPOLL_CTL_ADD, fd, &event);
         if (epoll_ctl_r == -1)
             RCD_SYSCALL_EXCEPTION(epoll_ctl, exception_io);
         // DBG("[io/", i2fs(fd), "]: EPOLL_CTL_ADD");
     }
     if (event_already_ready)
         return;
+    if (lwt_metrics_enabled) {
+        // The fd is classified once when it starts being tracked, the type is stored below.
+        if (fd_type == lwt_fd_type_unknown)
+            fd_type = lwt_metrics_fd_type(fd, is_epoll);
+        lwt_metrics_shard_t* metrics = lwt_metrics_local();
+        if (metrics != 0)
+            metrics->io_waits[fd_type]++;
+    }
     // DBG("[io/", i2fs(fd), "]: fiber deferred");
     lwt_scheduler_fiber_defer(false, 0, 0, fd);
     // If we're still attached to the blocking fd we detach now. If we woke up
     // due to an I/O event the I/O thread should have detached us already but
     // we might also have woken up due to cancellation.
-    LWT_SYS_SPINLOCK_WLOCK(&shared_bfd_mem.rwlock); {
+    LWT_SYS_SPINLOCK_WLOCK(&io_shard->rwlock); {
+        blocking_fd->fd_type = fd_type;
         if (event == lwt_fd_event_read) {
             if (blocking_fd->read_fiber == fiber)
                 blocking_fd->read_fiber = 0;
@@ -1813,29 +4224,230 @@ static void lwt_io_block(int fd, lwt_fd_event_t event, bool is_epoll) {
             if (blocking_fd->write_fiber == fiber)
                 blocking_fd->write_fiber = 0;
         }
-    } LWT_SYS_SPINLOCK_UNLOCK(&shared_bfd_mem.rwlock);
-    lwt_cancellation_point_raw(fiber);
+    } LWT_SYS_SPINLOCK_UNLOCK(&io_shard->rwlock);
+    lwt_cancellation_point_raw(fiber);
+}
+
+
+void lwt_block_until_edge_level_io_event(int fd, lwt_fd_event_t event) {
+    return lwt_io_block(fd, event, false);
+}
+
+void lwt_block_until_epoll_ready(int fd, lwt_fd_event_t event) {
+    return lwt_io_block(fd, event, true);
+}
+
+void lwt_io_free_fd_tracking(int fd) {
+    lwt_io_shard_t* io_shard = lwt_io_get_shard(fd);
+    LWT_SYS_SPINLOCK_WLOCK(&io_shard->rwlock); {
+        hmap_bfd_lookup_t blu = hmap_bfd_lookup(&io_shard->blocking_fd_map, fd, true);
+        if (hmap_bfd_found(blu)) {
+            lwt_blocking_fd_t* blocking_fd = hmap_bfd_value(blu);
+            hmap_bfd_delete(&io_shard->blocking_fd_map, blu);
+            lwt_blocking_fd_free(blocking_fd);
+        }
+    } LWT_SYS_SPINLOCK_UNLOCK(&io_shard->rwlock);
+    // DBG("[io/", i2fs(fd), "]: tracking free'd");
+}
+
+/// Sets up the io_uring instance and maps its rings. Returns false if the kernel does not support io_uring,
+/// lacks a feature we require or refuses to create the ring in which case the default engine is used.
+static bool lwt_uring_init() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int32_t ring_fd = io_uring_setup(0x100, &params);
+    if (ring_fd == -1)
+        return false;
+    // Reading and writing at the current file position requires IORING_FEAT_RW_CUR_POS. Since all fibers park on the
+    // completion queue we also require that the kernel never drops completions when it overflows.
+    const uint32_t required_features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS;
+    if ((params.features & required_features) != required_features) {
+        close(ring_fd);
+        return false;
+    }
+    size_t sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = MAX(sq_ring_size, cq_ring_size);
+    void* ring_ptr = mmap(0, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring_ptr == MAP_FAILED) {
+        close(ring_fd);
+        return false;
+    }
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes_ptr = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED) {
+        munmap(ring_ptr, ring_size);
+        close(ring_fd);
+        return false;
+    }
+    lwt_uring.ring_fd = ring_fd;
+    lwt_uring.sq_head = ring_ptr + params.sq_off.head;
+    lwt_uring.sq_tail = ring_ptr + params.sq_off.tail;
+    lwt_uring.sq_mask = *((uint32_t*) (ring_ptr + params.sq_off.ring_mask));
+    lwt_uring.sq_entries = *((uint32_t*) (ring_ptr + params.sq_off.ring_entries));
+    lwt_uring.sq_array = ring_ptr + params.sq_off.array;
+    lwt_uring.sqes = sqes_ptr;
+    lwt_uring.cq_head = ring_ptr + params.cq_off.head;
+    lwt_uring.cq_tail = ring_ptr + params.cq_off.tail;
+    lwt_uring.cq_mask = *((uint32_t*) (ring_ptr + params.cq_off.ring_mask));
+    lwt_uring.cqes = ring_ptr + params.cq_off.cqes;
+    lwt_uring.started = true;
+    return true;
+}
+
+/// Waits for completions and wakes up the fibers that own them. All completions that are available are
+/// consumed in a batch under a single scheduler lock.
+static void lwt_uring_completion_thread(void* arg_ptr) {
+    // Rename the system fiber.
+    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+    phys_thread->system_fiber.main_name = "[librcd io_uring fiber]";
+    lwt_trace_ring_init(phys_thread);
+    for (;;) {
+        int32_t enter_r = io_uring_enter(lwt_uring.ring_fd, 0, 1, IORING_ENTER_GETEVENTS, 0);
+        if (enter_r == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            RCD_SYSCALL_EXCEPTION(io_uring_enter, exception_fatal);
+        uint32_t cq_head = *lwt_uring.cq_head;
+        uint32_t cq_tail = *lwt_uring.cq_tail;
+        // The completion entries must not be read before the tail.
+        sync_synchronize();
+        if (cq_head == cq_tail)
+            continue;
+        LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+            for (; cq_head != cq_tail; cq_head++) {
+                struct io_uring_cqe* cqe = &lwt_uring.cqes[cq_head & lwt_uring.cq_mask];
+                lwt_uring_req_t* req = (void*) cqe->user_data;
+                // Cancel requests have no owner.
+                if (req == 0)
+                    continue;
+                req->res = cqe->res;
+                req->complete = true;
+                lwt_scheduler_fiber_wake_done_raw(req->fiber);
+            }
+        } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+        // The kernel may reuse the completion entries after this.
+        sync_synchronize();
+        *lwt_uring.cq_head = cq_head;
+    }
+}
+
+/// Copies an entry to the submission queue and submits it to the kernel.
+static void lwt_uring_submit(const struct io_uring_sqe* sqe) {
+    for (uint32_t n_spins = 0;; n_spins = atomic_spin_yield(n_spins)) {
+        bool queued = false;
+        atomic_spinlock_lock(&lwt_uring.sq_lock);
+        uint32_t sq_tail = *lwt_uring.sq_tail;
+        if (sq_tail - *lwt_uring.sq_head < lwt_uring.sq_entries) {
+            uint32_t index = sq_tail & lwt_uring.sq_mask;
+            lwt_uring.sqes[index] = *sqe;
+            lwt_uring.sq_array[index] = index;
+            // The entry must be visible to the kernel before the tail is.
+            sync_synchronize();
+            *lwt_uring.sq_tail = sq_tail + 1;
+            queued = true;
+        }
+        atomic_spinlock_unlock(&lwt_uring.sq_lock);
+        if (queued)
+            break;
+    }
+    // The kernel consumes entries in order so a concurrent submitter may end up submitting our entry
+    // and we submit theirs. That is harmless.
+    for (;;) {
+        int32_t enter_r = io_uring_enter(lwt_uring.ring_fd, 1, 0, 0, 0);
+        if (enter_r != -1)
+            break;
+        if (errno == EAGAIN || errno == EBUSY) {
+            sched_yield();
+        } else if (errno != EINTR) {
+            RCD_SYSCALL_EXCEPTION(io_uring_enter, exception_fatal);
+        }
+    }
+}
+
+/// Submits an operation and defers the fiber until it completes. Returns the result of the operation which
+/// is a negative errno on failure. When the fiber is canceled the operation is canceled as well but we must
+/// still wait for it to complete as the kernel owns the request and buffers until then.
+static int32_t lwt_uring_call(struct io_uring_sqe* sqe) {
+    LWT_GET_LOCAL_FIBER(fiber);
+    lwt_cancellation_point_raw(fiber);
+    lwt_uring_req_t req = {.fiber = fiber, .res = 0, .complete = false};
+    sqe->user_data = (uint64_t) &req;
+    // Prevents race (defer bounces if the operation completes before it).
+    fiber->ctrl.done = false;
+    lwt_uring_submit(sqe);
+    lwt_scheduler_fiber_defer(false, 0, 0, sqe->fd);
+    bool complete;
+    LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+        complete = req.complete;
+    } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+    if (!complete) {
+        // We woke up due to cancellation.
+        struct io_uring_sqe cancel_sqe = {.opcode = IORING_OP_ASYNC_CANCEL, .fd = -1, .addr = (uint64_t) &req};
+        lwt_uring_submit(&cancel_sqe);
+        bool prev_unintr = fiber->ctrl.unintr;
+        fiber->ctrl.unintr = true;
+        for (;;) {
+            LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+                complete = req.complete;
+                if (!complete)
+                    fiber->ctrl.done = false;
+            } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+            if (complete)
+                break;
+            lwt_scheduler_fiber_defer(false, 0, 0, sqe->fd);
+        }
+        fiber->ctrl.unintr = prev_unintr;
+        lwt_cancellation_point_raw(fiber);
+    }
+    return req.res;
 }
 
+/// Converts an io_uring result to the syscall convention.
+static ssize_t lwt_uring_result(int32_t res) {
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
 
-void lwt_block_until_edge_level_io_event(int fd, lwt_fd_event_t event) {
-    return lwt_io_block(fd, event, false);
+bool lwt_uring_is_enabled() {
+    return lwt_uring.enabled;
 }
 
-void lwt_block_until_epoll_ready(int fd, lwt_fd_event_t event) {
-    return lwt_io_block(fd, event, true);
+bool lwt_uring_set_enabled(bool enabled) {
+    bool was_enabled = lwt_uring.enabled;
+    if (enabled && !lwt_uring.started) {
+        if (!lwt_uring_init())
+            return was_enabled;
+        lwt_start_cb_t uring_start_cb = {.start_fn = lwt_uring_completion_thread, .arg_ptr = 0};
+        lwt_start_physical_thread(uring_start_cb);
+    }
+    lwt_uring.enabled = enabled;
+    return was_enabled;
 }
 
-void lwt_io_free_fd_tracking(int fd) {
-    LWT_SYS_SPINLOCK_WLOCK(&shared_bfd_mem.rwlock); {
-        hmap_bfd_lookup_t blu = hmap_bfd_lookup(&shared_bfd_mem.blocking_fd_map, fd, true);
-        if (hmap_bfd_found(blu)) {
-            lwt_blocking_fd_t* blocking_fd = hmap_bfd_value(blu);
-            hmap_bfd_delete(&shared_bfd_mem.blocking_fd_map, blu);
-            lwt_blocking_fd_free(blocking_fd);
-        }
-    } LWT_SYS_SPINLOCK_UNLOCK(&shared_bfd_mem.rwlock);
-    // DBG("[io/", i2fs(fd), "]: tracking free'd");
+ssize_t lwt_uring_pread(int32_t fd, void* buf, size_t count, int64_t offset) {
+    struct io_uring_sqe sqe = {.opcode = IORING_OP_READ, .fd = fd, .off = (uint64_t) offset, .addr = (uint64_t) buf, .len = MIN(count, INT32_MAX)};
+    return lwt_uring_result(lwt_uring_call(&sqe));
+}
+
+ssize_t lwt_uring_pwrite(int32_t fd, const void* buf, size_t count, int64_t offset) {
+    struct io_uring_sqe sqe = {.opcode = IORING_OP_WRITE, .fd = fd, .off = (uint64_t) offset, .addr = (uint64_t) buf, .len = MIN(count, INT32_MAX)};
+    return lwt_uring_result(lwt_uring_call(&sqe));
+}
+
+ssize_t lwt_uring_read(int32_t fd, void* buf, size_t count) {
+    // Offset -1 reads at (and advances) the current file position.
+    return lwt_uring_pread(fd, buf, count, -1);
+}
+
+ssize_t lwt_uring_write(int32_t fd, const void* buf, size_t count) {
+    return lwt_uring_pwrite(fd, buf, count, -1);
+}
+
+int32_t lwt_uring_fsync(int32_t fd) {
+    struct io_uring_sqe sqe = {.opcode = IORING_OP_FSYNC, .fd = fd};
+    return lwt_uring_result(lwt_uring_call(&sqe));
 }
 
 fiber_main lwt_program_main(fiber_main_attr, list(fstr_t)* main_args, list(fstr_t)* main_env) {
@@ -1855,6 +4467,9 @@ int32_t lwt_init_process(int argc, char** argv, char** env) {
     throw("this librcd program cannot run as an init process", exception_fatal);
 }
 
+__attribute__((weak))
+void lwt_configure(lwt_config_t* config) {}
+
 static void lwt_init_program_cmdline_mem(int argc, char** argv, char** env) {
     // We know that the arguments and environments is allocated in one single contiguous chunk from arg 0 to the last environment variable.
     void* arg_mem_start = (void*) argv[0];
@@ -1881,9 +4496,6 @@ void __lwthreads_main(int argc, char** argv, char** env) {
     phys_thread->linux_tid = gettid();
     lwt_setup_physical_thread();
     phys_thread->system_rwspinlock = 0;
-    // Initialize shared data structure trees.
-    hmap_fid_init(&shared_fiber_mem.fiber_map);
-    hmap_bfd_init(&shared_bfd_mem.blocking_fd_map);
     // Initialize global program path.
     global_heap {
         lwt_program_path = fstr_from_cstr(argv[0]);
@@ -1895,11 +4507,45 @@ void __lwthreads_main(int argc, char** argv, char** env) {
     // We branch of from normal execution here if librcd is running as init.
     if (phys_thread->pid == 1)
         exit_group(lwt_init_process(argc, argv, env));
-    // Creating main epoll file descriptor that schedules all asynchronous I/O.
-    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-    if (epoll_fd == -1)
-        RCD_SYSCALL_EXCEPTION(epoll_create1, exception_fatal);
-    lwt_shared_epoll_fd = epoll_fd;
+    // Let the program tune the runtime configuration.
+    lwt_configure(&lwt_config);
+    lwt_preemption_slice_us = lwt_config.preemption_slice_us;
+    lwt_executor_spin_us = lwt_config.executor_spin_us;
+    lwt_trace.enabled = (lwt_config.trace_ring_events > 0);
+    lwt_metrics_enabled = lwt_config.metrics;
+    lwt_hot_splits.enabled = lwt_config.hot_split_tracking;
+    vm_set_huge_pages(lwt_config.vm_huge_pages);
+    // Trace timestamps are relative to startup and ticks are converted to time by comparing with the monotonic clock.
+    if (lwt_config.trace_ring_events > 0 || lwt_config.metrics) {
+        lwt_tsc_epoch.tsc0 = lwt_rdtsc();
+        lwt_tsc_epoch.ns0 = lwt_timer_now_ns();
+    }
+    // Discover where executors should be pinned before the first one is started.
+    if (lwt_config.executor_affinity)
+        lwt_cpu_topology_init();
+    // Creating the epoll file descriptors that schedules all asynchronous I/O, one per I/O shard.
+    lwt_io_shard_count = lwt_config.io_shard_count;
+    if (lwt_io_shard_count == 0)
+        lwt_io_shard_count = MAX((lwt_system_cpu_count() + 3) / 4, 1);
+    global_heap {
+        lwt_io_shards = lwt_alloc_new(sizeof(lwt_io_shard_t) * lwt_io_shard_count);
+    }
+    for (uint32_t i = 0; i < lwt_io_shard_count; i++) {
+        lwt_io_shard_t* io_shard = &lwt_io_shards[i];
+        io_shard->rwlock = 0;
+        hmap_bfd_init(&io_shard->blocking_fd_map);
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1)
+            RCD_SYSCALL_EXCEPTION(epoll_create1, exception_fatal);
+        io_shard->epoll_fd = epoll_fd;
+        lwt_timer_wheel_init(&io_shard->timer_wheel, epoll_fd);
+        io_shard->wake_fd = eventfd2(0, EFD_NONBLOCK);
+        if (io_shard->wake_fd == -1)
+            RCD_SYSCALL_EXCEPTION(eventfd2, exception_fatal);
+        struct epoll_event wake_event = {.events = EPOLLIN | EPOLLET, .data.fd = io_shard->wake_fd};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, io_shard->wake_fd, &wake_event) == -1)
+            RCD_SYSCALL_EXCEPTION(epoll_ctl, exception_fatal);
+    }
     // Create janitor thread for vm.
     lwt_physical_thread_t* janitor_phys_thread;
     {
@@ -1907,6 +4553,19 @@ void __lwthreads_main(int argc, char** argv, char** env) {
         janitor_phys_thread = lwt_start_physical_thread(janitor_start_cb);
         vm_janitor_notify_ptid(janitor_phys_thread->pid);
     }
+    // Start the system monitor that adds spare executors when executors are blocked.
+    if (lwt_config.elastic_executors)
+        lwt_sysmon_start(lwt_config.max_spare_executors);
+    // Start the thread that writes the profile on demand.
+    if (lwt_config.profiler_interval_us > 0) {
+        lwt_start_cb_t profiler_start_cb = {.start_fn = lwt_profiler_dump_thread, .arg_ptr = 0};
+        lwt_start_physical_thread(profiler_start_cb);
+    }
+    // Blocker threads are started on demand.
+    lwt_blocker_pool.max_threads = (lwt_config.blocker_thread_count > 0? lwt_config.blocker_thread_count: LWT_BLOCKER_THREAD_COUNT_DEFAULT);
+    // Set up the io_uring engine and its completion thread if requested.
+    if (lwt_config.io_uring)
+        lwt_uring_set_enabled(true);
     // Initialize stdio compatibility.
     stdio_init();
 #ifdef RCD_SELF_TEST
@@ -1927,12 +4586,18 @@ void __lwthreads_main(int argc, char** argv, char** env) {
             list_push_end(main_env, fstr_t, fss(fstr_from_cstr(env[i])));
         spawn_static_fiber(lwt_program_main("[main]", main_args, main_env));
     }
-    // We use the main thread as the i/o monitoring thread.
-    return lwt_io_monitor_thread(0);
+    // Start monitor threads for all I/O shards except the first one.
+    for (uint32_t i = 1; i < lwt_io_shard_count; i++) {
+        lwt_start_cb_t io_monitor_start_cb = {.start_fn = lwt_io_monitor_thread, .arg_ptr = &lwt_io_shards[i]};
+        lwt_start_physical_thread(io_monitor_start_cb);
+    }
+    // We use the main thread as the i/o monitoring thread for the first shard.
+    return lwt_io_monitor_thread(&lwt_io_shards[0]);
 }
 
 void lwt_cancellation_point() {
     LWT_GET_LOCAL_FIBER(fiber);
+    lwt_preemption_point_raw(fiber);
     lwt_cancellation_point_raw(fiber);
 }
 
@@ -1978,7 +4643,7 @@ void __rcd_escape_gh_txn(lwt_heap_t** __rcd_global_heap_tail) {
         // Append the tail to the global heap.
         LWT_SYS_SPINLOCK_WLOCK(&lwt_global_heap.rwlock); {
             // We could specify a sub heap to explicitly require global_heap_tail to be a member of here, but since the call to this function is auto generated we don't really have to.
-            vm_heap_import(0, lwt_global_heap.heap, *__rcd_global_heap_tail);
+            vm_heap_import(0, lwt_global_heap.heap, *__rcd_global_heap_tail, 0);
         } LWT_SYS_SPINLOCK_UNLOCK(&lwt_global_heap.rwlock);
     }
 }
@@ -1990,6 +4655,13 @@ void __lwt_fiber_stack_push_sub_heap() {
     lwt_fiber_event_push(fiber, lwt_fiber_event_sub_heap, edata);
 }
 
+void __lwt_fiber_stack_push_arena_heap() {
+    LWT_GET_LOCAL_FIBER(fiber);
+    fiber->current_heap = vm_heap_create_arena(fiber->current_heap);
+    lwt_fiber_event_data_t edata;
+    lwt_fiber_event_push(fiber, lwt_fiber_event_sub_heap, edata);
+}
+
 void __lwt_fiber_stack_pop_sub_heap(void* arg_ptr) {
     LWT_GET_LOCAL_FIBER(fiber);
     lwt_fiber_event_pop(fiber, lwt_fiber_event_sub_heap);
@@ -2014,19 +4686,8 @@ rcd_fid_t __lwt_fiber_stack_push_mitosis() {
     LWT_GET_LOCAL_FIBER(fiber);
     // Create the new inactive fiber and index it.
     vm_heap_t* new_heap = vm_heap_create(0);
-    lwt_fiber_t* new_fiber = lwt_fiber_allocate();
-    register rcd_fid_t new_fiber_id;
-    {
-        static rcd_fid_t fiber_id_counter = LWT_INIT_FIBER_ID + 1;
-        for (;;) {
-            sync_synchronize();
-            new_fiber_id = fiber_id_counter;
-            register rcd_fid_t new_fiber_id_counter = new_fiber_id + 1;
-            if (atomic_cas_uint128(&fiber_id_counter, new_fiber_id, new_fiber_id_counter))
-                break;
-        }
-    }
-    new_fiber->ctrl.id = new_fiber_id;
+    lwt_fiber_t* new_fiber = lwt_fiber_reuse();
+    new_fiber->ctrl.id = 0;
     new_fiber->ctrl.canceled = 0;
     new_fiber->ctrl.hidden_cancel = false;
     new_fiber->ctrl.done = false;
@@ -2035,16 +4696,22 @@ rcd_fid_t __lwt_fiber_stack_push_mitosis() {
     new_fiber->ctrl.deferred = false;
     new_fiber->ctrl.started = false;
     new_fiber->main_name = "[librcd fiber in mitosis]";
+    // System fibers have no class, fibers they spawn are normal.
+    new_fiber->fiber_class = (fiber->fiber_class != lwt_fiber_class_inherit? fiber->fiber_class: lwt_fiber_class_normal);
     new_fiber->instance_name = "";
     new_fiber->stack_alloc_stack = 0;
     new_fiber->current_stacklet = 0;
+    new_fiber->peak_stack_depth = 0;
+    new_fiber->enqueue_tsc = 0;
     new_fiber->current_heap = new_heap;
     rbtree_init(&new_fiber->ifc_fn_queues, lwt_cmp_ifc_fn_queues);
     new_fiber->defer_wait_fid = 0;
     new_fiber->defer_wait_fd = -1;
+    new_fiber->join_timeout_ns = 0;
+    rcd_fid_t new_fiber_id;
     LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
-        hmap_fid_lookup_t lu = hmap_fid_lookup(&shared_fiber_mem.fiber_map, new_fiber_id, false);
-        hmap_fid_insert(&shared_fiber_mem.fiber_map, lu, new_fiber_id, new_fiber);
+        new_fiber_id = lwt_fid_table_insert(new_fiber);
+        new_fiber->ctrl.id = new_fiber_id;
         DL_APPEND(shared_fiber_mem.fiber_list, new_fiber);
     } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
     // Push mitosis fiber event unto the event stack.
@@ -2065,15 +4732,21 @@ rcd_fid_t __lwt_fiber_stack_pop_mitosis(void (*start_fn)(void *), void* arg_ptr,
     lwt_fiber_t* new_fiber = edata.mitosis->new_fiber;
     rcd_fid_t new_fiber_id = new_fiber->ctrl.id;
     new_fiber->main_name = fiber_options->name;
-    new_fiber->est_stack_size = fiber_options->est_stack_size;
+    new_fiber->est_stack_size = MAX(fiber_options->est_stack_size, lwt_stack_learn_get(fiber_options->name));
+    if (fiber_options->fiber_class != lwt_fiber_class_inherit)
+        new_fiber->fiber_class = fiber_options->fiber_class;
     new_fiber->instance_name = fiber_name;
+    lwt_trace_event(lwt_trace_event_spawn, new_fiber_id, fiber->ctrl.id, new_fiber->main_name.str, new_fiber->main_name.len);
+    lwt_metrics_shard_t* metrics = lwt_metrics_local();
+    if (metrics != 0)
+        metrics->fibers_spawned++;
     // While the fiber is not started we steal this fields to store the start_fn and arg_ptr.
     new_fiber->event_stack = (void*) start_fn;
     new_fiber->current_ifc_join_event = (void*) arg_ptr;
     // Enqueue the new fiber as execution blocking, so pending physical thread can start working on it asap.
     // DBG("[lwt] inserting fiber: #", DBG_PTR(new_fiber->ctrl->id));
     LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
-        lwt_scheduler_exec_block_enqueue(new_fiber);
+        lwt_scheduler_exec_block_enqueue(new_fiber, true);
     } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
     // Pop the mitosis event from the event heap.
     fiber->current_heap = edata.mitosis->post_mitosis_heap;
@@ -2092,8 +4765,8 @@ void __lwt_fiber_stack_pop_mitosis_and_abort(uint8_t* _rcd_mitosis_used) {
     __lwt_fiber_stack_pop_mitosis(lwt_zombie_fiber_main, 0, "[librcd zombie fiber]", &fiber_options);
 }
 
-static lwt_ifc_fn_queue_t* ref_ifc_fn_queue(lwt_fiber_t* server_fiber, void* ifc_fn_ptr) {
-    assert(ATOMIC_RWLOCK_IS_WLOCKED(shared_fiber_mem.rwlock));
+static lwt_ifc_fn_queue_t* ref_ifc_fn_queue(lwt_fiber_t* server_fiber, void* ifc_fn_ptr, rwspinlock_t* ifc_lock) {
+    assert(ATOMIC_RWLOCK_IS_WLOCKED(*ifc_lock));
     lwt_ifc_fn_queue_t* ifc_fn_queue = RBTREE_LOOKUP_KEY(lwt_ifc_fn_queue_t, rb_node, &server_fiber->ifc_fn_queues, .fn_ptr = ifc_fn_ptr);
     if (ifc_fn_queue == 0) {
         ifc_fn_queue = lwt_ifc_fn_queue_allocate();
@@ -2104,13 +4777,14 @@ static lwt_ifc_fn_queue_t* ref_ifc_fn_queue(lwt_fiber_t* server_fiber, void* ifc
         ifc_fn_queue->server_fiber = server_fiber;
         ifc_fn_queue->waiting_clients.first = 0;
         ifc_fn_queue->waiting_clients.last = 0;
+        ifc_fn_queue->ifc_lock = ifc_lock;
         rbtree_insert(&ifc_fn_queue->rb_node, &server_fiber->ifc_fn_queues);
     }
     return ifc_fn_queue;
 }
 
 static void deref_ifc_fn_queue(lwt_ifc_fn_queue_t* ifc_fn_queue) {
-    assert(ATOMIC_RWLOCK_IS_WLOCKED(shared_fiber_mem.rwlock));
+    assert(ATOMIC_RWLOCK_IS_WLOCKED(*ifc_fn_queue->ifc_lock));
     if (ifc_fn_queue->ifc_server_ref_count == 0 && ifc_fn_queue->waiting_clients.first == 0) {
         if (ifc_fn_queue->server_fiber != 0)
             rbtree_remove(&ifc_fn_queue->rb_node, &ifc_fn_queue->server_fiber->ifc_fn_queues);
@@ -2123,7 +4797,7 @@ static lwt_ifc_client_t* lwt_ifc_dequeue_waiting_client(lwt_ifc_fn_queue_t* ifc_
 }
 
 static lwt_ifc_fn_queue_t* lwt_ifc_get_next_waiting_client_queue(lwt_ifc_fn_queue_t** ifc_fn_queues, size_t n_ifc_fn_queues) {
-    assert(ATOMIC_RWLOCK_IS_WLOCKED(shared_fiber_mem.rwlock));
+    assert(n_ifc_fn_queues == 0 || ATOMIC_RWLOCK_IS_WLOCKED(*ifc_fn_queues[0]->ifc_lock));
     // Find the next waiting client (with the lowest call id = has waited the longest).
     lwt_ifc_client_t* next_waiting_client;
     lwt_ifc_fn_queue_t* next_ifc_fn_queue = 0;
@@ -2138,6 +4812,66 @@ static lwt_ifc_fn_queue_t* lwt_ifc_get_next_waiting_client_queue(lwt_ifc_fn_queu
     return next_ifc_fn_queue;
 }
 
+/// Attaches the next waiting client(s) to the server or, if there are none, starts listening for future clients.
+/// Called by the server every time it (re-)accepts and by the last client to unjoin an auto re-accepting server.
+static void lwt_ifc_server_reaccept_raw(lwt_ifc_server_t* ifc_server) {
+    assert(ATOMIC_RWLOCK_IS_WLOCKED(*ifc_server->ifc_lock));
+    lwt_ifc_fn_queue_t* waiting_client_queue = lwt_ifc_get_next_waiting_client_queue(ifc_server->fn_queues, ifc_server->n_fn_queues);
+    if (waiting_client_queue != 0) {
+        // Found client, attach and wake it.
+        lwt_ifc_client_t* waiting_client = lwt_ifc_dequeue_waiting_client(waiting_client_queue);
+        waiting_client->server_state = ifc_server->accept_state;
+        waiting_client->ifc_server = ifc_server;
+        lwt_scheduler_fiber_wake_done(waiting_client->fiber);
+        DL_PREPEND(ifc_server->running_clients, waiting_client);
+        if (waiting_client->call_type == RCD_IFC_CALL_SHARED) {
+            // If we accept a shared join we can join with all other shared clients that are next in line.
+            for (;;) {
+                lwt_ifc_fn_queue_t* waiting_client_queue = lwt_ifc_get_next_waiting_client_queue(ifc_server->fn_queues, ifc_server->n_fn_queues);
+                if (waiting_client_queue == 0) {
+                    // Listen for future shared client calls.
+                    ifc_server->server_state = ifc_server->accept_state;
+                    ifc_server->read_locked_state = true;
+                    goto reconnect_ifc_server_references;
+                }
+                lwt_ifc_client_t* waiting_client = waiting_client_queue->waiting_clients.first;
+                if (waiting_client->call_type != RCD_IFC_CALL_SHARED) {
+                    // Throw away the server state to prevent the next locked join from being starved.
+                    ifc_server->server_state = 0;
+                    break;
+                }
+                lwt_ifc_dequeue_waiting_client(waiting_client_queue);
+                waiting_client->server_state = ifc_server->accept_state;
+                waiting_client->ifc_server = ifc_server;
+                lwt_scheduler_fiber_wake_done(waiting_client->fiber);
+                DL_PREPEND(ifc_server->running_clients, waiting_client);
+            }
+        } else {
+            // We're locked joining - don't share the server state.
+            ifc_server->server_state = 0;
+        }
+    } else {
+        // Listen for any future client calls.
+        ifc_server->server_state = ifc_server->accept_state;
+        ifc_server->read_locked_state = false;
+        reconnect_ifc_server_references: {
+            // Re-connect all ifc server references so clients can find us.
+            for (size_t i = 0; i < ifc_server->n_fn_queues; i++) {
+                lwt_ifc_fn_queue_t* ifc_fn_queue = ifc_server->fn_queues[i];
+                lwt_ifc_server_ref_t** new_head = (ifc_server->read_locked_state? &ifc_fn_queue->sharedish_servers: &ifc_fn_queue->freeish_servers);
+                lwt_ifc_server_ref_t* ifc_server_ref = &ifc_server->server_refs[i];
+                if (ifc_server_ref->head != 0) {
+                    if (ifc_server_ref->head == new_head)
+                        continue;
+                    DL_DELETE(*ifc_server_ref->head, ifc_server_ref);
+                }
+                DL_PREPEND(*new_head, ifc_server_ref);
+                ifc_server_ref->head = new_head;
+            }
+        }
+    }
+}
+
 /// Defers the current fiber by accepting one or more requests for the specified ifc.
 void __lwt_ifc_accept(void** fn_list, size_t n_fn_list, void* server_state, bool is_auto_reaccepting, bool is_server_side_accept) {
     // If not accepting on any functions we return immediately.
@@ -2159,20 +4893,22 @@ void __lwt_ifc_accept(void** fn_list, size_t n_fn_list, void* server_state, bool
     } else {
         accepting_fiber = fiber;
     }
-    // Ref all relevant ifc fn queues.
+    // Ref all relevant ifc fn queues. They are all protected by the ifc lock of the accepting fiber.
+    // The accepting fiber cannot exit while we accept as it's either us or the server we're joined with.
+    rwspinlock_t* ifc_lock = &lwt_fid_table_id_slot(accepting_fiber->ctrl.id)->ifc_lock;
     lwt_ifc_fn_queue_t* ifc_fn_queues[n_fn_list];
     size_t n_final_fns = 0;
-    LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+    LWT_SYS_SPINLOCK_WLOCK(ifc_lock); {
         for (size_t i = 0; i < n_fn_list; i++) {
             void* fn_ptr = fn_list[i];
             if (fn_ptr == 0)
                 continue;
-            lwt_ifc_fn_queue_t* ifc_fn_queue = ref_ifc_fn_queue(accepting_fiber, fn_ptr);
+            lwt_ifc_fn_queue_t* ifc_fn_queue = ref_ifc_fn_queue(accepting_fiber, fn_ptr, ifc_lock);
             ifc_fn_queue->ifc_server_ref_count++;
             ifc_fn_queues[n_final_fns] = ifc_fn_queue;
             n_final_fns++;
         }
-    } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+    } LWT_SYS_SPINLOCK_UNLOCK(ifc_lock);
     // If not accepting on any functions we return immediately.
     if (n_final_fns == 0)
         return;
@@ -2181,72 +4917,26 @@ void __lwt_ifc_accept(void** fn_list, size_t n_fn_list, void* server_state, bool
     ifc_server.fiber = fiber;
     ifc_server.heap = fiber->current_heap;
     ifc_server.running_clients = 0;
+    ifc_server.ifc_lock = ifc_lock;
     lwt_ifc_server_ref_t ifc_server_refs[n_final_fns];
     for (size_t i = 0; i < n_final_fns; i++) {
         ifc_server_refs[i].server = &ifc_server;
         ifc_server_refs[i].head = 0;
     }
+    ifc_server.accept_state = server_state;
+    ifc_server.fn_queues = ifc_fn_queues;
+    ifc_server.server_refs = ifc_server_refs;
+    ifc_server.n_fn_queues = n_final_fns;
+    ifc_server.auto_reaccepting = is_auto_reaccepting;
+    ifc_server.draining = false;
     // Accept clients. The server heap cannot be used beyond this point since
     // the client owns it until it's disconnected.
     do {
-        LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
-            lwt_ifc_fn_queue_t* waiting_client_queue = lwt_ifc_get_next_waiting_client_queue(ifc_fn_queues, n_final_fns);
-            if (waiting_client_queue != 0) {
-                // Found client, attach and wake it.
-                lwt_ifc_client_t* waiting_client = lwt_ifc_dequeue_waiting_client(waiting_client_queue);
-                waiting_client->server_state = server_state;
-                waiting_client->ifc_server = &ifc_server;
-                lwt_scheduler_fiber_wake_done_raw(waiting_client->fiber);
-                DL_PREPEND(ifc_server.running_clients, waiting_client);
-                if (waiting_client->call_type == RCD_IFC_CALL_SHARED) {
-                    // If we accept a shared join we can join with all other shared clients that are next in line.
-                    for (;;) {
-                        lwt_ifc_fn_queue_t* waiting_client_queue = lwt_ifc_get_next_waiting_client_queue(ifc_fn_queues, n_final_fns);
-                        if (waiting_client_queue == 0) {
-                            // Listen for future shared client calls.
-                            ifc_server.server_state = server_state;
-                            ifc_server.read_locked_state = true;
-                            goto reconnect_ifc_server_references;
-                        }
-                        lwt_ifc_client_t* waiting_client = waiting_client_queue->waiting_clients.first;
-                        if (waiting_client->call_type != RCD_IFC_CALL_SHARED) {
-                            // Throw away the server state to prevent the next locked join from being starved.
-                            ifc_server.server_state = 0;
-                            break;
-                        }
-                        lwt_ifc_dequeue_waiting_client(waiting_client_queue);
-                        waiting_client->server_state = server_state;
-                        waiting_client->ifc_server = &ifc_server;
-                        lwt_scheduler_fiber_wake_done_raw(waiting_client->fiber);
-                        DL_PREPEND(ifc_server.running_clients, waiting_client);
-                    }
-                } else {
-                    // We're locked joining - don't share the server state.
-                    ifc_server.server_state = 0;
-                }
-            } else {
-                // Listen for any future client calls.
-                ifc_server.server_state = server_state;
-                ifc_server.read_locked_state = false;
-                reconnect_ifc_server_references: {
-                    // Re-connect all ifc server references so clients can find us.
-                    for (size_t i = 0; i < n_final_fns; i++) {
-                        lwt_ifc_fn_queue_t* ifc_fn_queue = ifc_fn_queues[i];
-                        lwt_ifc_server_ref_t** new_head = (ifc_server.read_locked_state? &ifc_fn_queue->sharedish_servers: &ifc_fn_queue->freeish_servers);
-                        lwt_ifc_server_ref_t* ifc_server_ref = &ifc_server_refs[i];
-                        if (ifc_server_ref->head != 0) {
-                            if (ifc_server_ref->head == new_head)
-                                continue;
-                            DL_DELETE(*ifc_server_ref->head, ifc_server_ref);
-                        }
-                        DL_PREPEND(*new_head, ifc_server_ref);
-                        ifc_server_ref->head = new_head;
-                    }
-                }
-            }
+        LWT_SYS_SPINLOCK_WLOCK(ifc_lock); {
+            lwt_ifc_server_reaccept_raw(&ifc_server);
             // Either waiting for clients to connect or complete at this point.
             fiber->ctrl.done = false;
-        } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+        } LWT_SYS_SPINLOCK_UNLOCK(ifc_lock);
         // Wait for new clients to attach and complete and/or old clients to complete or cancellation.
         lwt_scheduler_fiber_defer(false, &ifc_server, accepting_fiber->ctrl.id, -1);
         if (!fiber->ctrl.unintr && (fiber->ctrl.canceled != 0 || fiber->ctrl.join_race)) {
@@ -2255,33 +4945,36 @@ void __lwt_ifc_accept(void** fn_list, size_t n_fn_list, void* server_state, bool
             bool pending_join_race = false;
             for (;;) {
                 bool got_running_clients = false;
-                LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
-                    // Consume a pending cancellation if we don't already have one.
-                    // The hidden cancel flag ensures that we can get no more cancellations if one is already pending.
-                    if (pending_canceled == 0) {
-                        pending_canceled = fiber->ctrl.canceled;
-                        if (pending_canceled != 0) {
-                            fiber->ctrl.canceled = 0;
-                            fiber->ctrl.hidden_cancel = true;
+                LWT_SYS_SPINLOCK_WLOCK(ifc_lock); {
+                    LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+                        // Consume a pending cancellation if we don't already have one.
+                        // The hidden cancel flag ensures that we can get no more cancellations if one is already pending.
+                        if (pending_canceled == 0) {
+                            pending_canceled = fiber->ctrl.canceled;
+                            if (pending_canceled != 0) {
+                                fiber->ctrl.canceled = 0;
+                                fiber->ctrl.hidden_cancel = true;
+                            }
                         }
-                    }
-                    // Consume any pending join race. Unless we remove the flag we will be woken again.
-                    pending_join_race = pending_join_race || fiber->ctrl.join_race;
-                    fiber->ctrl.join_race = false;
-                    // Stop any listening.
-                    ifc_server.server_state = 0;
-                    // Enable live join race on all running clients to make them abort request processing asap.
-                    got_running_clients = (ifc_server.running_clients != 0);
-                    if (got_running_clients) {
-                        lwt_ifc_client_t* running_client;
-                        DL_FOREACH(ifc_server.running_clients, running_client) {
-                            running_client->live_join_race = true;
-                            lwt_scheduler_fiber_wake_join_race_raw(running_client->fiber);
+                        // Consume any pending join race. Unless we remove the flag we will be woken again.
+                        pending_join_race = pending_join_race || fiber->ctrl.join_race;
+                        fiber->ctrl.join_race = false;
+                        // Stop any listening and make sure unjoining clients wake us up.
+                        ifc_server.server_state = 0;
+                        ifc_server.draining = true;
+                        // Enable live join race on all running clients to make them abort request processing asap.
+                        got_running_clients = (ifc_server.running_clients != 0);
+                        if (got_running_clients) {
+                            lwt_ifc_client_t* running_client;
+                            DL_FOREACH(ifc_server.running_clients, running_client) {
+                                running_client->live_join_race = true;
+                                lwt_scheduler_fiber_wake_join_race_raw(running_client->fiber);
+                            }
+                            // We need to defer afterwards, waiting for all clients to exit.
+                            fiber->ctrl.done = false;
                         }
-                        // We need to defer afterwards, waiting for all clients to exit.
-                        fiber->ctrl.done = false;
-                    }
-                } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+                    } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+                } LWT_SYS_SPINLOCK_UNLOCK(ifc_lock);
                 // No more running clients, we can leave.
                 if (!got_running_clients)
                     break;
@@ -2302,7 +4995,7 @@ void __lwt_ifc_accept(void** fn_list, size_t n_fn_list, void* server_state, bool
         }
     } while (is_auto_reaccepting);
     // Reference cleanup.
-    LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+    LWT_SYS_SPINLOCK_WLOCK(ifc_lock); {
         for (size_t i = 0; i < n_final_fns; i++) {
             // Disconnect ifc server reference if it's referenced.
             lwt_ifc_server_ref_t* ifc_server_ref = &ifc_server_refs[i];
@@ -2313,7 +5006,7 @@ void __lwt_ifc_accept(void** fn_list, size_t n_fn_list, void* server_state, bool
             ifc_fn_queue->ifc_server_ref_count--;
             deref_ifc_fn_queue(ifc_fn_queue);
         }
-    } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+    } LWT_SYS_SPINLOCK_UNLOCK(ifc_lock);
     // Raise any pending cancel here.
     lwt_cancellation_point_raw(fiber);
 }
@@ -2330,33 +5023,97 @@ void* __lwt_fiber_stack_push_ifc_call_join(void* ifc_fn_ptr, rcd_fid_t fiber_id,
     //ifc-dbg// DBG("client ", DBG_PTR(fiber), " is pushing join");
     // This function is a cancellation point so check here to save cycles.
     lwt_cancellation_point_raw(fiber);
+    lwt_trace_event(lwt_trace_event_ifc_call, fiber->ctrl.id, fiber_id, ifc_fn_ptr, 0);
+    lwt_metrics_shard_t* metrics = lwt_metrics_local();
+    if (metrics != 0)
+        lwt_metrics_ifc_join(metrics, ifc_fn_ptr);
     // Ref the ifc queue and check if we can attach to an existing server state immediately.
     lwt_ifc_fn_queue_t* ifc_fn_queue = 0;
     lwt_ifc_client_t* ifc_client = lwt_ifc_client_allocate();
     ifc_client->fiber = fiber;
     ifc_client->live_join_race = false;
     ifc_client->call_type = call_type;
-    LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
-        hmap_fid_lookup_t lu = hmap_fid_lookup(&shared_fiber_mem.fiber_map, fiber_id, true);
-        if (!hmap_fid_found(lu))
-            break;
-        lwt_fiber_t* server_fiber = hmap_fid_value(lu);
-        ifc_fn_queue = ref_ifc_fn_queue(server_fiber, ifc_fn_ptr);
-        if (call_type == RCD_IFC_CALL_SHARED) {
+    // Resolve the server without locking and then lock its ifc queues. The server might have exited and its
+    // slot reused while we where locking so validate that it's still indexed after taking the lock.
+    lwt_fiber_t* server_fiber = lwt_fid_table_lookup(fiber_id);
+    if (server_fiber != 0) {
+        lwt_fid_slot_t* slot = lwt_fid_table_id_slot(fiber_id);
+        LWT_SYS_SPINLOCK_WLOCK(&slot->ifc_lock); {
+            if (lwt_fid_table_lookup(fiber_id) != server_fiber)
+                break;
+            ifc_fn_queue = ref_ifc_fn_queue(server_fiber, ifc_fn_ptr, &slot->ifc_lock);
+            if (call_type == RCD_IFC_CALL_SHARED) {
+                for (;;) {
+                    lwt_ifc_server_ref_t* ifc_server_ref = ifc_fn_queue->sharedish_servers;
+                    if (ifc_server_ref == 0)
+                        break;
+                    lwt_ifc_server_t* ifc_server = ifc_server_ref->server;
+                    void* server_state = ifc_server->server_state;
+                    if (server_state == 0) {
+                        // Disconnect ifc server reference as it's invalid.
+                        assert(ifc_server_ref->head == &ifc_fn_queue->sharedish_servers);
+                        DL_DELETE(ifc_fn_queue->sharedish_servers, ifc_server_ref);
+                        ifc_server_ref->head = 0;
+                    } else {
+                        if (!ifc_server->read_locked_state)
+                            lwt_ifc_trigger_free_sharedish_error();
+                        // Use the server state.
+                        ifc_client->server_state = server_state;
+                        ifc_client->ifc_server = ifc_server;
+                        DL_APPEND(ifc_server->running_clients, ifc_client);
+                        goto client_aquired_server_state;
+                    }
+                }
+            }
             for (;;) {
-                lwt_ifc_server_ref_t* ifc_server_ref = ifc_fn_queue->sharedish_servers;
-                if (ifc_server_ref == 0)
+                lwt_ifc_server_ref_t* ifc_server_ref = ifc_fn_queue->freeish_servers;
+                if (ifc_server_ref == 0) {
+                    if (call_type == RCD_IFC_CALL_LOCK_SERVER) {
+                        // Find one legitimate shared server and stop it from accepting more shared clients to prevent starvation.
+                        for (bool starvation_possible = true; starvation_possible;) {
+                            lwt_ifc_server_ref_t* ifc_server_ref = ifc_fn_queue->sharedish_servers;
+                            if (ifc_server_ref == 0)
+                                break;
+                            lwt_ifc_server_t* ifc_server = ifc_server_ref->server;
+                            if (ifc_server->server_state != 0) {
+                                if (!ifc_server->read_locked_state)
+                                    lwt_ifc_trigger_free_sharedish_error();
+                                // Prevent this shared ifc server from accepting more shared clients by clearing the server state.
+                                ifc_server->server_state = 0;
+                                starvation_possible = false;
+                            }
+                            // Disconnect ifc server reference as it's not valid (now).
+                            assert(ifc_server_ref->head == &ifc_fn_queue->sharedish_servers);
+                            DL_DELETE(ifc_fn_queue->sharedish_servers, ifc_server_ref);
+                            ifc_server_ref->head = 0;
+                        }
+                    }
                     break;
+                }
                 lwt_ifc_server_t* ifc_server = ifc_server_ref->server;
                 void* server_state = ifc_server->server_state;
                 if (server_state == 0) {
-                    // Disconnect ifc server reference as it's invalid.
-                    assert(ifc_server_ref->head == &ifc_fn_queue->sharedish_servers);
-                    DL_DELETE(ifc_fn_queue->sharedish_servers, ifc_server_ref);
+                    // Disconnect ifc server reference as it's no longer valid.
+                    assert(ifc_server_ref->head == &ifc_fn_queue->freeish_servers);
+                    DL_DELETE(ifc_fn_queue->freeish_servers, ifc_server_ref);
                     ifc_server_ref->head = 0;
                 } else {
-                    if (!ifc_server->read_locked_state)
-                        lwt_ifc_trigger_free_sharedish_error();
+                    if (ifc_server->read_locked_state) {
+                        // Reconnect the ifc server reference to the sharedish servers instead.
+                        assert(ifc_server_ref->head == &ifc_fn_queue->freeish_servers);
+                        DL_DELETE(ifc_fn_queue->freeish_servers, ifc_server_ref);
+                        DL_APPEND(ifc_fn_queue->sharedish_servers, ifc_server_ref);
+                        ifc_server_ref->head = &ifc_fn_queue->sharedish_servers;
+                        // We can use this ifc server now if we are doing a shared join, otherwise continue search.
+                        if (call_type != RCD_IFC_CALL_SHARED)
+                            continue;
+                    } else if (call_type == RCD_IFC_CALL_SHARED) {
+                        // We're shared joining - read lock the server state.
+                        ifc_server->read_locked_state = true;
+                    } else {
+                        // We're locked joining - don't share the server state.
+                        ifc_server->server_state = 0;
+                    }
                     // Use the server state.
                     ifc_client->server_state = server_state;
                     ifc_client->ifc_server = ifc_server;
@@ -2364,73 +5121,17 @@ void* __lwt_fiber_stack_push_ifc_call_join(void* ifc_fn_ptr, rcd_fid_t fiber_id,
                     goto client_aquired_server_state;
                 }
             }
-        }
-        for (;;) {
-            lwt_ifc_server_ref_t* ifc_server_ref = ifc_fn_queue->freeish_servers;
-            if (ifc_server_ref == 0) {
-                if (call_type == RCD_IFC_CALL_LOCK_SERVER) {
-                    // Find one legitimate shared server and stop it from accepting more shared clients to prevent starvation.
-                    for (bool starvation_possible = true; starvation_possible;) {
-                        lwt_ifc_server_ref_t* ifc_server_ref = ifc_fn_queue->sharedish_servers;
-                        if (ifc_server_ref == 0)
-                            break;
-                        lwt_ifc_server_t* ifc_server = ifc_server_ref->server;
-                        if (ifc_server->server_state != 0) {
-                            if (!ifc_server->read_locked_state)
-                                lwt_ifc_trigger_free_sharedish_error();
-                            // Prevent this shared ifc server from accepting more shared clients by clearing the server state.
-                            ifc_server->server_state = 0;
-                            starvation_possible = false;
-                        }
-                        // Disconnect ifc server reference as it's not valid (now).
-                        assert(ifc_server_ref->head == &ifc_fn_queue->sharedish_servers);
-                        DL_DELETE(ifc_fn_queue->sharedish_servers, ifc_server_ref);
-                        ifc_server_ref->head = 0;
-                    }
-                }
-                break;
-            }
-            lwt_ifc_server_t* ifc_server = ifc_server_ref->server;
-            void* server_state = ifc_server->server_state;
-            if (server_state == 0) {
-                // Disconnect ifc server reference as it's no longer valid.
-                assert(ifc_server_ref->head == &ifc_fn_queue->freeish_servers);
-                DL_DELETE(ifc_fn_queue->freeish_servers, ifc_server_ref);
-                ifc_server_ref->head = 0;
-            } else {
-                if (ifc_server->read_locked_state) {
-                    // Reconnect the ifc server reference to the sharedish servers instead.
-                    assert(ifc_server_ref->head == &ifc_fn_queue->freeish_servers);
-                    DL_DELETE(ifc_fn_queue->freeish_servers, ifc_server_ref);
-                    DL_APPEND(ifc_fn_queue->sharedish_servers, ifc_server_ref);
-                    ifc_server_ref->head = &ifc_fn_queue->sharedish_servers;
-                    // We can use this ifc server now if we are doing a shared join, otherwise continue search.
-                    if (call_type != RCD_IFC_CALL_SHARED)
-                        continue;
-                } else if (call_type == RCD_IFC_CALL_SHARED) {
-                    // We're shared joining - read lock the server state.
-                    ifc_server->read_locked_state = true;
-                } else {
-                    // We're locked joining - don't share the server state.
-                    ifc_server->server_state = 0;
-                }
-                // Use the server state.
-                ifc_client->server_state = server_state;
-                ifc_client->ifc_server = ifc_server;
-                DL_APPEND(ifc_server->running_clients, ifc_client);
-                goto client_aquired_server_state;
-            }
-        }
-        // No server state was ready to be joined with.
-        ifc_client->server_state = 0;
-        // Assign unique call id of the join so we can be ordered across different join queues.
-        ifc_client->call_id = shared_fiber_mem.ifc_call_id;
-        shared_fiber_mem.ifc_call_id++;
-        // Add ourself to waiting clients.
-        QUEUE_ENQUEUE(&ifc_fn_queue->waiting_clients, ifc_client);
-        fiber->ctrl.done = false;
-        client_aquired_server_state:;
-    } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+            // No server state was ready to be joined with.
+            ifc_client->server_state = 0;
+            // Assign unique call id of the join so we can be ordered across different join queues.
+            ifc_client->call_id = slot->ifc_call_id;
+            slot->ifc_call_id++;
+            // Add ourself to waiting clients.
+            QUEUE_ENQUEUE(&ifc_fn_queue->waiting_clients, ifc_client);
+            fiber->ctrl.done = false;
+            client_aquired_server_state:;
+        } LWT_SYS_SPINLOCK_UNLOCK(&slot->ifc_lock);
+    }
     // If server fiber doesn't exist we throw a race exception or no such fiber exception depending on if the fiber is interruptible or not.
     if (ifc_fn_queue == 0) {
         // Free the ifc client and forward run time to exception handler.
@@ -2446,13 +5147,22 @@ void* __lwt_fiber_stack_push_ifc_call_join(void* ifc_fn_ptr, rcd_fid_t fiber_id,
     }
     // If we didn't catch a server state we need to sleep until we're attached automatically (by server) or canceled.
     if (ifc_client->server_state == 0) {
-        // Wait until server attaches us or until we're canceled, join raced, or if we're uninterruptable - simply done.
+        // Interruptible joins gives up waiting when the join timeout of the fiber expires.
+        lwt_timer_t join_timer;
+        bool has_join_timer = (fiber->join_timeout_ns != 0 && !fiber->ctrl.unintr);
+        if (has_join_timer) {
+            join_timer = (lwt_timer_t) {.action = lwt_timer_action_wake, .fiber = fiber};
+            lwt_timer_arm(&join_timer, fiber->join_timeout_ns);
+        }
+        // Wait until server attaches us or until we're canceled, join raced, timed out or if we're uninterruptable - simply done.
         lwt_scheduler_fiber_defer(false, 0, fiber_id, -1);
+        bool join_timed_out = (has_join_timer && !lwt_timer_disarm(&join_timer));
         // If we're attached we where dequeued and added to running clients automatically.
         if (ifc_client->server_state == 0) {
-            if (!fiber->ctrl.unintr && fiber->ctrl.canceled == 0 && !fiber->ctrl.join_race)
+            if (!fiber->ctrl.unintr && fiber->ctrl.canceled == 0 && !fiber->ctrl.join_race && !join_timed_out)
                 throw("scheduler error: client woke up without any satisfied preconditions", exception_fatal);
-            LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+            rwspinlock_t* ifc_lock = ifc_fn_queue->ifc_lock;
+            LWT_SYS_SPINLOCK_WLOCK(ifc_lock); {
                 // The outside check is just an optimization, we need to check server state again
                 // with lock to ensure there's no race between checking and removing us from the waiting clients queue.
                 if (ifc_client->server_state == 0) {
@@ -2460,7 +5170,7 @@ void* __lwt_fiber_stack_push_ifc_call_join(void* ifc_fn_ptr, rcd_fid_t fiber_id,
                     QUEUE_STEP_OUT(&ifc_fn_queue->waiting_clients, ifc_client);
                     deref_ifc_fn_queue(ifc_fn_queue);
                 }
-            } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+            } LWT_SYS_SPINLOCK_UNLOCK(ifc_lock);
             // Server state might be set now if we had a race between the unprotected (optimization check) and the inner check.
             // If then server already accepted us we're just another joined fiber and have to jump through the same hoops any other joined fibers have to jump through to pop the join,
             // so we don't do any special optimizations for popping joins here. They will simply be immediately unwound with the cancellation point below.
@@ -2473,6 +5183,8 @@ void* __lwt_fiber_stack_push_ifc_call_join(void* ifc_fn_ptr, rcd_fid_t fiber_id,
                 } else {
                     // Throw cancellation or join race exception now.
                     lwt_cancellation_point_raw(fiber);
+                    // Otherwise the join timed out.
+                    throw_eio("join timed out before the server accepted it", lwt_join_timeout);
                 }
                 assert(false);
             }
@@ -2486,6 +5198,7 @@ void* __lwt_fiber_stack_push_ifc_call_join(void* ifc_fn_ptr, rcd_fid_t fiber_id,
     edata.ifc_call_join->prev = fiber->current_ifc_join_event;
     fiber->current_ifc_join_event = edata.ifc_call_join;
     lwt_fiber_event_push(fiber, lwt_fiber_event_ifc_join, edata);
+    lwt_trace_event(lwt_trace_event_ifc_accept, fiber->ctrl.id, fiber_id, ifc_fn_ptr, 0);
     // Raise any pending cancel here.
     lwt_cancellation_point_raw(fiber);
     // Return server state.
@@ -2500,14 +5213,33 @@ void __lwt_fiber_stack_pop_ifc_call_join() {
     lwt_ifc_server_t* ifc_server = ifc_client->ifc_server;
     fiber->current_ifc_join_event = edata.ifc_call_join->prev;
     lwt_edata_ifc_join_free(edata.ifc_call_join);
-    LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+    // The server cannot leave the accept without taking its ifc lock so it's safe to reference until we unlock.
+    rwspinlock_t* ifc_lock = ifc_server->ifc_lock;
+    LWT_SYS_SPINLOCK_WLOCK(ifc_lock); {
         assert(ifc_server->running_clients != 0);
         DL_DELETE(ifc_server->running_clients, ifc_client);
-        // Wake the server and throw away any shared server state if this was the last client.
-        if (ifc_server->running_clients == 0) {
+        if (ifc_server->running_clients != 0)
+            break;
+        // We're the last client. An auto re-accepting server would just wake up to re-accept and go back to sleep
+        // so we do that on its behalf, handing the server directly to the next waiting client or letting the next
+        // call attach immediately without ever going through the run queues. The server still has to wake up if
+        // it's going to leave the accept.
+        bool handoff = (ifc_server->auto_reaccepting && !ifc_server->draining);
+        if (handoff) {
+            lwt_fiber_t* server_fiber = ifc_server->fiber;
+            LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+                handoff = (server_fiber->ctrl.unintr || (server_fiber->ctrl.canceled == 0 && !server_fiber->ctrl.join_race));
+            } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+        }
+        if (handoff) {
+            lwt_ifc_server_reaccept_raw(ifc_server);
+        } else {
+            // Wake the server and throw away any shared server state.
             ifc_server->server_state = 0;
-            lwt_scheduler_fiber_wake_done_raw(ifc_server->fiber);
+            lwt_scheduler_fiber_wake_done(ifc_server->fiber);
         }
+    } LWT_SYS_SPINLOCK_UNLOCK(ifc_lock);
+    LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
         // If only had an inner join race that applied to this join we can defuse it here as we
         // successfully unjoined before ever noticing that we had a join race.
         if (fiber->ctrl.join_race && ifc_client->live_join_race) {
@@ -2934,6 +5666,8 @@ void* lwt_alloc_new(size_t size) {
     // Current heap might be zero in a really primitive context, we abort here asap instead of recursing until the stack blows.
     if (fiber->current_heap == 0)
         abort();
+    // Allocation is frequent in cpu bound code so it's a good place for fibers to be preempted.
+    lwt_preemption_point_raw(fiber);
     return vm_heap_alloc(fiber->current_heap, size, 0);
 }
 
@@ -2947,6 +5681,7 @@ void* lwt_alloc_buffer(size_t min_size, size_t* size_out) {
     LWT_GET_LOCAL_FIBER(fiber);
     if (fiber->current_heap == 0)
         abort();
+    lwt_preemption_point_raw(fiber);
     return vm_heap_alloc(fiber->current_heap, min_size, size_out);
 }
 
@@ -2954,15 +5689,34 @@ void lwt_alloc_escape(void* ptr) {
     LWT_GET_LOCAL_FIBER(fiber);
     if (fiber->current_heap == 0)
         abort();
-    if (!vm_heap_escape(ptr))
+    if (!vm_heap_escape(ptr, 0))
+        throw("attempted to escape allocation without a parent heap", exception_fatal);
+}
+
+void* lwt_alloc_escape_reloc(void* ptr) {
+    LWT_GET_LOCAL_FIBER(fiber);
+    if (fiber->current_heap == 0)
+        abort();
+    void* new_ptr;
+    if (!vm_heap_escape(ptr, &new_ptr))
         throw("attempted to escape allocation without a parent heap", exception_fatal);
+    return new_ptr;
 }
 
 void lwt_alloc_import(void* ptr) {
     LWT_GET_LOCAL_FIBER(fiber);
     if (fiber->current_heap == 0)
         abort();
-    vm_heap_import(0, fiber->current_heap, ptr);
+    vm_heap_import(0, fiber->current_heap, ptr, 0);
+}
+
+void* lwt_alloc_import_reloc(void* ptr) {
+    LWT_GET_LOCAL_FIBER(fiber);
+    if (fiber->current_heap == 0)
+        abort();
+    void* new_ptr;
+    vm_heap_import(0, fiber->current_heap, ptr, &new_ptr);
+    return new_ptr;
 }
 
 size_t lwt_alloc_get_size(void* ptr) {
@@ -3256,15 +6010,513 @@ static void lwt_inner_fiber_dump_fd(int32_t write_fd, lwt_fiber_t* fiber) { sub_
 }}
 
 void lwt_write_fiber_dump_fd(int32_t write_fd) { sub_heap {
-    rio_direct_write(write_fd, concs("[librcd] fiber dump of [", i2fs(hmap_fid_count(&shared_fiber_mem.fiber_map)), "] fibers commencing ****"), 0);
-    LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
-        lwt_fiber_t* fiber;
-        DL_FOREACH(shared_fiber_mem.fiber_list, fiber)
-            lwt_inner_fiber_dump_fd(write_fd, fiber);
-    } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+    rio_direct_write(write_fd, concs("[librcd] fiber dump of [", i2fs(lwt_fid_table.count), "] fibers commencing ****"), 0);
+    // The ifc server state of a fiber is protected by the ifc lock of its slot which must be taken before the
+    // shared lock so fibers are dumped one slot at a time. A fiber can't exit while its slot is locked.
+    size_t n_slots = lwt_fid_table.n_chunks * LWT_FID_CHUNK_SLOTS;
+    for (uint32_t slot_i = 0; slot_i < n_slots; slot_i++) {
+        lwt_fid_slot_t* slot = lwt_fid_table_slot(slot_i);
+        if (slot == 0 || slot->fiber == 0)
+            continue;
+        LWT_SYS_SPINLOCK_RLOCK(&slot->ifc_lock); {
+            LWT_SYS_SPINLOCK_WLOCK(&shared_fiber_mem.rwlock); {
+                lwt_fiber_t* fiber = slot->fiber;
+                if (fiber != 0)
+                    lwt_inner_fiber_dump_fd(write_fd, fiber);
+            } LWT_SYS_SPINLOCK_UNLOCK(&shared_fiber_mem.rwlock);
+        } LWT_SYS_SPINLOCK_UNLOCK(&slot->ifc_lock);
+    }
     rio_direct_write(write_fd, "[librcd] fiber dump complete ****\n", 0);
 }}
 
 void lwt_write_fiber_dump_debug() {
     lwt_write_fiber_dump_fd(STDERR_FILENO);
 }
+
+void lwt_write_learned_stack_sizes_fd(int32_t write_fd) { sub_heap {
+    for (size_t i = 0; i < LWT_STACK_LEARN_SLOTS; i++) {
+        struct lwt_stack_learn_slot* slot = &lwt_stack_learn.slots[i];
+        if (slot->main_name.str == 0)
+            continue;
+        rio_direct_write(write_fd, concs(slot->main_name, " ", ui2fs(slot->stack_size), "\n"), 0);
+    }
+}}
+
+void lwt_load_learned_stack_sizes(fstr_t profile) {
+    for (fstr_t line; fstr_iterate_trim(&profile, "\n", &line);) {
+        if (line.len == 0)
+            continue;
+        fstr_t main_name, stack_size_str;
+        uint128_t stack_size;
+        if (!fstr_rdivide(line, " ", &main_name, &stack_size_str) || main_name.len == 0 || !fstr_unserial_uint(stack_size_str, 10, &stack_size))
+            throw(concs("malformed learned stack size line [", line, "]"), exception_arg);
+        // Learned main names must stay valid forever so new ones are copied to the global heap.
+        fstr_mem_t* main_name_mem = 0;
+        if (lwt_stack_learn_slot(main_name, false) == 0) {
+            global_heap {
+                main_name_mem = fstr_cpy(main_name);
+            }
+            main_name = fss(main_name_mem);
+        }
+        atomic_spinlock_lock(&lwt_stack_learn.lock); {
+            struct lwt_stack_learn_slot* slot = lwt_stack_learn_slot(main_name, true);
+            if (slot != 0) {
+                slot->stack_size = MAX(slot->stack_size, (size_t) MIN(stack_size, (uint128_t) LWT_STACK_LEARN_MAX_SIZE));
+                // The copy is only kept when it was inserted, another insert of the same main can have won the race.
+                if (slot->main_name.str == main_name.str)
+                    main_name_mem = 0;
+            }
+        } atomic_spinlock_unlock(&lwt_stack_learn.lock);
+        if (main_name_mem != 0) {
+            global_heap {
+                lwt_alloc_free(main_name_mem);
+            }
+        }
+    }
+}
+
+bool lwt_hot_split_tracking_set_enabled(bool enabled) {
+    bool was_enabled = lwt_hot_splits.enabled;
+    lwt_hot_splits.enabled = enabled;
+    return was_enabled;
+}
+
+void lwt_write_hot_split_dump_fd(int32_t write_fd) { sub_heap {
+    // Sort the tracked sites by split count, most splits first.
+    lwt_hot_split_site_t* sites[LWT_HOT_SPLIT_SITES];
+    size_t n_sites = 0;
+    for (size_t i = 0; i < LWT_HOT_SPLIT_SITES; i++) {
+        lwt_hot_split_site_t* hs = &lwt_hot_splits.sites[i];
+        if (hs->site == 0)
+            continue;
+        size_t j = n_sites++;
+        for (; j > 0 && sites[j - 1]->count < hs->count; j--)
+            sites[j] = sites[j - 1];
+        sites[j] = hs;
+    }
+    rio_direct_write(write_fd, concs("[librcd] hot split dump of [", ui2fs(n_sites), "] sites and [", ui2fs(lwt_hot_splits.n_splits), "] splits commencing ****\n"), 0);
+    for (size_t i = 0; i < n_sites; i++) {
+        rio_direct_write(write_fd, concs("\n[librcd] split site [#", ui2fs(i), "], splits: [", ui2fs(sites[i]->count), "]\n"), 0);
+        for (size_t bt_i = 0; bt_i < LWT_HOT_SPLIT_BACKTRACE_DEPTH && sites[i]->backtrace[bt_i] != 0; bt_i++)
+            rio_direct_write(write_fd, concs(" #", ui2fs(bt_i), ": ", fss(rfl_addr_to_location(sites[i]->backtrace[bt_i] - 1)), "\n"), 0);
+    }
+    rio_direct_write(write_fd, "[librcd] hot split dump complete ****\n", 0);
+}}
+
+void lwt_write_profile_folded_fd(int32_t write_fd) { sub_heap {
+    for (lwt_executor_thread_t* exec_thread = lwt_executor_threads; exec_thread != 0; exec_thread = exec_thread->next) {
+        lwt_profiler_t* profiler = exec_thread->phys_thread->profiler;
+        if (profiler == 0)
+            continue;
+        for (size_t i = 0; i < LWT_PROFILER_STACKS; i++) {
+            lwt_profiler_stack_t* ps = &profiler->stacks[i];
+            uint64_t count = ps->count;
+            if (count == 0)
+                continue;
+            sync_synchronize();
+            sub_heap {
+                // Folded stacks start at the root, which is the fiber main and then the instance.
+                fstr_t folded[LWT_PROFILER_DEPTH + 2];
+                size_t n_folded = 0;
+                folded[n_folded++] = ps->main_name;
+                if (ps->instance_name_len > 0)
+                    folded[n_folded++] = (fstr_t) {.str = ps->instance_name, .len = ps->instance_name_len};
+                for (size_t frame_i = ps->n_frames; frame_i > 0; frame_i--) {
+                    void* addr = ps->frames[frame_i - 1];
+                    fstr_t func;
+                    folded[n_folded++] = (rfl_addr_to_func(addr, &func)? func: fss(rfl_addr_to_location(addr)));
+                }
+                rio_direct_write(write_fd, concs(fss(fstr_concat(folded, n_folded, ";")), " ", ui2fs(count), "\n"), 0);
+            }
+        }
+    }
+}}
+
+/// Writes one trace event object to the trace event array.
+static void lwt_write_trace_json_event(int32_t write_fd, bool* first, json_value_t event) { sub_heap {
+    rio_direct_write(write_fd, concs((*first? "\n": ",\n"), fss(json_stringify(event))), 0);
+    *first = false;
+}}
+
+/// Writes the time a fiber was running on a thread as a complete trace event.
+static void lwt_write_trace_json_run(int32_t write_fd, bool* first, json_value_t pid, json_value_t tid, rcd_fid_t fid, fstr_t name, double ts, double end_ts) { sub_heap {
+    lwt_write_trace_json_event(write_fd, first, jobj_new(
+        {"name", jstr(name)}, {"cat", jstr("fiber")}, {"ph", jstr("X")}, {"ts", jnum(ts)}, {"dur", jnum(end_ts - ts)},
+        {"pid", pid}, {"tid", tid}, {"args", jobj_new({"fid", jnum(fid)})}
+    ));
+}}
+
+bool lwt_trace_set_enabled_local(bool enabled, size_t n_events) {
+    bool was_enabled = lwt_trace.enabled;
+    if (enabled) {
+        if (lwt_tsc_epoch.tsc0 == 0) {
+            lwt_tsc_epoch.tsc0 = lwt_rdtsc();
+            lwt_tsc_epoch.ns0 = lwt_timer_now_ns();
+        }
+        lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+        if (phys_thread->trace_ring == 0)
+            lwt_trace_ring_alloc(phys_thread, n_events);
+    }
+    lwt_trace.enabled = enabled;
+    return was_enabled;
+}
+
+void lwt_write_trace_json_fd(int32_t write_fd) { sub_heap {
+    // Calibrate the time stamp counter against the monotonic clock over the time tracing has been running.
+    uint64_t tsc_now = lwt_rdtsc();
+    uint64_t ns_now = lwt_timer_now_ns();
+    double ns_per_tick = lwt_tsc_ns_per_tick(tsc_now, ns_now);
+    json_value_t pid = jnum(getpid());
+    bool first = true;
+    rio_direct_write(write_fd, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0);
+    for (lwt_trace_ring_t* ring = lwt_trace.rings; ring != 0; ring = ring->next) sub_heap {
+        json_value_t tid = jnum(ring->tid);
+        lwt_write_trace_json_event(write_fd, &first, jobj_new(
+            {"name", jstr("thread_name")}, {"ph", jstr("M")}, {"pid", pid}, {"tid", tid},
+            {"args", jobj_new({"name", jstr(concs(ring->thread_name, " [", i2fs(ring->tid), "]"))})}
+        ));
+        // The fiber that is running on the thread and since when. Running time is drawn as a complete event
+        // that ends when the fiber is switched out.
+        rcd_fid_t run_fid = 0;
+        fstr_t run_name = {0};
+        double run_ts = 0;
+        uint64_t n_events = ring->n_events;
+        uint64_t ring_len = ring->mask + 1;
+        for (uint64_t i = (n_events > ring_len? n_events - ring_len: 0); i < n_events; i++) {
+            // The event could be overwritten while we read it, skip it if it is.
+            lwt_trace_event_t* ring_event = &ring->events[i & ring->mask];
+            if (ring_event->seq != i + 1)
+                continue;
+            lwt_trace_event_t event = *ring_event;
+            sync_synchronize();
+            if (ring_event->seq != i + 1)
+                continue;
+            double ts = ((int64_t) (event.tsc - lwt_tsc_epoch.tsc0)) * ns_per_tick / 1000;
+            fstr_t event_str = {.str = (void*) event.ptr, .len = event.len};
+            bool is_switch_out = (event.type == lwt_trace_event_defer || event.type == lwt_trace_event_defer_fid
+            || event.type == lwt_trace_event_defer_fd || event.type == lwt_trace_event_defer_accept
+            || event.type == lwt_trace_event_yield || event.type == lwt_trace_event_preempt || event.type == lwt_trace_event_exit);
+            if (run_fid != 0 && (event.type == lwt_trace_event_run || (is_switch_out && event.fid == run_fid))) {
+                lwt_write_trace_json_run(write_fd, &first, pid, tid, run_fid, run_name, run_ts, ts);
+                run_fid = 0;
+            }
+            if (event.type == lwt_trace_event_run) {
+                run_fid = event.fid;
+                run_name = event_str;
+                run_ts = ts;
+                continue;
+            }
+            sub_heap {
+                fstr_t name;
+                json_value_t args = jobj_new({"fid", jnum(event.fid)});
+                switch (event.type) {{
+                } case lwt_trace_event_spawn: {
+                    name = "spawn";
+                    JSON_SET(args, "parent", jnum(event.arg));
+                    JSON_SET(args, "main", jstr(event_str));
+                    break;
+                } case lwt_trace_event_wake: {
+                    name = "wake";
+                    JSON_SET(args, "waker", jnum(event.arg));
+                    break;
+                } case lwt_trace_event_defer_fid: {
+                    name = "wait fiber";
+                    JSON_SET(args, "wait_fid", jnum(event.arg));
+                    break;
+                } case lwt_trace_event_defer_fd: {
+                    name = "wait fd";
+                    JSON_SET(args, "wait_fd", jnum(event.arg));
+                    break;
+                } case lwt_trace_event_ifc_call:
+                  case lwt_trace_event_ifc_accept: {
+                    name = (event.type == lwt_trace_event_ifc_call? "ifc call": "ifc accept");
+                    fstr_t fn_name;
+                    JSON_SET(args, "server", jnum(event.arg));
+                    JSON_SET(args, "fn", jstr(rfl_addr_to_func((void*) event.ptr, &fn_name)? fn_name: "?"));
+                    break;
+                } case lwt_trace_event_defer: {
+                    name = "wait";
+                    break;
+                } case lwt_trace_event_defer_accept: {
+                    name = "wait ifc clients";
+                    break;
+                } case lwt_trace_event_yield: {
+                    name = "yield";
+                    break;
+                } case lwt_trace_event_preempt: {
+                    name = "preempt";
+                    break;
+                } case lwt_trace_event_exit: {
+                    name = "exit";
+                    break;
+                } default: {
+                    name = "?";
+                    break;
+                }}
+                lwt_write_trace_json_event(write_fd, &first, jobj_new(
+                    {"name", jstr(name)}, {"cat", jstr("scheduler")}, {"ph", jstr("i")}, {"s", jstr("t")}, {"ts", jnum(ts)},
+                    {"pid", pid}, {"tid", tid}, {"args", args}
+                ));
+            }
+        }
+        // The fiber is still running.
+        if (run_fid != 0)
+            lwt_write_trace_json_run(write_fd, &first, pid, tid, run_fid, run_name, run_ts, (tsc_now - lwt_tsc_epoch.tsc0) * ns_per_tick / 1000);
+    }
+    rio_direct_write(write_fd, "\n]}\n", 0);
+}}
+
+/// Run queue depth and context switches of an executor at the time of a metrics snapshot.
+typedef struct lwt_metrics_executor {
+    uint32_t executor_index;
+    int64_t tid;
+    uint64_t run_queue_depth;
+    uint64_t context_switches;
+} lwt_metrics_executor_t;
+
+/// Counters of all executors summed up along with gauges read at the same time.
+typedef struct lwt_metrics_snapshot {
+    list(lwt_metrics_executor_t)* executors;
+    uint64_t run_queue_depth;
+    uint64_t fibers_alive;
+    uint64_t context_switches;
+    uint64_t preemptions;
+    uint64_t yields;
+    uint64_t stacklet_overflows;
+    uint64_t fibers_spawned;
+    uint64_t fibers_exited;
+    uint64_t queue_wait_buckets[LWT_METRICS_WAIT_BUCKETS];
+    uint64_t queue_wait_count;
+    double queue_wait_ns_sum;
+    /// Length of a time stamp counter tick in nanoseconds.
+    double ns_per_tick;
+    uint64_t io_waits[LWT_N_FD_TYPES];
+    /// Number of ifc joins per ifc function name.
+    dict(uint64_t)* ifc_joins;
+    size_t vm_allocated_bytes;
+    vm_stats_t vm_stats;
+    vm_frag_report_t vm_frag;
+} lwt_metrics_snapshot_t;
+
+static const fstr_t lwt_fd_type_names[LWT_N_FD_TYPES] = {
+    [lwt_fd_type_unknown] = "unknown",
+    [lwt_fd_type_socket] = "socket",
+    [lwt_fd_type_pipe] = "pipe",
+    [lwt_fd_type_char] = "char",
+    [lwt_fd_type_epoll] = "epoll",
+    [lwt_fd_type_other] = "other",
+};
+
+/// Takes a snapshot of the metrics without stopping the executors. The counters are read lock free while they are
+/// updated so the snapshot is not consistent across counters, but every counter is exact at some point during it.
+/// The snapshot is allocated in the current heap.
+static void lwt_metrics_snapshot(lwt_metrics_snapshot_t* snap) {
+    memset(snap, 0, sizeof(*snap));
+    snap->ns_per_tick = lwt_tsc_ns_per_tick(lwt_rdtsc(), lwt_timer_now_ns());
+    snap->executors = new_list(lwt_metrics_executor_t);
+    snap->ifc_joins = new_dict(uint64_t);
+    uint64_t queue_wait_ticks_sum = 0, ifc_joins_other = 0;
+    for (lwt_executor_thread_t* exec_thread = lwt_executor_threads; exec_thread != 0; exec_thread = exec_thread->next) {
+        lwt_physical_thread_t* exec_phys_thread = exec_thread->phys_thread;
+        lwt_metrics_shard_t* metrics = exec_phys_thread->metrics;
+        lwt_metrics_executor_t executor = {
+            .executor_index = exec_phys_thread->executor_index,
+            .tid = exec_phys_thread->linux_tid,
+            .run_queue_depth = exec_phys_thread->run_queue.length,
+            .context_switches = (metrics != 0? metrics->context_switches: 0),
+        };
+        list_push_end(snap->executors, lwt_metrics_executor_t, executor);
+        snap->run_queue_depth += executor.run_queue_depth;
+        if (metrics == 0)
+            continue;
+        snap->context_switches += executor.context_switches;
+        snap->preemptions += metrics->preemptions;
+        snap->yields += metrics->yields;
+        snap->stacklet_overflows += metrics->stacklet_overflows;
+        snap->fibers_spawned += metrics->fibers_spawned;
+        snap->fibers_exited += metrics->fibers_exited;
+        for (size_t i = 0; i < LWT_METRICS_WAIT_BUCKETS; i++) {
+            uint64_t count = metrics->queue_wait_buckets[i];
+            snap->queue_wait_buckets[i] += count;
+            snap->queue_wait_count += count;
+        }
+        queue_wait_ticks_sum += metrics->queue_wait_ticks_sum;
+        for (size_t i = 0; i < LWT_N_FD_TYPES; i++)
+            snap->io_waits[i] += metrics->io_waits[i];
+        // Joins of the same function made on different executors are counted together.
+        for (size_t i = 0; i < LWT_METRICS_IFC_FNS; i++) {
+            void* fn_ptr = metrics->ifc_joins[i].fn_ptr;
+            if (fn_ptr == 0)
+                continue;
+            uint64_t count = metrics->ifc_joins[i].count;
+            fstr_t fn_name;
+            if (!rfl_addr_to_func(fn_ptr, &fn_name))
+                fn_name = "?";
+            uint64_t* total = dict_read(snap->ifc_joins, uint64_t, fn_name);
+            if (total != 0) {
+                *total += count;
+            } else {
+                dict_insert(snap->ifc_joins, uint64_t, fn_name, count);
+            }
+        }
+        ifc_joins_other += metrics->ifc_joins_other;
+    }
+    if (ifc_joins_other > 0)
+        dict_insert(snap->ifc_joins, uint64_t, "[other]", ifc_joins_other);
+    snap->queue_wait_ns_sum = queue_wait_ticks_sum * snap->ns_per_tick;
+    snap->fibers_alive = lwt_fid_table.count;
+    snap->vm_allocated_bytes = vm_get_total_allocated_bytes();
+    vm_get_stats(&snap->vm_stats);
+    vm_get_frag_report(&snap->vm_frag);
+}
+
+/// Returns the upper bound in nanoseconds of a bucket in the queue wait time histogram.
+static double lwt_metrics_wait_bucket_le_ns(lwt_metrics_snapshot_t* snap, size_t bucket_i) {
+    return (1UL << bucket_i) * snap->ns_per_tick;
+}
+
+bool lwt_metrics_set_enabled(bool enabled) {
+    bool was_enabled = lwt_metrics_enabled;
+    if (enabled && lwt_tsc_epoch.tsc0 == 0) {
+        lwt_tsc_epoch.tsc0 = lwt_rdtsc();
+        lwt_tsc_epoch.ns0 = lwt_timer_now_ns();
+    }
+    lwt_metrics_enabled = enabled;
+    if (enabled) {
+        // Executors that start from now on allocate their own shard.
+        for (lwt_executor_thread_t* exec_thread = lwt_executor_threads; exec_thread != 0; exec_thread = exec_thread->next)
+            lwt_metrics_init(exec_thread->phys_thread);
+    }
+    return was_enabled;
+}
+
+void lwt_write_metrics_json_fd(int32_t write_fd) { sub_heap {
+    lwt_metrics_snapshot_t snap;
+    lwt_metrics_snapshot(&snap);
+    json_value_t executors = json_new_array();
+    list_foreach(snap.executors, lwt_metrics_executor_t, executor) {
+        list_push_end(json_get_array(executors), json_value_t, jobj_new(
+            {"index", jnum(executor.executor_index)}, {"tid", jnum(executor.tid)},
+            {"run_queue_depth", jnum(executor.run_queue_depth)}, {"context_switches", jnum(executor.context_switches)}
+        ));
+    }
+    // The last bucket has no upper bound.
+    json_value_t wait_buckets = json_new_array();
+    for (size_t i = 0; i < LWT_METRICS_WAIT_BUCKETS; i++) {
+        json_value_t le_ns = (i < LWT_METRICS_WAIT_BUCKETS - 1? jnum(lwt_metrics_wait_bucket_le_ns(&snap, i)): jnull);
+        list_push_end(json_get_array(wait_buckets), json_value_t, jobj_new({"le_ns", le_ns}, {"count", jnum(snap.queue_wait_buckets[i])}));
+    }
+    json_value_t io_waits = json_new_object();
+    for (size_t i = lwt_fd_type_unknown + 1; i < LWT_N_FD_TYPES; i++)
+        JSON_SET(io_waits, lwt_fd_type_names[i], jnum(snap.io_waits[i]));
+    json_value_t ifc_joins = json_new_object();
+    dict_foreach(snap.ifc_joins, uint64_t, fn_name, count)
+        JSON_SET(ifc_joins, fn_name, jnum(count));
+    json_value_t vm_classes = json_new_object();
+    for (size_t size_2e = 0; size_2e < LENGTHOF(snap.vm_stats.class_allocated_bytes); size_2e++) {
+        if (snap.vm_stats.class_allocated_bytes[size_2e] != 0)
+            JSON_SET(vm_classes, ui2fs(1UL << size_2e), jnum(snap.vm_stats.class_allocated_bytes[size_2e]));
+    }
+    json_value_t vm_free_classes = json_new_object();
+    json_value_t vm_dirty_classes = json_new_object();
+    for (size_t size_2e = 0; size_2e < LENGTHOF(snap.vm_frag.free_bytes); size_2e++) {
+        if (snap.vm_frag.free_bytes[size_2e] != 0)
+            JSON_SET(vm_free_classes, ui2fs(1UL << size_2e), jnum(snap.vm_frag.free_bytes[size_2e]));
+        if (snap.vm_frag.dirty_bytes[size_2e] != 0)
+            JSON_SET(vm_dirty_classes, ui2fs(1UL << size_2e), jnum(snap.vm_frag.dirty_bytes[size_2e]));
+    }
+    json_value_t metrics = jobj_new(
+        {"executors", executors},
+        {"run_queue_depth", jnum(snap.run_queue_depth)},
+        {"fibers_alive", jnum(snap.fibers_alive)},
+        {"context_switches", jnum(snap.context_switches)},
+        {"preemptions", jnum(snap.preemptions)},
+        {"yields", jnum(snap.yields)},
+        {"stacklet_overflows", jnum(snap.stacklet_overflows)},
+        {"fibers_spawned", jnum(snap.fibers_spawned)},
+        {"fibers_exited", jnum(snap.fibers_exited)},
+        {"queue_wait", jobj_new({"buckets", wait_buckets}, {"count", jnum(snap.queue_wait_count)}, {"sum_ns", jnum(snap.queue_wait_ns_sum)})},
+        {"io_waits", io_waits},
+        {"ifc_joins", ifc_joins},
+        {"vm", jobj_new(
+            {"allocated_bytes", jnum(snap.vm_allocated_bytes)},
+            {"class_allocated_bytes", vm_classes},
+            {"janitor_reclaimed_bytes", jnum(snap.vm_stats.janitor_reclaimed_bytes)},
+            {"janitor_reclaimed_mmaps", jnum(snap.vm_stats.janitor_reclaimed_mmaps)},
+            {"huge_page_bytes", jnum(snap.vm_stats.huge_page_bytes)},
+            {"pool_bytes", jnum(snap.vm_frag.pool_bytes)},
+            {"class_free_bytes", vm_free_classes},
+            {"class_dirty_bytes", vm_dirty_classes},
+            {"reclaimable_bytes", jnum(snap.vm_frag.reclaimable_bytes)},
+            {"stranded_bytes", jnum(snap.vm_frag.stranded_bytes)},
+            {"coalesced_chunks", jnum(snap.vm_frag.coalesced_chunks)}
+        )}
+    );
+    rio_direct_write(write_fd, concs(fss(json_stringify(metrics)), "\n"), 0);
+}}
+
+/// Writes the help and type lines of a metric in the Prometheus text format.
+static void lwt_write_metrics_prometheus_header(int32_t write_fd, fstr_t name, fstr_t type, fstr_t help) { sub_heap {
+    rio_direct_write(write_fd, concs("# HELP ", name, " ", help, "\n# TYPE ", name, " ", type, "\n"), 0);
+}}
+
+/// Writes a metric without labels in the Prometheus text format.
+static void lwt_write_metrics_prometheus_value(int32_t write_fd, fstr_t name, fstr_t type, fstr_t help, uint64_t value) { sub_heap {
+    lwt_write_metrics_prometheus_header(write_fd, name, type, help);
+    rio_direct_write(write_fd, concs(name, " ", ui2fs(value), "\n"), 0);
+}}
+
+void lwt_write_metrics_prometheus_fd(int32_t write_fd) { sub_heap {
+    lwt_metrics_snapshot_t snap;
+    lwt_metrics_snapshot(&snap);
+    lwt_write_metrics_prometheus_header(write_fd, "librcd_run_queue_depth", "gauge", "Number of fibers in the run queue of the executor.");
+    list_foreach(snap.executors, lwt_metrics_executor_t, executor)
+        rio_direct_write(write_fd, concs("librcd_run_queue_depth{executor=\"", ui2fs(executor.executor_index), "\"} ", ui2fs(executor.run_queue_depth), "\n"), 0);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_fibers_alive", "gauge", "Number of fibers that have not exited.", snap.fibers_alive);
+    lwt_write_metrics_prometheus_header(write_fd, "librcd_context_switches_total", "counter", "Number of times the executor switched in a fiber.");
+    list_foreach(snap.executors, lwt_metrics_executor_t, executor)
+        rio_direct_write(write_fd, concs("librcd_context_switches_total{executor=\"", ui2fs(executor.executor_index), "\"} ", ui2fs(executor.context_switches), "\n"), 0);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_preemptions_total", "counter", "Number of fibers preempted after using up their time slice.", snap.preemptions);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_yields_total", "counter", "Number of times a fiber yielded.", snap.yields);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_stacklet_overflows_total", "counter", "Number of times a fiber overflowed into a new stacklet.", snap.stacklet_overflows);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_fibers_spawned_total", "counter", "Number of fibers spawned by fibers.", snap.fibers_spawned);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_fibers_exited_total", "counter", "Number of fibers that exited.", snap.fibers_exited);
+    lwt_write_metrics_prometheus_header(write_fd, "librcd_queue_wait_seconds", "histogram", "Time fibers waited in a run queue before they were switched in.");
+    uint64_t cumulative_count = 0;
+    for (size_t i = 0; i < LWT_METRICS_WAIT_BUCKETS; i++) {
+        cumulative_count += snap.queue_wait_buckets[i];
+        fstr_t le = (i < LWT_METRICS_WAIT_BUCKETS - 1? fss(fstr_from_double(lwt_metrics_wait_bucket_le_ns(&snap, i) / 1e9)): "+Inf");
+        rio_direct_write(write_fd, concs("librcd_queue_wait_seconds_bucket{le=\"", le, "\"} ", ui2fs(cumulative_count), "\n"), 0);
+    }
+    rio_direct_write(write_fd, concs("librcd_queue_wait_seconds_sum ", fss(fstr_from_double(snap.queue_wait_ns_sum / 1e9)), "\n"), 0);
+    rio_direct_write(write_fd, concs("librcd_queue_wait_seconds_count ", ui2fs(snap.queue_wait_count), "\n"), 0);
+    lwt_write_metrics_prometheus_header(write_fd, "librcd_io_waits_total", "counter", "Number of times a fiber waited for a file descriptor.");
+    for (size_t i = lwt_fd_type_unknown + 1; i < LWT_N_FD_TYPES; i++)
+        rio_direct_write(write_fd, concs("librcd_io_waits_total{fd_type=\"", lwt_fd_type_names[i], "\"} ", ui2fs(snap.io_waits[i]), "\n"), 0);
+    lwt_write_metrics_prometheus_header(write_fd, "librcd_ifc_joins_total", "counter", "Number of ifc calls joined per ifc function.");
+    dict_foreach(snap.ifc_joins, uint64_t, fn_name, count)
+        rio_direct_write(write_fd, concs("librcd_ifc_joins_total{fn=\"", fn_name, "\"} ", ui2fs(count), "\n"), 0);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_vm_allocated_bytes_total", "gauge", "Bytes currently allocated from the vm.", snap.vm_allocated_bytes);
+    lwt_write_metrics_prometheus_header(write_fd, "librcd_vm_class_allocated_bytes", "gauge", "Bytes currently allocated from the vm per size class.");
+    for (size_t size_2e = 0; size_2e < LENGTHOF(snap.vm_stats.class_allocated_bytes); size_2e++) {
+        if (snap.vm_stats.class_allocated_bytes[size_2e] != 0)
+            rio_direct_write(write_fd, concs("librcd_vm_class_allocated_bytes{size=\"", ui2fs(1UL << size_2e), "\"} ", ui2fs(snap.vm_stats.class_allocated_bytes[size_2e]), "\n"), 0);
+    }
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_vm_janitor_reclaimed_bytes_total", "counter", "Bytes the vm janitor has returned to the system.", snap.vm_stats.janitor_reclaimed_bytes);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_vm_janitor_reclaimed_mmaps_total", "counter", "Segments the vm janitor has returned to the system.", snap.vm_stats.janitor_reclaimed_mmaps);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_vm_huge_page_bytes", "gauge", "Bytes of vm pool memory mapped with huge pages.", snap.vm_stats.huge_page_bytes);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_vm_pool_bytes", "gauge", "Bytes mapped from the system for the vm pool.", snap.vm_frag.pool_bytes);
+    lwt_write_metrics_prometheus_header(write_fd, "librcd_vm_class_free_bytes", "gauge", "Bytes in free vm chunks per size class.");
+    for (size_t size_2e = 0; size_2e < LENGTHOF(snap.vm_frag.free_bytes); size_2e++) {
+        if (snap.vm_frag.free_bytes[size_2e] != 0)
+            rio_direct_write(write_fd, concs("librcd_vm_class_free_bytes{size=\"", ui2fs(1UL << size_2e), "\"} ", ui2fs(snap.vm_frag.free_bytes[size_2e]), "\n"), 0);
+    }
+    lwt_write_metrics_prometheus_header(write_fd, "librcd_vm_class_dirty_bytes", "gauge", "Bytes in freed vm chunks that still hold memory per size class.");
+    for (size_t size_2e = 0; size_2e < LENGTHOF(snap.vm_frag.dirty_bytes); size_2e++) {
+        if (snap.vm_frag.dirty_bytes[size_2e] != 0)
+            rio_direct_write(write_fd, concs("librcd_vm_class_dirty_bytes{size=\"", ui2fs(1UL << size_2e), "\"} ", ui2fs(snap.vm_frag.dirty_bytes[size_2e]), "\n"), 0);
+    }
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_vm_reclaimable_bytes", "gauge", "Bytes in freed vm chunks that the janitor will return to the system.", snap.vm_frag.reclaimable_bytes);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_vm_stranded_bytes", "gauge", "Bytes in free vm chunks that hold memory which can't be returned to the system.", snap.vm_frag.stranded_bytes);
+    lwt_write_metrics_prometheus_value(write_fd, "librcd_vm_coalesced_chunks_total", "counter", "Free vm buddy chunk pairs merged by the janitor.", snap.vm_frag.coalesced_chunks);
+}}
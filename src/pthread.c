@@ -378,7 +378,7 @@ int32_t pthread_mutex_trylock(pthread_mutex_t* mutex) {
 
 fiber_main pthread_mutex_timedlock_fiber(fiber_main_attr, rcd_fid_t fiber_id, bool* aquire_ok, pthread_mutex_t* restrict mutex, const struct timespec* restrict abs_timeout) {
     try {
-        ifc_cancel_alarm_arm(abs_timeout->tv_nsec + abs_timeout->tv_sec * RIO_NS_SEC);
+        ifc_cancel_timeout_arm(abs_timeout->tv_nsec + abs_timeout->tv_sec * RIO_NS_SEC);
         pthread_mutex_fiber_lock_exclusive(fiber_id, aquire_ok, mutex->mutex_fid);
     } catch (exception_canceled | exception_inner_join_fail, e) {}
 }
@@ -783,7 +783,7 @@ int32_t pthread_rwlock_tryrdlock(pthread_rwlock_t* rwlock) {
 
 fiber_main pthread_rwlock_timedrdlock_fiber(fiber_main_attr, rcd_fid_t fiber_id, bool* aquire_ok, pthread_rwlock_t* restrict rwlock, const struct timespec* restrict abs_timeout) {
     try {
-        ifc_cancel_alarm_arm(abs_timeout->tv_nsec + abs_timeout->tv_sec * RIO_NS_SEC);
+        ifc_cancel_timeout_arm(abs_timeout->tv_nsec + abs_timeout->tv_sec * RIO_NS_SEC);
         pthread_rwlock_fiber_rdlock(fiber_id, aquire_ok, rwlock->rwlock_fid);
     } catch (exception_canceled | exception_inner_join_fail, e) {}
 }
@@ -852,7 +852,7 @@ int32_t pthread_rwlock_trywrlock(pthread_rwlock_t* rwlock) {
 
 fiber_main pthread_rwlock_timedwrlock_fiber(fiber_main_attr, rcd_fid_t fiber_id, bool* aquire_ok, pthread_rwlock_t* restrict rwlock, const struct timespec* restrict abs_timeout) {
     try {
-        ifc_cancel_alarm_arm(abs_timeout->tv_nsec + abs_timeout->tv_sec * RIO_NS_SEC);
+        ifc_cancel_timeout_arm(abs_timeout->tv_nsec + abs_timeout->tv_sec * RIO_NS_SEC);
         pthread_rwlock_fiber_wrlock(fiber_id, aquire_ok, rwlock->rwlock_fid);
     } catch (exception_canceled | exception_inner_join_fail, e) {}
 }
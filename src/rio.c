@@ -543,7 +543,9 @@ fstr_mem_t* rio_file_real_path(fstr_t file_path) { sub_heap {
 rio_t* rio_file_open(fstr_t file_path, bool read_only, bool create) {
     int32_t fd;
     sub_heap {
-        fd = open(fstr_to_cstr(file_path), (read_only? O_RDONLY: O_RDWR) | (create? O_CREAT: 0) | O_NONBLOCK | O_CLOEXEC, 0644);
+        // io_uring honors O_NONBLOCK and would answer EAGAIN on a page cache miss instead of reading from disk.
+        int32_t nonblock_flag = lwt_uring_is_enabled()? 0: O_NONBLOCK;
+        fd = open(fstr_to_cstr(file_path), (read_only? O_RDONLY: O_RDWR) | (create? O_CREAT: 0) | nonblock_flag | O_CLOEXEC, 0644);
         if (fd == -1)
             RCD_SYSCALL_EXCEPTION(open, exception_io);
     }
@@ -613,10 +615,31 @@ void rio_file_unlock_raw(int32_t fd) {
         RCD_SYSCALL_EXCEPTION(flock, exception_io);
 }
 
+typedef struct rio_fsync_args {
+    int32_t fd;
+    int32_t fsync_r;
+    int32_t fsync_errno;
+} rio_fsync_args_t;
+
+static void rio_fsync_offload_main(void* arg_ptr) {
+    rio_fsync_args_t* fsync_args = arg_ptr;
+    fsync_args->fsync_r = fsync(fsync_args->fd);
+    fsync_args->fsync_errno = errno;
+}
+
 void rio_file_fsync(rio_t* file_h) {
     RIO_CHECK_TYPE(file_h, rio_type_file);
     int32_t fd = file_h->xfer.duplex.fd;
-    int32_t fsync_r = fsync(fd);
+    int32_t fsync_r;
+    if (lwt_uring_is_enabled()) {
+        fsync_r = lwt_uring_fsync(fd);
+    } else {
+        // Flushing to disk can take seconds, don't stall the executor with it.
+        rio_fsync_args_t fsync_args = {.fd = fd};
+        lwt_offload(rio_fsync_offload_main, &fsync_args);
+        fsync_r = fsync_args.fsync_r;
+        errno = fsync_args.fsync_errno;
+    }
     if (fsync_r == -1)
         RCD_SYSCALL_EXCEPTION(fsync, exception_io);
 }
@@ -1265,6 +1288,44 @@ void rio_write_file_contents(fstr_t file_path, fstr_t data) {
     }
 }
 
+/// Transfers a chunk of a regular file with the io_uring engine on a private descriptor that is opened without
+/// O_NONBLOCK. The engine honors O_NONBLOCK so a descriptor that has it set (e.g. from fdopen()) answers EWOULDBLOCK
+/// on a page cache miss. Clearing the flag would change the open file description that every other owner of the
+/// descriptor shares so we reopen the file instead, transfer at the current position and then advance it.
+/// Fails with ESPIPE if the file has no position, the caller must then wait for readiness instead.
+static ssize_t rio_file_uring_xfer_private(int32_t fd, void* buf, size_t len, bool write) {
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1)
+        return -1;
+    int32_t status_flags = fcntl(fd, F_GETFL, 0);
+    if (status_flags == -1)
+        return -1;
+    bool append = (write && (status_flags & O_APPEND) != 0);
+    ssize_t n_xfer = -1;
+    int32_t xfer_errno = 0;
+    sub_heap {
+        int32_t private_fd = open(fstr_to_cstr(concs("/proc/self/fd/", i2fs(fd))), (status_flags & (O_ACCMODE | O_APPEND)) | O_CLOEXEC, 0);
+        if (private_fd != -1) {
+            // Owning the descriptor with a handle closes it even if we are canceled.
+            rio_new_h(rio_type_file, private_fd, false, false, 0);
+            if (write) {
+                // With O_APPEND the kernel ignores the offset and writes at the end of the file.
+                n_xfer = lwt_uring_pwrite(private_fd, buf, len, append? -1: offset);
+            } else {
+                n_xfer = lwt_uring_pread(private_fd, buf, len, offset);
+            }
+        }
+        xfer_errno = errno;
+    }
+    if (n_xfer > 0) {
+        off_t lseek_r = (append? lseek(fd, 0, SEEK_END): lseek(fd, offset + n_xfer, SEEK_SET));
+        if (lseek_r == -1)
+            return -1;
+    }
+    errno = xfer_errno;
+    return n_xfer;
+}
+
 static fstr_t rio_read_direct(rio_t* rio, fstr_t buffer, bool* out_more_hint) {
     if (rio->type == rio_type_abstract) {
         if (rio->xfer.abstract.impl->read_part_fn == 0 || !rio->xfer.abstract.is_readable)
@@ -1275,16 +1336,28 @@ static fstr_t rio_read_direct(rio_t* rio, fstr_t buffer, bool* out_more_hint) {
     int32_t read_fd = rio_get_fd_read(rio);
     if (read_fd == -1)
         throw("the specified rio handle does not support the operation read", exception_arg);
+    // Regular files are always ready according to epoll so reading them blocks the physical thread.
+    // The io_uring engine reads them asynchronously instead, see rio_file_uring_xfer_private().
+    bool use_uring = (rio->type == rio_type_file && lwt_uring_is_enabled());
     for (;;) {
-        n_read = read(read_fd, buffer.str, buffer.len);
+        n_read = use_uring? lwt_uring_read(read_fd, buffer.str, buffer.len): read(read_fd, buffer.str, buffer.len);
+        if (n_read == -1 && errno == EWOULDBLOCK && use_uring) {
+            n_read = rio_file_uring_xfer_private(read_fd, buffer.str, buffer.len, false);
+            if (n_read == -1 && errno == ESPIPE) {
+                // Files without a position (e.g. fifos) support readiness.
+                use_uring = false;
+                errno = EWOULDBLOCK;
+            }
+        }
         if (n_read == 0)
             throw_eio("read() failed: end of stream reached", rio_eos);
         if (n_read > 0)
             break;
-        if (errno == EWOULDBLOCK)
+        if (errno == EWOULDBLOCK) {
             lwt_block_until_edge_level_io_event(read_fd, lwt_fd_event_read);
-        else if (errno != EINTR)
+        } else if (errno != EINTR) {
             RCD_SYSCALL_EXCEPTION(read, exception_io);
+        }
     }
     fstr_t slice = fstr_slice(buffer, 0, n_read);
     if (out_more_hint != 0) {
@@ -1442,11 +1515,22 @@ fstr_t rio_write_chunk(rio_t* rio, fstr_t chunk, bool more_hint) {
     if (write_fd == -1)
         throw("the specified rio handle does not support the operation write", exception_arg);
     bool send_with_msg_more = (more_hint && rio->type == rio_type_tcp);
+    // Regular files are written with the io_uring engine when enabled, see rio_read_direct().
+    bool use_uring = (rio->type == rio_type_file && lwt_uring_is_enabled());
     ssize_t n_sent = 0;
     if (chunk.len > 0) {
         for (;;) {
             if (send_with_msg_more) {
                 n_sent = send(write_fd, chunk.str, chunk.len, MSG_DONTWAIT | MSG_MORE);
+            } else if (use_uring) {
+                n_sent = lwt_uring_write(write_fd, chunk.str, chunk.len);
+                if (n_sent == -1 && errno == EWOULDBLOCK) {
+                    n_sent = rio_file_uring_xfer_private(write_fd, (void*) chunk.str, chunk.len, true);
+                    if (n_sent == -1 && errno == ESPIPE) {
+                        use_uring = false;
+                        errno = EWOULDBLOCK;
+                    }
+                }
             } else {
                 n_sent = write(write_fd, chunk.str, chunk.len);
             }
@@ -2025,13 +2109,7 @@ uint64_t rio_alarm_wait(rio_t* rio) {
 }
 
 void rio_wait(uint128_t wait_ns) {
-    if (wait_ns == 0)
-        return;
-    sub_heap {
-        rio_t* timer_h = rio_timer_create();
-        rio_alarm_set(timer_h, wait_ns, false, 0);
-        rio_alarm_wait(timer_h);
-    }
+    lwt_sleep(wait_ns);
 }
 
 rio_t* rio_eventfd_create(int64_t init_value, bool semaphore) {
@@ -2146,8 +2224,12 @@ rio_epoll_t* rio_epoll_create_raw(int32_t target_fd, rio_epoll_event_t epoll_eve
 
 static bool rio_epoll_poll_internal(int32_t epoll_fd) {
     struct epoll_event events[1];
-    int32_t epoll_wait_r = epoll_wait(epoll_fd, events, LENGTHOF(events), 0);
-    if (epoll_wait_r == -1 && errno != EINTR)
+    int32_t epoll_wait_r;
+    // A pending preemption signal makes epoll_wait() fail with EINTR even though it does not block.
+    do {
+        epoll_wait_r = epoll_wait(epoll_fd, events, LENGTHOF(events), 0);
+    } while (epoll_wait_r == -1 && errno == EINTR);
+    if (epoll_wait_r == -1)
         RCD_SYSCALL_EXCEPTION(epoll_wait, exception_io);
     return (epoll_wait_r != 0);
 }
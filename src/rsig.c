@@ -42,11 +42,18 @@ const size_t rtsig_sigcancel_exit_offset = offsetof(siginfo_t, __si_fields.__rt.
 /// Built in handler for real time cancellation handling.
 void rsig_sigcancel_handler();
 
+/// Built in handler for time slice preemption.
+void rsig_sigpreempt_handler();
+
 /// Built in handler for segmentation failures. This is the low-handler that
 /// paves the way for the high-level handler to be safely called even though
 /// it has a segmented stack prologue.
 void rsig_sigsegv_low_handler();
 
+/// Built in handler for profiler samples. Like the segmentation failure
+/// low-handler it paves the way for the high-level sampler.
+void rsig_sigprof_low_handler();
+
 void rsig_thread_signal_mask_reset() {
     int r_rt_sigprocmask = rt_sigprocmask(SIG_SETMASK, &rsig_default_mask, 0);
     if (r_rt_sigprocmask == -1)
@@ -69,6 +76,15 @@ static void rsig_init_sys_signal_cfg(rsig_full_signal_cfg_t* rsig_full_scfg) {
     rsig_full_scfg->sig_cfgs[SIGUSR1].ignore = true;
     // For reasons that need to be researched, we handle the cancellation signal but must block it as well.
     rsig_full_scfg->sig_cfgs[LWT_ASYNC_CANCEL_SIGNAL].handler_fn = (void*) rsig_sigcancel_handler;
+    // The preemption signal is only sent to executors by their own timer. Restarting makes most syscalls transparent
+    // to it but nanosleep, epoll_wait and futex waits with a timeout still fail with EINTR and must be retried.
+    rsig_full_scfg->sig_cfgs[LWT_PREEMPT_SIGNAL].pass = true;
+    rsig_full_scfg->sig_cfgs[LWT_PREEMPT_SIGNAL].handler_fn = (void*) rsig_sigpreempt_handler;
+    rsig_full_scfg->sig_cfgs[LWT_PREEMPT_SIGNAL].restart = true;
+    // The profiler signal is only sent to executors by their own timer when the profiler is enabled.
+    rsig_full_scfg->sig_cfgs[LWT_PROFILER_SIGNAL].pass = true;
+    rsig_full_scfg->sig_cfgs[LWT_PROFILER_SIGNAL].handler_fn = (void*) rsig_sigprof_low_handler;
+    rsig_full_scfg->sig_cfgs[LWT_PROFILER_SIGNAL].restart = true;
 }
 
 __attribute__((weak))
@@ -109,6 +125,8 @@ void rsig_init() {
         } else {
             sa.handler = sig_cfg.handler_fn;
             sa.flags |= SA_SIGINFO | SA_RESTORER;
+            if (sig_cfg.restart)
+                sa.flags |= SA_RESTART;
         }
         // Initialize signal action now and expect it to be unchanged for the rest of the lifetime of the process.
         rsig_rt_sigaction(sig, &sa, 0);
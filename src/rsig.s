@@ -6,7 +6,9 @@
 
 .text
 .global rtsig_sigcancel_exit_offset
+.global lwt_sched_tick_offset
 .global rsig_sigsegv_high_handler
+.global lwt_profiler_sample
 
 /// function called by signal handler when receiving real-time signal 33 which we define to mean "cancel thread"
 /// this is the declaration in c:
@@ -27,6 +29,32 @@ rsig_sigcancel_handler:
     syscall
     hlt
 
+/// function called by signal handler when receiving real-time signal 34 which we define to mean "time slice expired"
+/// this is the declaration in c:
+/// static void rsig_sigpreempt_handler(int sig, siginfo_t* si, struct ucontext* uc) {
+///    lwt_physical_thread_t* phys_thread = LWT_PHYS_THREAD;
+///    if (phys_thread->sched_tick == phys_thread->preempt_tick) {
+///        phys_thread->preempt_pending = true;
+///    } else {
+///        phys_thread->preempt_tick = phys_thread->sched_tick;
+///    }
+/// }
+/// a fiber is only preempted after it has been running for a full time slice since the executor picked it
+/// we must however implement it in assembler as the interrupted fiber could be anywhere, including __morestack
+.global rsig_sigpreempt_handler
+rsig_sigpreempt_handler:
+    // %rax = &phys_thread->sched_tick, followed by preempt_tick and preempt_pending
+    mov %fs:0x0, %rax
+    add lwt_sched_tick_offset, %rax
+    mov (%rax), %rdx
+    cmp 0x8(%rax), %rdx
+    je 1f
+    mov %rdx, 0x8(%rax)
+    ret
+1:
+    movb $1, 0x10(%rax)
+    ret
+
 /// function called by signal handler when receiving signal 11 (SIGSEGV)
 /// it removes any segmented stack state for the thread so we can safely call the high level handler
 /// lwt ensures that worker threads are configured with a signal stack so even if we where in the
@@ -58,6 +86,27 @@ rsig_sigsegv_low_handler:
     // return so the program can crash the normal way it would when receiving this signal
     ret
 
+/// function called by signal handler when receiving SIGPROF which the per-executor profiler timer sends
+/// like the sigsegv handler it disables the end of stack so the high level handler can be called on the signal stack
+/// but the interrupted context continues to run afterwards so the end of stack must be restored before returning
+/// %r12 and %r13 are callee saved in the high level handler and restored by sigreturn so we are free to use them
+.global rsig_sigprof_low_handler
+rsig_sigprof_low_handler:
+    // save end of stack in %r12 and set it to the special value [0] to disable it
+    mov %fs:0x8, %r12
+    xor %r11, %r11
+    mov %r11, %fs:0x8
+    // call lwt_profiler_sample(uc, end_of_stack) with aligned stack
+    mov %rdx, %rdi
+    mov %r12, %rsi
+    mov %rsp, %r13
+    andq $-16, %rsp
+    call lwt_profiler_sample
+    mov %r13, %rsp
+    // restore end of stack
+    mov %r12, %fs:0x8
+    ret
+
 .data
 sigsegv_msg: .string "CRITICAL ERROR: SEGMENTATION FAILURE\n"
 sigsegv_msg_len = . -sigsegv_msg
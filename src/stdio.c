@@ -141,7 +141,7 @@ fiber_main stdio_file_fiber(fiber_main_attr, rio_t* rio_h) {
 
 static void stdio_init_file_handle(FILE* ret_fh, rio_t* rio_h) {
     fmitosis {
-        lwt_alloc_import(rio_h);
+        rio_h = lwt_alloc_import_reloc(rio_h);
         ret_fh->stdio_file_fid = spawn_static_fiber(stdio_file_fiber("", rio_h));
     }
 }
@@ -17,19 +17,30 @@ typedef struct vm_heap vm_heap_t;
 void* vm_mmap_reserve_sys(size_t min_size, size_t* size_out);
 void vm_mmap_unreserve_sys(void* ptr, size_t size);
 
+/// Returns the chunks cached by the current physical thread to the shared free lists. Must be called by physical
+/// threads that exit voluntarily or the chunks are lost.
+void vm_thread_cache_flush();
+
+/// Like vm_thread_cache_flush() but for the cache at the specified location. Used to reclaim the cache of a
+/// physical thread that was killed from the outside once it's gone.
+void vm_thread_cache_release(struct vm_thread_cache** cache_ptr);
+
 void vm_wait_for_janitor();
 void vm_janitor_notify_ptid(int32_t ptid);
 void vm_janitor_thread(void* arg_ptr);
 
 void* vm_heap_alloc_destructable(vm_heap_t* heap, size_t min_size, size_t* size_out, vm_destructor_t destructor_fn);
 void* vm_heap_alloc(vm_heap_t* heap, size_t min_size, size_t* size_out);
-bool vm_heap_escape(void* primary_ptr);
-bool vm_heap_import(vm_heap_t* require_sub_heap, vm_heap_t* dst_heap, void* primary_ptr);
+/// Arena allocations are copied when they are moved to another heap. The new location is written to out_primary_ptr.
+/// It's a core error to move an arena allocation when out_primary_ptr is 0.
+bool vm_heap_escape(void* primary_ptr, void** out_primary_ptr);
+bool vm_heap_import(vm_heap_t* require_sub_heap, vm_heap_t* dst_heap, void* primary_ptr, void** out_primary_ptr);
 bool vm_heap_has_allocs(vm_heap_t* heap);
 bool vm_heap_free(vm_heap_t* require_sub_heap, void* primary_ptr);
 size_t vm_heap_get_size(vm_heap_t* require_sub_heap, void* primary_ptr);
 
 vm_heap_t* vm_heap_release(vm_heap_t* heap, size_t n_returned_allocs, void* returned_allocs[]);
 vm_heap_t* vm_heap_create(vm_heap_t* parent_heap);
+vm_heap_t* vm_heap_create_arena(vm_heap_t* parent_heap);
 
 #endif	/* VM_INTERNAL_H */
@@ -48,6 +48,68 @@
 /// We start off with a 4 MB allocation of virtual memory in the pool.
 #define VM_POOL_MMAP_INIT_SIZE_2E 18
 
+/// Heap allocations up to this size (including the allocation headers) are carved from slabs with fine grained size
+/// classes instead of being rounded up to a power of two by the buddy allocator. Slab memory is never returned to the
+/// system so this must be smaller than PAGE_SIZE. The debug modes that track or guard every allocation in
+/// vm_mmap_reserve_sys() disable slabs.
+#if defined(VM_DEBUG_PAGE_AND_NOREUSE_ALLOCS) || defined(VM_DEBUG_GUARD_ZONE) || defined(VM_DEBUG_LEAK)
+# define VM_SLAB_MAX_SIZE (0)
+#else
+# define VM_SLAB_MAX_SIZE (3584)
+#endif
+
+/// Number of slab size classes: 16 byte steps up to 256 bytes, then four steps per power of two up to 3584 bytes.
+#define VM_SLAB_N_CLASSES (31)
+
+/// Size of the spans that slab objects are carved from.
+#define VM_SLAB_SPAN_SIZE (1UL << 16)
+
+/// Bytes of free slab objects a physical thread keeps per size class before returning half of them to the class.
+#define VM_SLAB_MAGAZINE_MAX_BYTES (1UL << 14)
+
+/// Arena heaps bump allocate from chunks that start at a page and double in size up to the max size. Allocations
+/// larger than a quarter of the max size and allocations with destructors use the normal linked heap allocations
+/// instead. Disabled by the debug modes that track or guard every allocation in vm_mmap_reserve_sys().
+#define VM_ARENA_CHUNK_MAX_SIZE (1UL << 16)
+#if defined(VM_DEBUG_PAGE_AND_NOREUSE_ALLOCS) || defined(VM_DEBUG_GUARD_ZONE) || defined(VM_DEBUG_LEAK)
+# define VM_ARENA_MAX_ALLOC_SIZE (0)
+#else
+# define VM_ARENA_MAX_ALLOC_SIZE (VM_ARENA_CHUNK_MAX_SIZE / 4)
+#endif
+
+/// Tag in the top bits of the size of arena allocations that tells them apart from linked heap allocations.
+#define VM_ARENA_ALLOC_TAG (0xa7e4000000000000UL)
+#define VM_ARENA_ALLOC_TAG_MASK (0xffff000000000000UL)
+
+/// Free chunks of up to 2^n lines (64 KB) are cached per physical thread in magazines. Page sized chunks that sit
+/// in a magazine can't be reclaimed by the janitor so the bytes cached per size class are bounded as well. Disabled
+/// by the debug mode that never reuses memory.
+#if defined(VM_DEBUG_PAGE_AND_NOREUSE_ALLOCS)
+# define VM_MAGAZINE_MAX_LINES_2E (0)
+#else
+# define VM_MAGAZINE_MAX_LINES_2E (11)
+#endif
+#define VM_MAGAZINE_MAX_CHUNKS (16)
+#define VM_MAGAZINE_MAX_BYTES (1UL << 18)
+
+/// Chunks flushed from the magazines of executors that are pinned to a NUMA node are kept in a depot of that node
+/// so they are reused on the node their pages were faulted in on. Like magazines the janitor can't reclaim chunks
+/// in a depot so it's bounded to four full magazines per size class. Executors on nodes above the max share the
+/// global free lists.
+#define VM_NODE_DEPOT_MAX_NODES (16)
+#define VM_NODE_DEPOT_MAX_MAGAZINES (4)
+
+/// Bytes a thread cache counts as allocated or freed before folding them into vm_total_allocated_bytes, bounding how
+/// far the exported total drifts from the exact one per physical thread.
+#define VM_TOTAL_ALLOCATED_FOLD_BYTES (1L << 16)
+
+/// Free chunks of a size class the janitor copies the addresses of at once when merging buddies. Bounds the stack it
+/// uses and the time it holds the free list lock for each batch.
+#define VM_COALESCE_BATCH_CHUNKS (256)
+
+/// Size of the huge pages that large pool regions are backed with when enabled with vm_set_huge_pages().
+#define VM_HUGE_PAGE_SIZE (1UL << 21)
+
 /// Delta janitor thread priority.
 #define VM_JANITOR_NICENESS_DELTA (10)
 
@@ -111,6 +173,50 @@ typedef struct vm_state {
     int32_t janitor_wait_state;
 } vm_state_t;
 
+/// A slab size class. Objects are carved from spans reserved from the buddy allocator and recycled through a free
+/// list. Spans are never split up again, just like small buddy chunks are never reclaimed.
+typedef struct vm_slab_class {
+    int8_t lock;
+    /// Free objects linked by their first qword.
+    void* free_list;
+    /// The part of the latest span that has not been carved yet. Objects are carved on demand so span memory is
+    /// not touched before it's used.
+    void* span_ptr;
+    void* span_end;
+} __attribute__((aligned(64))) vm_slab_class_t;
+
+/// A stack of free chunks of a single size class.
+typedef struct vm_magazine {
+    uint32_t n_chunks;
+    void* chunks[VM_MAGAZINE_MAX_CHUNKS];
+} vm_magazine_t;
+
+/// Magazines of a physical thread, indexed by lines_2e. Chunks are moved between the magazines and the shared free
+/// lists in batches so most reservations don't touch any shared state. Only accessed by the owning physical thread
+/// or, once it's gone, by the thread that reclaims it.
+typedef struct vm_thread_cache {
+    vm_magazine_t magazines[VM_MAGAZINE_MAX_LINES_2E + 1];
+    /// Free slab objects, indexed by slab class.
+    vm_magazine_t slab_magazines[VM_SLAB_N_CLASSES];
+    /// Bytes allocated minus bytes freed by the physical thread that are not yet folded into vm_total_allocated_bytes.
+    int64_t allocated_bytes;
+    /// Bytes reserved minus bytes unreserved by the physical thread per size class, indexed by lines_2e. Can be
+    /// negative as chunks are often unreserved by another thread than the one that reserved them.
+    int64_t class_allocated_bytes[VM_MAX_SIZE_2E + 1];
+    /// Links in the list of thread caches that vm_get_stats() sums the counters of.
+    struct vm_thread_cache* next;
+    struct vm_thread_cache* prev;
+} vm_thread_cache_t;
+
+/// Free chunks that were last used on a NUMA node, indexed by lines_2e.
+typedef struct vm_node_depot {
+    int8_t lock;
+    uint32_t n_chunks[VM_MAGAZINE_MAX_LINES_2E + 1];
+    void* chunks[VM_MAGAZINE_MAX_LINES_2E + 1][VM_MAGAZINE_MAX_CHUNKS * VM_NODE_DEPOT_MAX_MAGAZINES];
+} __attribute__((aligned(64))) vm_node_depot_t;
+
+static vm_node_depot_t vm_node_depots[VM_NODE_DEPOT_MAX_NODES];
+
 typedef struct vm_heap_destructor_hdr {
     vm_destructor_t destructor_fn;
 } vm_heap_destructor_hdr_t;
@@ -140,9 +246,34 @@ typedef struct vm_heap_alloc_hdr {
 
 CASSERT(sizeof(vm_heap_alloc_hdr_t) == 32);
 
+/// Arena allocations are not linked together as they are released with the chunk they were bumped from.
+/// The size tag overlaps the next field of vm_heap_alloc_hdr_t which is a user space pointer and never has the tag bits set.
+typedef struct vm_arena_alloc_hdr {
+    /// Checksum protected heap the allocation is member of.
+    vm_csheap_t heap;
+    /// Size of the allocation, tagged with VM_ARENA_ALLOC_TAG.
+    uint64_t size_tag;
+} vm_arena_alloc_hdr_t;
+
+CASSERT(sizeof(vm_arena_alloc_hdr_t) == 16);
+CASSERT(offsetof(vm_heap_alloc_hdr_t, next) + sizeof(uint64_t) == sizeof(vm_heap_alloc_hdr_t));
+
+typedef struct vm_arena_chunk {
+    struct vm_arena_chunk* next;
+    size_t size;
+} vm_arena_chunk_t;
+
+CASSERT(sizeof(vm_arena_chunk_t) % VM_ALLOC_ALIGN == 0);
+
 struct vm_heap {
     struct vm_heap* parent;
     vm_heap_alloc_hdr_t* alloc_headers;
+    /// True if small allocations are bumped from arena chunks.
+    bool is_arena;
+    /// Arena chunks, newest first, and the part of the newest chunk that is not allocated yet.
+    vm_arena_chunk_t* arena_chunks;
+    void* arena_ptr;
+    void* arena_end;
 };
 
 #if defined(VM_DEBUG_LEAK)
@@ -181,8 +312,48 @@ vm_state_t vm_state = {
     .pool_mmap_end_2e = VM_POOL_MMAP_INIT_SIZE_2E,
 };
 
+static vm_slab_class_t vm_slab_classes[VM_SLAB_N_CLASSES] = {{0}};
+
+/// Bytes allocated by physical threads whose thread cache has been released or that had none when allocating plus the
+/// bytes live thread caches have folded in. Thread caches fold their count under vm_thread_caches_lock.
 size_t vm_total_allocated_bytes = 0;
 
+/// Bytes allocated per size class by physical threads whose thread cache has been released, indexed by lines_2e.
+/// Live threads count in their thread cache so reservations don't contend on shared counters.
+static int64_t vm_class_allocated_bytes[VM_MAX_SIZE_2E + 1] = {0};
+
+/// Thread caches of live physical threads. The lock protects the list and the counters of released caches.
+static vm_thread_cache_t* vm_thread_caches = 0;
+static int8_t vm_thread_caches_lock = 0;
+
+/// Kind of huge pages new pool regions are mapped with. Written once at startup.
+static vm_huge_pages_t vm_huge_pages = vm_huge_pages_none;
+
+/// Pool regions mapped from the system. Buddy chunks are aligned to their size relative to the start of their region.
+/// Only appended to while holding free_vm_list_lock. The janitor reads the table without the lock but only looks up
+/// chunks from regions that were added before the chunks were handed out. There is room for every region as each
+/// region is at least twice as large as the previous one.
+typedef struct vm_pool_region {
+    void* start_ptr;
+    size_t size;
+    bool is_huge;
+    /// Mapped from the reserved hugetlb pages rather than backed by transparent huge pages.
+    bool is_hugetlb;
+} vm_pool_region_t;
+
+static vm_pool_region_t vm_pool_regions[VM_MAX_SIZE_2E];
+static volatile uint8_t vm_n_pool_regions = 0;
+static bool vm_has_hugetlb_regions = false;
+static size_t vm_pool_bytes = 0;
+static size_t vm_huge_page_bytes = 0;
+
+/// Number of buddy chunk pairs merged by the janitor. Only written by the janitor thread.
+static uint64_t vm_coalesced_chunks = 0;
+
+/// Bytes and segments returned to the system by the janitor. Only written by the janitor thread.
+static uint64_t vm_janitor_reclaimed_bytes = 0;
+static uint64_t vm_janitor_reclaimed_mmaps = 0;
+
 /// Increase this size when new x86_64 architecture allows additional bits of
 /// virtual memory addressing in user space.
 const uint8_t vm_linux_x86_64_virtual_memory_user_space_size_2e = 47;
@@ -234,6 +405,16 @@ static uint8_t vm_page_size_lines_2e() {
     return vm_bytes_to_lines_2e(PAGE_SIZE, false);
 }
 
+/// "Lock free" update of memory usage statistics.
+static void vm_stats_add(size_t* counter, int64_t delta) {
+    for (;;) {
+        uint64_t old_total = *counter;
+        uint64_t new_total = old_total + delta;
+        if (atomic_cas_uint64(counter, old_total, new_total))
+            break;
+    }
+}
+
 static void vm_mmap_failure(size_t len) {
     int32_t err = errno;
     const char* errno_cstr = strerror(err);
@@ -320,74 +501,568 @@ static void vm_free_mmap_index(vm_mmap_index_t* mmap_index) {
     } atomic_spinlock_unlock(&vm_state.free_map_ranges_lock);
 }
 
+/// Pops a dirty segment of the specified size class. Caller must hold dirty_mmaps_lock.
+static void* vm_dirty_mmap_pop(uint8_t lines_2e) {
+    vm_dirty_mmap_index_t* dirty_mmap_size_index = vm_state.dirty_mmap_sizes[lines_2e];
+    if (dirty_mmap_size_index == 0)
+        return 0;
+    // DBG_RAW("[vm/vm_free_list_pop] popping 32*2e^", DBG_INT(lines_2e), " range from dirty vm\n");
+    vm_dirty_mmap_t* dirty_mmap = ((void*) dirty_mmap_size_index) - offsetof(vm_dirty_mmap_t, size_index);
+    vm_dirty_mmap_index_t** dirty_mmap_queue = (dirty_mmap->is_new? &vm_state.new_dirty_mmap_queue: &vm_state.old_dirty_mmap_queue);
+    DL_DELETE(*dirty_mmap_queue, &dirty_mmap->queue_index);
+    DL_DELETE(vm_state.dirty_mmap_sizes[dirty_mmap->size_2e], &dirty_mmap->size_index);
+    return dirty_mmap->start_ptr;
+}
+
+/// Passes a segment to the janitor so it can let the system reclaim it. Caller must hold dirty_mmaps_lock.
+static void vm_dirty_mmap_push(void* ptr, uint8_t lines_2e) {
+    vm_dirty_mmap_t* dirty_mmap = ptr;
+    dirty_mmap->start_ptr = ptr;
+    dirty_mmap->size_2e = lines_2e;
+    dirty_mmap->is_new = true;
+    DL_APPEND(vm_state.new_dirty_mmap_queue, &dirty_mmap->queue_index);
+    DL_PREPEND(vm_state.dirty_mmap_sizes[lines_2e], &dirty_mmap->size_index);
+    if (vm_state.janitor_wait_state == 1) {
+        vm_state.janitor_wait_state = 0;
+        int32_t futex_r = futex((int32_t*) &vm_state.janitor_wait_state, FUTEX_WAKE, 1, 0, 0, 0);
+        if (futex_r == -1)
+            RCD_SYSCALL_EXCEPTION(futex, exception_fatal);
+    }
+}
+
+static void vm_pool_region_add(void* start_ptr, size_t size, bool is_huge, bool is_hugetlb) {
+    if (vm_n_pool_regions == LENGTHOF(vm_pool_regions))
+        VM_CORE_ERROR("librcd/vm_pool_region_add: pool region table is full");
+    vm_pool_regions[vm_n_pool_regions] = (vm_pool_region_t) {
+        .start_ptr = start_ptr, .size = size, .is_huge = is_huge, .is_hugetlb = is_hugetlb
+    };
+    sync_synchronize();
+    vm_n_pool_regions++;
+    vm_stats_add(&vm_pool_bytes, size);
+    if (is_huge)
+        vm_stats_add(&vm_huge_page_bytes, size);
+    if (is_hugetlb)
+        vm_has_hugetlb_regions = true;
+}
+
+static vm_pool_region_t* vm_pool_region_find(void* ptr) {
+    uint8_t n_pool_regions = vm_n_pool_regions;
+    sync_synchronize();
+    for (uint8_t i = 0; i < n_pool_regions; i++) {
+        if (ptr >= vm_pool_regions[i].start_ptr && ptr < vm_pool_regions[i].start_ptr + vm_pool_regions[i].size)
+            return &vm_pool_regions[i];
+    }
+    return 0;
+}
+
+/// Chunks smaller than a huge page in huge page regions can't be returned to the system. Neither can any chunk in
+/// hugetlb regions as kernels before 5.18 fail MADV_DONTNEED on hugetlb pages.
+static bool vm_is_in_huge_page(void* ptr, size_t size) {
+    if (size >= VM_HUGE_PAGE_SIZE && !vm_has_hugetlb_regions)
+        return false;
+    vm_pool_region_t* region = vm_pool_region_find(ptr);
+    return (region != 0 && region->is_huge && (region->is_hugetlb || size < VM_HUGE_PAGE_SIZE));
+}
+
+/// Maps a new pool region, backed by huge pages when it's large enough and they are enabled. Caller must hold
+/// free_vm_list_lock.
+static void* vm_pool_mmap(size_t size) {
+    if (vm_huge_pages == vm_huge_pages_none || size < VM_HUGE_PAGE_SIZE) {
+        void* mmap_r = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mmap_r == MAP_FAILED)
+            vm_mmap_failure(size);
+        vm_pool_region_add(mmap_r, size, false, false);
+        return mmap_r;
+    }
+    void* start_ptr = MAP_FAILED;
+    if (vm_huge_pages == vm_huge_pages_hugetlb) {
+        // Fails when not enough hugetlb pages are reserved in the system.
+        start_ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    bool is_hugetlb = (start_ptr != MAP_FAILED);
+    if (!is_hugetlb) {
+        // Transparent huge pages can only back huge page aligned memory so we map an extra huge page and trim the
+        // mapping to be aligned. The pool sizes are powers of two so all buddy chunks of huge page size or larger
+        // in the region are then aligned as well.
+        size_t mmap_size = size + VM_HUGE_PAGE_SIZE;
+        void* mmap_r = mmap(0, mmap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mmap_r == MAP_FAILED)
+            vm_mmap_failure(mmap_size);
+        start_ptr = (void*) vm_align_ceil((uintptr_t) mmap_r, VM_HUGE_PAGE_SIZE);
+        size_t head_size = start_ptr - mmap_r;
+        if (head_size > 0 && munmap(mmap_r, head_size) == -1)
+            VM_CORE_ERROR("librcd/vm_pool_mmap: munmap failed");
+        if (head_size < VM_HUGE_PAGE_SIZE && munmap(start_ptr + size, VM_HUGE_PAGE_SIZE - head_size) == -1)
+            VM_CORE_ERROR("librcd/vm_pool_mmap: munmap failed");
+        // This is only advice, transparent huge pages might be disabled in the system.
+        (void) madvise(start_ptr, size, MADV_HUGEPAGE);
+    }
+    vm_pool_region_add(start_ptr, size, true, is_hugetlb);
+    return start_ptr;
+}
+
+void vm_set_huge_pages(vm_huge_pages_t huge_pages) {
+#if !defined(VM_DEBUG_PAGE_AND_NOREUSE_ALLOCS) && !defined(VM_DEBUG_GUARD_ZONE)
+    vm_huge_pages = huge_pages;
+#endif
+}
+
+/// Pops a clean segment of the specified size class, splitting larger segments or querying the system for more
+/// memory as required. Caller must hold free_vm_list_lock.
+static void* vm_clean_mmap_pop(uint8_t lines_2e) {
+    void* start_ptr;
+    // DBG_RAW("[vm/vm_free_list_pop] popping 32*2e^", DBG_INT(lines_2e), " range from from pure vm\n");
+    vm_mmap_index_t* mmap_index = vm_state.free_vm_list[lines_2e];
+    if (mmap_index != 0) {
+        start_ptr = mmap_index->start_ptr;
+        vm_state.free_vm_list[lines_2e] = mmap_index->next;
+        vm_free_mmap_index(mmap_index);
+    } else {
+        // Find a larger segment and use instead.
+        uint8_t larger_lines_2e = lines_2e + 1;
+        for (;; larger_lines_2e++) {
+            if (larger_lines_2e == VM_MAX_SIZE_2E)
+                VM_CORE_ERROR("librcd/vm_free_list_pop: ran out virtual memory on system");
+            if (larger_lines_2e >= vm_state.pool_mmap_end_2e) {
+                // DBG_RAW("[vm/vm_free_list_pop] no available 32*2e^", DBG_INT(lines_2e), " chunk, querying system for larger 2e^", DBG_INT(larger_lines_2e), " chunk\n");
+                // We reached or passed the size class of the segment we initialized the pool with last time. This means that there
+                // is either not enough free memory in the pool or the memory is not contiguous enough. Query the system for more memory.
+                start_ptr = vm_pool_mmap(vm_lines_2e_to_bytes(larger_lines_2e));
+                // We double the amount of memory we require each time this exhaustion happens as calling mmap() is a waste of time we'd like to avoid.
+                vm_state.pool_mmap_end_2e = larger_lines_2e + 1;
+                break;
+            }
+            // Query the next size class.
+            vm_mmap_index_t* mmap_index = vm_state.free_vm_list[larger_lines_2e];
+            if (mmap_index != 0) {
+                // DBG_RAW("[vm/vm_free_list_pop] no available 32*2e^", DBG_INT(lines_2e), " chunk, splitting larger 2e^", DBG_INT(larger_lines_2e), " chunk\n");
+                start_ptr = mmap_index->start_ptr;
+                vm_state.free_vm_list[larger_lines_2e] = mmap_index->next;
+                vm_free_mmap_index(mmap_index);
+                break;
+            }
+        }
+        // We need to index the smaller chunks immediately before unlocking to prevent parallel pop's from trying to smash chunks as well or return out of memory.
+        void* cur_split_ptr = start_ptr + vm_lines_2e_to_bytes(larger_lines_2e);
+        for (uint8_t split_lines_2e = larger_lines_2e - 1; split_lines_2e >= lines_2e; split_lines_2e--) {
+            cur_split_ptr -= vm_lines_2e_to_bytes(split_lines_2e);
+            vm_free_list_push(cur_split_ptr, split_lines_2e, true);
+        }
+    }
+    // DBG_RAW("[vm/vm_free_list_pop] returning range [", DBG_PTR(start_ptr), "]-[", DBG_PTR(start_ptr + vm_lines_2e_to_bytes(lines_2e)), "]\n");
+    return start_ptr;
+}
+
 static void* vm_free_list_pop(uint8_t lines_2e) {
     if (lines_2e > VM_MAX_SIZE_2E || lines_2e == 0)
         VM_CORE_ERROR("librcd/vm_free_list_pop: got invalid chunk size");
-    uint8_t page_size_lines_2e = vm_page_size_lines_2e();
     void* start_ptr = 0;
-    if (lines_2e >= page_size_lines_2e) {
+    if (lines_2e >= vm_page_size_lines_2e()) {
         // First priority is always to reuse an already dirty segment saving us from the wasted work of having to clean it up and remap it to physical memory.
         atomic_spinlock_lock(&vm_state.dirty_mmaps_lock); {
-            vm_dirty_mmap_index_t* dirty_mmap_size_index = vm_state.dirty_mmap_sizes[lines_2e];
-            if (dirty_mmap_size_index != 0) {
-                // DBG_RAW("[vm/vm_free_list_pop] popping 32*2e^", DBG_INT(lines_2e), " range from dirty vm\n");
-                vm_dirty_mmap_t* dirty_mmap = ((void*) dirty_mmap_size_index) - offsetof(vm_dirty_mmap_t, size_index);
-                vm_dirty_mmap_index_t** dirty_mmap_queue = (dirty_mmap->is_new? &vm_state.new_dirty_mmap_queue: &vm_state.old_dirty_mmap_queue);
-                DL_DELETE(*dirty_mmap_queue, &dirty_mmap->queue_index);
-                DL_DELETE(vm_state.dirty_mmap_sizes[dirty_mmap->size_2e], &dirty_mmap->size_index);
-                start_ptr = dirty_mmap->start_ptr;
-            }
+            start_ptr = vm_dirty_mmap_pop(lines_2e);
         } atomic_spinlock_unlock(&vm_state.dirty_mmaps_lock);
     }
     if (start_ptr == 0) {
         // If we can't reuse a dirty segment we aquire a clean one instead from the pure virtual memory.
         atomic_spinlock_lock(&vm_state.free_vm_list_lock); {
-            // DBG_RAW("[vm/vm_free_list_pop] popping 32*2e^", DBG_INT(lines_2e), " range from from pure vm\n");
+            start_ptr = vm_clean_mmap_pop(lines_2e);
+        } atomic_spinlock_unlock(&vm_state.free_vm_list_lock);
+    }
+    return start_ptr;
+}
+
+static uint32_t vm_magazine_capacity(uint8_t lines_2e) {
+    return MIN(VM_MAGAZINE_MAX_CHUNKS, VM_MAGAZINE_MAX_BYTES / vm_lines_2e_to_bytes(lines_2e));
+}
+
+/// Fills half of an empty magazine from the node depot and then the shared free lists, locking them at most once each.
+static void vm_magazine_refill(vm_magazine_t* magazine, uint8_t lines_2e, vm_node_depot_t* node_depot) {
+    uint32_t n_refill = MAX(vm_magazine_capacity(lines_2e) / 2, 1);
+    if (node_depot != 0 && node_depot->n_chunks[lines_2e] > 0) {
+        atomic_spinlock_lock(&node_depot->lock); {
+            while (magazine->n_chunks < n_refill && node_depot->n_chunks[lines_2e] > 0)
+                magazine->chunks[magazine->n_chunks++] = node_depot->chunks[lines_2e][--node_depot->n_chunks[lines_2e]];
+        } atomic_spinlock_unlock(&node_depot->lock);
+    }
+    if (magazine->n_chunks < n_refill && lines_2e >= vm_page_size_lines_2e()) {
+        atomic_spinlock_lock(&vm_state.dirty_mmaps_lock); {
+            for (void* start_ptr; magazine->n_chunks < n_refill && (start_ptr = vm_dirty_mmap_pop(lines_2e)) != 0;)
+                magazine->chunks[magazine->n_chunks++] = start_ptr;
+        } atomic_spinlock_unlock(&vm_state.dirty_mmaps_lock);
+    }
+    if (magazine->n_chunks < n_refill) {
+        atomic_spinlock_lock(&vm_state.free_vm_list_lock); {
+            while (magazine->n_chunks < n_refill)
+                magazine->chunks[magazine->n_chunks++] = vm_clean_mmap_pop(lines_2e);
+        } atomic_spinlock_unlock(&vm_state.free_vm_list_lock);
+    }
+}
+
+/// Returns the oldest chunks in a magazine to the node depot and, when it's full, to the shared free lists until
+/// n_keep chunks remain.
+static void vm_magazine_flush(vm_magazine_t* magazine, uint8_t lines_2e, uint32_t n_keep, vm_node_depot_t* node_depot) {
+    if (magazine->n_chunks <= n_keep)
+        return;
+    uint32_t n_flush = magazine->n_chunks - n_keep;
+    uint32_t i = 0;
+    if (node_depot != 0) {
+        uint32_t depot_capacity = vm_magazine_capacity(lines_2e) * VM_NODE_DEPOT_MAX_MAGAZINES;
+        atomic_spinlock_lock(&node_depot->lock); {
+            for (; i < n_flush && node_depot->n_chunks[lines_2e] < depot_capacity; i++)
+                node_depot->chunks[lines_2e][node_depot->n_chunks[lines_2e]++] = magazine->chunks[i];
+        } atomic_spinlock_unlock(&node_depot->lock);
+    }
+    if (i == n_flush) {
+        // Everything fit in the node depot.
+    } else if (lines_2e >= vm_page_size_lines_2e()) {
+        atomic_spinlock_lock(&vm_state.dirty_mmaps_lock); {
+            for (; i < n_flush; i++)
+                vm_dirty_mmap_push(magazine->chunks[i], lines_2e);
+        } atomic_spinlock_unlock(&vm_state.dirty_mmaps_lock);
+    } else {
+        atomic_spinlock_lock(&vm_state.free_vm_list_lock); {
+            for (; i < n_flush; i++)
+                vm_free_list_push(magazine->chunks[i], lines_2e, true);
+        } atomic_spinlock_unlock(&vm_state.free_vm_list_lock);
+    }
+    memmove(magazine->chunks, magazine->chunks + n_flush, n_keep * sizeof(void*));
+    magazine->n_chunks = n_keep;
+}
+
+/// Returns the depot of the NUMA node the current physical thread is pinned to or 0 if it has none.
+static vm_node_depot_t* vm_node_depot_get() {
+    int32_t numa_node = lwt_get_numa_node();
+    return (numa_node >= 0 && numa_node < VM_NODE_DEPOT_MAX_NODES? &vm_node_depots[numa_node]: 0);
+}
+
+static vm_thread_cache_t* vm_thread_cache_get() {
+    vm_thread_cache_t** cache_ptr = lwt_get_vm_thread_cache_ptr();
+    if (*cache_ptr == 0) {
+        vm_thread_cache_t* cache = vm_free_list_pop(vm_bytes_to_lines_2e(sizeof(vm_thread_cache_t), true));
+        memset(cache, 0, sizeof(vm_thread_cache_t));
+        atomic_spinlock_lock(&vm_thread_caches_lock); {
+            DL_PREPEND(vm_thread_caches, cache);
+        } atomic_spinlock_unlock(&vm_thread_caches_lock);
+        *cache_ptr = cache;
+    }
+    return *cache_ptr;
+}
+
+/// Counts bytes allocated (or freed when negative) by the physical thread of the cache and folds the count into
+/// vm_total_allocated_bytes when it has drifted far enough.
+static void vm_thread_cache_count_allocated(vm_thread_cache_t* cache, int64_t delta) {
+    cache->allocated_bytes += delta;
+    if (cache->allocated_bytes >= VM_TOTAL_ALLOCATED_FOLD_BYTES || cache->allocated_bytes <= -VM_TOTAL_ALLOCATED_FOLD_BYTES) {
+        atomic_spinlock_lock(&vm_thread_caches_lock); {
+            vm_stats_add(&vm_total_allocated_bytes, cache->allocated_bytes);
+            cache->allocated_bytes = 0;
+        } atomic_spinlock_unlock(&vm_thread_caches_lock);
+    }
+}
+
+static void* vm_thread_cache_pop(uint8_t lines_2e) {
+    vm_magazine_t* magazine = &vm_thread_cache_get()->magazines[lines_2e];
+    if (magazine->n_chunks == 0)
+        vm_magazine_refill(magazine, lines_2e, vm_node_depot_get());
+    return magazine->chunks[--magazine->n_chunks];
+}
+
+static void vm_thread_cache_push(void* ptr, uint8_t lines_2e) {
+    vm_magazine_t* magazine = &vm_thread_cache_get()->magazines[lines_2e];
+    uint32_t capacity = vm_magazine_capacity(lines_2e);
+    if (magazine->n_chunks == capacity)
+        vm_magazine_flush(magazine, lines_2e, capacity / 2, vm_node_depot_get());
+    magazine->chunks[magazine->n_chunks++] = ptr;
+}
+
+/// Returns the slab size class of an allocation of at most VM_SLAB_MAX_SIZE bytes.
+static size_t vm_slab_class_index(size_t size) {
+    if (size <= 256)
+        return (MAX(size, 1) + 15) / 16 - 1;
+    // Four classes per power of two: (5, 6, 7, 8) * 2^(size_2e - 2).
+    uint8_t size_2e = vm_log2(size - 1);
+    return 16 + (size_2e - 8) * 4 + (((size - 1) >> (size_2e - 2)) - 4);
+}
+
+static size_t vm_slab_class_size(size_t class_i) {
+    if (class_i < 16)
+        return (class_i + 1) * 16;
+    size_t step_i = class_i - 16;
+    return ((step_i % 4) + 5) << (step_i / 4 + 6);
+}
+
+static uint32_t vm_slab_magazine_capacity(size_t class_i) {
+    return MIN(VM_MAGAZINE_MAX_CHUNKS, MAX(VM_SLAB_MAGAZINE_MAX_BYTES / vm_slab_class_size(class_i), 2));
+}
+
+/// Takes a free object from a slab class, carving a new span when it has none. Must hold the class lock.
+static void* vm_slab_class_pop(vm_slab_class_t* slab_class, size_t class_size) {
+    void* ptr = slab_class->free_list;
+    if (ptr != 0) {
+        slab_class->free_list = *((void**) ptr);
+        return ptr;
+    }
+    if (slab_class->span_ptr + class_size > slab_class->span_end) {
+        // The span is used up, the remainder that is too small for an object is wasted.
+        slab_class->span_ptr = vm_mmap_reserve(VM_SLAB_SPAN_SIZE, 0);
+        slab_class->span_end = slab_class->span_ptr + VM_SLAB_SPAN_SIZE;
+        // Only the objects carved from spans count as allocated. Reserving the span created the thread cache.
+        (*lwt_get_vm_thread_cache_ptr())->allocated_bytes -= VM_SLAB_SPAN_SIZE;
+    }
+    ptr = slab_class->span_ptr;
+    slab_class->span_ptr += class_size;
+    return ptr;
+}
+
+/// Returns the oldest objects in a slab magazine to the free list of their class until n_keep objects remain.
+static void vm_slab_magazine_flush(vm_magazine_t* magazine, size_t class_i, uint32_t n_keep) {
+    if (magazine->n_chunks <= n_keep)
+        return;
+    uint32_t n_flush = magazine->n_chunks - n_keep;
+    vm_slab_class_t* slab_class = &vm_slab_classes[class_i];
+    atomic_spinlock_lock(&slab_class->lock); {
+        for (uint32_t i = 0; i < n_flush; i++) {
+            *((void**) magazine->chunks[i]) = slab_class->free_list;
+            slab_class->free_list = magazine->chunks[i];
+        }
+    } atomic_spinlock_unlock(&slab_class->lock);
+    memmove(magazine->chunks, magazine->chunks + n_flush, n_keep * sizeof(void*));
+    magazine->n_chunks = n_keep;
+}
+
+/// Returns the thread cache for slab allocations. Creating it can take the free list lock which must not happen on a
+/// fiber stack, so fibers on physical threads that have not reserved any chunk yet get 0 and use the classes directly.
+static vm_thread_cache_t* vm_slab_thread_cache_get() {
+    return (LWT_READ_STACK_LIMIT == 0? vm_thread_cache_get(): *lwt_get_vm_thread_cache_ptr());
+}
+
+/// Allocates an object of at least min_size bytes from the slab of its size class, through the magazine of the
+/// physical thread so the class lock is only taken once per batch of objects.
+/// Like vm_mmap_reserve() the object is counted as allocated, free span and magazine memory is not.
+static void* vm_slab_alloc(size_t min_size, size_t* size_out) {
+    size_t class_i = vm_slab_class_index(min_size);
+    size_t class_size = vm_slab_class_size(class_i);
+    vm_slab_class_t* slab_class = &vm_slab_classes[class_i];
+    void* ptr;
+    // The fibers of a physical thread share its magazines. Counting as a held spinlock keeps them from being
+    // preempted while one of them uses the magazine.
+    atomic_spinlock_held_add(1); {
+        vm_thread_cache_t* cache = vm_slab_thread_cache_get();
+        if (cache != 0) {
+            vm_magazine_t* magazine = &cache->slab_magazines[class_i];
+            if (magazine->n_chunks == 0) {
+                uint32_t n_refill = vm_slab_magazine_capacity(class_i) / 2;
+                atomic_spinlock_lock(&slab_class->lock); {
+                    while (magazine->n_chunks < n_refill)
+                        magazine->chunks[magazine->n_chunks++] = vm_slab_class_pop(slab_class, class_size);
+                } atomic_spinlock_unlock(&slab_class->lock);
+            }
+            ptr = magazine->chunks[--magazine->n_chunks];
+            vm_thread_cache_count_allocated(cache, class_size);
+        } else {
+            atomic_spinlock_lock(&slab_class->lock); {
+                ptr = vm_slab_class_pop(slab_class, class_size);
+            } atomic_spinlock_unlock(&slab_class->lock);
+            vm_stats_add(&vm_total_allocated_bytes, class_size);
+        }
+    } atomic_spinlock_held_add(-1);
+    if (size_out != 0)
+        *size_out = class_size;
+#if defined(DEBUG)
+    // Fill small chunks with 0xa0 in debug to reduce the chance that code that expects them to be initialized to 0 works by accident.
+    memset(ptr, 0xa0, MIN(0x200, class_size));
+#endif
+    return ptr;
+}
+
+/// Returns an object allocated with vm_slab_alloc() with the same min_size to the magazine of the physical thread.
+static void vm_slab_free(void* ptr, size_t min_size) {
+    size_t class_i = vm_slab_class_index(min_size);
+    size_t class_size = vm_slab_class_size(class_i);
+    vm_slab_class_t* slab_class = &vm_slab_classes[class_i];
+#if defined(DEBUG)
+    // Fill small chunks with 0xfe in debug to reduce the chance that code that uses them afterwards to work by accident.
+    memset(ptr, 0xfe, MIN(0x200, class_size));
+#endif
+    atomic_spinlock_held_add(1); {
+        vm_thread_cache_t* cache = vm_slab_thread_cache_get();
+        if (cache != 0) {
+            vm_magazine_t* magazine = &cache->slab_magazines[class_i];
+            uint32_t capacity = vm_slab_magazine_capacity(class_i);
+            if (magazine->n_chunks == capacity)
+                vm_slab_magazine_flush(magazine, class_i, capacity / 2);
+            magazine->chunks[magazine->n_chunks++] = ptr;
+            vm_thread_cache_count_allocated(cache, -(int64_t) class_size);
+        } else {
+            atomic_spinlock_lock(&slab_class->lock); {
+                *((void**) ptr) = slab_class->free_list;
+                slab_class->free_list = ptr;
+            } atomic_spinlock_unlock(&slab_class->lock);
+            vm_stats_add(&vm_total_allocated_bytes, -(int64_t) class_size);
+        }
+    } atomic_spinlock_held_add(-1);
+}
+
+void vm_thread_cache_flush() {
+    vm_thread_cache_release(lwt_get_vm_thread_cache_ptr());
+}
+
+void vm_thread_cache_release(vm_thread_cache_t** cache_ptr) {
+    vm_thread_cache_t* cache = *cache_ptr;
+    if (cache == 0)
+        return;
+    for (uint8_t lines_2e = 1; lines_2e <= VM_MAGAZINE_MAX_LINES_2E; lines_2e++)
+        vm_magazine_flush(&cache->magazines[lines_2e], lines_2e, 0, 0);
+    for (size_t class_i = 0; class_i < VM_SLAB_N_CLASSES; class_i++)
+        vm_slab_magazine_flush(&cache->slab_magazines[class_i], class_i, 0);
+    atomic_spinlock_lock(&vm_thread_caches_lock); {
+        vm_stats_add(&vm_total_allocated_bytes, cache->allocated_bytes);
+        for (uint8_t lines_2e = 1; lines_2e <= VM_MAX_SIZE_2E; lines_2e++)
+            vm_class_allocated_bytes[lines_2e] += cache->class_allocated_bytes[lines_2e];
+        DL_DELETE(vm_thread_caches, cache);
+    } atomic_spinlock_unlock(&vm_thread_caches_lock);
+    *cache_ptr = 0;
+    // The cache was written to so it's dirty unless it's too small to be returned to the system.
+    uint8_t lines_2e = vm_bytes_to_lines_2e(sizeof(vm_thread_cache_t), true);
+    if (lines_2e >= vm_page_size_lines_2e()) {
+        atomic_spinlock_lock(&vm_state.dirty_mmaps_lock); {
+            vm_dirty_mmap_push(cache, lines_2e);
+        } atomic_spinlock_unlock(&vm_state.dirty_mmaps_lock);
+    } else {
+        vm_free_list_push(cache, lines_2e, false);
+    }
+}
+
+static int32_t vm_ptr_cmp(const void* a, const void* b) {
+    void *ptr_a = *((void**) a), *ptr_b = *((void**) b);
+    return ptr_a > ptr_b? 1: (ptr_a < ptr_b? -1: 0);
+}
+
+/// Returns the index of ptr in a sorted array of pointers or -1 if it's not in it.
+static ssize_t vm_ptr_search(void* ptrs[], size_t n_ptrs, void* ptr) {
+    size_t low = 0, high = n_ptrs;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (ptrs[middle] == ptr)
+            return middle;
+        if (ptrs[middle] < ptr) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return -1;
+}
+
+/// Returns true if the chunk is the lower half of a chunk of twice the size in a pool region.
+static bool vm_is_lower_buddy(void* start_ptr, size_t size) {
+    vm_pool_region_t* region = vm_pool_region_find(start_ptr);
+    if (region == 0)
+        return false;
+    size_t region_offset = start_ptr - region->start_ptr;
+    return (region_offset & (size * 2 - 1)) == 0 && region_offset + size * 2 <= region->size;
+}
+
+/// Returns true if a chunk merged from two free halves of the size class can be returned to the system while the
+/// halves held memory that couldn't: halves smaller than a page, or smaller than a huge page in huge page regions.
+static bool vm_is_merge_reclaimable(void* start_ptr, uint8_t lines_2e) {
+    size_t merged_size = vm_lines_2e_to_bytes(lines_2e + 1);
+    if (vm_is_in_huge_page(start_ptr, merged_size))
+        return false;
+    return lines_2e + 1 == vm_page_size_lines_2e() || (merged_size == VM_HUGE_PAGE_SIZE && vm_is_in_huge_page(start_ptr, merged_size / 2));
+}
+
+/// Merges the free chunks of a size class with their free buddies into chunks of the next size class.
+/// Returns the number of merged pairs. The free list stays in place so reservations of the size class keep finding
+/// chunks in it: the addresses of a batch of chunks are copied, sorted without holding free_vm_list_lock and only
+/// the buddy pairs found are unlinked under it. Merged chunks that hold memory the janitor can now reclaim are passed
+/// to it as dirty, every other free chunk of page size or larger is either not backed by memory or stranded.
+static uint64_t vm_coalesce_free_list(uint8_t lines_2e) {
+    size_t size = vm_lines_2e_to_bytes(lines_2e);
+    uint64_t n_merged = 0;
+    for (size_t offset = 0;;) {
+        void* starts[VM_COALESCE_BATCH_CHUNKS];
+        size_t n_starts = 0;
+        atomic_spinlock_lock(&vm_state.free_vm_list_lock); {
             vm_mmap_index_t* mmap_index = vm_state.free_vm_list[lines_2e];
-            if (mmap_index != 0) {
-                start_ptr = mmap_index->start_ptr;
-                vm_state.free_vm_list[lines_2e] = mmap_index->next;
-                vm_free_mmap_index(mmap_index);
-            } else {
-                // Find a larger segment and use instead.
-                uint8_t larger_lines_2e = lines_2e + 1;
-                for (;; larger_lines_2e++) {
-                    if (larger_lines_2e == VM_MAX_SIZE_2E)
-                        VM_CORE_ERROR("librcd/vm_free_list_pop: ran out virtual memory on system");
-                    if (larger_lines_2e >= vm_state.pool_mmap_end_2e) {
-                        // DBG_RAW("[vm/vm_free_list_pop] no available 32*2e^", DBG_INT(lines_2e), " chunk, querying system for larger 2e^", DBG_INT(larger_lines_2e), " chunk\n");
-                        // We reached or passed the size class of the segment we initialized the pool with last time. This means that there
-                        // is either not enough free memory in the pool or the memory is not contiguous enough. Query the system for more memory.
-                        size_t next_pool_size = vm_lines_2e_to_bytes(larger_lines_2e);
-                        void* mmap_r = mmap(0, next_pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-                        if (mmap_r == MAP_FAILED)
-                            vm_mmap_failure(next_pool_size);
-                        start_ptr = mmap_r;
-                        // We double the amount of memory we require each time this exhaustion happens as calling mmap() is a waste of time we'd like to avoid.
-                        vm_state.pool_mmap_end_2e = larger_lines_2e + 1;
-                        break;
-                    }
-                    // Query the next size class.
-                    vm_mmap_index_t* mmap_index = vm_state.free_vm_list[larger_lines_2e];
-                    if (mmap_index != 0) {
-                        // DBG_RAW("[vm/vm_free_list_pop] no available 32*2e^", DBG_INT(lines_2e), " chunk, splitting larger 2e^", DBG_INT(larger_lines_2e), " chunk\n");
-                        start_ptr = mmap_index->start_ptr;
-                        vm_state.free_vm_list[larger_lines_2e] = mmap_index->next;
-                        vm_free_mmap_index(mmap_index);
-                        break;
+            for (size_t i = 0; i < offset && mmap_index != 0; i++)
+                mmap_index = mmap_index->next;
+            for (; mmap_index != 0 && n_starts < LENGTHOF(starts); mmap_index = mmap_index->next)
+                starts[n_starts++] = mmap_index->start_ptr;
+        } atomic_spinlock_unlock(&vm_state.free_vm_list_lock);
+        if (n_starts < 2)
+            break;
+        // Buddies are neighbours when the addresses are sorted. Keep the halves of buddy pairs, still sorted.
+        sort(starts, n_starts, sizeof(void*), vm_ptr_cmp, 0);
+        size_t n_halves = 0;
+        for (size_t i = 0; i + 1 < n_starts; i++) {
+            if (starts[i + 1] == starts[i] + size && vm_is_lower_buddy(starts[i], size)) {
+                starts[n_halves++] = starts[i];
+                starts[n_halves++] = starts[i + 1];
+                i++;
+            }
+        }
+        vm_mmap_index_t* halves[VM_COALESCE_BATCH_CHUNKS];
+        memset(halves, 0, n_halves * sizeof(vm_mmap_index_t*));
+        if (n_halves > 0) {
+            atomic_spinlock_lock(&vm_state.free_vm_list_lock); {
+                size_t n_found = 0;
+                for (vm_mmap_index_t** link = &vm_state.free_vm_list[lines_2e]; *link != 0 && n_found < n_halves;) {
+                    vm_mmap_index_t* mmap_index = *link;
+                    ssize_t half_i = vm_ptr_search(starts, n_halves, mmap_index->start_ptr);
+                    if (half_i != -1) {
+                        halves[half_i] = mmap_index;
+                        *link = mmap_index->next;
+                        n_found++;
+                    } else {
+                        link = &mmap_index->next;
                     }
                 }
-                // We need to index the smaller chunks immediately before unlocking to prevent parallel pop's from trying to smash chunks as well or return out of memory.
-                void* cur_split_ptr = start_ptr + vm_lines_2e_to_bytes(larger_lines_2e);
-                for (uint8_t split_lines_2e = larger_lines_2e - 1; split_lines_2e >= lines_2e; split_lines_2e--) {
-                    cur_split_ptr -= vm_lines_2e_to_bytes(split_lines_2e);
-                    vm_free_list_push(cur_split_ptr, split_lines_2e, true);
+                // Chunks whose buddy was reserved since the addresses were copied go back on the list.
+                for (size_t i = 0; i < n_halves; i += 2) {
+                    if (halves[i] != 0 && halves[i + 1] != 0)
+                        continue;
+                    for (size_t j = i; j < i + 2; j++) {
+                        if (halves[j] == 0)
+                            continue;
+                        halves[j]->next = vm_state.free_vm_list[lines_2e];
+                        vm_state.free_vm_list[lines_2e] = halves[j];
+                        halves[j] = 0;
+                    }
                 }
+            } atomic_spinlock_unlock(&vm_state.free_vm_list_lock);
+        }
+        size_t n_batch_merged = 0;
+        for (size_t i = 0; i < n_halves; i += 2) {
+            if (halves[i] == 0)
+                continue;
+            vm_free_mmap_index(halves[i]);
+            vm_free_mmap_index(halves[i + 1]);
+            if (vm_is_merge_reclaimable(starts[i], lines_2e)) {
+                atomic_spinlock_lock(&vm_state.dirty_mmaps_lock); {
+                    vm_dirty_mmap_push(starts[i], lines_2e + 1);
+                } atomic_spinlock_unlock(&vm_state.dirty_mmaps_lock);
+            } else {
+                // Merged chunks that need an mmap index might split up again into this size class.
+                vm_free_list_push(starts[i], lines_2e + 1, false);
             }
-            // DBG_RAW("[vm/vm_free_list_pop] returning range [", DBG_PTR(start_ptr), "]-[", DBG_PTR(start_ptr + vm_lines_2e_to_bytes(lines_2e)), "]\n");
-        } atomic_spinlock_unlock(&vm_state.free_vm_list_lock);
+            n_batch_merged++;
+        }
+        n_merged += n_batch_merged;
+        if (n_starts < LENGTHOF(starts))
+            break;
+        // The chunks that were not merged are still in front of the next batch.
+        offset += n_starts - n_batch_merged * 2;
     }
-    return start_ptr;
+    return n_merged;
+}
+
+/// Merges free buddies in all size classes, smallest first so merged chunks can merge further. Chunks that are
+/// allocated, dirty or cached by physical threads are not free and prevent their buddies from being merged.
+static void vm_coalesce_free_lists() {
+    for (uint8_t lines_2e = 1; lines_2e < VM_MAX_SIZE_2E - 1; lines_2e++)
+        vm_coalesced_chunks += vm_coalesce_free_list(lines_2e);
 }
 
 void vm_wait_for_janitor() {
@@ -436,12 +1111,21 @@ void vm_janitor_thread(void* arg_ptr) {
             void* mmap_start_ptr = dirty_mmap->start_ptr;
             assert(((uintptr_t) mmap_start_ptr % PAGE_SIZE) == 0);
             uint8_t mmap_2e_size = dirty_mmap->size_2e;
-            // DBG_RAW("[vm/vm_janitor_thread] shredding 2e^", DBG_INT(mmap_2e_size), " range @ [", DBG_PTR(mmap_start_ptr), "]\n");
-            int madvise_r = madvise(mmap_start_ptr, vm_lines_2e_to_bytes(mmap_2e_size), MADV_DONTNEED);
-            if (madvise_r == -1)
-                RCD_SYSCALL_EXCEPTION(madvise, exception_fatal);
+            size_t mmap_size = vm_lines_2e_to_bytes(mmap_2e_size);
+            // Releasing part of a huge page would make the kernel split it, so chunks smaller than a huge page in huge
+            // page regions stay resident. Larger chunks are huge page aligned. Hugetlb pages always stay resident.
+            if (!vm_is_in_huge_page(mmap_start_ptr, mmap_size)) {
+                // DBG_RAW("[vm/vm_janitor_thread] shredding 2e^", DBG_INT(mmap_2e_size), " range @ [", DBG_PTR(mmap_start_ptr), "]\n");
+                int madvise_r = madvise(mmap_start_ptr, mmap_size, MADV_DONTNEED);
+                if (madvise_r == -1)
+                    RCD_SYSCALL_EXCEPTION(madvise, exception_fatal);
+                vm_janitor_reclaimed_bytes += mmap_size;
+                vm_janitor_reclaimed_mmaps++;
+            }
             vm_free_list_push(mmap_start_ptr, mmap_2e_size, false);
         }
+        // Undo fragmentation, the reclaimed mmaps might complete free buddies.
+        vm_coalesce_free_lists();
         // Make all existing new dirty mmaps old.
         atomic_spinlock_lock(&vm_state.dirty_mmaps_lock); {
             vm_dirty_mmap_index_t* dirty_mmap_index;
@@ -510,15 +1194,11 @@ void* vm_mmap_reserve_sys(size_t min_size, size_t* size_out) {
     size_t user_size = min_size;
 #endif
     uint8_t size_lines_2e = vm_bytes_to_lines_2e(min_size, true);
-    void* ptr = vm_free_list_pop(size_lines_2e);
-    // "Lock free" update of memory usage statistics.
+    void* ptr = (size_lines_2e <= VM_MAGAZINE_MAX_LINES_2E? vm_thread_cache_pop(size_lines_2e): vm_free_list_pop(size_lines_2e));
     size_t final_size = vm_lines_2e_to_bytes(size_lines_2e);
-    for (;;) {
-        uint64_t old_total = vm_total_allocated_bytes;
-        uint64_t new_total = old_total + final_size;
-        if (atomic_cas_uint64(&vm_total_allocated_bytes, old_total, new_total))
-            break;
-    }
+    vm_thread_cache_t* cache = vm_thread_cache_get();
+    vm_thread_cache_count_allocated(cache, final_size);
+    cache->class_allocated_bytes[size_lines_2e] += final_size;
     // Return the final size if caller required it.
     if (size_out != 0)
         *size_out = final_size;
@@ -675,34 +1355,22 @@ void vm_mmap_unreserve_sys(void* ptr, size_t size) {
     }
 #endif
     uint8_t lines_2e = vm_bytes_to_lines_2e(size, true);
-    if (size >= PAGE_SIZE) {
+    if (lines_2e <= VM_MAGAZINE_MAX_LINES_2E) {
+        // Keep the chunk in the magazine of the physical thread, it will likely need one of the same size soon.
+        vm_thread_cache_push(ptr, lines_2e);
+    } else if (size >= PAGE_SIZE) {
         // Memory maps larger than PAGE_SIZE is passed to the janitor so it can let the system reclaim them.
-        vm_dirty_mmap_t* dirty_mmap = ptr;
-        dirty_mmap->start_ptr = ptr;
-        dirty_mmap->size_2e = lines_2e;
-        dirty_mmap->is_new = true;
         atomic_spinlock_lock(&vm_state.dirty_mmaps_lock); {
-            DL_APPEND(vm_state.new_dirty_mmap_queue, &dirty_mmap->queue_index);
-            DL_PREPEND(vm_state.dirty_mmap_sizes[lines_2e], &dirty_mmap->size_index);
-            if (vm_state.janitor_wait_state == 1) {
-                vm_state.janitor_wait_state = 0;
-                int32_t futex_r = futex((int32_t*) &vm_state.janitor_wait_state, FUTEX_WAKE, 1, 0, 0, 0);
-                if (futex_r == -1)
-                    RCD_SYSCALL_EXCEPTION(futex, exception_fatal);
-            }
+            vm_dirty_mmap_push(ptr, lines_2e);
         } atomic_spinlock_unlock(&vm_state.dirty_mmaps_lock);
     } else {
         // Memory maps smaller than PAGE_SIZE cannot be reclaimed by the system and is simply returned to the vm free list.
         vm_free_list_push(ptr, lines_2e, false);
     }
-    // "Lock free" update of memory usage statistics.
     size_t final_size = vm_lines_2e_to_bytes(lines_2e);
-    for (;;) {
-        uint64_t old_total = vm_total_allocated_bytes;
-        uint64_t new_total = old_total - final_size;
-        if (atomic_cas_uint64(&vm_total_allocated_bytes, old_total, new_total))
-            break;
-    }
+    vm_thread_cache_t* cache = vm_thread_cache_get();
+    vm_thread_cache_count_allocated(cache, -(int64_t) final_size);
+    cache->class_allocated_bytes[lines_2e] -= final_size;
 }
 
 void vm_mmap_unreserve(void* ptr, size_t size) {
@@ -716,6 +1384,73 @@ void vm_mmap_unreserve(void* ptr, size_t size) {
     }
 }
 
+size_t vm_get_total_allocated_bytes() {
+    int64_t allocated_bytes;
+    // Caches fold their count under the same lock so every byte is counted either in the total or in a single cache.
+    atomic_spinlock_lock(&vm_thread_caches_lock); {
+        allocated_bytes = (int64_t) *((volatile size_t*) &vm_total_allocated_bytes);
+        for (vm_thread_cache_t* cache = vm_thread_caches; cache != 0; cache = cache->next)
+            allocated_bytes += *((volatile int64_t*) &cache->allocated_bytes);
+    } atomic_spinlock_unlock(&vm_thread_caches_lock);
+    return MAX(allocated_bytes, 0);
+}
+
+void vm_get_stats(vm_stats_t* stats_out) {
+    memset(stats_out, 0, sizeof(*stats_out));
+    // The counters of live threads are read while they are updated so the sum is not a consistent snapshot, but
+    // every chunk is counted exactly once when no chunk is reserved or unreserved while summing.
+    atomic_spinlock_lock(&vm_thread_caches_lock); {
+        for (uint8_t lines_2e = 1; lines_2e <= VM_MAX_SIZE_2E; lines_2e++) {
+            uint8_t size_2e = lines_2e - 1 + VM_LINE_SIZE_2E;
+            if (size_2e >= LENGTHOF(stats_out->class_allocated_bytes))
+                continue;
+            int64_t class_allocated_bytes = vm_class_allocated_bytes[lines_2e];
+            for (vm_thread_cache_t* cache = vm_thread_caches; cache != 0; cache = cache->next)
+                class_allocated_bytes += *((volatile int64_t*) &cache->class_allocated_bytes[lines_2e]);
+            stats_out->class_allocated_bytes[size_2e] = MAX(class_allocated_bytes, 0);
+        }
+    } atomic_spinlock_unlock(&vm_thread_caches_lock);
+    stats_out->janitor_reclaimed_bytes = vm_janitor_reclaimed_bytes;
+    stats_out->janitor_reclaimed_mmaps = vm_janitor_reclaimed_mmaps;
+    stats_out->huge_page_bytes = vm_huge_page_bytes;
+}
+
+void vm_get_frag_report(vm_frag_report_t* report_out) {
+    memset(report_out, 0, sizeof(*report_out));
+    uint8_t page_size_lines_2e = vm_page_size_lines_2e();
+    atomic_spinlock_lock(&vm_state.free_vm_list_lock); {
+        for (uint8_t lines_2e = 1; lines_2e < VM_MAX_SIZE_2E; lines_2e++) {
+            uint8_t size_2e = lines_2e - 1 + VM_LINE_SIZE_2E;
+            size_t size = vm_lines_2e_to_bytes(lines_2e);
+            for (vm_mmap_index_t* mmap_index = vm_state.free_vm_list[lines_2e]; mmap_index != 0; mmap_index = mmap_index->next) {
+                if (size_2e < LENGTHOF(report_out->free_bytes))
+                    report_out->free_bytes[size_2e] += size;
+                if (lines_2e < page_size_lines_2e || vm_is_in_huge_page(mmap_index->start_ptr, size))
+                    report_out->stranded_bytes += size;
+            }
+        }
+    } atomic_spinlock_unlock(&vm_state.free_vm_list_lock);
+    atomic_spinlock_lock(&vm_state.dirty_mmaps_lock); {
+        for (uint8_t lines_2e = 1; lines_2e < VM_MAX_SIZE_2E; lines_2e++) {
+            uint8_t size_2e = lines_2e - 1 + VM_LINE_SIZE_2E;
+            size_t size = vm_lines_2e_to_bytes(lines_2e);
+            vm_dirty_mmap_index_t* dirty_mmap_index;
+            DL_FOREACH(vm_state.dirty_mmap_sizes[lines_2e], dirty_mmap_index) {
+                vm_dirty_mmap_t* dirty_mmap = ((void*) dirty_mmap_index) - offsetof(vm_dirty_mmap_t, size_index);
+                if (size_2e < LENGTHOF(report_out->dirty_bytes))
+                    report_out->dirty_bytes[size_2e] += size;
+                if (vm_is_in_huge_page(dirty_mmap->start_ptr, size)) {
+                    report_out->stranded_bytes += size;
+                } else {
+                    report_out->reclaimable_bytes += size;
+                }
+            }
+        }
+    } atomic_spinlock_unlock(&vm_state.dirty_mmaps_lock);
+    report_out->pool_bytes = vm_pool_bytes;
+    report_out->coalesced_chunks = vm_coalesced_chunks;
+}
+
 /// This function assumes that the pool has already been aligned.
 static inline vm_mchunk_t vm_aligned_alloc_pool(vm_mchunk_t* pool, size_t size) {
     size_t aligned_size = vm_align_ceil(size, VM_ALLOC_ALIGN);
@@ -766,6 +1501,20 @@ void vm_static_free(void** free_list_top, int8_t* sync_lock, void* element) {
         atomic_spinlock_unlock(sync_lock);
 }
 
+/// Reserves the memory for a heap allocation. Small allocations are taken from slabs, saving both memory and the
+/// switch to the thread static mega stack that vm_mmap_reserve() requires in fibers.
+static inline void* vm_heap_chunk_reserve(size_t total_size, size_t* size_out) {
+    if (total_size <= VM_SLAB_MAX_SIZE)
+        return vm_slab_alloc(total_size, size_out);
+    return vm_mmap_reserve(total_size, size_out);
+}
+
+static inline void vm_heap_chunk_unreserve(void* ptr, size_t total_size) {
+    if (total_size <= VM_SLAB_MAX_SIZE)
+        return vm_slab_free(ptr, total_size);
+    return vm_mmap_unreserve(ptr, total_size);
+}
+
 static uint16_t vm_csheap_sum(uint64_t heap_ptr) {
     return (heap_ptr ^ (heap_ptr >> 16) ^ (heap_ptr >> 32) ^ 0xd68a);
 }
@@ -786,6 +1535,69 @@ static vm_csheap_t vm_csheap_clear() {
     return (vm_csheap_t) {0};
 }
 
+static void* vm_arena_alloc(vm_heap_t* heap, size_t min_size, size_t* size_out) {
+    size_t user_size = vm_align_ceil(min_size, VM_ALLOC_ALIGN);
+    size_t total_size = sizeof(vm_arena_alloc_hdr_t) + user_size;
+    if (total_size > (size_t) (heap->arena_end - heap->arena_ptr)) {
+        // Bump from a new chunk. The rest of the current chunk is wasted until the arena is released.
+        size_t chunk_size = (heap->arena_chunks != 0? MIN(heap->arena_chunks->size * 2, VM_ARENA_CHUNK_MAX_SIZE): PAGE_SIZE);
+        chunk_size = MAX(chunk_size, sizeof(vm_arena_chunk_t) + total_size);
+        vm_arena_chunk_t* chunk = vm_mmap_reserve(chunk_size, &chunk_size);
+        chunk->size = chunk_size;
+        chunk->next = heap->arena_chunks;
+        heap->arena_chunks = chunk;
+        heap->arena_ptr = ((void*) chunk) + sizeof(vm_arena_chunk_t);
+        heap->arena_end = ((void*) chunk) + chunk_size;
+    }
+    vm_arena_alloc_hdr_t* alloc_header = heap->arena_ptr;
+    heap->arena_ptr += total_size;
+    alloc_header->heap = vm_csheap_write(heap);
+    alloc_header->size_tag = user_size | VM_ARENA_ALLOC_TAG;
+    if (size_out != 0)
+        *size_out = user_size;
+    void* primary_ptr = ((void*) alloc_header) + sizeof(vm_arena_alloc_hdr_t);
+#if defined(DEBUG)
+    memset(primary_ptr, 0xa0, MIN(0x200, user_size));
+#endif
+    return primary_ptr;
+}
+
+/// Returns the arena allocation header of the primary pointer or 0 if it's a linked heap allocation.
+static inline vm_arena_alloc_hdr_t* vm_arena_alloc_header(void* primary_ptr) {
+    vm_arena_alloc_hdr_t* alloc_header = primary_ptr - sizeof(vm_arena_alloc_hdr_t);
+    return ((alloc_header->size_tag & VM_ARENA_ALLOC_TAG_MASK) == VM_ARENA_ALLOC_TAG)? alloc_header: 0;
+}
+
+static inline size_t vm_arena_alloc_size(vm_arena_alloc_hdr_t* alloc_header) {
+    return (alloc_header->size_tag & ~VM_ARENA_ALLOC_TAG_MASK);
+}
+
+static inline vm_heap_t* vm_arena_alloc_resolve(vm_arena_alloc_hdr_t* alloc_header) {
+    vm_heap_t* heap = vm_csheap_read(alloc_header->heap);
+    if (heap == 0)
+        VM_CORE_ERROR("librcd/vm_arena_alloc_resolve: invalid primary pointer or allocation is already free");
+    return heap;
+}
+
+static void vm_arena_alloc_free(void* primary_ptr, vm_arena_alloc_hdr_t* alloc_header) {
+    // The memory itself is reclaimed when the arena is released.
+    alloc_header->heap = vm_csheap_clear();
+#if defined(DEBUG)
+    memset(primary_ptr, 0xfe, MIN(0x200, vm_arena_alloc_size(alloc_header)));
+#endif
+}
+
+/// Arena allocations can't be unlinked from their heap so they are moved to another heap by copying them.
+static void vm_arena_alloc_move(void* primary_ptr, vm_arena_alloc_hdr_t* alloc_header, vm_heap_t* dst_heap, void** out_primary_ptr) {
+    if (out_primary_ptr == 0)
+        VM_CORE_ERROR("librcd/vm: attempted to move arena allocation to another heap without taking the new location of it");
+    size_t size = vm_arena_alloc_size(alloc_header);
+    void* new_primary_ptr = vm_heap_alloc(dst_heap, size, 0);
+    memcpy(new_primary_ptr, primary_ptr, size);
+    vm_arena_alloc_free(primary_ptr, alloc_header);
+    *out_primary_ptr = new_primary_ptr;
+}
+
 void* vm_heap_alloc_destructable(vm_heap_t* heap, size_t min_size, size_t* size_out, vm_destructor_t destructor_fn) {
     assert(heap != 0);
     if (min_size == 0)
@@ -794,14 +1606,16 @@ void* vm_heap_alloc_destructable(vm_heap_t* heap, size_t min_size, size_t* size_
         VM_CORE_ERROR("librcd/vm: allocation size is too large to be sensible, memory is corrupt");
     /*if (heap->in_use_by_child)
         VM_CORE_ERROR("librcd/vm: attempt to meddle with heap that is locked by an existing child");*/
-    // Calculate sizes.
     bool use_destructor = (destructor_fn != 0);
+    if (heap->is_arena && !use_destructor && min_size <= VM_ARENA_MAX_ALLOC_SIZE)
+        return vm_arena_alloc(heap, min_size, size_out);
+    // Calculate sizes.
     size_t destructor_size = (use_destructor? vm_align_ceil(sizeof(vm_heap_destructor_hdr_t), VM_ALLOC_ALIGN): 0);
     size_t header_size = vm_align_ceil(sizeof(vm_heap_alloc_hdr_t), VM_ALLOC_ALIGN);
     size_t prefix_size = destructor_size + header_size;
     size_t total_size = prefix_size + min_size;
     // Do allocation and populate allocation headers.
-    void* ptr = vm_mmap_reserve(total_size, size_out);
+    void* ptr = vm_heap_chunk_reserve(total_size, size_out);
     if (size_out != 0) {
         // Adjust the final total size, removing the space reserved for the prefix.
         *size_out -= prefix_size;
@@ -864,7 +1678,7 @@ static inline vm_heap_t* vm_heap_ptr_resolve(void* primary_ptr, vm_mchunk_t* out
 static inline void vm_heap_free_raw(void* primary_ptr, vm_mchunk_t chunk, vm_heap_destructor_hdr_t* destructor_header) {
     if (destructor_header != 0)
         destructor_header->destructor_fn(primary_ptr);
-    vm_mmap_unreserve(chunk.ptr, chunk.size);
+    vm_heap_chunk_unreserve(chunk.ptr, chunk.size);
 }
 
 static bool vm_require_heap(vm_heap_t* heap, vm_heap_t* require_parent_heap) {
@@ -878,9 +1692,19 @@ static bool vm_require_heap(vm_heap_t* heap, vm_heap_t* require_parent_heap) {
     }
 }
 
-bool vm_heap_escape(void* primary_ptr) {
+bool vm_heap_escape(void* primary_ptr, void** out_primary_ptr) {
+    if (out_primary_ptr != 0)
+        *out_primary_ptr = primary_ptr;
     if (primary_ptr == 0)
         return true;
+    vm_arena_alloc_hdr_t* arena_alloc_header = vm_arena_alloc_header(primary_ptr);
+    if (arena_alloc_header != 0) {
+        vm_heap_t* parent_heap = (void*) (((uintptr_t) vm_arena_alloc_resolve(arena_alloc_header)->parent) & ~0x1);
+        if (parent_heap == 0)
+            return false;
+        vm_arena_alloc_move(primary_ptr, arena_alloc_header, parent_heap, out_primary_ptr);
+        return true;
+    }
     vm_heap_alloc_hdr_t* alloc_header;
     vm_heap_t* child_heap = vm_heap_ptr_resolve(primary_ptr, 0, &alloc_header, 0);
     vm_heap_t* parent_heap = child_heap->parent;
@@ -893,12 +1717,23 @@ bool vm_heap_escape(void* primary_ptr) {
 }
 
 bool vm_heap_has_allocs(vm_heap_t* heap) {
-    return (heap->alloc_headers != 0);
+    return (heap->alloc_headers != 0 || heap->arena_chunks != 0);
 }
 
-bool vm_heap_import(vm_heap_t* require_sub_heap, vm_heap_t* dst_heap, void* primary_ptr) {
+bool vm_heap_import(vm_heap_t* require_sub_heap, vm_heap_t* dst_heap, void* primary_ptr, void** out_primary_ptr) {
+    if (out_primary_ptr != 0)
+        *out_primary_ptr = primary_ptr;
     if (primary_ptr == 0)
         return true;
+    vm_arena_alloc_hdr_t* arena_alloc_header = vm_arena_alloc_header(primary_ptr);
+    if (arena_alloc_header != 0) {
+        vm_heap_t* src_heap = vm_arena_alloc_resolve(arena_alloc_header);
+        if (!vm_require_heap(require_sub_heap, src_heap))
+            return false;
+        if (src_heap != dst_heap)
+            vm_arena_alloc_move(primary_ptr, arena_alloc_header, dst_heap, out_primary_ptr);
+        return true;
+    }
     vm_heap_alloc_hdr_t* alloc_header;
     vm_heap_t* src_heap = vm_heap_ptr_resolve(primary_ptr, 0, &alloc_header, 0);
     if (!vm_require_heap(require_sub_heap, src_heap))
@@ -912,6 +1747,13 @@ bool vm_heap_import(vm_heap_t* require_sub_heap, vm_heap_t* dst_heap, void* prim
 bool vm_heap_free(vm_heap_t* require_sub_heap, void* primary_ptr) {
     if (primary_ptr == 0)
         return true;
+    vm_arena_alloc_hdr_t* arena_alloc_header = vm_arena_alloc_header(primary_ptr);
+    if (arena_alloc_header != 0) {
+        if (!vm_require_heap(require_sub_heap, vm_arena_alloc_resolve(arena_alloc_header)))
+            return false;
+        vm_arena_alloc_free(primary_ptr, arena_alloc_header);
+        return true;
+    }
     vm_mchunk_t chunk;
     vm_heap_alloc_hdr_t* alloc_header;
     vm_heap_destructor_hdr_t* destructor_header;
@@ -927,6 +1769,12 @@ bool vm_heap_free(vm_heap_t* require_sub_heap, void* primary_ptr) {
 size_t vm_heap_get_size(vm_heap_t* require_sub_heap, void* primary_ptr) {
     if (primary_ptr == 0)
         return true;
+    vm_arena_alloc_hdr_t* arena_alloc_header = vm_arena_alloc_header(primary_ptr);
+    if (arena_alloc_header != 0) {
+        if (!vm_require_heap(require_sub_heap, vm_arena_alloc_resolve(arena_alloc_header)))
+            return false;
+        return vm_arena_alloc_size(arena_alloc_header);
+    }
     vm_mchunk_t chunk;
     vm_heap_alloc_hdr_t* alloc_header;
     vm_heap_t* alloc_heap = vm_heap_ptr_resolve(primary_ptr, &chunk, &alloc_header, 0);
@@ -960,6 +1808,16 @@ vm_heap_t* vm_heap_create(vm_heap_t* parent_heap) {
     vm_heap_t* heap = vm_heap_free_list_allocate();
     heap->alloc_headers = 0;
     heap->parent = parent_heap;
+    heap->is_arena = false;
+    heap->arena_chunks = 0;
+    heap->arena_ptr = 0;
+    heap->arena_end = 0;
+    return heap;
+}
+
+vm_heap_t* vm_heap_create_arena(vm_heap_t* parent_heap) {
+    vm_heap_t* heap = vm_heap_create(parent_heap);
+    heap->is_arena = true;
     return heap;
 }
 
@@ -974,7 +1832,7 @@ vm_heap_t* vm_heap_release(vm_heap_t* heap, size_t n_returned_allocs, void* retu
         // Import surviving allocs into parent.
         for (size_t i = 0; i < n_returned_allocs; i++) {
             void* primary_ptr = returned_allocs[i];
-            if (!vm_heap_import(heap, parent_heap, primary_ptr))
+            if (!vm_heap_import(heap, parent_heap, primary_ptr, 0))
                 VM_CORE_ERROR("librcd/vm_heap_release: trying to return allocation in sub heap that is not member of sub heap");
         }
     }
@@ -993,6 +1851,12 @@ vm_heap_t* vm_heap_release(vm_heap_t* heap, size_t n_returned_allocs, void* retu
             vm_heap_free_raw(primary_ptr, chunk, destructor_header);
         }
     }
+    // Arena allocations have no destructors so the chunks can be returned without looking at them.
+    for (vm_arena_chunk_t *arena_chunk = heap->arena_chunks, *next; arena_chunk != 0; arena_chunk = next) {
+        next = arena_chunk->next;
+        vm_mmap_unreserve(arena_chunk, arena_chunk->size);
+    }
+    heap->arena_chunks = 0;
     // Allow parent heap to be used again.
     if (parent_heap != 0)
         vm_heap_toggle_in_use(parent_heap, false);
@@ -190,6 +190,41 @@ void rcd_self_test_vm() {
             vm_mmap_unreserve(allocs[i], PAGE_SIZE * length);
             vm_wait_for_janitor();
         }
+        // The janitor should have merged the reclaimed mappings with their free buddies.
+        vm_frag_report_t frag;
+        vm_get_frag_report(&frag);
+        atest(frag.coalesced_chunks > 0);
+        uint64_t free_bytes = 0;
+        for (size_t i = 0; i < LENGTHOF(frag.free_bytes); i++)
+            free_bytes += frag.free_bytes[i] + frag.dirty_bytes[i];
+        atest(free_bytes > 0 && free_bytes <= frag.pool_bytes);
+        atest(frag.stranded_bytes + frag.reclaimable_bytes <= free_bytes);
+    }
+    // Test that pool regions mapped with transparent huge pages are counted and that the janitor returns chunks of
+    // whole huge pages in them to the system.
+    TEST_MEM_LEAK {
+        vm_set_huge_pages(vm_huge_pages_transparent);
+        vm_stats_t stats0;
+        vm_get_stats(&stats0);
+        // Larger than any free chunk so it's carved from a new pool region.
+        size_t huge_size = 1UL << 30;
+        uint8_t* huge_chunk = vm_mmap_reserve(huge_size, 0);
+        vm_set_huge_pages(vm_huge_pages_none);
+        atest(((uintptr_t) huge_chunk % (2UL << 20)) == 0);
+        vm_stats_t stats1;
+        vm_get_stats(&stats1);
+        atest(stats1.huge_page_bytes >= stats0.huge_page_bytes + huge_size);
+        memset(huge_chunk, 0x42, 4UL << 20);
+        vm_mmap_unreserve(huge_chunk, huge_size);
+        vm_stats_t stats2;
+        for (size_t i = 0; i < 100; i++) {
+            vm_wait_for_janitor();
+            vm_get_stats(&stats2);
+            if (stats2.janitor_reclaimed_bytes >= stats1.janitor_reclaimed_bytes + huge_size)
+                break;
+        }
+        atest(stats2.janitor_reclaimed_bytes >= stats1.janitor_reclaimed_bytes + huge_size);
+        atest(stats2.huge_page_bytes == stats1.huge_page_bytes);
     }
     TEST_MEM_LEAK sub_heap {
         // Make some allocations.
@@ -214,6 +249,68 @@ void rcd_self_test_vm() {
             }
             // Deallocate all the chunks. This should detect immediate problems with vm_free.
         }
+        // Test that small allocations are not rounded up to a power of two and that freed chunks are reused intact.
+        TEST_MEM_LEAK sub_heap {
+            uint8_t* allocs[200];
+            size_t lengths[LENGTHOF(allocs)];
+            for (size_t i = 0; i < LENGTHOF(allocs); i++) {
+                size_t length = primes[i * 2];
+                allocs[i] = lwt_alloc_buffer(length, &lengths[i]);
+                atest(lengths[i] >= length && lengths[i] - length <= length / 4 + 24);
+                atest(((uintptr_t) allocs[i] % 16) == 0);
+                memset(allocs[i], i % 0xff, lengths[i]);
+            }
+            for (size_t i = 0; i < LENGTHOF(allocs); i += 2)
+                lwt_alloc_free(allocs[i]);
+            for (size_t i = 0; i < LENGTHOF(allocs); i += 2) {
+                allocs[i] = lwt_alloc_buffer(primes[i * 2], &lengths[i]);
+                memset(allocs[i], i % 0xff, lengths[i]);
+            }
+            for (size_t i = 0; i < LENGTHOF(allocs); i++) {
+                for (size_t j = 0; j < lengths[i]; j++)
+                    atest(allocs[i][j] == i % 0xff);
+            }
+        }
+        // Test that small objects pass intact through the magazines of the physical thread, which are refilled from and
+        // flushed to the slab classes many times over here, and that they are counted as allocated while in use.
+        TEST_MEM_LEAK sub_heap {
+            uint8_t* allocs[300];
+            size_t lengths[LENGTHOF(allocs)];
+            for (size_t round = 0; round < 3; round++) {
+                size_t allocated_bytes = vm_get_total_allocated_bytes();
+                for (size_t i = 0; i < LENGTHOF(allocs); i++) {
+                    allocs[i] = lwt_alloc_buffer(48 + (i % 3) * 1000, &lengths[i]);
+                    memset(allocs[i], (i + round) % 0xff, lengths[i]);
+                }
+                atest(vm_get_total_allocated_bytes() > allocated_bytes);
+                for (size_t i = 0; i < LENGTHOF(allocs); i++) {
+                    for (size_t j = 0; j < i; j++)
+                        atest(allocs[i] != allocs[j]);
+                    for (size_t j = 0; j < lengths[i]; j++)
+                        atest(allocs[i][j] == (i + round) % 0xff);
+                }
+                for (size_t i = 0; i < LENGTHOF(allocs); i++)
+                    lwt_alloc_free(allocs[i]);
+                atest(vm_get_total_allocated_bytes() == allocated_bytes);
+            }
+        }
+        // Test that reserved chunks are counted exactly in the total of allocated bytes.
+        TEST_MEM_LEAK {
+            size_t allocated_bytes = vm_get_total_allocated_bytes();
+            void* chunks[4];
+            for (size_t i = 0; i < LENGTHOF(chunks); i++)
+                chunks[i] = vm_mmap_reserve(PAGE_SIZE << i, 0);
+            atest(vm_get_total_allocated_bytes() == allocated_bytes + PAGE_SIZE * 15);
+            for (size_t i = 0; i < LENGTHOF(chunks); i++)
+                vm_mmap_unreserve(chunks[i], PAGE_SIZE << i);
+            atest(vm_get_total_allocated_bytes() == allocated_bytes);
+            // The exported total lags behind by at most the 64 KiB the thread counts before adding to it.
+            size_t approx_allocated_bytes = vm_total_allocated_bytes;
+            void* chunk = vm_mmap_reserve(PAGE_SIZE << 8, 0);
+            atest(vm_total_allocated_bytes >= approx_allocated_bytes + (PAGE_SIZE << 8) - (1UL << 16));
+            vm_mmap_unreserve(chunk, PAGE_SIZE << 8);
+            atest(vm_get_total_allocated_bytes() == allocated_bytes);
+        }
         // Test making 10 allocations and preserving 5 of them that should interleave.
         TEST_MEM_LEAK sub_heap {
             uint64_t* allocs[10];
@@ -234,6 +331,40 @@ void rcd_self_test_vm() {
                 atest(*allocs[i] == i);
             }
         }
+        // Test arena heaps, allocations that escape are copied to the parent heap.
+        TEST_MEM_LEAK sub_heap {
+            uint8_t* escaped[10];
+            arena_heap {
+                uint8_t* allocs[LENGTHOF(primes)];
+                for (size_t i = 0; i < LENGTHOF(primes); i++) {
+                    size_t length = primes[i];
+                    allocs[i] = lwt_alloc_new(length);
+                    atest(lwt_alloc_get_size(allocs[i]) >= length);
+                    atest(((uintptr_t) allocs[i] % 16) == 0);
+                    memset(allocs[i], i % 0xff, length);
+                }
+                for (size_t i = 0; i < LENGTHOF(primes); i++) {
+                    for (size_t j = 0; j < primes[i]; j++)
+                        atest(allocs[i][j] == i % 0xff);
+                }
+                for (size_t i = 0; i < LENGTHOF(escaped); i++) {
+                    escaped[i] = escape(allocs[i * 7]);
+                    lwt_alloc_free(allocs[i * 7 + 1]);
+                }
+                // Allocations with destructors are linked to the arena like in other heaps.
+                destructor_test_t* dt = lwt_alloc_destructable(sizeof(destructor_test_t), rcd_test_destructor);
+                dt->value = 50;
+                dt->self_test = dt;
+                rcd_test_destructor_value += 50;
+            }
+            atest(rcd_test_destructor_value == 0);
+            for (size_t i = 0; i < LENGTHOF(escaped); i++) {
+                size_t length = primes[i * 7];
+                atest(lwt_alloc_get_size(escaped[i]) >= length);
+                for (size_t j = 0; j < length; j++)
+                    atest(escaped[i][j] == (i * 7) % 0xff);
+            }
+        }
         // Test destructor behavior.
         TEST_MEM_LEAK sub_heap {
             size_t asserted_rcd_test_destructor_value = 0;
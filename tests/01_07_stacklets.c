@@ -7,6 +7,7 @@
 #include "rcd.h"
 #include "musl.h"
 #include "test.h"
+#include "lwthreads-internal.h"
 
 #pragma librcd
 
@@ -87,6 +88,27 @@ static size_t test_va_fn1(bool do_some_alloca, size_t n_args, ...) {
      }
 }
 
+/// Overflows into a new stacklet on every level so a loop calling it crosses the same stacklet boundaries over and over.
+static size_t test_hot_split_fn(size_t depth, size_t value) {
+    size_t stacklet_forcer[0x402];
+    for (size_t i = 0; i < 8; i++)
+        stacklet_forcer[i] = value + i;
+    if (depth > 0) {
+        // Yield sometimes so stacklets are also released when switching fiber.
+        if (value % 0x40 == 0)
+            lwt_yield();
+        atest(test_hot_split_fn(depth - 1, value + 1) == value + 8);
+    }
+    // The frame must be intact after the younger stacklets has been released and possibly reused.
+    for (size_t i = 0; i < 8; i++)
+        atest(stacklet_forcer[i] == value + i);
+    return stacklet_forcer[7];
+}
+
+fiber_main test_stack_learn_fiber(fiber_main_attr) {
+    atest(test_hot_split_fn(4, 0) == 7);
+}
+
 /// Tests that memory allocated inside a try block on the same frame on the root is free'd.
 fiber_main test_va_unwind_save_inner_sameframe(fiber_main_attr, size_t size) {
     uint8_t* data;
@@ -188,9 +210,73 @@ void rcd_self_test_stacklets() {
             atest(n == 16);
         }
     }
+    // Test hot splits, the younger stacklets should be reused from the fiber and executor stacklet caches.
+    for (size_t i = 0; i < 0x400; i++) {
+        atest(test_hot_split_fn(i % 4, i) == i + 7);
+        try {
+            test_dsa_alloca(2, true);
+        } catch (exception_arg, e);
+    }
+    // Test that hot split tracking counts the splits and dumps the sites where they happen with their backtrace.
+    sub_heap {
+        bool was_tracking = lwt_hot_split_tracking_set_enabled(true);
+        for (size_t i = 0; i < 0x100; i++)
+            atest(test_hot_split_fn(3, i) == i + 7);
+        lwt_hot_split_tracking_set_enabled(was_tracking);
+        rio_t* pipe = rio_open_pipe();
+        lwt_write_hot_split_dump_fd(rio_get_fd_write(pipe));
+        rio_pipe_close_end(pipe, false);
+        fstr_t dump = rio_read_to_end(pipe, fss(fstr_alloc(0x10000)));
+        size_t n_splits = 0, n_sites = 0, n_site_splits = 0, n_top_frames = 0;
+        for (fstr_t line; fstr_iterate_trim(&dump, "\n", &line);) {
+            fstr_t head_str, count_str;
+            if (fstr_divide(line, "] sites and [", &head_str, &count_str)) {
+                atest(fstr_divide(count_str, "]", &count_str, 0));
+                n_splits = fstr_to_uint(count_str, 10);
+            } else if (fstr_divide(line, "], splits: [", &head_str, &count_str)) {
+                n_sites++;
+                n_site_splits += fstr_to_uint(fstr_slice(count_str, 0, -2), 10);
+            } else if (n_sites == 1 && fstr_prefixes(line, "#")) {
+                n_top_frames++;
+            }
+        }
+        // Every call recurses three times with frames that don't fit in a stacklet together.
+        atest(n_splits >= 3 * 0x100);
+        atest(n_sites > 0 && n_site_splits <= n_splits);
+        atest(n_top_frames > 1);
+    }
     // Test dynamic alloc and unwind to root.
     fmitosis {
         ifc_wait(spawn_static_fiber(test_va_unwind_save_inner_sameframe("", 42)));
     }
+    // Test that the stack depth of fibers is learned and that learned stack sizes can be dumped and loaded.
+    fmitosis {
+        ifc_wait(spawn_static_fiber(test_stack_learn_fiber("")));
+    }
+    lwt_load_learned_stack_sizes("test_stack_learn_loaded 123456\ntest_stack_learn_huge 99999999999\n");
+    sub_heap {
+        rio_t* pipe = rio_open_pipe();
+        lwt_write_learned_stack_sizes_fd(rio_get_fd_write(pipe));
+        rio_pipe_close_end(pipe, false);
+        fstr_t profile = rio_read_to_end(pipe, fss(fstr_alloc(0x10000)));
+        bool found_fiber = false, found_loaded = false, found_huge = false;
+        for (fstr_t line; fstr_iterate_trim(&profile, "\n", &line);) {
+            fstr_t main_name, stack_size_str;
+            atest(fstr_rdivide(line, " ", &main_name, &stack_size_str));
+            size_t stack_size = fstr_to_uint(stack_size_str, 10);
+            if (fstr_equal(main_name, "test_stack_learn_fiber")) {
+                atest(stack_size >= 4 * 0x402 * sizeof(size_t));
+                found_fiber = true;
+            } else if (fstr_equal(main_name, "test_stack_learn_loaded")) {
+                atest(stack_size == 123456);
+                found_loaded = true;
+            } else if (fstr_equal(main_name, "test_stack_learn_huge")) {
+                // Learned sizes are capped so a single profile line can't make every root stacklet huge.
+                atest(stack_size < 99999999999UL && stack_size >= 123456);
+                found_huge = true;
+            }
+        }
+        atest(found_fiber && found_loaded && found_huge);
+    }
     // TODO: Test different calls to slowly incrementing function frame (stacklet) sizes to detect off by-n errors in minimum stack required calculations.
 }
@@ -5,6 +5,10 @@
 /* See the COPYING file distributed with this project for more information. */
 
 #include "rcd.h"
+#include "musl.h"
+#include "atomic.h"
+#include "json.h"
+#include "lwthreads-internal.h"
 
 #pragma librcd
 
@@ -157,6 +161,162 @@ fiber_main multi_fiber_test_pool_upclient_fiber(fiber_main_attr, rcd_fid_t pool_
     multi_fiber_test_pool_upjoined(pool_fid, upserver_fid);
 }
 
+join_locked(uint64_t) multi_fiber_test_ping(uint64_t ball, join_server_params) {
+    return ball + 1;
+}
+
+fiber_main multi_fiber_test_pong_fiber(fiber_main_attr) {
+    try {
+        auto_accept_join(multi_fiber_test_ping, join_server_params);
+    } catch (exception_canceled, e) {}
+}
+
+fiber_main multi_fiber_test_ping_fiber(fiber_main_attr, rcd_fid_t pong_fid, uint64_t n_rounds) {
+    uint64_t ball = 0;
+    for (uint64_t i = 0; i < n_rounds; i++)
+        ball = multi_fiber_test_ping(ball, pong_fid);
+    atest(ball == n_rounds);
+}
+
+static void multi_fiber_test_offload_sleep(void* arg_ptr) {
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 10 * RIO_NS_MS};
+    nanosleep(&ts, 0);
+    *((int32_t*) arg_ptr) += 1;
+}
+
+typedef struct multi_fiber_test_offload_barrier {
+    int32_t n_arrived;
+    int32_t n_total;
+    int32_t n_passed;
+} multi_fiber_test_offload_barrier_t;
+
+/// Waits in the blocker thread until all tasks have arrived, which only
+/// happens if they run concurrently. Gives up after ten seconds so a broken
+/// pool fails the test instead of hanging it.
+static void multi_fiber_test_offload_barrier(void* arg_ptr) {
+    multi_fiber_test_offload_barrier_t* barrier = arg_ptr;
+    for (int32_t n_arrived = barrier->n_arrived; !atomic_cas_int32(&barrier->n_arrived, n_arrived, n_arrived + 1); n_arrived = barrier->n_arrived);
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = RIO_NS_MS};
+    for (size_t i = 0; i < 10000; i++) {
+        if (((volatile multi_fiber_test_offload_barrier_t*) barrier)->n_arrived == barrier->n_total) {
+            for (int32_t n_passed = barrier->n_passed; !atomic_cas_int32(&barrier->n_passed, n_passed, n_passed + 1); n_passed = barrier->n_passed);
+            return;
+        }
+        nanosleep(&ts, 0);
+    }
+}
+
+static void multi_fiber_test_offload_block(void* arg_ptr) {
+    poll(0, 0, -1);
+}
+
+fiber_main multi_fiber_test_offload_fiber(fiber_main_attr, multi_fiber_test_offload_barrier_t* barrier) {
+    lwt_offload(multi_fiber_test_offload_barrier, barrier);
+}
+
+fiber_main multi_fiber_test_class_fiber(fiber_main_attr, lwt_fiber_class_t* out_fiber_class) {
+    *out_fiber_class = lwt_get_fiber_class();
+    for (size_t i = 0; i < 0x100; i++)
+        lwt_yield();
+}
+
+fiber_main multi_fiber_test_spin_fiber(fiber_main_attr, bool* stop) {
+    while (!*((volatile bool*) stop))
+        lwt_yield();
+}
+
+fiber_main multi_fiber_test_progress_fiber(fiber_main_attr, uint32_t* out_n_rounds, uint32_t n_rounds) {
+    for (; *out_n_rounds < n_rounds; (*out_n_rounds)++)
+        lwt_yield();
+}
+
+typedef struct multi_fiber_test_sysmon_state {
+    int32_t n_blocking;
+    int32_t n_blocked;
+    int32_t n_unblocked;
+    int32_t n_unblocked_at_progress;
+} multi_fiber_test_sysmon_state_t;
+
+/// Blocks the executor it runs on in a syscall. Once every blocking fiber has
+/// arrived every executor is blocked.
+fiber_main multi_fiber_test_sysmon_block_fiber(fiber_main_attr, multi_fiber_test_sysmon_state_t* state) {
+    for (int32_t n = state->n_blocked; !atomic_cas_int32(&state->n_blocked, n, n + 1); n = state->n_blocked);
+    struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
+    nanosleep(&ts, 0);
+    for (int32_t n = state->n_unblocked; !atomic_cas_int32(&state->n_unblocked, n, n + 1); n = state->n_unblocked);
+}
+
+/// Waits until every executor is blocked and then records how many of them
+/// were unblocked by the time it managed to run a number of rounds.
+fiber_main multi_fiber_test_sysmon_progress_fiber(fiber_main_attr, multi_fiber_test_sysmon_state_t* state) {
+    volatile multi_fiber_test_sysmon_state_t* vstate = state;
+    while (vstate->n_blocked < vstate->n_blocking)
+        lwt_yield();
+    for (size_t i = 0; i < 0x100; i++)
+        lwt_yield();
+    state->n_unblocked_at_progress = vstate->n_unblocked;
+}
+
+/// Takes profiler samples as if the profiler signal interrupted the fiber three times at the same place. The fiber
+/// never yields so it stays on the executor that it allocated the sample table on.
+fiber_main multi_fiber_test_profiled_fiber(fiber_main_attr) {
+    lwt_profiler_init_local();
+    struct ucontext uc;
+    memset(&uc, 0, sizeof(uc));
+    uc.uc_mcontext.gregs[REG_RIP] = (greg_t) lwt_yield;
+    uc.uc_mcontext.gregs[REG_RBP] = (greg_t) __builtin_frame_address(0);
+    for (size_t i = 0; i < 3; i++)
+        lwt_profiler_sample(&uc, LWT_READ_STACK_LIMIT);
+}
+
+/// Returns the metrics as a parsed JSON snapshot.
+static json_value_t multi_fiber_test_read_metrics() {
+    rio_t* pipe = rio_open_pipe();
+    lwt_write_metrics_json_fd(rio_get_fd_write(pipe));
+    rio_pipe_close_end(pipe, false);
+    return json_parse(rio_read_to_end(pipe, fss(fstr_alloc(0x10000))))->value;
+}
+
+/// Returns the number of joins to multi_fiber_test_ping() in a metrics snapshot.
+static double multi_fiber_test_ping_joins(json_value_t metrics) {
+    double n_joins = 0;
+    dict_foreach(json_get_object(JSON_REF(metrics, "ifc_joins")), json_value_t, fn_name, count) {
+        if (fstr_scan(fn_name, "multi_fiber_test_ping") >= 0)
+            n_joins += json_get_number(count);
+    }
+    return n_joins;
+}
+
+/// Returns the allocated bytes of a vm size class in a metrics snapshot.
+static double multi_fiber_test_class_bytes(json_value_t metrics, size_t class_size) {
+    json_value_t class_bytes = JSON_LREF(metrics, "vm", "class_allocated_bytes", ui2fs(class_size));
+    return json_is_null(class_bytes)? 0: json_get_number(class_bytes);
+}
+
+fiber_main multi_fiber_test_small_fiber(fiber_main_attr, uint64_t* out_sum, uint64_t value) {
+    *out_sum += value;
+}
+
+/// Keeps the executor it runs on busy until every barrier fiber has arrived so every executor has run one of them.
+/// Gives up after ten seconds so a broken scheduler fails the test instead of hanging it.
+fiber_main multi_fiber_test_spin_barrier_fiber(fiber_main_attr, int32_t* n_arrived, int32_t n_total) {
+    for (int32_t n = *n_arrived; !atomic_cas_int32(n_arrived, n, n + 1); n = *n_arrived);
+    uint128_t start_ns = rio_get_time_timer();
+    while (*((volatile int32_t*) n_arrived) < n_total && rio_get_time_timer() - start_ns < 10 * RIO_NS_SEC);
+}
+
+fiber_main multi_fiber_test_flag_fiber(fiber_main_attr, bool* out_flag) {
+    *((volatile bool*) out_flag) = true;
+}
+
+fiber_main multi_fiber_test_large_fiber(fiber_main_attr, uint64_t* out_sum, uint64_t value) {
+    // Large frame so the root stacklet differs in size from the one of the small fiber.
+    uint64_t values[0x800];
+    for (size_t i = 0; i < LENGTHOF(values); i++)
+        values[i] = value;
+    *out_sum += values[value % LENGTHOF(values)];
+}
+
 void rcd_self_test_multi_fiber() {
     sub_heap {
         const int total_fibers = 2000;
@@ -175,6 +335,28 @@ void rcd_self_test_multi_fiber() {
             atest(test_number == i * 2);
         }
     }
+    // Ping pong between many independent pairs of fibers. The pairs wake each other up in a tight loop so this
+    // exercises the local run queues and work stealing between executors.
+    sub_heap {
+        const int total_pairs = 32;
+        const uint64_t total_rounds = 2000;
+        rcd_fid_t pong_fids[total_pairs];
+        rcd_fid_t ping_fids[total_pairs];
+        for (int i = 0; i < total_pairs; i++) {
+            fmitosis {
+                pong_fids[i] = spawn_static_fiber(multi_fiber_test_pong_fiber(""));
+            }
+        }
+        for (int i = 0; i < total_pairs; i++) {
+            fmitosis {
+                ping_fids[i] = spawn_static_fiber(multi_fiber_test_ping_fiber("", pong_fids[i], total_rounds));
+            }
+        }
+        for (int i = 0; i < total_pairs; i++)
+            ifc_wait(ping_fids[i]);
+        for (int i = 0; i < total_pairs; i++)
+            lwt_cancel_fiber_id(pong_fids[i]);
+    }
     // Try to call a non existing fiber and expect join/race exception.
     try {
         multi_fiber_test_get_number(1, ULONG_MAX);
@@ -330,4 +512,326 @@ void rcd_self_test_multi_fiber() {
         }
         atest(total_worker_count == expected_total_worker_count);
     }
+    // Test that fiber ids are not reused when the fiber table recycles slots.
+    sub_heap {
+        rcd_fid_t dead_fid;
+        fmitosis {
+            dead_fid = spawn_static_fiber(multi_fiber_test_run_inf_cancel(""));
+        }
+        lwt_cancel_fiber_id(dead_fid);
+        ifc_wait(dead_fid);
+        rcd_sub_fiber_t* live_sf;
+        fmitosis {
+            int* test_number = new(int);
+            *test_number = 7;
+            live_sf = spawn_fiber(multi_fiber_test_main("", test_number));
+        }
+        rcd_fid_t live_fid = lwt_get_sub_fiber_id(live_sf);
+        atest(live_fid != dead_fid);
+        // Canceling or joining the dead fiber must not affect the fiber that took over its slot.
+        lwt_cancel_fiber_id(dead_fid);
+        try {
+            multi_fiber_test_get_number(7, dead_fid);
+            atest(false);
+        } catch (exception_inner_join_fail, e) {}
+        atest(multi_fiber_test_get_number(7, live_fid) == 14);
+    }
+    // Test that blocking calls are offloaded concurrently. Every task blocks its thread until all of them
+    // are running so they can only pass the barrier if they overlap.
+    sub_heap {
+        rcd_sub_fiber_t* offload_sfs[16];
+        multi_fiber_test_offload_barrier_t barrier = {.n_total = LENGTHOF(offload_sfs)};
+        for (size_t i = 0; i < LENGTHOF(offload_sfs); i++) {
+            fmitosis {
+                offload_sfs[i] = spawn_fiber(multi_fiber_test_offload_fiber("", &barrier));
+            }
+        }
+        for (size_t i = 0; i < LENGTHOF(offload_sfs); i++)
+            ifc_wait(lwt_get_sub_fiber_id(offload_sfs[i]));
+        atest(barrier.n_arrived == barrier.n_total);
+        atest(barrier.n_passed == barrier.n_total);
+    }
+    // Test that offloaded calls that block forever can be canceled and that the pool recovers.
+    for (size_t i = 0; i < 4; i++) {
+        try {
+            sub_heap {
+                ifc_cancel_timeout_arm(10 * RIO_NS_MS);
+                lwt_offload(multi_fiber_test_offload_block, 0);
+                atest(false);
+            }
+        } catch (exception_canceled, e) {}
+    }
+    {
+        int32_t counter = 0;
+        lwt_offload(multi_fiber_test_offload_sleep, &counter);
+        atest(counter == 1);
+    }
+    // Test spawning many short lived fibers with different stack sizes so fiber structs and root stacklets are recycled.
+    {
+        uint64_t n_reused_fibers = lwt_get_reused_fiber_count();
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < 0x1000; i++) {
+            fmitosis {
+                if (i % 3 == 0) {
+                    ifc_wait(spawn_static_fiber(multi_fiber_test_large_fiber("", &sum, i)));
+                } else {
+                    ifc_wait(spawn_static_fiber(multi_fiber_test_small_fiber("", &sum, i)));
+                }
+            }
+        }
+        atest(sum == (0x1000 * 0xfff) / 2);
+#ifndef DEBUG
+        // The spawning fiber waits for every fiber so most of them exit on the executor that spawns the next one.
+        atest(lwt_get_reused_fiber_count() - n_reused_fibers >= 0x400);
+#endif
+    }
+    // Test that fiber classes are inherited and that yielding latency fibers cannot starve background fibers.
+    sub_heap {
+        atest(lwt_get_fiber_class() == lwt_fiber_class_normal);
+        lwt_fiber_class_t classes[16];
+        rcd_sub_fiber_t* class_sfs[LENGTHOF(classes)];
+        for (size_t i = 0; i < LENGTHOF(classes); i++) {
+            lwt_fiber_class_t prev_class = lwt_set_fiber_class(i % 2 == 0? lwt_fiber_class_background: lwt_fiber_class_latency);
+            atest(prev_class == lwt_fiber_class_normal);
+            fmitosis {
+                class_sfs[i] = spawn_fiber(multi_fiber_test_class_fiber("", &classes[i]));
+            }
+            lwt_set_fiber_class(prev_class);
+        }
+        atest(lwt_get_fiber_class() == lwt_fiber_class_normal);
+        for (size_t i = 0; i < LENGTHOF(classes); i++) {
+            ifc_wait(lwt_get_sub_fiber_id(class_sfs[i]));
+            atest(classes[i] == (i % 2 == 0? lwt_fiber_class_background: lwt_fiber_class_latency));
+        }
+    }
+    // Test that a background fiber makes progress while latency fibers keep all executors busy.
+    sub_heap {
+        bool stop = false;
+        size_t n_spinners = 2 * MAX(lwt_system_cpu_count(), 1);
+        rcd_sub_fiber_t* spin_sfs[n_spinners];
+        lwt_fiber_class_t prev_class = lwt_set_fiber_class(lwt_fiber_class_latency);
+        for (size_t i = 0; i < n_spinners; i++) {
+            fmitosis {
+                spin_sfs[i] = spawn_fiber(multi_fiber_test_spin_fiber("", &stop));
+            }
+        }
+        lwt_set_fiber_class(lwt_fiber_class_background);
+        uint32_t n_rounds = 0;
+        rcd_sub_fiber_t* progress_sf;
+        fmitosis {
+            progress_sf = spawn_fiber(multi_fiber_test_progress_fiber("", &n_rounds, 0x100));
+        }
+        lwt_set_fiber_class(prev_class);
+        try {
+            sub_heap {
+                ifc_cancel_timeout_arm(10 * RIO_NS_SEC);
+                ifc_wait(lwt_get_sub_fiber_id(progress_sf));
+            }
+        } catch (exception_canceled, e) {}
+        atest(n_rounds == 0x100);
+        *((volatile bool*) &stop) = true;
+        for (size_t i = 0; i < n_spinners; i++)
+            ifc_wait(lwt_get_sub_fiber_id(spin_sfs[i]));
+    }
+    // Test that the system monitor adds a spare executor that keeps other fibers running while every executor is
+    // blocked in a syscall. Without it the progress fiber can only run after the blocking syscalls return.
+    sub_heap {
+        lwt_sysmon_start(0);
+        multi_fiber_test_sysmon_state_t state = {.n_blocking = lwt_get_executor_count()};
+        rcd_sub_fiber_t* block_sfs[state.n_blocking];
+        rcd_sub_fiber_t* progress_sf;
+        fmitosis {
+            progress_sf = spawn_fiber(multi_fiber_test_sysmon_progress_fiber("", &state));
+        }
+        for (size_t i = 0; i < state.n_blocking; i++) {
+            fmitosis {
+                block_sfs[i] = spawn_fiber(multi_fiber_test_sysmon_block_fiber("", &state));
+            }
+        }
+        ifc_wait(lwt_get_sub_fiber_id(progress_sf));
+        for (size_t i = 0; i < state.n_blocking; i++)
+            ifc_wait(lwt_get_sub_fiber_id(block_sfs[i]));
+        atest(state.n_unblocked == state.n_blocking);
+        atest(state.n_unblocked_at_progress == 0);
+    }
+    // Test that a fiber that has used up its time slice is preempted when it allocates, but not while it holds a
+    // spinlock. Two preemption signals without the executor picking another fiber in between is a used up slice.
+    sub_heap {
+        static int8_t lock = 0;
+        uint64_t sched_tick = lwt_get_sched_tick();
+        atomic_spinlock_lock(&lock);
+        raise(LWT_PREEMPT_SIGNAL);
+        raise(LWT_PREEMPT_SIGNAL);
+        lwt_alloc_new(0x10);
+        atest(lwt_get_sched_tick() == sched_tick);
+        atomic_spinlock_unlock(&lock);
+        lwt_alloc_new(0x10);
+        atest(lwt_get_sched_tick() != sched_tick);
+    }
+    // Test that a busy fiber is preempted by the timer of its executor. The fiber never yields so the sched tick of
+    // the executor only changes if it's switched out. Gives up after ten seconds.
+    sub_heap {
+        uint32_t prev_slice_us = lwt_preemption_set_slice(1000);
+        // Picking a fiber arms the timer of the executor.
+        lwt_yield();
+        uint64_t sched_tick = lwt_get_sched_tick();
+        uint128_t start_ns = rio_get_time_timer();
+        bool preempted = false;
+        while (!preempted && rio_get_time_timer() - start_ns < 10 * RIO_NS_SEC) {
+            sub_heap {
+                lwt_alloc_new(0x10);
+            }
+            preempted = (lwt_get_sched_tick() != sched_tick);
+        }
+        atest(preempted);
+        lwt_preemption_set_slice(prev_slice_us);
+        lwt_yield();
+    }
+    // Test that profiler samples are counted per stack and written as folded stacks rooted at the fiber main.
+    sub_heap {
+        rcd_sub_fiber_t* profiled_sf;
+        fmitosis {
+            profiled_sf = spawn_fiber(multi_fiber_test_profiled_fiber("profiled"));
+        }
+        ifc_wait(lwt_get_sub_fiber_id(profiled_sf));
+        rio_t* pipe = rio_open_pipe();
+        lwt_write_profile_folded_fd(rio_get_fd_write(pipe));
+        rio_pipe_close_end(pipe, false);
+        fstr_t profile = rio_read_to_end(pipe, fss(fstr_alloc(0x10000)));
+        size_t n_profiled_lines = 0;
+        for (fstr_t line; fstr_iterate_trim(&profile, "\n", &line);) {
+            fstr_t stack, count_str;
+            atest(fstr_rdivide(line, " ", &stack, &count_str));
+            if (!fstr_prefixes(stack, "multi_fiber_test_profiled_fiber;profiled;"))
+                continue;
+            atest(fstr_to_uint(count_str, 10) == 3);
+            n_profiled_lines++;
+        }
+        atest(n_profiled_lines == 1);
+    }
+    // Test that scheduler events are recorded in the trace ring of the thread in the order they happen. Spawning
+    // doesn't switch out the spawning fiber so both spawns are recorded on the thread that traces.
+    sub_heap {
+        bool was_tracing = lwt_trace_set_enabled_local(true, 0x40);
+        rcd_fid_t self_fid = lwt_get_fiber_id();
+        uint64_t traced_sum = 0;
+        rcd_sub_fiber_t* traced_sfs[2];
+        for (size_t i = 0; i < LENGTHOF(traced_sfs); i++) {
+            fmitosis {
+                traced_sfs[i] = spawn_fiber(multi_fiber_test_small_fiber("", &traced_sum, i));
+            }
+        }
+        for (size_t i = 0; i < LENGTHOF(traced_sfs); i++)
+            ifc_wait(lwt_get_sub_fiber_id(traced_sfs[i]));
+        lwt_trace_set_enabled_local(was_tracing, 0);
+        // Only this thread records events and its ring is small so the trace fits in the pipe buffer.
+        rio_t* pipe = rio_open_pipe();
+        lwt_write_trace_json_fd(rio_get_fd_write(pipe));
+        rio_pipe_close_end(pipe, false);
+        json_tree_t* trace = json_parse(rio_read_to_end(pipe, fss(fstr_alloc(0x10000))));
+        size_t n_spawns = 0, n_wakes = 0;
+        double last_ts = 0;
+        list(json_value_t)* events = json_get_array(JSON_REF(trace->value, "traceEvents"));
+        list_foreach(events, json_value_t, event) {
+            if (!fstr_equal(json_get_string(JSON_REF(event, "ph")), "i"))
+                continue;
+            fstr_t name = json_get_string(JSON_REF(event, "name"));
+            rcd_fid_t fid = json_get_number(JSON_REF(event, "args", "fid"));
+            if (fstr_equal(name, "spawn") && json_get_number(JSON_REF(event, "args", "parent")) == self_fid) {
+                atest(n_spawns < LENGTHOF(traced_sfs) && fid == lwt_get_sub_fiber_id(traced_sfs[n_spawns]));
+                atest(fstr_equal(json_get_string(JSON_REF(event, "args", "main")), "multi_fiber_test_small_fiber"));
+                atest(json_get_number(JSON_REF(event, "ts")) >= last_ts);
+                last_ts = json_get_number(JSON_REF(event, "ts"));
+                n_spawns++;
+            } else if (fstr_equal(name, "wake") && json_get_number(JSON_REF(event, "args", "waker")) == self_fid) {
+                // Every fiber is woken by the spawn right after it's spawned.
+                if (n_wakes < LENGTHOF(traced_sfs) && fid == lwt_get_sub_fiber_id(traced_sfs[n_wakes])) {
+                    atest(n_spawns == n_wakes + 1);
+                    n_wakes++;
+                }
+            }
+        }
+        atest(n_spawns == LENGTHOF(traced_sfs));
+        atest(n_wakes == LENGTHOF(traced_sfs));
+    }
+    // Test that metrics count known ifc joins, spawns and reservations once they are started.
+    sub_heap {
+        bool was_collecting = lwt_metrics_set_enabled(true);
+        rcd_sub_fiber_t* pong_sf;
+        fmitosis {
+            pong_sf = spawn_fiber(multi_fiber_test_pong_fiber(""));
+        }
+        rcd_fid_t pong_fid = lwt_get_sub_fiber_id(pong_sf);
+        json_value_t metrics0 = multi_fiber_test_read_metrics();
+        uint64_t ball = 0;
+        for (size_t i = 0; i < 0x40; i++)
+            ball = multi_fiber_test_ping(ball, pong_fid);
+        atest(ball == 0x40);
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < 0x10; i++) {
+            fmitosis {
+                ifc_wait(spawn_static_fiber(multi_fiber_test_small_fiber("", &sum, i)));
+            }
+        }
+        // Nothing else reserves chunks of this size class so it should move by exactly the reserved bytes.
+        const size_t chunk_size = 1UL << 23;
+        void* chunks[4];
+        for (size_t i = 0; i < LENGTHOF(chunks); i++)
+            chunks[i] = vm_mmap_reserve(chunk_size, 0);
+        json_value_t metrics1 = multi_fiber_test_read_metrics();
+        for (size_t i = 0; i < LENGTHOF(chunks); i++)
+            vm_mmap_unreserve(chunks[i], chunk_size);
+        json_value_t metrics2 = multi_fiber_test_read_metrics();
+        atest(multi_fiber_test_ping_joins(metrics1) - multi_fiber_test_ping_joins(metrics0) == 0x40);
+        atest(json_get_number(JSON_REF(metrics1, "fibers_spawned")) - json_get_number(JSON_REF(metrics0, "fibers_spawned")) >= 0x10);
+        atest(json_get_number(JSON_REF(metrics1, "fibers_exited")) - json_get_number(JSON_REF(metrics0, "fibers_exited")) >= 0x10);
+        atest(json_get_number(JSON_REF(metrics1, "context_switches")) > json_get_number(JSON_REF(metrics0, "context_switches")));
+        atest(multi_fiber_test_class_bytes(metrics1, chunk_size) - multi_fiber_test_class_bytes(metrics0, chunk_size) == LENGTHOF(chunks) * chunk_size);
+        atest(multi_fiber_test_class_bytes(metrics2, chunk_size) == multi_fiber_test_class_bytes(metrics0, chunk_size));
+        lwt_metrics_set_enabled(was_collecting);
+    }
+    // Test that enqueue skips the futex wake while executors spin instead of sleeping and that a spinning executor
+    // picks up new work within its spin window.
+    sub_heap {
+        const uint32_t spin_us = 500 * 1000;
+        uint32_t prev_spin_us = lwt_executor_spin_set(spin_us);
+        // Every executor runs a barrier fiber so none of them is left sleeping from before the spin was set.
+        int32_t n_executors = lwt_get_executor_count();
+        int32_t n_arrived = 0;
+        rcd_sub_fiber_t* barrier_sfs[n_executors];
+        for (int32_t i = 0; i < n_executors; i++) {
+            fmitosis {
+                barrier_sfs[i] = spawn_fiber(multi_fiber_test_spin_barrier_fiber("", &n_arrived, n_executors));
+            }
+        }
+        for (int32_t i = 0; i < n_executors; i++)
+            ifc_wait(lwt_get_sub_fiber_id(barrier_sfs[i]));
+        atest(n_arrived == n_executors);
+        rcd_sub_fiber_t* pong_sf;
+        fmitosis {
+            pong_sf = spawn_fiber(multi_fiber_test_pong_fiber(""));
+        }
+        rcd_fid_t pong_fid = lwt_get_sub_fiber_id(pong_sf);
+        uint64_t n_wakes0 = lwt_get_executor_futex_wake_count();
+        uint64_t ball = 0;
+        for (size_t i = 0; i < 0x100; i++)
+            ball = multi_fiber_test_ping(ball, pong_fid);
+        atest(ball == 0x100);
+        // Every join enqueues twice. Only spare executors that were already sleeping may still cost a wake.
+        atest(lwt_get_executor_futex_wake_count() - n_wakes0 < 0x10);
+        if (n_executors > 1) {
+            bool picked_up = false;
+            uint128_t start_ns = rio_get_time_timer();
+            rcd_sub_fiber_t* flag_sf;
+            fmitosis {
+                flag_sf = spawn_fiber(multi_fiber_test_flag_fiber("", &picked_up));
+            }
+            // Keep this executor busy so another one has to pick up the fiber.
+            while (!*((volatile bool*) &picked_up) && rio_get_time_timer() - start_ns < 10 * RIO_NS_SEC);
+            atest(picked_up);
+            atest(rio_get_time_timer() - start_ns < spin_us * 1000ULL);
+            ifc_wait(lwt_get_sub_fiber_id(flag_sf));
+        }
+        lwt_executor_spin_set(prev_spin_us);
+    }
 }
@@ -6,6 +6,7 @@
 
 #include "rcd.h"
 #include "linux.h"
+#include "lwthreads-internal.h"
 
 #pragma librcd
 
@@ -182,6 +183,48 @@ void rcd_self_test_io() {
         atest(fstr_cmp(test_message, read_data) == 0);
         rio_file_unlink(file_path);
     }
+    // Test reading a file that is not in the page cache with the io_uring engine enabled. A descriptor with
+    // O_NONBLOCK set answers EAGAIN on a cache miss. The read must then complete through the ring without
+    // changing the flags of the descriptor which are shared with every other owner of it.
+    sub_heap {
+        bool uring_was_enabled = lwt_uring_set_enabled(true);
+        fstr_t file_path = "/tmp/librcd-tmp-test-uncached";
+        try {
+            rio_file_unlink(file_path);
+        } catch (exception_io, e) {}
+        rio_t* file_h = rio_file_open(file_path, false, true);
+        rio_write(file_h, test_message);
+        rio_file_fsync(file_h);
+        int32_t fd = rio_get_fd_read(file_h);
+        atest(posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+        if (lwt_uring_is_enabled())
+            atest((fcntl(fd, F_GETFL, 0) & O_NONBLOCK) == 0);
+        int32_t nb_fd = open(fstr_to_cstr(file_path), O_RDONLY | O_NONBLOCK | O_CLOEXEC, 0);
+        atest(nb_fd != -1);
+        rio_t* nb_file_h = rio_new_h(rio_type_file, nb_fd, true, false, 0);
+        fstr_t read_data = rio_read_to_end(nb_file_h, fss(fstr_alloc(test_message.len + 1)));
+        atest(fstr_equal(read_data, test_message));
+        atest((fcntl(nb_fd, F_GETFL, 0) & O_NONBLOCK) != 0);
+        atest(rio_get_file_offset(nb_file_h) == test_message.len);
+        // Writes through a non-blocking descriptor, both at the file position and appending.
+        int32_t nb_wr_fd = open(fstr_to_cstr(file_path), O_WRONLY | O_NONBLOCK | O_CLOEXEC, 0);
+        atest(nb_wr_fd != -1);
+        rio_t* nb_wr_file_h = rio_new_h(rio_type_file, nb_wr_fd, false, true, 0);
+        rio_write(nb_wr_file_h, "HELLO");
+        atest(rio_get_file_offset(nb_wr_file_h) == 5);
+        int32_t nb_app_fd = open(fstr_to_cstr(file_path), O_WRONLY | O_APPEND | O_NONBLOCK | O_CLOEXEC, 0);
+        atest(nb_app_fd != -1);
+        rio_t* nb_app_file_h = rio_new_h(rio_type_file, nb_app_fd, false, true, 0);
+        rio_write(nb_app_file_h, "!");
+        atest(rio_get_file_offset(nb_app_file_h) == test_message.len + 1);
+        atest((fcntl(nb_wr_fd, F_GETFL, 0) & O_NONBLOCK) != 0);
+        atest((fcntl(nb_app_fd, F_GETFL, 0) & O_NONBLOCK) != 0);
+        rio_set_file_offset(file_h, 0, false);
+        read_data = rio_read_to_end(file_h, fss(fstr_alloc(test_message.len + 2)));
+        atest(fstr_equal(read_data, concs("HELLO", fstr_slice(test_message, 5, -1), "!")));
+        rio_file_unlink(file_path);
+        lwt_uring_set_enabled(uring_was_enabled);
+    }
     // Test listing the root and see that we can find bin tmp and var.
     sub_heap {
         list(fstr_mem_t*)* files = rio_file_list("/");
@@ -15,6 +15,68 @@ fiber_main ifc_test_run_inf_cancel(fiber_main_attr) {
     } catch (exception_canceled, e) {}
 }
 
+/// Never accepted by any server in the test.
+join_locked(void) ifc_test_never_accepted(join_server_params) {}
+
+join_locked(uint64_t) ifc_test_bench_call(uint64_t x, join_server_params) {
+    return x + 1;
+}
+
+fiber_main ifc_test_bench_server(fiber_main_attr) { try {
+    auto_accept_join(ifc_test_bench_call, join_server_params);
+} catch (exception_canceled, e); }
+
+fiber_main ifc_test_bench_client(fiber_main_attr, rcd_fid_t server_fid, uint64_t n_calls) {
+    for (uint64_t i = 0; i < n_calls; i++)
+        atest(ifc_test_bench_call(i, server_fid) == i + 1);
+}
+
+/// Runs n_calls joins over each of n_pairs independent client/server pairs concurrently and returns the number of
+/// joins per second.
+static uint64_t ifc_test_bench_joins(size_t n_pairs, uint64_t n_calls) { sub_heap {
+    rcd_sub_fiber_t* server_sfs[n_pairs];
+    for (size_t i = 0; i < n_pairs; i++) {
+        fmitosis {
+            server_sfs[i] = spawn_fiber(ifc_test_bench_server(""));
+        }
+    }
+    uint128_t start_ns = rio_get_time_timer();
+    rcd_sub_fiber_t* client_sfs[n_pairs];
+    for (size_t i = 0; i < n_pairs; i++) {
+        rcd_fid_t server_fid = lwt_get_sub_fiber_id(server_sfs[i]);
+        fmitosis {
+            client_sfs[i] = spawn_fiber(ifc_test_bench_client("", server_fid, n_calls));
+        }
+    }
+    for (size_t i = 0; i < n_pairs; i++)
+        ifc_wait(lwt_get_sub_fiber_id(client_sfs[i]));
+    uint128_t elapsed_ns = MAX(rio_get_time_timer() - start_ns, 1);
+    return (uint64_t) ((n_pairs * n_calls * RIO_NS_SEC) / elapsed_ns);
+}}
+
+/// Best join rate out of a few runs so a single hiccup does not decide a comparison.
+static uint64_t ifc_test_bench_joins_best(size_t n_pairs, uint64_t n_calls) {
+    uint64_t best_rate = 0;
+    for (size_t i = 0; i < 3; i++)
+        best_rate = MAX(best_rate, ifc_test_bench_joins(n_pairs, n_calls));
+    return best_rate;
+}
+
+/// Holds the server until the release event is triggered.
+join_locked(void) ifc_test_held_call(rcd_fid_t held_event_fid, rcd_fid_t release_event_fid, join_server_params) {
+    ifc_event_trigger(held_event_fid, 1);
+    ifc_event_wait(release_event_fid);
+}
+
+fiber_main ifc_test_held_server(fiber_main_attr) { try {
+    auto_accept_join(ifc_test_held_call, join_server_params);
+} catch (exception_canceled, e); }
+
+fiber_main ifc_test_held_client(fiber_main_attr, rcd_fid_t server_fid, rcd_fid_t held_event_fid, rcd_fid_t release_event_fid, bool* out_released) {
+    ifc_test_held_call(held_event_fid, release_event_fid, server_fid);
+    *out_released = true;
+}
+
 fiber_main ifc_test_max_event(fiber_main_attr, rcd_fid_t event_fid) {
     ifc_event_trigger(event_fid, ULONG_MAX);
 }
@@ -262,6 +324,14 @@ void rcd_self_test_ifc() {
             atest(false);
         }
     } catch (exception_canceled, e) {}
+    // Test timeout on the timer wheel that should be triggered.
+    try {
+        sub_heap {
+            ifc_cancel_timeout_arm(10 * RIO_NS_MS);
+            lwt_sleep(4 * RIO_NS_SEC);
+            atest(false);
+        }
+    } catch (exception_canceled, e) {}
     // Test timeout that should not be triggered.
     try {
         sub_heap {
@@ -273,6 +343,30 @@ void rcd_self_test_ifc() {
     } catch (exception_canceled, e) {
         atest(false);
     }
+    // Test that a join that is never accepted times out.
+    sub_heap {
+        rcd_sub_fiber_t* server_sf;
+        fmitosis {
+            server_sf = spawn_fiber(ifc_test_run_inf_cancel(""));
+        }
+        atest(lwt_set_join_timeout(10 * RIO_NS_MS) == 0);
+        uint128_t start_ns = rio_get_time_timer();
+        bool timed_out = false;
+        try {
+            ifc_test_never_accepted(lwt_get_sub_fiber_id(server_sf));
+        } catch_eio(lwt_join_timeout, e) {
+            timed_out = true;
+        }
+        atest(lwt_set_join_timeout(0) == 10 * RIO_NS_MS);
+        atest(timed_out);
+        atest(rio_get_time_timer() - start_ns >= 10 * RIO_NS_MS);
+    }
+    // Test that waiting never returns early.
+    for (size_t i = 0; i < 4; i++) {
+        uint128_t start_ns = rio_get_time_timer();
+        rio_wait((i + 1) * RIO_NS_MS);
+        atest(rio_get_time_timer() - start_ns >= (i + 1) * RIO_NS_MS);
+    }
     // Test that infinite pipe buffering.
     sub_heap {
         rio_t *ipipe_r, *ipipe_w;
@@ -297,6 +391,20 @@ void rcd_self_test_ifc() {
                                 atest(list_pop_start(chunk_list, fstr_mem_t*) == test_str);
                             }
                         }
+                        // Buckets allocated in an arena heap are copied when the pipe imports them.
+                        fstr_mem_t* arena_str;
+                        arena_heap {
+                            arena_str = fstr_cpy("foo bar arena");
+                            ifc_ibpipe_write(ibpipe_sf2id(ibp), arena_str, false);
+                        }
+                        lwt_heap_t* chunk_list_heap;
+                        list(fstr_mem_t*)* chunk_list = ifc_ibpipe_read(ibpipe_sf2id(ibp), 0, &chunk_list_heap);
+                        switch_heap(chunk_list_heap) {
+                            atest(list_count(chunk_list, fstr_mem_t*) == 1);
+                            fstr_mem_t* read_str = list_pop_start(chunk_list, fstr_mem_t*);
+                            atest(read_str != arena_str);
+                            atest(fstr_equal(fss(read_str), "foo bar arena"));
+                        }
                     } else {
                         rio_write_fstr(ipipe_w, "foo bar");
                         fstr_t test_str = fss(rio_read_fstr(ipipe_r));
@@ -356,7 +464,7 @@ void rcd_self_test_ifc() {
                 // Try read one byte and expect to timeout.
                 try {
                     sub_heap {
-                        ifc_cancel_alarm_arm(4 * RIO_NS_SEC);
+                        ifc_cancel_timeout_arm(4 * RIO_NS_SEC);
                         if (use_bucket) {
                             ifc_ibpipe_read(ibpipe_sf2id(ibp), 0, 0);
                         } else {
@@ -369,4 +477,60 @@ void rcd_self_test_ifc() {
             }
         }
     }
+    // Many clients contending for the same auto accepting server. Each unjoining
+    // client hands the server directly to the next waiting client.
+    sub_heap {
+        rcd_sub_fiber_t* server_sf;
+        fmitosis {
+            server_sf = spawn_fiber(ifc_test_bench_server(""));
+        }
+        rcd_fid_t server_fid = lwt_get_sub_fiber_id(server_sf);
+        const size_t n_clients = 0x10;
+        rcd_sub_fiber_t* client_sfs[n_clients];
+        for (size_t i = 0; i < n_clients; i++) {
+            fmitosis {
+                client_sfs[i] = spawn_fiber(ifc_test_bench_client("", server_fid, 0x400));
+            }
+        }
+        for (size_t i = 0; i < n_clients; i++)
+            ifc_wait(lwt_get_sub_fiber_id(client_sfs[i]));
+        // The server must still be accepting after the handoffs.
+        atest(ifc_test_bench_call(41, server_fid) == 42);
+    }
+    // Joins on independent servers make progress while another server is held
+    // in a join. Pairs never share any ifc lock with the held server.
+    sub_heap {
+        rcd_fid_t held_event_fid = ifc_create_event_fiber();
+        rcd_fid_t release_event_fid = ifc_create_event_fiber();
+        rcd_sub_fiber_t* held_server_sf;
+        fmitosis {
+            held_server_sf = spawn_fiber(ifc_test_held_server(""));
+        }
+        bool released = false;
+        rcd_sub_fiber_t* held_client_sf;
+        fmitosis {
+            held_client_sf = spawn_fiber(ifc_test_held_client("", lwt_get_sub_fiber_id(held_server_sf), held_event_fid, release_event_fid, &released));
+        }
+        ifc_event_wait(held_event_fid);
+        ifc_test_bench_joins(MAX(lwt_system_cpu_count(), 1), 0x400);
+        atest(!released);
+        ifc_event_trigger(release_event_fid, 1);
+        ifc_wait(lwt_get_sub_fiber_id(held_client_sf));
+        atest(released);
+    }
+    // Benchmark join throughput across independent client/server pairs. Pairs never
+    // share any ifc lock so throughput should scale with the number of cores.
+    {
+        const uint64_t n_calls = 0x4000;
+        size_t n_pairs = MAX(lwt_system_cpu_count(), 1);
+        uint64_t single_pair_rate = ifc_test_bench_joins_best(1, n_calls);
+        uint64_t multi_pair_rate = ifc_test_bench_joins_best(n_pairs, n_calls);
+        atest(single_pair_rate > 0 && multi_pair_rate > 0);
+        if (n_pairs > 1) {
+            bool scales = (multi_pair_rate > single_pair_rate);
+            if (!scales)
+                DBG("ifc join benchmark: [", DBG_INT(single_pair_rate), "] joins/s with 1 pair, [", DBG_INT(multi_pair_rate), "] joins/s with ", DBG_INT(n_pairs), " pairs");
+            atest(scales);
+        }
+    }
 }
@@ -7,7 +7,8 @@
 #ifndef TEST_H
 #define	TEST_H
 
-#define TEST_MEM_LEAK for (size_t mem_usage = vm_total_allocated_bytes; mem_usage != UINT64_MAX; ({ mem_usage = UINT64_MAX; }))
+/// Leak checks need the exact total, the lock it takes is only held while summing the thread counters.
+#define TEST_MEM_LEAK for (size_t mem_usage = vm_get_total_allocated_bytes(); mem_usage != UINT64_MAX; ({ mem_usage = UINT64_MAX; }))
 
 static void test_memory_leak(size_t original_mem_usage, size_t current_mem_usage) {
     atest(current_mem_usage == original_mem_usage);